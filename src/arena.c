@@ -0,0 +1,129 @@
+/*
+ * libconspack
+ * Copyright (C) 2012  Ryan Pavlik
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the GNU Lesser General Public
+ * License (LGPL) version 2.1 which accompanies this distribution, and
+ * is available at http://www.gnu.org/licenses/lgpl-2.1.html
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ */
+
+#include "config.h"
+#include "conspack/conspack.h"
+
+#include <string.h>
+
+#define ARENA_ALIGN 16
+
+struct _cpk_arena_block {
+    struct _cpk_arena_block *next;
+    size_t size;
+    size_t used;
+
+    /* Keeps data aligned for anything malloc would return */
+    union {
+        long double ld;
+        uint64_t u64;
+        void *ptr;
+    } align[];
+};
+
+#define BLOCK_DATA(b) ((uint8_t*)(b)->align)
+#define ALIGN_UP(n) (((n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+void cpk_arena_init(cpk_arena_t *arena, size_t block_size) {
+    arena->head = NULL;
+    arena->block_size = block_size ? block_size : CPK_ARENA_BLOCK;
+    arena->last = NULL;
+}
+
+void cpk_arena_fini(cpk_arena_t *arena) {
+    struct _cpk_arena_block *b = arena->head, *next = NULL;
+
+    while(b) {
+        next = b->next;
+        free(b);
+        b = next;
+    }
+
+    arena->head = NULL;
+    arena->last = NULL;
+}
+
+/* Keeps the newest block for reuse and releases the rest */
+void cpk_arena_reset(cpk_arena_t *arena) {
+    struct _cpk_arena_block *keep = arena->head;
+
+    if(!keep) return;
+
+    arena->head = keep->next;
+    cpk_arena_fini(arena);
+
+    keep->next = NULL;
+    keep->used = 0;
+    arena->head = keep;
+}
+
+void* cpk_arena_alloc(cpk_arena_t *arena, size_t bytes) {
+    struct _cpk_arena_block *b = arena->head;
+    size_t size = 0;
+    void *ptr = NULL;
+
+    bytes = ALIGN_UP(bytes ? bytes : 1);
+
+    if(!b || b->size - b->used < bytes) {
+        size = bytes > arena->block_size ? bytes : arena->block_size;
+
+        if(!(b = malloc(sizeof(*b) + size)))
+            return NULL;
+
+        b->size = size;
+        b->used = 0;
+
+        /* Oversized blocks go behind the current one, so it keeps
+           filling; otherwise the new block becomes current */
+        if(arena->head && bytes > arena->block_size) {
+            b->next = arena->head->next;
+            arena->head->next = b;
+        } else {
+            b->next = arena->head;
+            arena->head = b;
+        }
+    }
+
+    ptr = BLOCK_DATA(b) + b->used;
+    b->used += bytes;
+
+    arena->last = ptr;
+    return ptr;
+}
+
+/* The most recent allocation grows in place when its block has room */
+void* cpk_arena_realloc(cpk_arena_t *arena, void *ptr, size_t old_bytes,
+                        size_t bytes) {
+    struct _cpk_arena_block *b = arena->head;
+    size_t old = ALIGN_UP(old_bytes);
+    void *tmp = NULL;
+
+    if(!ptr) return cpk_arena_alloc(arena, bytes);
+    if(ALIGN_UP(bytes) <= old) return ptr;
+
+    if(ptr == arena->last && b &&
+       (uint8_t*)ptr + old == BLOCK_DATA(b) + b->used &&
+       ALIGN_UP(bytes) - old <= b->size - b->used) {
+        b->used += ALIGN_UP(bytes) - old;
+        return ptr;
+    }
+
+    if(!(tmp = cpk_arena_alloc(arena, bytes)))
+        return NULL;
+
+    memcpy(tmp, ptr, old_bytes < bytes ? old_bytes : bytes);
+    return tmp;
+}
@@ -0,0 +1,215 @@
+/*
+ * libconspack
+ * Copyright (C) 2012  Ryan Pavlik
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the GNU Lesser General Public
+ * License (LGPL) version 2.1 which accompanies this distribution, and
+ * is available at http://www.gnu.org/licenses/lgpl-2.1.html
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ */
+
+#include "config.h"
+#include "conspack/conspack.h"
+#include "internal.h"
+
+#include <string.h>
+
+/* Chunks handed out per claim, per thread; smaller chunks balance
+   uneven messages better at the cost of more contended claims */
+#define BATCH_CHUNKS_PER_THREAD 16
+
+void cpk_frame_init(cpk_frame_t *frame) {
+    frame->count = 0;
+    frame->capacity = 0;
+    frame->spans = NULL;
+}
+
+void cpk_frame_fini(cpk_frame_t *frame) {
+    free(frame->spans);
+    cpk_frame_init(frame);
+}
+
+static int frame_push(cpk_frame_t *frame, size_t offset, size_t length) {
+    cpk_span_t *spans = NULL;
+    size_t cap = frame->capacity;
+
+    if(frame->count == cap) {
+        cap = cap ? cap * 2 : 64;
+        if(!(spans = realloc(frame->spans, cap * sizeof(cpk_span_t))))
+            return -1;
+
+        frame->spans = spans;
+        frame->capacity = cap;
+    }
+
+    frame->spans[frame->count].offset = offset;
+    frame->spans[frame->count].length = length;
+    frame->count++;
+
+    return 0;
+}
+
+/* Appends the span of every message in buf to frame, walking headers
+   and sizes only.  On a malformed or truncated message the spans
+   before it are kept and err's position is relative to buf. */
+int cpk_frame(cpk_frame_t *frame, const uint8_t *buf, size_t len,
+              const cpk_limits_t *limits, cpk_object_t *err) {
+    cpk_object_t tmp;
+    size_t pos = 0, span = 0;
+
+    if(!err) err = &tmp;
+    err->header = 0;
+
+    while(pos < len) {
+        span = cpk_validate_span(buf + pos, len - pos, limits, err);
+
+        if(!span) {
+            err->error.pos += pos;
+            return CPK_ERROR;
+        }
+
+        if(frame_push(frame, pos, span)) {
+            cpk_err(err, CPK_ERR_ALLOC, CPK_ERR_ALLOC_MSG, 0, pos);
+            return CPK_ERROR;
+        }
+
+        pos += span;
+    }
+
+    return 0;
+}
+
+void cpk_batch_init(cpk_batch_t *batch) {
+    cpk_frame_init(&batch->frame);
+    batch->objs = NULL;
+    batch->narenas = 0;
+    batch->arenas = NULL;
+}
+
+void cpk_batch_fini(cpk_batch_t *batch) {
+    uint32_t i = 0;
+
+    for(i = 0; i < batch->narenas; i++)
+        cpk_arena_fini(&batch->arenas[i]);
+
+    free(batch->arenas);
+    free(batch->objs);
+    cpk_frame_fini(&batch->frame);
+    cpk_batch_init(batch);
+}
+
+typedef struct _batch_job {
+    cpk_batch_t *batch;
+    const uint8_t *buf;
+    const cpk_limits_t *limits;
+
+    size_t next;
+    size_t chunk;
+} batch_job_t;
+
+/* Threads claim chunks of spans from a shared index until none are
+   left, so a thread that draws small messages simply claims more */
+static void batch_worker(void *arg, uint32_t thread) {
+    batch_job_t *job = arg;
+    cpk_batch_t *batch = job->batch;
+    cpk_arena_t *arena = &batch->arenas[thread];
+    cpk_span_t *span = NULL;
+    cpk_input_t in;
+    size_t i = 0, start = 0, end = 0, count = batch->frame.count;
+
+    for(;;) {
+        start = __atomic_fetch_add(&job->next, job->chunk, __ATOMIC_RELAXED);
+        if(start >= count) break;
+
+        end = start + job->chunk < count ? start + job->chunk : count;
+
+        for(i = start; i < end; i++) {
+            span = &batch->frame.spans[i];
+
+            cpk_input_init(&in, (uint8_t*)job->buf + span->offset,
+                           span->length);
+            cpk_input_set_limits(&in, job->limits);
+            cpk_input_set_arena(&in, arena);
+
+            batch->objs[i] = cpk_decode_r(&in);
+        }
+    }
+}
+
+static int batch_arenas(cpk_batch_t *batch, uint32_t n) {
+    uint32_t i = 0;
+
+    for(i = 0; i < batch->narenas; i++)
+        cpk_arena_reset(&batch->arenas[i]);
+
+    if(n <= batch->narenas)
+        return 0;
+
+    for(i = 0; i < batch->narenas; i++)
+        cpk_arena_fini(&batch->arenas[i]);
+    free(batch->arenas);
+
+    batch->narenas = 0;
+    if(!(batch->arenas = calloc(n, sizeof(cpk_arena_t))))
+        return -1;
+
+    for(i = 0; i < n; i++)
+        cpk_arena_init(&batch->arenas[i], 0);
+
+    batch->narenas = n;
+    return 0;
+}
+
+/* Frames buf, then decodes every message across pool (or on the
+   caller's thread if pool is NULL).  Anything decoded by a previous
+   call on the same batch is released first.  If framing fails, the
+   messages before the bad one are still decoded, and CPK_ERROR is
+   returned with err describing the failure. */
+int cpk_decode_batch(cpk_batch_t *batch, cpk_pool_t *pool,
+                     const uint8_t *buf, size_t len,
+                     const cpk_limits_t *limits, cpk_object_t *err) {
+    cpk_object_t tmp, **objs = NULL;
+    uint32_t threads = cpk_pool_size(pool);
+    batch_job_t job;
+    int ret = 0;
+
+    if(!err) err = &tmp;
+    err->header = 0;
+
+    batch->frame.count = 0;
+    ret = cpk_frame(&batch->frame, buf, len, limits, err);
+    if(ret && err->error.code == CPK_ERR_ALLOC)
+        return CPK_ERROR;
+
+    if(batch_arenas(batch, threads))
+        goto nomem;
+
+    if(batch->frame.count) {
+        objs = realloc(batch->objs, batch->frame.count * sizeof(cpk_object_t*));
+        if(!objs) goto nomem;
+
+        batch->objs = objs;
+    }
+
+    job.batch = batch;
+    job.buf = buf;
+    job.limits = limits;
+    job.next = 0;
+    job.chunk = batch->frame.count / (threads * BATCH_CHUNKS_PER_THREAD);
+    if(!job.chunk) job.chunk = 1;
+
+    cpk_pool_run(pool, batch_worker, &job);
+
+    return ret;
+
+ nomem:
+    batch->frame.count = 0;
+    cpk_err(err, CPK_ERR_ALLOC, CPK_ERR_ALLOC_MSG, 0, 0);
+    return CPK_ERROR;
+}
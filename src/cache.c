@@ -0,0 +1,407 @@
+/*
+ * libconspack
+ * Copyright (C) 2012  Ryan Pavlik
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the GNU Lesser General Public
+ * License (LGPL) version 2.1 which accompanies this distribution, and
+ * is available at http://www.gnu.org/licenses/lgpl-2.1.html
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ */
+
+
+#include "config.h"
+#include "conspack/conspack.h"
+#include "internal.h"
+
+#include <string.h>
+
+#ifdef HAVE_PTHREAD_H
+#  include <pthread.h>
+#  define SHARD_LOCK(s)   pthread_mutex_lock(&(s)->lock)
+#  define SHARD_UNLOCK(s) pthread_mutex_unlock(&(s)->lock)
+#else
+#  define SHARD_LOCK(s)
+#  define SHARD_UNLOCK(s)
+#endif
+
+/*
+ * Trees are keyed by the exact bytes they were decoded from: the
+ * message's cpk_hash64 picks a shard and a bucket, and a hit is
+ * confirmed against a copy of the bytes, so collisions cost a compare
+ * rather than a wrong tree.  Each shard has its own lock, table, LRU
+ * list and share of the byte budget, so callers only contend when
+ * their messages land in the same shard, and decoding on a miss is
+ * done outside any lock.
+ *
+ * An entry's reference count includes one for the table.  Whoever
+ * drops the last reference frees it, so an entry evicted while callers
+ * still hold it lives until they release it.
+ */
+
+#define CACHE_LINE    64
+#define CACHE_BUCKETS 64
+
+struct _cpk_cache_ref {
+    uint64_t hash;
+    size_t bytes;               /* charged against the shard */
+    uint32_t refs;
+    cpk_object_t *tree;
+
+    struct _cpk_cache_ref *next;            /* bucket chain */
+    struct _cpk_cache_ref *newer, *older;   /* LRU order */
+
+    size_t len;
+    uint8_t key[];
+};
+
+typedef struct _cache_shard {
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_t lock;
+#endif
+    cpk_cache_ref_t **buckets;
+    size_t nbuckets;
+
+    cpk_cache_ref_t *newest, *oldest;
+    uint64_t entries;
+    size_t bytes, budget;
+
+    uint64_t hits, misses, evictions, uncached;
+
+    uint8_t pad[CACHE_LINE];
+} cache_shard_t;
+
+struct _cpk_cache {
+    uint32_t nshards;
+    cache_shard_t *shards;
+    const cpk_limits_t *limits;
+};
+
+/* max_bytes covers the trees, the keys and the bookkeeping, and is
+   split evenly between the shards.  Zero selects CPK_CACHE_BYTES and
+   CPK_CACHE_SHARDS.  limits is used for every decode and must outlive
+   the cache. */
+cpk_cache_t* cpk_cache_new(size_t max_bytes, uint32_t shards,
+                           const cpk_limits_t *limits) {
+    cpk_cache_t *cache = NULL;
+    uint32_t i = 0;
+
+    if(!max_bytes) max_bytes = CPK_CACHE_BYTES;
+    if(!shards) shards = CPK_CACHE_SHARDS;
+
+    if(!(cache = calloc(1, sizeof(cpk_cache_t))))
+        return NULL;
+
+    if(!(cache->shards = calloc(shards, sizeof(cache_shard_t)))) {
+        free(cache);
+        return NULL;
+    }
+
+    cache->nshards = shards;
+    cache->limits = limits;
+
+    for(i = 0; i < shards; i++) {
+        cache_shard_t *s = &cache->shards[i];
+
+        s->budget = max_bytes / shards;
+        s->nbuckets = CACHE_BUCKETS;
+        if(!(s->buckets = calloc(s->nbuckets, sizeof(cpk_cache_ref_t*))))
+            goto error;
+#ifdef HAVE_PTHREAD_H
+        pthread_mutex_init(&s->lock, NULL);
+#endif
+    }
+
+    return cache;
+
+ error:
+    while(i--) {
+#ifdef HAVE_PTHREAD_H
+        pthread_mutex_destroy(&cache->shards[i].lock);
+#endif
+        free(cache->shards[i].buckets);
+    }
+
+    free(cache->shards);
+    free(cache);
+    return NULL;
+}
+
+static void ref_drop(cpk_cache_ref_t *e) {
+    if(__atomic_sub_fetch(&e->refs, 1, __ATOMIC_ACQ_REL))
+        return;
+
+    cpk_free_r(e->tree);
+    free(e);
+}
+
+/* Drops the table's references to a list built by shard_unlink */
+static void drop_list(cpk_cache_ref_t *list) {
+    cpk_cache_ref_t *next = NULL;
+
+    for(; list; list = next) {
+        next = list->next;
+        ref_drop(list);
+    }
+}
+
+static cpk_cache_ref_t**
+shard_bucket(cache_shard_t *s, uint64_t hash) {
+    return &s->buckets[hash & (s->nbuckets - 1)];
+}
+
+/* Takes e out of the table and the LRU list and pushes it on *list,
+   to be dropped once the lock is released */
+static void shard_unlink(cache_shard_t *s, cpk_cache_ref_t *e,
+                         cpk_cache_ref_t **list) {
+    cpk_cache_ref_t **p = shard_bucket(s, e->hash);
+
+    while(*p != e)
+        p = &(*p)->next;
+    *p = e->next;
+
+    if(e->newer) e->newer->older = e->older;
+    else s->newest = e->older;
+
+    if(e->older) e->older->newer = e->newer;
+    else s->oldest = e->newer;
+
+    s->entries--;
+    s->bytes -= e->bytes;
+
+    e->next = *list;
+    *list = e;
+}
+
+static void shard_touch(cache_shard_t *s, cpk_cache_ref_t *e) {
+    if(s->newest == e) return;
+
+    e->newer->older = e->older;
+    if(e->older) e->older->newer = e->newer;
+    else s->oldest = e->newer;
+
+    e->older = s->newest;
+    e->newer = NULL;
+    s->newest->newer = e;
+    s->newest = e;
+}
+
+/* Doubling the table is best effort; chains just get longer if it
+   fails */
+static void shard_grow(cache_shard_t *s) {
+    cpk_cache_ref_t **old = s->buckets, **b = NULL, *e = NULL, *next = NULL;
+    size_t n = s->nbuckets, i = 0;
+
+    if(!(s->buckets = calloc(n * 2, sizeof(cpk_cache_ref_t*)))) {
+        s->buckets = old;
+        return;
+    }
+
+    s->nbuckets = n * 2;
+
+    for(i = 0; i < n; i++) {
+        for(e = old[i]; e; e = next) {
+            next = e->next;
+            b = shard_bucket(s, e->hash);
+            e->next = *b;
+            *b = e;
+        }
+    }
+
+    free(old);
+}
+
+static cpk_cache_ref_t*
+shard_find(cache_shard_t *s, uint64_t hash, const uint8_t *buf, size_t len) {
+    cpk_cache_ref_t *e = *shard_bucket(s, hash);
+
+    for(; e; e = e->next)
+        if(e->hash == hash && e->len == len && !memcmp(e->key, buf, len))
+            return e;
+
+    return NULL;
+}
+
+static cpk_cache_ref_t* cache_decode(cpk_cache_t *cache, uint64_t hash,
+                                     const uint8_t *buf, size_t len,
+                                     cpk_object_t *err) {
+    cpk_cache_ref_t *e = NULL;
+    cpk_object_t *tree = NULL;
+    cpk_input_t in;
+
+    cpk_input_init(&in, (uint8_t*)buf, len);
+    cpk_input_set_limits(&in, cache->limits);
+
+    if(!(tree = cpk_decode_r(&in))) {
+        if(err) cpk_err(err, CPK_ERR_ALLOC, CPK_ERR_ALLOC_MSG, 0, 0);
+        return NULL;
+    }
+
+    if(CPK_IS_ERROR(tree->header)) {
+        if(err) *err = *tree;
+        cpk_free_r(tree);
+        return NULL;
+    }
+
+    if(in.buffer_read != len) {
+        if(err) cpk_err(err, CPK_ERR_TRAILING, CPK_ERR_TRAILING_MSG, 0,
+                        in.buffer_read);
+        cpk_free_r(tree);
+        return NULL;
+    }
+
+    if(!(e = malloc(sizeof(cpk_cache_ref_t) + len))) {
+        if(err) cpk_err(err, CPK_ERR_ALLOC, CPK_ERR_ALLOC_MSG, 0, 0);
+        cpk_free_r(tree);
+        return NULL;
+    }
+
+    e->hash = hash;
+    e->bytes = sizeof(cpk_cache_ref_t) + len + in.allocated;
+    e->refs = 1;
+    e->tree = tree;
+    e->next = e->newer = e->older = NULL;
+    e->len = len;
+    memcpy(e->key, buf, len);
+
+    return e;
+}
+
+/* Returns a reference to the tree decoded from exactly buf[0..len),
+   decoding it only if the cache does not already hold it, or NULL
+   with err set if it does not decode.  The tree is shared and must
+   not be changed; hand the reference back with cpk_cache_release.
+   Trees too big for a shard are returned without being kept. */
+cpk_cache_ref_t* cpk_cache_decode(cpk_cache_t *cache, const uint8_t *buf,
+                                  size_t len, cpk_object_t *err) {
+    uint64_t hash = cpk_hash64(0, buf, len);
+    cache_shard_t *s = &cache->shards[(hash >> 32) % cache->nshards];
+    cpk_cache_ref_t *e = NULL, *found = NULL, *evicted = NULL;
+
+    if(err) err->header = 0;
+
+    SHARD_LOCK(s);
+    if((e = shard_find(s, hash, buf, len))) {
+        __atomic_add_fetch(&e->refs, 1, __ATOMIC_RELAXED);
+        shard_touch(s, e);
+        s->hits++;
+        SHARD_UNLOCK(s);
+        return e;
+    }
+
+    s->misses++;
+    SHARD_UNLOCK(s);
+
+    if(!(e = cache_decode(cache, hash, buf, len, err)))
+        return NULL;
+
+    SHARD_LOCK(s);
+
+    /* Someone else may have decoded the same bytes meanwhile */
+    if((found = shard_find(s, hash, buf, len))) {
+        __atomic_add_fetch(&found->refs, 1, __ATOMIC_RELAXED);
+        shard_touch(s, found);
+        SHARD_UNLOCK(s);
+        ref_drop(e);
+        return found;
+    }
+
+    if(e->bytes > s->budget) {
+        s->uncached++;
+        SHARD_UNLOCK(s);
+        return e;
+    }
+
+    while(s->bytes + e->bytes > s->budget) {
+        shard_unlink(s, s->oldest, &evicted);
+        s->evictions++;
+    }
+
+    if(s->entries >= s->nbuckets)
+        shard_grow(s);
+
+    e->refs++;
+    e->next = *shard_bucket(s, hash);
+    *shard_bucket(s, hash) = e;
+
+    e->older = s->newest;
+    if(s->newest) s->newest->newer = e;
+    else s->oldest = e;
+    s->newest = e;
+
+    s->entries++;
+    s->bytes += e->bytes;
+    SHARD_UNLOCK(s);
+
+    drop_list(evicted);
+    return e;
+}
+
+const cpk_object_t* cpk_cache_tree(cpk_cache_ref_t *ref) {
+    return ref->tree;
+}
+
+/* Safe from any thread, and after the cache itself is gone */
+void cpk_cache_release(cpk_cache_ref_t *ref) {
+    if(ref) ref_drop(ref);
+}
+
+/* Trees still referenced stay valid until released */
+void cpk_cache_clear(cpk_cache_t *cache) {
+    cpk_cache_ref_t *evicted = NULL;
+    uint32_t i = 0;
+
+    for(i = 0; i < cache->nshards; i++) {
+        cache_shard_t *s = &cache->shards[i];
+
+        SHARD_LOCK(s);
+        while(s->oldest)
+            shard_unlink(s, s->oldest, &evicted);
+        SHARD_UNLOCK(s);
+
+        drop_list(evicted);
+        evicted = NULL;
+    }
+}
+
+void cpk_cache_free(cpk_cache_t *cache) {
+    uint32_t i = 0;
+
+    if(!cache) return;
+
+    cpk_cache_clear(cache);
+
+    for(i = 0; i < cache->nshards; i++) {
+#ifdef HAVE_PTHREAD_H
+        pthread_mutex_destroy(&cache->shards[i].lock);
+#endif
+        free(cache->shards[i].buckets);
+    }
+
+    free(cache->shards);
+    free(cache);
+}
+
+void cpk_cache_stats(cpk_cache_t *cache, cpk_cache_stats_t *stats) {
+    uint32_t i = 0;
+
+    memset(stats, 0, sizeof(cpk_cache_stats_t));
+
+    for(i = 0; i < cache->nshards; i++) {
+        cache_shard_t *s = &cache->shards[i];
+
+        SHARD_LOCK(s);
+        stats->hits += s->hits;
+        stats->misses += s->misses;
+        stats->evictions += s->evictions;
+        stats->uncached += s->uncached;
+        stats->entries += s->entries;
+        stats->bytes += s->bytes;
+        SHARD_UNLOCK(s);
+    }
+}
@@ -0,0 +1,251 @@
+/*
+ * libconspack
+ * Copyright (C) 2012  Ryan Pavlik
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the GNU Lesser General Public
+ * License (LGPL) version 2.1 which accompanies this distribution, and
+ * is available at http://www.gnu.org/licenses/lgpl-2.1.html
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ */
+
+#include "config.h"
+#include "conspack/conspack.h"
+
+#include <string.h>
+
+#ifdef HAVE_ZLIB
+#  include <zlib.h>
+#endif
+
+/*
+ * The bundled codec is a byte-oriented LZ77 in the manner of LZ4: a
+ * block is a run of sequences, each a token (literal count in the high
+ * nibble, match length less 4 in the low; 15 in either continues in
+ * following bytes, 255 at a time), the literals, a 16-bit little-endian
+ * match offset and the match.  The last sequence stops after its
+ * literals.  It trades ratio for speed and needs no library.
+ */
+
+#define LZ_MIN_MATCH  4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS  14
+#define LZ_TAIL       12    /* last bytes always sent as literals */
+
+static size_t lz_bound(size_t len) {
+    return len + len / 255 + 16;
+}
+
+static uint32_t lz_read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static uint32_t lz_hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/* Writes a count continued past 15 in bytes of 255; NULL if no room */
+static uint8_t* lz_put_count(uint8_t *op, uint8_t *end, size_t n) {
+    for(; n >= 255; n -= 255) {
+        if(op >= end) return NULL;
+        *op++ = 255;
+    }
+
+    if(op >= end) return NULL;
+    *op++ = n;
+
+    return op;
+}
+
+static uint8_t* lz_sequence(uint8_t *op, uint8_t *end,
+                            const uint8_t *lit, size_t nlit,
+                            size_t offset, size_t mlen) {
+    uint8_t *token = op;
+
+    if(op >= end) return NULL;
+    op++;
+
+    *token = (nlit < 15 ? nlit : 15) << 4;
+    if(nlit >= 15 && !(op = lz_put_count(op, end, nlit - 15)))
+        return NULL;
+
+    if((size_t)(end - op) < nlit) return NULL;
+    memcpy(op, lit, nlit);
+    op += nlit;
+
+    if(!mlen) return op;
+
+    if(end - op < 2) return NULL;
+    *op++ = offset & 0xFF;
+    *op++ = offset >> 8;
+
+    mlen -= LZ_MIN_MATCH;
+    *token |= mlen < 15 ? mlen : 15;
+    if(mlen >= 15 && !(op = lz_put_count(op, end, mlen - 15)))
+        return NULL;
+
+    return op;
+}
+
+static size_t lz_compress(uint8_t *dst, size_t dst_len,
+                          const uint8_t *src, size_t len, int level) {
+    uint32_t table[1 << LZ_HASH_BITS];
+    uint8_t *op = dst, *end = dst + dst_len;
+    size_t ip = 0, anchor = 0, cand = 0, mlen = 0, misses = 0;
+    uint32_t seq = 0, h = 0;
+
+    (void)level;
+
+    memset(table, 0, sizeof(table));
+
+    while(len > LZ_TAIL && ip < len - LZ_TAIL) {
+        seq = lz_read32(src + ip);
+        h = lz_hash(seq);
+        cand = table[h];
+        table[h] = ip;
+
+        if(cand >= ip || ip - cand > LZ_MAX_OFFSET ||
+           lz_read32(src + cand) != seq) {
+            /* Step faster through data that is not matching */
+            ip += 1 + (misses++ >> 6);
+            continue;
+        }
+
+        misses = 0;
+        for(mlen = LZ_MIN_MATCH; ip + mlen < len - LZ_TAIL / 2 &&
+                src[cand + mlen] == src[ip + mlen]; mlen++);
+
+        op = lz_sequence(op, end, src + anchor, ip - anchor, ip - cand, mlen);
+        if(!op) return 0;
+
+        ip += mlen;
+        anchor = ip;
+    }
+
+    op = lz_sequence(op, end, src + anchor, len - anchor, 0, 0);
+    return op ? (size_t)(op - dst) : 0;
+}
+
+/* Reads a count continued past 15; -1 if the input ends first */
+static int lz_get_count(const uint8_t **ip, const uint8_t *end, size_t *n) {
+    uint8_t b = 0;
+
+    do {
+        if(*ip >= end) return -1;
+        b = *(*ip)++;
+        *n += b;
+    } while(b == 255);
+
+    return 0;
+}
+
+/* Every length and offset is checked, so damaged or hostile blocks
+   fail rather than read or write out of bounds */
+static int lz_decompress(uint8_t *dst, size_t dst_len,
+                         const uint8_t *src, size_t len) {
+    const uint8_t *ip = src, *iend = src + len;
+    uint8_t *op = dst, *oend = dst + dst_len;
+    const uint8_t *match = NULL;
+    size_t nlit = 0, mlen = 0, offset = 0;
+    uint8_t token = 0;
+
+    while(ip < iend) {
+        token = *ip++;
+
+        nlit = token >> 4;
+        if(nlit == 15 && lz_get_count(&ip, iend, &nlit)) return -1;
+
+        if((size_t)(iend - ip) < nlit || (size_t)(oend - op) < nlit)
+            return -1;
+
+        memcpy(op, ip, nlit);
+        op += nlit;
+        ip += nlit;
+
+        if(ip == iend) break;
+
+        if(iend - ip < 2) return -1;
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+
+        if(!offset || offset > (size_t)(op - dst)) return -1;
+
+        mlen = token & 15;
+        if(mlen == 15 && lz_get_count(&ip, iend, &mlen)) return -1;
+        mlen += LZ_MIN_MATCH;
+
+        if((size_t)(oend - op) < mlen) return -1;
+
+        /* Overlapping matches repeat the bytes just written */
+        match = op - offset;
+        if(offset >= mlen) {
+            memcpy(op, match, mlen);
+            op += mlen;
+        } else {
+            while(mlen--) *op++ = *match++;
+        }
+    }
+
+    return op == oend ? 0 : -1;
+}
+
+static const cpk_codec_t codec_none = {
+    CPK_CODEC_NONE, "none", NULL, NULL, NULL
+};
+
+static const cpk_codec_t codec_lz = {
+    CPK_CODEC_LZ, "lz", lz_bound, lz_compress, lz_decompress
+};
+
+#ifdef HAVE_ZLIB
+
+static size_t zlib_bound(size_t len) {
+    return compressBound(len);
+}
+
+static size_t zlib_compress(uint8_t *dst, size_t dst_len,
+                            const uint8_t *src, size_t len, int level) {
+    uLongf out = dst_len;
+
+    if(!level) level = Z_DEFAULT_COMPRESSION;
+    if(compress2(dst, &out, src, len, level) != Z_OK)
+        return 0;
+
+    return out;
+}
+
+static int zlib_decompress(uint8_t *dst, size_t dst_len,
+                           const uint8_t *src, size_t len) {
+    uLongf out = dst_len;
+
+    if(uncompress(dst, &out, src, len) != Z_OK || out != dst_len)
+        return -1;
+
+    return 0;
+}
+
+static const cpk_codec_t codec_zlib = {
+    CPK_CODEC_ZLIB, "zlib", zlib_bound, zlib_compress, zlib_decompress
+};
+
+#endif
+
+/* The codec for id, or NULL if it is unknown or was not built */
+const cpk_codec_t* cpk_codec(uint8_t id) {
+    switch(id) {
+        case CPK_CODEC_NONE: return &codec_none;
+        case CPK_CODEC_LZ:   return &codec_lz;
+#ifdef HAVE_ZLIB
+        case CPK_CODEC_ZLIB: return &codec_zlib;
+#endif
+    }
+
+    return NULL;
+}
@@ -14,35 +14,1262 @@
  *
  */
 
+/*
+ * conspack: looks into conspack data from the command line.
+ *
+ *   cat       explains each message, or writes it as JSON
+ *   stat      counts values by type, sizes and depth without decoding
+ *   validate  checks every message, and a record file's checksums
+ *   bench     times validating, decoding and encoding the messages
+ *
+ * Input is a file of messages back to back, a record file (see
+ * recfile.c), or standard input with no file or "-".  Files are
+ * mapped.  Either way input is framed a window at a time, and each
+ * window's messages are shared out across a pool (-j threads, one
+ * per cpu by default).  Framing a stream is the only serial pass; a
+ * record file's records are checked, checksums included, on the pool
+ * too.  cat still writes its output in input order.
+ */
+
 #include "config.h"
 
 #include "conspack/conspack.h"
 
 #include <stdio.h>
+#include <string.h>
 #include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_SYS_MMAN_H
+#  include <sys/mman.h>
+#endif
+
+/* Input is framed this much at a time; a window grows to hold a
+   message bigger than it, up to WINDOW_MAX when reading a stream */
+#define WINDOW     (32 * 1024 * 1024)
+#define WINDOW_MAX (1024 * 1024 * 1024)
+
+/* Records framed at a time from a record file */
+#define WINDOW_RECORDS 65536
+
+/* Chunks a window's messages are split into, per thread */
+#define CHUNKS_PER_THREAD 16
+
+/* Histograms count by bit length: 0, 1, 2-3, 4-7, ... */
+#define HIST 34
+
+static cpk_pool_t *pool = NULL;
+
+static void error_at(cpk_object_t *err, uint32_t code, const char *reason,
+                     size_t pos) {
+    err->header = CPK_ERROR;
+    err->error.code = code;
+    err->error.reason = (char*)reason;
+    err->error.value = 0;
+    err->error.pos = pos;
+}
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int write_all(int fd, const uint8_t *buf, size_t len) {
+    ssize_t n = 0;
+
+    while(len) {
+        n = write(fd, buf, len);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) return -1;
+
+        buf += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+ /* Input */
+
+typedef struct _source {
+    const char *name;
+    int fd;
+
+    cpk_recfile_t *rf;
+    uint64_t record;
+
+    uint8_t *map;       /* the whole file, when it could be mapped */
+    size_t size;
+
+    uint8_t *buf;       /* otherwise a window read from fd */
+    size_t cap;
+    size_t len;
+    int eof;
+
+    uint64_t offset;    /* of the window's first byte in the input */
+    size_t consumed;    /* framed last time, dropped on the next */
+    size_t want;
+
+    const cpk_limits_t *limits;
+    int failed;
+    cpk_object_t err;
+} source_t;
+
+/* A record file is opened as one when its header is there to see, so
+   only a mapped file can be read as records */
+static int source_open(source_t *src, const char *path, uint32_t rf_flags,
+                       const cpk_limits_t *limits) {
+    struct stat st;
+
+    memset(src, 0, sizeof(*src));
+    src->name = path && strcmp(path, "-") ? path : "<stdin>";
+    src->fd = 0;
+    src->want = WINDOW;
+    src->limits = limits;
+
+    if(path && strcmp(path, "-") &&
+       (src->fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+        fprintf(stderr, "conspack: %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+#ifdef HAVE_SYS_MMAN_H
+    if(!fstat(src->fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0) {
+        src->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, src->fd, 0);
+
+        if(src->map == MAP_FAILED) {
+            src->map = NULL;
+        } else {
+            src->size = st.st_size;
+#  ifdef MADV_SEQUENTIAL
+            madvise(src->map, src->size, MADV_SEQUENTIAL);
+#  endif
+        }
+    }
+#else
+    (void)st;
+#endif
+
+    if(src->map && src->size >= 4 && !memcmp(src->map, "CPKF", 4)) {
+        if(!(src->rf = cpk_recfile_open(path, rf_flags))) {
+            fprintf(stderr, "conspack: %s: not a readable record file\n",
+                    path);
+            return -1;
+        }
+
+        munmap(src->map, src->size);
+        src->map = NULL;
+    }
+
+    return 0;
+}
 
-void cpk_print_buffer(cpk_output_t *out) {
-    int i;
-    
-    printf("#(");
-    for(i = 0; i < (out->buffer_used - 1); i++)
-        printf("%u ", (unsigned int)(out->buffer[i]));
+static void source_close(source_t *src) {
+#ifdef HAVE_SYS_MMAN_H
+    if(src->map) munmap(src->map, src->size);
+#endif
 
-    printf("%u)\n", out->buffer[out->buffer_used - 1]);
+    if(src->rf) cpk_recfile_close(src->rf);
+    if(src->fd > 0) close(src->fd);
+    free(src->buf);
 }
 
-int main() {
+/* Reads until the window holds want bytes or the input ends */
+static int source_fill(source_t *src) {
+    uint8_t *buf = NULL;
+    ssize_t n = 0;
+
+    if(src->cap < src->want) {
+        if(!(buf = realloc(src->buf, src->want))) return -1;
+
+        src->buf = buf;
+        src->cap = src->want;
+    }
+
+    while(!src->eof && src->len < src->want) {
+        n = read(src->fd, src->buf + src->len, src->want - src->len);
+        if(n < 0 && errno == EINTR) continue;
+        if(n < 0) return -1;
+        if(!n) src->eof = 1;
+
+        src->len += n;
+    }
+
+    return 0;
+}
+
+/* A window of records checked across the pool */
+typedef struct _check {
+    const cpk_limits_t *limits;
+    const uint8_t *base;    /* payload of the window's first record */
+    uint64_t first;
+    cpk_span_t *spans;
+
+    uint64_t *bad;          /* per thread: first bad record seen */
+    cpk_object_t *errs;
+} check_t;
+
+/* Threads see their records in order, so once one has found a bad
+   record it skips the rest */
+static int check_record(void *arg, uint32_t thread, uint64_t n,
+                        cpk_input_t *in) {
+    check_t *c = arg;
+    cpk_object_t err;
+    size_t span = 0;
+
+    if(n > c->bad[thread])
+        return 0;
+
+    span = cpk_validate_span(in->buffer, in->buffer_size, c->limits, &err);
+    if(span && span == in->buffer_size) {
+        c->spans[n - c->first].offset = in->buffer - c->base;
+        c->spans[n - c->first].length = span;
+        return 0;
+    }
+
+    if(span)
+        error_at(&err, CPK_ERR_TRAILING, CPK_ERR_TRAILING_MSG, 0);
+
+    err.error.pos = n;
+    c->bad[thread] = n;
+    c->errs[thread] = err;
+    return 0;
+}
+
+/* Frames a window of records, each taken to hold one message, with
+   spans relative to the first.  Payloads are validated here, checksums
+   included, as cpk_frame validates a stream; err's position is a
+   record number. */
+static int window_records(source_t *src, cpk_frame_t *frame,
+                          const uint8_t **buf, cpk_object_t *err) {
+    uint32_t threads = cpk_pool_size(pool), i = 0;
+    uint64_t count = cpk_recfile_count(src->rf), end = 0, bad = 0;
+    cpk_span_t *spans = NULL;
+    cpk_object_t damaged;
+    cpk_input_t in;
+    check_t c;
+    int ret = 0;
+
+    if(frame->capacity < WINDOW_RECORDS) {
+        if(!(spans = realloc(frame->spans,
+                             WINDOW_RECORDS * sizeof(cpk_span_t)))) {
+            error_at(err, CPK_ERR_ALLOC, CPK_ERR_ALLOC_MSG, 0);
+            return CPK_ERROR;
+        }
+
+        frame->spans = spans;
+        frame->capacity = WINDOW_RECORDS;
+    }
+
+    frame->count = 0;
+    if(src->record >= count)
+        return 0;
+
+    if(cpk_recfile_get(src->rf, src->record, &in, err))
+        goto fail;
+
+    c.limits = src->limits;
+    c.base = in.buffer;
+    c.first = src->record;
+    c.spans = frame->spans;
+    c.bad = malloc(threads * sizeof(uint64_t));
+    c.errs = malloc(threads * sizeof(cpk_object_t));
+    if(!c.bad || !c.errs) {
+        free(c.bad);
+        free(c.errs);
+        error_at(err, CPK_ERR_ALLOC, CPK_ERR_ALLOC_MSG, src->record);
+        goto fail;
+    }
+
+    for(i = 0; i < threads; i++) c.bad[i] = UINT64_MAX;
+
+    /* A damaged record stops the scan, perhaps before other threads
+       reached the records ahead of it, so those are scanned again */
+    bad = UINT64_MAX;
+    end = count - src->record < WINDOW_RECORDS ? count
+                                               : src->record + WINDOW_RECORDS;
+    while((ret = cpk_recfile_scan(src->rf, pool, src->record, end,
+                                  check_record, &c, &damaged)) == CPK_ERROR) {
+        bad = end = damaged.error.pos;
+        *err = damaged;
+    }
+
+    for(i = 0; i < threads; i++)
+        if(c.bad[i] < bad) {
+            bad = c.bad[i];
+            *err = c.errs[i];
+        }
+
+    free(c.bad);
+    free(c.errs);
+
+    *buf = c.base;
+    if(bad == UINT64_MAX) {
+        frame->count = end - src->record;
+        src->record = end;
+        return frame->count;
+    }
+
+    frame->count = bad - src->record;
+    src->record = bad;
+
+ fail:
+    src->err = *err;
+    src->failed = 1;
+    return frame->count ? (int)frame->count : CPK_ERROR;
+}
+
+/* Frames the next window of src, leaving buf where its spans start.
+   Returns the messages framed, 0 at the end of the input, or
+   CPK_ERROR with err's position from the start of the input.  Those
+   before a malformed message are framed first, and the next call
+   fails.  Anything framed is gone from a stream by the next call. */
+static int source_window(source_t *src, cpk_frame_t *frame,
+                         const uint8_t **buf, cpk_object_t *err) {
+    const uint8_t *p = NULL;
+    size_t len = 0, end = 0;
+    int last = 0, ret = 0;
+
+    frame->count = 0;
+
+    if(src->failed) {
+        *err = src->err;
+        return CPK_ERROR;
+    }
+
+    if(src->rf)
+        return window_records(src, frame, buf, err);
+
+    src->offset += src->consumed;
+    if(!src->map && src->consumed) {
+        memmove(src->buf, src->buf + src->consumed,
+                src->len - src->consumed);
+        src->len -= src->consumed;
+    }
+    src->consumed = 0;
+
+    for(;;) {
+        if(src->map) {
+            p = src->map + src->offset;
+            len = src->size - src->offset;
+            if(len > src->want) len = src->want;
+            last = src->offset + len == src->size;
+        } else {
+            if(source_fill(src)) {
+                error_at(err, CPK_ERR_EOF, strerror(errno), src->offset);
+                return CPK_ERROR;
+            }
+
+            p = src->buf;
+            len = src->len;
+            last = src->eof;
+        }
+
+        if(!len) return 0;
+
+        ret = cpk_frame(frame, p, len, src->limits, err);
+        end = frame->count ? frame->spans[frame->count - 1].offset +
+                             frame->spans[frame->count - 1].length : 0;
+
+        /* A message running past the window is framed with the next,
+           or in a bigger one if it is the first */
+        if(ret && err->error.code == CPK_ERR_EOF && !last) {
+            if(frame->count) break;
+
+            if(!src->map && src->want >= WINDOW_MAX) {
+                error_at(err, CPK_ERR_LIMIT, CPK_ERR_LIMIT_MSG, src->offset);
+                return CPK_ERROR;
+            }
+
+            src->want *= 2;
+            continue;
+        }
+
+        if(ret) {
+            err->error.pos += src->offset;
+            src->err = *err;
+            src->failed = 1;
+
+            if(!frame->count) return CPK_ERROR;
+        }
+
+        break;
+    }
+
+    *buf = p;
+    src->consumed = end;
+    return frame->count;
+}
+
+static void report_error(const source_t *src, const cpk_object_t *err) {
+    if(src->rf)
+        fprintf(stderr, "conspack: %s: record %zu: %s\n", src->name,
+                err->error.pos, err->error.reason);
+    else
+        fprintf(stderr, "conspack: %s: %s at byte %zu\n", src->name,
+                err->error.reason, err->error.pos);
+}
+
+ /* Running windows across the pool */
+
+/* Called with a contiguous run of a window's messages */
+typedef void (*chunk_fn_t)(void *arg, uint32_t thread, uint32_t chunk,
+                           const uint8_t *buf, const cpk_span_t *spans,
+                           size_t count);
+
+typedef struct _chunk_job {
+    chunk_fn_t fn;
+    void *arg;
+
+    const uint8_t *buf;
+    const cpk_frame_t *frame;
+    uint32_t chunks;
+    uint32_t next;
+} chunk_job_t;
+
+static void chunk_worker(void *arg, uint32_t thread) {
+    chunk_job_t *job = arg;
+    size_t count = job->frame->count, start = 0, end = 0;
+    uint32_t c = 0;
+
+    for(;;) {
+        c = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        if(c >= job->chunks) break;
+
+        start = count * c / job->chunks;
+        end = count * (c + 1) / job->chunks;
+
+        job->fn(job->arg, thread, c, job->buf, job->frame->spans + start,
+                end - start);
+    }
+}
+
+static uint32_t max_chunks(void) {
+    return cpk_pool_size(pool) * CHUNKS_PER_THREAD;
+}
+
+/* Runs fn over a window in up to max_chunks() chunks, in order of
+   their numbers only within a thread; returns how many there were */
+static uint32_t run_chunks(const uint8_t *buf, const cpk_frame_t *frame,
+                           chunk_fn_t fn, void *arg) {
+    chunk_job_t job;
+
+    job.fn = fn;
+    job.arg = arg;
+    job.buf = buf;
+    job.frame = frame;
+    job.chunks = frame->count < max_chunks() ? frame->count : max_chunks();
+    job.next = 0;
+
+    cpk_pool_run(pool, chunk_worker, &job);
+    return job.chunks;
+}
+
+/* Frames src a window at a time and runs fn over each.  after, if not
+   NULL, is called once a window is done with the chunks it had. */
+static int each_window(source_t *src, chunk_fn_t fn, void *arg,
+                       int (*after)(void *arg, uint32_t chunks)) {
+    cpk_frame_t frame;
+    cpk_object_t err;
+    const uint8_t *buf = NULL;
+    uint32_t chunks = 0;
+    int n = 0, ret = 0;
+
+    cpk_frame_init(&frame);
+
+    while((n = source_window(src, &frame, &buf, &err)) > 0) {
+        chunks = run_chunks(buf, &frame, fn, arg);
+
+        if(after && after(arg, chunks)) {
+            ret = -1;
+            break;
+        }
+    }
+
+    if(n < 0) {
+        report_error(src, &err);
+        ret = -1;
+    }
+
+    cpk_frame_fini(&frame);
+    return ret;
+}
+
+static uint32_t threads_arg(const char *s) {
+    return strtoul(s, NULL, 10);
+}
+
+ /* cat */
+
+typedef struct _cat {
+    int json;
+    cpk_explain_opts_t opts;
+
+    cpk_output_t *outs;     /* one per chunk */
+    cpk_arena_t *arenas;    /* one per thread */
+    uint64_t failed;
+} cat_t;
+
+static int sink_output(void *arg, const uint8_t *data, size_t len) {
+    return cpk_write_bytes(arg, data, len) < 0;
+}
+
+static void cat_chunk(void *arg, uint32_t thread, uint32_t chunk,
+                      const uint8_t *buf, const cpk_span_t *spans,
+                      size_t count) {
+    cat_t *cat = arg;
+    cpk_output_t *out = &cat->outs[chunk];
+    cpk_arena_t *arena = &cat->arenas[thread];
+    cpk_object_t *obj = NULL, err;
+    cpk_input_t in;
+    size_t i = 0, used = 0;
+
+    cpk_output_clear(out);
+
+    for(i = 0; i < count; i++) {
+        cpk_input_init(&in, (uint8_t*)buf + spans[i].offset,
+                       spans[i].length);
+
+        /* A message JSON cannot hold is written as null, keeping one
+           line per message */
+        if(cat->json) {
+            used = out->buffer_used;
+            if(cpk_to_json(&in, sink_output, out, &err)) {
+                out->buffer_used = used;
+                cpk_write_bytes(out, (const uint8_t*)"null", 4);
+                __atomic_fetch_add(&cat->failed, 1, __ATOMIC_RELAXED);
+            }
+        } else {
+            cpk_input_set_arena(&in, arena);
+            cpk_input_set_flags(&in, CPK_DECODE_VIEWS);
+
+            if((obj = cpk_decode_r(&in)))
+                cpk_explain_sink(obj, &cat->opts, sink_output, out);
+        }
+
+        cpk_write8(out, '\n');
+    }
+
+    cpk_arena_reset(arena);
+}
+
+static int cat_write(void *arg, uint32_t chunks) {
+    cat_t *cat = arg;
+    uint32_t c = 0;
+
+    for(c = 0; c < chunks; c++)
+        if(write_all(1, cat->outs[c].buffer, cat->outs[c].buffer_used))
+            return -1;
+
+    return 0;
+}
+
+static int cmd_cat(int argc, char **argv) {
+    uint32_t threads = 0, i = 0;
+    source_t src;
+    cat_t cat;
+    int opt = 0, ret = 0;
+
+    memset(&cat, 0, sizeof(cat));
+
+    while((opt = getopt(argc, argv, "Jd:n:s:j:")) != -1) {
+        switch(opt) {
+            case 'J': cat.json = 1; break;
+            case 'd': cat.opts.max_depth = strtoul(optarg, NULL, 10); break;
+            case 'n': cat.opts.max_elements = strtoul(optarg, NULL, 10); break;
+            case 's': cat.opts.max_string = strtoul(optarg, NULL, 10); break;
+            case 'j': threads = threads_arg(optarg); break;
+            default:  return 2;
+        }
+    }
+
+    if(source_open(&src, argv[optind], CPK_RECFILE_VERIFY, NULL)) return 1;
+
+    pool = cpk_pool_new(threads);
+    cat.outs = calloc(max_chunks(), sizeof(cpk_output_t));
+    cat.arenas = calloc(cpk_pool_size(pool), sizeof(cpk_arena_t));
+    if(!cat.outs || !cat.arenas) {
+        fprintf(stderr, "conspack: out of memory\n");
+        return 1;
+    }
+
+    for(i = 0; i < max_chunks(); i++)
+        cpk_output_init(&cat.outs[i]);
+    for(i = 0; i < cpk_pool_size(pool); i++)
+        cpk_arena_init(&cat.arenas[i], 0);
+
+    ret = each_window(&src, cat_chunk, &cat, cat_write);
+    if(cat.failed) {
+        fprintf(stderr, "conspack: %s: %" PRIu64 " messages could not be "
+                "written as JSON\n", src.name, cat.failed);
+        ret = -1;
+    }
+
+    for(i = 0; i < max_chunks(); i++)
+        cpk_output_fini(&cat.outs[i]);
+    for(i = 0; i < cpk_pool_size(pool); i++)
+        cpk_arena_fini(&cat.arenas[i]);
+
+    free(cat.outs);
+    free(cat.arenas);
+    source_close(&src);
+    return ret ? 1 : 0;
+}
+
+ /* stat */
+
+typedef struct _tally {
+    uint64_t messages;
+    uint64_t bytes;
+    uint64_t values;
+
+    uint64_t kinds[CPK_STAT_KINDS];
+    uint64_t numbers[16];
+    uint64_t containers[4];     /* by container type, vector first */
+    uint64_t fixed;
+
+    uint64_t sizes[HIST];       /* message bytes */
+    uint64_t elements[HIST];    /* container sizes */
+    uint64_t strings[HIST];     /* string bytes */
+    uint64_t depths[HIST];      /* deepest value of each message */
+
+    uint64_t max_size;
+    uint32_t max_elements;
+    uint32_t max_string;
+    uint32_t max_depth;
+} tally_t;
+
+typedef struct _scan {
+    tally_t *t;
+    uint32_t deepest;
+} scan_t;
+
+static inline int bucket(uint64_t n) {
+    int b = n ? 64 - __builtin_clzll(n) : 0;
+    return b < HIST ? b : HIST - 1;
+}
+
+static inline uint32_t get_size(const uint8_t **p, uint8_t width) {
+    const uint8_t *q = *p;
+
+    *p += width;
+    switch(width) {
+        case 1: return q[0];
+        case 2: return (uint32_t)q[0] << 8 | q[1];
+        case 4: return (uint32_t)q[0] << 24 | (uint32_t)q[1] << 16 |
+                       (uint32_t)q[2] << 8 | q[3];
+    }
+
+    return 0;
+}
+
+static inline void count_value(scan_t *s, const cpk_header_info_t *info,
+                               uint64_t n) {
+    s->t->values += n;
+    s->t->kinds[cpk_stats_slot(info->kind)] += n;
+    if(info->kind == CPK_NUMBER) s->t->numbers[info->numtype] += n;
+}
+
+static const uint8_t* scan_r(scan_t *s, const uint8_t *p, uint32_t depth,
+                             int skip_header, uint8_t header);
+
+static const uint8_t* scan_container(scan_t *s, const uint8_t *p,
+                                     uint32_t depth, uint8_t header) {
+    const cpk_header_info_t *info = CPK_HEADER_INFO(header), *fi = NULL;
+    uint32_t size = get_size(&p, info->size);
+    uint64_t n = size, i = 0;
+    uint8_t fixed = 0;
+    int payload = -1;
+
+    s->t->containers[(header & CPK_CONTAINER_TYPE_MASK) >> 3]++;
+    s->t->elements[bucket(size)]++;
+    if(size > s->t->max_elements) s->t->max_elements = size;
+
+    if(info->flags & CPK_HD_FIXED) {
+        s->t->fixed++;
+        fixed = *p++;
+        fi = CPK_HEADER_INFO(fixed);
+
+        /* Elements the fixed header says everything about */
+        if(fi->flags & CPK_HD_INLINE && fi->kind != CPK_TAG)
+            payload = 0;
+        else if(fi->kind == CPK_NUMBER && !fi->children)
+            payload = fi->payload;
+    }
+
+    if(info->flags & CPK_HD_MAP) n *= 2;
+    if(info->flags & CPK_HD_TMAP) p = scan_r(s, p, depth + 1, 0, 0);
+
+    if(payload >= 0) {
+        count_value(s, fi, n);
+        if(n && depth + 1 > s->deepest) s->deepest = depth + 1;
+
+        return p + n * payload;
+    }
+
+    for(i = 0; i < n; i++)
+        p = scan_r(s, p, depth + 1, info->flags & CPK_HD_FIXED, fixed);
+
+    return p;
+}
+
+/* Walks a message cpk_frame has already validated, so it trusts every
+   size and header it meets; nesting is counted as validation does */
+static const uint8_t* scan_r(scan_t *s, const uint8_t *p, uint32_t depth,
+                             int skip_header, uint8_t header) {
+    const cpk_header_info_t *info = NULL;
+    uint32_t size = 0, i = 0;
+
+    for(;;) {
+        if(!skip_header) header = *p++;
+        info = CPK_HEADER_INFO(header);
+
+        count_value(s, info, 1);
+        if(depth > s->deepest) s->deepest = depth;
+
+        if((info->flags & CPK_HD_INLINE) && !info->children)
+            return p;
+
+        switch(info->kind) {
+            case CPK_NUMBER:
+                if(info->children) break;
+                return p + info->payload;
+
+            case CPK_CONTAINER:
+                return scan_container(s, p, depth, header);
+
+            case CPK_STRING:
+                size = get_size(&p, info->size);
+                s->t->strings[bucket(size)]++;
+                if(size > s->t->max_string) s->t->max_string = size;
+
+                return p + size;
+
+            case CPK_REF:
+            case CPK_INDEX:
+            case CPK_POINTER:
+                return p + info->size;
+
+            case CPK_TAG:
+                p += info->size;
+                skip_header = 0;
+                continue;
+
+            case CPK_CONS:
+                p = scan_r(s, p, depth + 1, 0, 0);
+                skip_header = 0;
+                continue;
+        }
+
+        for(i = 0; i < info->children; i++)
+            p = scan_r(s, p, depth + 1, 0, 0);
+
+        return p;
+    }
+}
+
+static void stat_chunk(void *arg, uint32_t thread, uint32_t chunk,
+                       const uint8_t *buf, const cpk_span_t *spans,
+                       size_t count) {
+    tally_t *t = &((tally_t*)arg)[thread];
+    scan_t s;
+    size_t i = 0;
+
+    (void)chunk;
+    s.t = t;
+
+    for(i = 0; i < count; i++) {
+        s.deepest = 0;
+        scan_r(&s, buf + spans[i].offset, 0, 0, 0);
+
+        t->messages++;
+        t->bytes += spans[i].length;
+        t->sizes[bucket(spans[i].length)]++;
+        t->depths[bucket(s.deepest)]++;
+        if(spans[i].length > t->max_size) t->max_size = spans[i].length;
+        if(s.deepest > t->max_depth) t->max_depth = s.deepest;
+    }
+}
+
+static void tally_add(tally_t *to, const tally_t *t) {
+    int i = 0;
+
+    to->messages += t->messages;
+    to->bytes += t->bytes;
+    to->values += t->values;
+    to->fixed += t->fixed;
+
+    for(i = 0; i < CPK_STAT_KINDS; i++) to->kinds[i] += t->kinds[i];
+    for(i = 0; i < 16; i++) to->numbers[i] += t->numbers[i];
+    for(i = 0; i < 4; i++) to->containers[i] += t->containers[i];
+
+    for(i = 0; i < HIST; i++) {
+        to->sizes[i] += t->sizes[i];
+        to->elements[i] += t->elements[i];
+        to->strings[i] += t->strings[i];
+        to->depths[i] += t->depths[i];
+    }
+
+    if(t->max_size > to->max_size) to->max_size = t->max_size;
+    if(t->max_elements > to->max_elements) to->max_elements = t->max_elements;
+    if(t->max_string > to->max_string) to->max_string = t->max_string;
+    if(t->max_depth > to->max_depth) to->max_depth = t->max_depth;
+}
+
+static void print_count(const char *name, uint64_t n, uint64_t total) {
+    if(n)
+        printf("  %-14s %14" PRIu64 "  %5.1f%%\n", name, n,
+               total ? 100.0 * n / total : 0);
+}
+
+static void print_hist(const char *title, const uint64_t *hist,
+                       uint64_t max) {
+    uint64_t total = 0, top = 0;
+    int i = 0, w = 0;
+
+    for(i = 0; i < HIST; i++) {
+        total += hist[i];
+        if(hist[i] > top) top = hist[i];
+    }
+
+    if(!total) return;
+
+    printf("\n%s (max %" PRIu64 ")\n", title, max);
+
+    for(i = 0; i < HIST; i++) {
+        if(!hist[i]) continue;
+
+        if(i < 2)
+            printf("  %10d            ", i);
+        else
+            printf("  %10" PRIu64 " - %-8" PRIu64, (uint64_t)1 << (i - 1),
+                   i < 64 ? ((uint64_t)1 << i) - 1 : UINT64_MAX);
+
+        printf(" %14" PRIu64 "  %5.1f%%  ", hist[i], 100.0 * hist[i] / total);
+        for(w = (int)(40 * hist[i] / top); w > 0; w--) putchar('#');
+        putchar('\n');
+    }
+}
+
+static const char *kind_names[CPK_STAT_KINDS] = {
+    "boolean", "number", "container", "string", "ref", "rref",
+    "pointer", "tag", "index", "cons", "package", "symbol"
+};
+
+static const char *number_names[16] = {
+    "int8", "int16", "int32", "int64", "uint8", "uint16", "uint32",
+    "uint64", "single-float", "double-float", "int128", "uint128",
+    "complex", NULL, NULL, "rational"
+};
+
+static const char *container_names[4] = { "vector", "list", "map", "tmap" };
+
+static void stat_print(const source_t *src, const tally_t *t) {
+    uint64_t containers = 0;
+    int i = 0;
+
+    printf("%s\n", src->name);
+    printf("  %-14s %14" PRIu64 "\n", "messages", t->messages);
+    printf("  %-14s %14" PRIu64 "\n", "bytes", t->bytes);
+    printf("  %-14s %14" PRIu64 "\n", "values", t->values);
+    printf("  %-14s %14u\n", "max depth", t->max_depth);
+
+    printf("\nvalues\n");
+    for(i = 0; i < CPK_STAT_KINDS; i++)
+        print_count(kind_names[i], t->kinds[i], t->values);
+
+    printf("\nnumbers\n");
+    for(i = 0; i < 16; i++)
+        if(number_names[i])
+            print_count(number_names[i], t->numbers[i],
+                        t->kinds[CPK_STAT_NUMBER]);
+
+    for(i = 0; i < 4; i++) containers += t->containers[i];
+
+    printf("\ncontainers\n");
+    for(i = 0; i < 4; i++)
+        print_count(container_names[i], t->containers[i], containers);
+    print_count("fixed", t->fixed, containers);
+
+    print_hist("message bytes", t->sizes, t->max_size);
+    print_hist("container elements", t->elements, t->max_elements);
+    print_hist("string bytes", t->strings, t->max_string);
+    print_hist("depth", t->depths, t->max_depth);
+}
+
+static int cmd_stat(int argc, char **argv) {
+    tally_t *tallies = NULL, total;
+    uint32_t threads = 0, i = 0;
+    source_t src;
+    int opt = 0, ret = 0;
+
+    while((opt = getopt(argc, argv, "j:")) != -1) {
+        switch(opt) {
+            case 'j': threads = threads_arg(optarg); break;
+            default:  return 2;
+        }
+    }
+
+    if(source_open(&src, argv[optind], CPK_RECFILE_VERIFY, NULL)) return 1;
+
+    pool = cpk_pool_new(threads);
+    if(!(tallies = calloc(cpk_pool_size(pool), sizeof(tally_t)))) {
+        fprintf(stderr, "conspack: out of memory\n");
+        return 1;
+    }
+
+    ret = each_window(&src, stat_chunk, tallies, NULL);
+
+    memset(&total, 0, sizeof(total));
+    for(i = 0; i < cpk_pool_size(pool); i++)
+        tally_add(&total, &tallies[i]);
+
+    stat_print(&src, &total);
+
+    free(tallies);
+    source_close(&src);
+    return ret ? 1 : 0;
+}
+
+ /* validate */
+
+static int cmd_validate(int argc, char **argv) {
+    cpk_limits_t limits;
+    cpk_frame_t frame;
+    cpk_object_t err;
+    const uint8_t *buf = NULL;
+    uint64_t messages = 0, bytes = 0;
+    uint32_t threads = 0;
+    size_t i = 0;
+    source_t src;
+    int opt = 0, ret = 0, n = 0, quiet = 0;
+
+    memset(&limits, 0, sizeof(limits));
+
+    while((opt = getopt(argc, argv, "qd:n:s:j:")) != -1) {
+        switch(opt) {
+            case 'q': quiet = 1; break;
+            case 'd': limits.max_depth = strtoul(optarg, NULL, 10); break;
+            case 'n': limits.max_elements = strtoull(optarg, NULL, 10); break;
+            case 's': limits.max_size = strtoul(optarg, NULL, 10); break;
+            case 'j': threads = threads_arg(optarg); break;
+            default:  return 2;
+        }
+    }
+
+    if(source_open(&src, argv[optind], CPK_RECFILE_VERIFY, &limits))
+        return 1;
+
+    pool = cpk_pool_new(threads);
+
+    /* Framing is validating; record windows are checked across the
+       pool, while a stream has to be framed in order */
+    cpk_frame_init(&frame);
+
+    while((n = source_window(&src, &frame, &buf, &err)) > 0) {
+        messages += n;
+        for(i = 0; i < frame.count; i++)
+            bytes += frame.spans[i].length;
+    }
+
+    if(n < 0) {
+        report_error(&src, &err);
+        fprintf(stderr, "conspack: %s: %" PRIu64 " messages valid "
+                "before it\n", src.name, messages);
+        ret = -1;
+    }
+
+    cpk_frame_fini(&frame);
+
+    if(!ret && !quiet) {
+        if(src.rf)
+            printf("%s: ok, %" PRIu64 " records\n", src.name, messages);
+        else
+            printf("%s: ok, %" PRIu64 " messages, %" PRIu64 " bytes\n",
+                   src.name, messages, bytes);
+    }
+
+    source_close(&src);
+    return ret ? 1 : 0;
+}
+
+ /* bench */
+
+typedef struct _corpus {
+    cpk_output_t data;      /* every message, back to back */
+    cpk_frame_t frame;
+    cpk_batch_t batch;      /* decoded once, for encode */
+    double min_seconds;
+} corpus_t;
+
+typedef void (*bench_fn_t)(corpus_t *c);
+
+static void bench_validate(corpus_t *c) {
+    cpk_frame_t frame;
+
+    cpk_frame_init(&frame);
+    cpk_frame(&frame, c->data.buffer, c->data.buffer_used, NULL, NULL);
+    cpk_frame_fini(&frame);
+}
+
+static void bench_decode(corpus_t *c) {
+    cpk_input_t in;
+    size_t i = 0;
+
+    for(i = 0; i < c->frame.count; i++) {
+        cpk_input_init(&in, c->data.buffer + c->frame.spans[i].offset,
+                       c->frame.spans[i].length);
+        cpk_free_r(cpk_decode_r(&in));
+    }
+}
+
+/* Each message decodes over the last one's tree, as a server
+   reading one message after another would */
+static void bench_reuse(corpus_t *c) {
+    cpk_object_t *tree = NULL;
+    cpk_input_t in;
+    size_t i = 0;
+
+    for(i = 0; i < c->frame.count; i++) {
+        cpk_input_init(&in, c->data.buffer + c->frame.spans[i].offset,
+                       c->frame.spans[i].length);
+        tree = cpk_decode_into(&in, tree);
+    }
+
+    cpk_free_r(tree);
+}
+
+static void bench_batch(corpus_t *c) {
+    cpk_batch_t batch;
+
+    cpk_batch_init(&batch);
+    cpk_decode_batch(&batch, pool, c->data.buffer, c->data.buffer_used,
+                     NULL, NULL);
+    cpk_batch_fini(&batch);
+}
+
+static void bench_encode(corpus_t *c) {
     cpk_output_t out;
+    size_t i = 0;
+
+    cpk_output_init(&out);
+    for(i = 0; i < c->batch.frame.count; i++)
+        cpk_encode_object(&out, c->batch.objs[i]);
+    cpk_output_fini(&out);
+}
+
+static int sink_count(void *arg, const uint8_t *data, size_t len) {
+    (void)data;
+    *(size_t*)arg += len;
+    return 0;
+}
+
+static void bench_json(corpus_t *c) {
     cpk_input_t in;
-    cpk_object_t *obj;
-    uint8_t data[] = { 36, 3, 20, 1, 2, 3 };
+    size_t i = 0, n = 0;
+
+    for(i = 0; i < c->frame.count; i++) {
+        cpk_input_init(&in, c->data.buffer + c->frame.spans[i].offset,
+                       c->frame.spans[i].length);
+        cpk_to_json(&in, sink_count, &n, NULL);
+    }
+}
 
+typedef struct _bench {
+    const char *name;
+    bench_fn_t run;
+    int parallel;
+} bench_t;
+
+static const bench_t benches[] = {
+    { "validate", bench_validate, 0 },
+    { "decode",   bench_decode,   0 },
+    { "reuse",    bench_reuse,    0 },
+    { "batch",    bench_batch,    1 },
+    { "encode",   bench_encode,   0 },
+    { "json",     bench_json,     0 },
+    { NULL, NULL, 0 }
+};
+
+/* Copies every message of src into one buffer */
+static int corpus_load(corpus_t *c, source_t *src) {
+    cpk_object_t err;
+    const uint8_t *buf = NULL;
+    size_t i = 0;
+    int n = 0;
+
+    while((n = source_window(src, &c->frame, &buf, &err)) > 0)
+        for(i = 0; i < c->frame.count; i++)
+            cpk_write_bytes(&c->data, buf + c->frame.spans[i].offset,
+                            c->frame.spans[i].length);
+
+    if(n < 0) {
+        report_error(src, &err);
+        return -1;
+    }
+
+    c->frame.count = 0;
+    if(cpk_frame(&c->frame, c->data.buffer, c->data.buffer_used, NULL,
+                 &err)) {
+        report_error(src, &err);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int cmd_bench(int argc, char **argv) {
+    const char *only = NULL;
+    const bench_t *b = NULL;
+    cpk_output_t out;
+    uint32_t threads = 0;
+    uint64_t reps = 0;
+    double start = 0, secs = 0, per = 0;
+    source_t src;
+    corpus_t c;
+    size_t i = 0;
+    int opt = 0, same = 0;
+
+    memset(&c, 0, sizeof(c));
+    c.min_seconds = 1;
+
+    while((opt = getopt(argc, argv, "t:a:j:")) != -1) {
+        switch(opt) {
+            case 't': c.min_seconds = strtod(optarg, NULL); break;
+            case 'a': only = optarg; break;
+            case 'j': threads = threads_arg(optarg); break;
+            default:  return 2;
+        }
+    }
+
+    if(source_open(&src, argv[optind], 0, NULL)) return 1;
+
+    pool = cpk_pool_new(threads);
+    cpk_output_init(&c.data);
+    cpk_frame_init(&c.frame);
+    cpk_batch_init(&c.batch);
+
+    if(corpus_load(&c, &src)) return 1;
+
+    if(!c.frame.count) {
+        fprintf(stderr, "conspack: %s: no messages\n", src.name);
+        return 1;
+    }
+
+    /* Encoding a decoded tree should give back the bytes it came from */
+    cpk_decode_batch(&c.batch, pool, c.data.buffer, c.data.buffer_used,
+                     NULL, NULL);
     cpk_output_init(&out);
-    cpk_input_init(&in, data, sizeof(data));
+    for(i = 0; i < c.batch.frame.count; i++)
+        cpk_encode_object(&out, c.batch.objs[i]);
+    same = out.buffer_used == c.data.buffer_used &&
+           !memcmp(out.buffer, c.data.buffer, out.buffer_used);
+    cpk_output_fini(&out);
+
+    printf("%s: %zu messages, %zu bytes, %u threads%s\n\n", src.name,
+           c.frame.count, c.data.buffer_used, cpk_pool_size(pool),
+           same ? "" : " (re-encoding does not give the same bytes)");
+    printf("%-10s %10s %12s %10s\n", "", "MB/s", "msgs/s", "ns/msg");
+
+    for(b = benches; b->name; b++) {
+        if(only && strcmp(only, b->name)) continue;
 
-    obj = cpk_decode_r(&in);
-    
-    cpk_explain_object(&out, obj);
-    cpk_print(&out);
+        b->run(&c);
+
+        reps = 0;
+        start = now();
+        do {
+            b->run(&c);
+            reps++;
+            secs = now() - start;
+        } while(secs < c.min_seconds);
+
+        per = secs / reps;
+        printf("%-10s %10.1f %12.0f %10.1f%s\n", b->name,
+               c.data.buffer_used / per / 1e6, c.frame.count / per,
+               per * 1e9 / c.frame.count, b->parallel ? "  (-j)" : "");
+        fflush(stdout);
+    }
+
+    cpk_batch_fini(&c.batch);
+    cpk_frame_fini(&c.frame);
+    cpk_output_fini(&c.data);
+    source_close(&src);
+    return 0;
+}
+
+ /* Commands */
+
+typedef struct _command {
+    const char *name;
+    int (*run)(int argc, char **argv);
+    const char *usage;
+} command_t;
+
+static const command_t commands[] = {
+    { "cat", cmd_cat,
+      "[-J] [-d depth] [-n elements] [-s bytes] [-j threads] [file]\n"
+      "    explain each message, or with -J write it as JSON; -d, -n and\n"
+      "    -s cut explanations short" },
+    { "stat", cmd_stat,
+      "[-j threads] [file]\n"
+      "    count values by type, and sizes and depth, without decoding" },
+    { "validate", cmd_validate,
+      "[-q] [-d depth] [-n elements] [-s size] [-j threads] [file]\n"
+      "    check every message against the limits given, and a record\n"
+      "    file's checksums; exits 1 at the first bad message" },
+    { "bench", cmd_bench,
+      "[-t seconds] [-a api] [-j threads] [file]\n"
+      "    time validate, decode, reuse, batch, encode and json over the\n"
+      "    messages; only batch uses more than one thread" },
+    { NULL, NULL, NULL }
+};
+
+static void usage(FILE *f) {
+    const command_t *c = NULL;
+
+    fprintf(f, "usage: conspack command [options] [file]\n\n");
+
+    for(c = commands; c->name; c++)
+        fprintf(f, "  %s %s\n\n", c->name, c->usage);
+
+    fprintf(f, "A file may hold messages back to back or be a record "
+               "file; with none, or\n\"-\", standard input is read.  "
+               "-j 0, the default, is a thread per cpu.\n");
 }
 
+int main(int argc, char **argv) {
+    const command_t *c = NULL;
+    int ret = 0;
+
+    if(argc < 2) {
+        usage(stderr);
+        return 2;
+    }
+
+    if(!strcmp(argv[1], "-h") || !strcmp(argv[1], "help")) {
+        usage(stdout);
+        return 0;
+    }
+
+    for(c = commands; c->name; c++) {
+        if(strcmp(argv[1], c->name)) continue;
+
+        ret = c->run(argc - 1, argv + 1);
+        if(ret == 2)
+            fprintf(stderr, "usage: conspack %s %s\n", c->name, c->usage);
+
+        cpk_pool_free(pool);
+        return ret;
+    }
+
+    fprintf(stderr, "conspack: no command named %s\n", argv[1]);
+    usage(stderr);
+    return 2;
+}
@@ -20,15 +20,26 @@
 
 #include "config.h"
 #include "conspack/conspack.h"
+#include "internal.h"
 
 #include <stdio.h>
 #include <memory.h>
 #include <string.h>
+#include <unistd.h>
+#include <errno.h>
 
 const char *CPK_ERR_EOF_MSG = "End of input";
 const char *CPK_ERR_BAD_HEADER_MSG = "Bad header value";
 const char *CPK_ERR_BAD_SIZE_MSG = "Bad size type";
 const char *CPK_ERR_BAD_TYPE_MSG = "Bad type";
+const char *CPK_ERR_TRAILING_MSG = "Trailing data after value";
+const char *CPK_ERR_LIMIT_MSG = "Limit exceeded";
+
+const char *CPK_ERR_ALLOC_MSG = "Out of memory";
+const char *CPK_ERR_CHECKSUM_MSG = "Checksum mismatch";
+const char *CPK_ERR_ABORTED_MSG = "Aborted by callback";
+const char *CPK_ERR_SYNTAX_MSG = "Syntax error";
+const char *CPK_ERR_IO_MSG = "I/O error";
 
 void cpk_input_init(cpk_input_t *in, uint8_t *data, size_t len) {
     in->buffer = data;
@@ -36,6 +47,24 @@ void cpk_input_init(cpk_input_t *in, uint8_t *data, size_t len) {
     in->buffer_size = len;
 
     in->fd = -1;
+
+    in->limits = NULL;
+    in->allocated = 0;
+    in->unbacked = 0;
+    in->depth = 0;
+
+    in->stats = NULL;
+    in->arena = NULL;
+    in->flags = 0;
+    in->crc = 0;
+    in->crc_pos = 0;
+
+    in->stage = NULL;
+    in->hashing = NULL;
+
+    in->string_threshold = 0;
+    in->string_fn = NULL;
+    in->string_arg = NULL;
 }
 
 void cpk_input_init_fd(cpk_input_t *in, int fd) {
@@ -44,72 +73,211 @@ void cpk_input_init_fd(cpk_input_t *in, int fd) {
     in->buffer_size = 0;
 
     in->fd = fd;
+
+    in->limits = NULL;
+    in->allocated = 0;
+    in->unbacked = 0;
+    in->depth = 0;
+
+    in->stats = NULL;
+    in->arena = NULL;
+    in->flags = 0;
+    in->crc = 0;
+    in->crc_pos = 0;
+
+    in->stage = NULL;
+    in->hashing = NULL;
+
+    in->string_threshold = 0;
+    in->string_fn = NULL;
+    in->string_arg = NULL;
+}
+
+/* Only staged inputs hold anything to release */
+void cpk_input_fini(cpk_input_t *in) {
+    cpk_stage_free(in->stage);
+    in->stage = NULL;
+}
+
+void cpk_input_set_limits(cpk_input_t *in, const cpk_limits_t *limits) {
+    in->limits = limits;
+}
+
+void cpk_input_set_stats(cpk_input_t *in, cpk_stats_t *stats) {
+    in->stats = stats;
+}
+
+void cpk_input_set_arena(cpk_input_t *in, cpk_arena_t *arena) {
+    in->arena = arena;
+}
+
+/* A NULL fn keeps every string, whatever the threshold */
+void cpk_input_set_strings(cpk_input_t *in, uint32_t threshold,
+                           cpk_string_fn_t fn, void *arg) {
+    in->string_threshold = threshold;
+    in->string_fn = fn;
+    in->string_arg = arg;
+}
+
+/* Views need the input's memory to outlive the tree, so they are only
+   made from buffers; descriptor input always copies.  Restarts the
+   running checksum. */
+void cpk_input_set_flags(cpk_input_t *in, uint32_t flags) {
+    in->flags = flags;
+    in->crc = 0;
+    in->crc_pos = in->buffer_read;
+}
+
+/* As for output, descriptor reads are summed as they are made and
+   buffers in runs as decoding passes over them, which also covers
+   views and skips that never copy their bytes */
+#define CRC_CHUNK 4096
+
+static void crc_catch_up(cpk_input_t *in) {
+    if(in->fd < 0 && in->buffer_read > in->crc_pos)
+        in->crc = cpk_crc32c(in->crc, in->buffer + in->crc_pos,
+                             in->buffer_read - in->crc_pos);
+
+    in->crc_pos = in->buffer_read;
+}
+
+uint32_t cpk_input_crc(cpk_input_t *in) {
+    if(in->flags & CPK_DECODE_CRC)
+        crc_catch_up(in);
+
+    return in->crc;
 }
 
 int cpk_input_has(cpk_input_t *in, size_t bytes) {
+    if((in->flags & CPK_DECODE_CRC) &&
+       in->buffer_read - in->crc_pos >= CRC_CHUNK)
+        crc_catch_up(in);
+
     return (in->buffer_size - in->buffer_read) >= bytes;
 }
 
-int cpk_read8(cpk_input_t *in, uint8_t *dest) {
+/* Bytes known to be left, or SIZE_MAX when reading from a descriptor */
+size_t cpk_input_remaining(cpk_input_t *in) {
     if(in->fd >= 0)
-        return read(in->fd, dest, 1);
-    else {
+        return SIZE_MAX;
+
+    return in->buffer_size - in->buffer_read;
+}
+
+/* In fd mode buffer_read still tracks the stream position, for errors */
+static int read_fd(cpk_input_t *in, void *dest, size_t len) {
+    uint8_t *p = dest;
+    ssize_t n = 0;
+
+    while(len) {
+        if(in->stage) {
+            n = cpk_stage_read(in, p, len);
+        } else {
+            n = read(in->fd, p, len);
+            CPK_STAT_ADD(in->stats, syscalls, 1);
+        }
+
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) return -1;
+
+        if(in->flags & CPK_DECODE_CRC)
+            in->crc = cpk_crc32c(in->crc, p, n);
+        p += n;
+        len -= n;
+        in->buffer_read += n;
+        CPK_STAT_ADD(in->stats, bytes_read, n);
+    }
+
+    return 0;
+}
+
+int cpk_read8(cpk_input_t *in, uint8_t *dest) {
+    if(in->fd >= 0) {
+        if(read_fd(in, dest, 1) < 0) return -1;
+    } else {
         if(!cpk_input_has(in, 1)) return -1;
         *dest = in->buffer[in->buffer_read];
         in->buffer_read++;
+        CPK_STAT_ADD(in->stats, bytes_read, 1);
     }
 
     return 1;
 }
 
 int cpk_read16(cpk_input_t *in, uint16_t *dest) {
-    if(in->fd >= 0)
-        return read(in->fd, dest, 2);
-    else {
+    uint16_t tmp;
+
+    if(in->fd >= 0) {
+        if(read_fd(in, &tmp, 2) < 0) return -1;
+    } else {
         if(!cpk_input_has(in, 2)) return -1;
-        *dest = net16(*(uint16_t*)(in->buffer + in->buffer_read));
+        memcpy(&tmp, in->buffer + in->buffer_read, 2);
         in->buffer_read += 2;
+        CPK_STAT_ADD(in->stats, bytes_read, 2);
     }
 
+    *dest = net16(tmp);
     return 2;
 }
 
 int cpk_read32(cpk_input_t *in, uint32_t *dest) {
-    if(in->fd >= 0)
-        return read(in->fd, dest, 4);
-    else {
+    uint32_t tmp;
+
+    if(in->fd >= 0) {
+        if(read_fd(in, &tmp, 4) < 0) return -1;
+    } else {
         if(!cpk_input_has(in, 4)) return -1;
-        *dest = net32(*(uint32_t*)(in->buffer + in->buffer_read));
+        memcpy(&tmp, in->buffer + in->buffer_read, 4);
         in->buffer_read += 4;
+        CPK_STAT_ADD(in->stats, bytes_read, 4);
     }
 
+    *dest = net32(tmp);
     return 4;
 }
 
 int cpk_read64(cpk_input_t *in, uint64_t *dest) {
-    if(in->fd >= 0)
-        return read(in->fd, dest, 8);
-    else {
+    uint64_t tmp;
+
+    if(in->fd >= 0) {
+        if(read_fd(in, &tmp, 8) < 0) return -1;
+    } else {
         if(!cpk_input_has(in, 8)) return -1;
-        *dest = net64(*(uint64_t*)(in->buffer + in->buffer_read));
+        memcpy(&tmp, in->buffer + in->buffer_read, 8);
         in->buffer_read += 8;
+        CPK_STAT_ADD(in->stats, bytes_read, 8);
     }
 
+    *dest = net64(tmp);
     return 8;
 }
 
 int cpk_read_bytes(cpk_input_t *in, uint8_t *dest, size_t len) {
-    if(in->fd >= 0)
-        read(in->fd, dest, len);
-    else {
+    if(in->fd >= 0) {
+        if(read_fd(in, dest, len) < 0) return -1;
+    } else {
         if(!cpk_input_has(in, len)) return -1;
         memcpy(dest, (in->buffer + in->buffer_read), len);
         in->buffer_read += len;
+        CPK_STAT_ADD(in->stats, bytes_read, len);
     }
 
     return len;
 }
 
+/* Reads a trailer left by cpk_write_crc and checks it against the sum
+   of what was consumed since the last one, then restarts the sum */
+int cpk_read_crc(cpk_input_t *in) {
+    uint32_t expect = cpk_input_crc(in), crc = 0;
+
+    if(cpk_read32(in, &crc) < 0)
+        return CPK_ERROR;
+
+    in->crc = 0;
+    in->crc_pos = in->buffer_read;
+    return crc == expect ? 0 : CPK_ERROR;
+}
+
 void cpk_err(cpk_object_t *obj, uint32_t code, const char *reason,
              uint8_t value, size_t pos) {
     obj->header = CPK_ERROR;
@@ -127,99 +295,251 @@ void cpk_err(cpk_object_t *obj, uint32_t code, const char *reason,
     } \
 }
 
-#define READN(len,src,dest,err) \
+#define READ_R(n,src,dest,err,ret) \
 {   cpk_input_t *_in = (src); \
-    if(cpk_read_bytes(_in,(dest),(len)) < 0) { \
+    if(cpk_read##n(_in,(dest)) < 0) { \
         cpk_err((err), CPK_ERR_EOF, CPK_ERR_EOF_MSG, 0, _in->buffer_read); \
-        return; \
+        return (ret); \
     } \
 }
 
-#define DECODE_TEST(in,dest,test,err) \
-{   cpk_input_t *__in = (in); \
-    cpk_object_t *__err = (err); \
- \
-    dest = malloc(sizeof(cpk_object_t)); \
- \
-    cpk_decode(__in, dest, 0);         \
-    if(CPK_IS_ERROR(dest->header)) { \
-        *__err = *dest; \
-        free(dest); \
-        dest = NULL; \
-    } \
- \
-    if(!test(dest->header)) { \
-        cpk_err(__err, CPK_ERR_BAD_TYPE, CPK_ERR_BAD_TYPE_MSG, \
-                dest->header, __in->buffer_read); \
-        free(dest); \
-        dest = NULL; \
-    } \
+/* The budgets below are per message */
+static inline void decode_begin(cpk_input_t *in) {
+    in->allocated = 0;
+    in->unbacked = 0;
+    in->hashing = NULL;
 }
 
-uint8_t cpk_decode_header(uint8_t header) {
-    uint8_t tmp = header & 0xF0;
-    uint8_t ref = header & 0xE0;
-
-    if(header == 0x64)
-        return header;
-    else if(ref == CPK_REF || ref == CPK_TAG || ref == CPK_INDEX)
-        return ref;
-    else if((header & CPK_SYMBOL_MASK) == CPK_SYMBOL)
-        return CPK_SYMBOL;
-    else if(tmp == 0x80)
-        return header;
+/* Every allocation made while decoding is charged against the input's
+   max_alloc budget before it is made, so a hostile size field fails
+   with CPK_ERR_LIMIT instead of committing memory. */
+static int charge(cpk_input_t *in, cpk_object_t *err, size_t bytes) {
+    uint64_t max = in->limits ? in->limits->max_alloc : 0;
+
+    if(max && (bytes > max || in->allocated > max - bytes)) {
+        cpk_err(err, CPK_ERR_LIMIT, CPK_ERR_LIMIT_MSG, 0, in->buffer_read);
+        return -1;
+    }
+
+    in->allocated += bytes;
+    return 0;
+}
+
+static void* decode_alloc(cpk_input_t *in, cpk_object_t *err, size_t bytes) {
+    void *ptr = NULL;
+
+    if(charge(in, err, bytes)) return NULL;
+
+    if(in->arena)
+        ptr = cpk_arena_alloc(in->arena, bytes);
+    else
+        ptr = malloc(bytes);
+
+    if(!ptr) {
+        cpk_err(err, CPK_ERR_ALLOC, CPK_ERR_ALLOC_MSG, 0, in->buffer_read);
+        return NULL;
+    }
+
+    CPK_STAT_ADD(in->stats, allocs, 1);
+    CPK_STAT_ADD(in->stats, alloc_bytes, bytes);
+    return ptr;
+}
+
+static void* decode_realloc(cpk_input_t *in, cpk_object_t *err, void *ptr,
+                            size_t old_bytes, size_t bytes) {
+    void *tmp = NULL;
 
+    if(charge(in, err, bytes - old_bytes)) return NULL;
+
+    if(in->arena)
+        tmp = cpk_arena_realloc(in->arena, ptr, old_bytes, bytes);
+    else
+        tmp = realloc(ptr, bytes);
+
+    if(!tmp) {
+        cpk_err(err, CPK_ERR_ALLOC, CPK_ERR_ALLOC_MSG, 0, in->buffer_read);
+        return NULL;
+    }
+
+    CPK_STAT_ADD(in->stats, reallocs, 1);
+    CPK_STAT_ADD(in->stats, alloc_bytes, bytes - old_bytes);
     return tmp;
 }
 
-void cpk_decode_number(cpk_input_t *in, cpk_object_t *obj, uint8_t h) {
-    cpk_object_t *a = NULL, *b = NULL;
-    
-    switch(CPK_NUMBER_TYPE(h)) {
-        case CPK_INT8:
-        case CPK_UINT8:
-            READ(8, in, &obj->number.val.uint8, obj);
-            break;
+/* A fresh, zeroed object; not charged, since callers charge it */
+static cpk_object_t* decode_new(cpk_input_t *in) {
+    cpk_object_t *obj = NULL;
 
-        case CPK_INT16:
-        case CPK_UINT16:
-            READ(16, in, &obj->number.val.uint16, obj);
-            break;
+    if(in->arena) {
+        if((obj = cpk_arena_alloc(in->arena, sizeof(cpk_object_t))))
+            memset(obj, 0, sizeof(cpk_object_t));
+    } else {
+        obj = calloc(1, sizeof(cpk_object_t));
+    }
 
-        case CPK_INT32:
-        case CPK_UINT32:
-            READ(32, in, &obj->number.val.uint32, obj);
-            break;
+    if(obj) {
+        CPK_STAT_ADD(in->stats, allocs, 1);
+        CPK_STAT_ADD(in->stats, alloc_bytes, sizeof(cpk_object_t));
+    }
 
-        case CPK_INT64:
-        case CPK_UINT64:
-            READ(64, in, &obj->number.val.uint64, obj);
-            break;
+    return obj;
+}
 
-        case CPK_SINGLE_FLOAT:
-            READ(32, in, &obj->number.val.uint32, obj);
-            break;
+/* Arena memory is only ever released with the arena */
+static void decode_drop(cpk_input_t *in, cpk_object_t *obj) {
+    if(in->arena) return;
 
-        case CPK_DOUBLE_FLOAT:
-            READ(64, in, &obj->number.val.uint64, obj);
-            break;
+    cpk_free(obj);
+    free(obj);
+}
 
-        case CPK_COMPLEX:
-        case CPK_RATIONAL:
-            DECODE_TEST(in, a, CPK_IS_NUMBER, obj);
-            if(!a) return;
-            
-            DECODE_TEST(in, b, CPK_IS_NUMBER, obj);
-            if(!b) { cpk_free(b); free(b); return; }
+static void decode_drop_r(cpk_input_t *in, cpk_object_t *obj) {
+    if(!in->arena)
+        cpk_free_r(obj);
+}
+
+/* Descriptor input has no known end, so containers and strings are
+   always grown as their contents arrive there. */
+static inline int decode_grows(cpk_input_t *in) {
+    return in->fd >= 0 || (in->limits && (in->limits->flags & CPK_LIMIT_GROW));
+}
+
+uint8_t cpk_decode_header(uint8_t header) {
+    return cpk_header_table[header].kind;
+}
+
+static void bad_header(cpk_input_t *in, cpk_object_t *obj, uint8_t header) {
+    if(CPK_HEADER_INFO(header)->flags & CPK_HD_BAD_SIZE)
+        cpk_err(obj, CPK_ERR_BAD_SIZE, CPK_ERR_BAD_SIZE_MSG,
+                header, in->buffer_read);
+    else
+        cpk_err(obj, CPK_ERR_BAD_HEADER, CPK_ERR_BAD_HEADER_MSG,
+                header, in->buffer_read);
+}
+
+/* A rational's or complex's parts are read straight into obj when
+   both are numbers of 64 bits or fewer, as all but bignum parts are;
+   otherwise each gets an object of its own. */
+static void decode_parts(cpk_input_t *in, cpk_object_t *obj) {
+    const cpk_header_info_t *info = NULL;
+    cpk_object_t part[2], *own[2] = { NULL, NULL };
+    uint8_t h = 0;
+    int i = 0;
+
+    for(i = 0; i < 2; i++) {
+        if(cpk_read8(in, &h) < 0) {
+            cpk_err(obj, CPK_ERR_EOF, CPK_ERR_EOF_MSG, 0, in->buffer_read);
+            goto error;
+        }
+
+        info = CPK_HEADER_INFO(h);
+        if(!(info->flags & CPK_HD_VALID)) {
+            bad_header(in, obj, h);
+            goto error;
+        }
+
+        if(info->kind != CPK_NUMBER) {
+            cpk_err(obj, CPK_ERR_BAD_TYPE, CPK_ERR_BAD_TYPE_MSG,
+                    h, in->buffer_read);
+            goto error;
+        }
+
+        CPK_STAT_VALUE(in->stats, CPK_NUMBER);
+
+        if(info->children || info->payload > 8) {
+            if(!(own[i] = decode_alloc(in, obj, sizeof(cpk_object_t))))
+                goto error;
+
+            own[i]->header = h;
+            cpk_decode_number(in, own[i], h);
+            if(CPK_IS_ERROR(own[i]->header)) {
+                *obj = *own[i];
+                goto error;
+            }
+        } else {
+            part[i].header = h;
+            part[i].number.val.uint64 = 0;
+            cpk_decode_number(in, &part[i], h);
+            if(CPK_IS_ERROR(part[i].header)) {
+                *obj = part[i];
+                goto error;
+            }
+        }
+    }
 
-            obj->complex.r = a;
-            obj->complex.i = b;
+    if(!own[0] && !own[1]) {
+        for(i = 0; i < 2; i++) {
+            obj->complex.part[i] = (uint8_t)part[i].header;
+            obj->complex.parts.val[i] = part[i].number.val.uint64;
+        }
+
+        return;
+    }
+
+    for(i = 0; i < 2; i++) {
+        if(!own[i]) {
+            if(!(own[i] = decode_alloc(in, obj, sizeof(cpk_object_t))))
+                goto error;
+
+            *own[i] = part[i];
+        }
+    }
+
+    obj->complex.part[0] = obj->complex.part[1] = 0;
+    obj->complex.parts.obj[0] = own[0];
+    obj->complex.parts.obj[1] = own[1];
+    return;
+
+ error:
+    for(i = 0; i < 2; i++)
+        if(own[i]) decode_drop(in, own[i]);
+}
+
+void cpk_decode_number(cpk_input_t *in, cpk_object_t *obj, uint8_t h) {
+    const cpk_header_info_t *info = CPK_HEADER_INFO(h);
+#ifdef __SIZEOF_INT128__
+    uint64_t hi = 0, lo = 0;
+#endif
+
+    if(info->children) {
+        decode_parts(in, obj);
+        return;
+    }
+
+    /* Floats share the width of the same-sized integers */
+    switch(info->payload) {
+        case 1: READ(8, in, &obj->number.val.uint8, obj); break;
+        case 2: READ(16, in, &obj->number.val.uint16, obj); break;
+        case 4: READ(32, in, &obj->number.val.uint32, obj); break;
+        case 8: READ(64, in, &obj->number.val.uint64, obj); break;
+
+        case 16:
+#ifdef __SIZEOF_INT128__
+            READ(64, in, &hi, obj);
+            READ(64, in, &lo, obj);
+            obj->number.val.uint128 = (cpk_uint128_t)hi << 64 | lo;
+#else
+            if(cpk_read_bytes(in, obj->number.val.uint128_bytes, 16) < 0)
+                cpk_err(obj, CPK_ERR_EOF, CPK_ERR_EOF_MSG, 0, in->buffer_read);
+#endif
             break;
 
         default:
             cpk_err(obj, CPK_ERR_BAD_HEADER, CPK_ERR_BAD_HEADER_MSG,
                     h, in->buffer_read);
-    }            
+    }
+}
+
+/* Part i of a rational (numerator, denominator) or complex (real,
+   imaginary); an inline part is unpacked into tmp */
+const cpk_object_t* cpk_number_part(const cpk_object_t *obj, int i,
+                                    cpk_object_t *tmp) {
+    if(!obj->complex.part[0])
+        return obj->complex.parts.obj[i];
+
+    tmp->header = obj->complex.part[i];
+    tmp->number.val.uint64 = obj->complex.parts.val[i];
+    return tmp;
 }
 
 uint32_t
@@ -228,56 +548,309 @@ cpk_decode_size(cpk_input_t *in, uint8_t header, cpk_object_t *err) {
     uint16_t i16;
     uint32_t i32;
 
-    switch(header & CPK_SIZE_MASK) {
-        case CPK_SIZE_8:  READ(8, in, &i8, err); return i8;
-        case CPK_SIZE_16: READ(16, in, &i16, err); return i16;
-        case CPK_SIZE_32: READ(32, in, &i32, err); return i32;
+    switch(CPK_HEADER_INFO(header)->size) {
+        case 1: READ_R(8, in, &i8, err, 0); i32 = i8; break;
+        case 2: READ_R(16, in, &i16, err, 0); i32 = i16; break;
+        case 4: READ_R(32, in, &i32, err, 0); break;
+
+        default:
+            cpk_err(err, CPK_ERR_BAD_SIZE, CPK_ERR_BAD_SIZE_MSG,
+                    header, in->buffer_read);
+            return 0;
+    }
+
+    if(in->limits && in->limits->max_size && i32 > in->limits->max_size) {
+        cpk_err(err, CPK_ERR_LIMIT, CPK_ERR_LIMIT_MSG,
+                header, in->buffer_read);
+        return 0;
     }
+
+    return i32;
 }
 
-void cpk_decode(cpk_input_t *in, cpk_object_t *obj, int skip_header) {
+/* Reads a string from a descriptor in chunks that double as data
+   arrives, so a declared size only costs memory once it is backed by
+   actual input. */
+static void decode_string_grow(cpk_input_t *in, cpk_object_t *obj) {
+    uint8_t *data = NULL, *tmp = NULL;
+    size_t size = obj->string.size, cap = 0, got = 0, want = 0;
+
+    cap = size < CPK_GROW_CHUNK ? size : CPK_GROW_CHUNK;
+    if(!(data = decode_alloc(in, obj, cap + 1))) return;
+
+    while(got < size) {
+        if(got == cap) {
+            want = (size - cap) < cap ? size : cap * 2;
+            if(!(tmp = decode_realloc(in, obj, data, cap + 1, want + 1)))
+                goto error;
+
+            data = tmp;
+            cap = want;
+        }
+
+        if(cpk_read_bytes(in, data + got, cap - got) < 0) {
+            cpk_err(obj, CPK_ERR_EOF, CPK_ERR_EOF_MSG, 0, in->buffer_read);
+            goto error;
+        }
+
+        got = cap;
+    }
+
+    data[size] = 0;
+    obj->string.data = data;
+    obj->string.cap = size;
+    return;
+
+ error:
+    if(!in->arena) free(data);
+}
+
+/* Hands a string over the threshold to the callback rather than
+   keeping it.  A buffer is passed in place; a descriptor is read
+   through one chunk-sized scratch buffer, so memory stays flat however
+   long the string is. */
+static void decode_string_stream(cpk_input_t *in, cpk_object_t *obj) {
+    uint8_t *chunk = NULL;
+    uint32_t size = obj->string.size, got = 0, n = 0;
+
+    obj->string.flags = CPK_STRING_STREAMED;
+    obj->string.data = NULL;
+
+    if(in->fd < 0 && !cpk_input_has(in, size)) {
+        cpk_err(obj, CPK_ERR_EOF, CPK_ERR_EOF_MSG, 0, in->buffer_read);
+        return;
+    }
+
+    if(in->fd >= 0 &&
+       !(chunk = malloc(size < CPK_STRING_CHUNK ? size : CPK_STRING_CHUNK))) {
+        cpk_err(obj, CPK_ERR_ALLOC, CPK_ERR_ALLOC_MSG, 0, in->buffer_read);
+        return;
+    }
+
+    while(got < size) {
+        n = (size - got) < CPK_STRING_CHUNK ? size - got : CPK_STRING_CHUNK;
+
+        if(in->fd >= 0) {
+            if(cpk_read_bytes(in, chunk, n) < 0) {
+                cpk_err(obj, CPK_ERR_EOF, CPK_ERR_EOF_MSG, 0, in->buffer_read);
+                break;
+            }
+        } else {
+            chunk = in->buffer + in->buffer_read;
+            in->buffer_read += n;
+            CPK_STAT_ADD(in->stats, bytes_read, n);
+        }
+
+        if(in->string_fn(in->string_arg, obj, chunk, n, got)) {
+            cpk_err(obj, CPK_ERR_ABORTED, CPK_ERR_ABORTED_MSG, 0,
+                    in->buffer_read);
+            break;
+        }
+
+        got += n;
+    }
+
+    if(in->fd >= 0) free(chunk);
+}
+
+/* Hashes are taken over the buffer after the fact, so descriptor input
+   has nothing to take them from */
+static inline int hashing(cpk_input_t *in) {
+    return (in->flags & CPK_DECODE_HASH) && in->fd < 0;
+}
+
+/* Starts hashing a container whose bytes after the header start at
+   body; what came before is the enclosing container's to hash */
+static void hash_open(cpk_input_t *in, struct _cpk_hash_level *level,
+                      uint8_t header, size_t body) {
+    struct _cpk_hash_level *up = in->hashing;
+
+    if(up) {
+        cpk_hash_update(&up->state, in->buffer + up->from, body - up->from);
+        up->from = body;
+    }
+
+    cpk_hash_begin(&level->state, header);
+    level->from = body;
+    level->up = up;
+    in->hashing = level;
+}
+
+/* Ends level where the input is now; the enclosing container hashes
+   its result in place of its bytes */
+static uint64_t hash_close(cpk_input_t *in, struct _cpk_hash_level *level) {
+    struct _cpk_hash_level *up = level->up;
+    uint64_t h = 0;
+    uint8_t le[8];
+    int i = 0;
+
+    cpk_hash_update(&level->state, in->buffer + level->from,
+                    in->buffer_read - level->from);
+    h = cpk_hash_end(&level->state);
+
+    in->hashing = up;
+    if(up) {
+        for(i = 0; i < 8; i++)
+            le[i] = (uint8_t)(h >> (i * 8));
+
+        cpk_hash_update(&up->state, le, 8);
+        up->from = in->buffer_read;
+    }
+
+    return h;
+}
+
+/* After a failure inside level, if it was opened */
+static inline void hash_drop(cpk_input_t *in, struct _cpk_hash_level *level) {
+    if(in->hashing == level)
+        in->hashing = level->up;
+}
+
+/* A string buffer taken over from an earlier decode that turned out
+   not to fit */
+static inline void release_string(cpk_input_t *in, uint8_t *data) {
+    if(!in->arena) free(data);
+}
+
+/* Decodes one header and whatever immediately belongs to it, returning
+   the header's table entry, or NULL with obj holding the error.  With
+   reuse set, obj's string data and cap are a buffer it may decode into
+   (data is NULL when it has none). */
+static const cpk_header_info_t*
+decode_one(cpk_input_t *in, cpk_object_t *obj, int skip_header, int reuse) {
+    const cpk_header_info_t *info = NULL;
+    uint8_t *data = NULL;
+    uint32_t cap = 0;
+    size_t body = 0;
     uint8_t header;
 
     if(!skip_header) {
-        READ(8, in, &header, obj);
+        READ_R(8, in, &header, obj, NULL);
         obj->header = (unsigned short)header;
     } else {
         header = obj->header;
     }
 
-    switch(cpk_decode_header(obj->header)) {
-        case CPK_BOOL:
-            READ(8, in, &obj->bool.val, obj);
-            break;
+    info = CPK_HEADER_INFO(header);
+
+    if(!(info->flags & CPK_HD_VALID)) {
+        bad_header(in, obj, header);
+        return NULL;
+    }
 
+    CPK_STAT_VALUE(in->stats, info->kind);
+
+    if(info->flags & CPK_HD_INLINE) {
+        if(info->kind == CPK_BOOL) {
+            obj->bool.val = info->value;
+        } else {
+            obj->ref.val = info->value;
+            if(info->kind == CPK_TAG) obj->tag.obj = NULL;
+        }
+
+        return info;
+    }
+
+    switch(info->kind) {
         case CPK_NUMBER:
             cpk_decode_number(in, obj, header);
             break;
             
         case CPK_CONTAINER:
             obj->container.size = cpk_decode_size(in, header, obj);
+            if(CPK_IS_ERROR(obj->header)) return NULL;
+
             obj->container.obj  = NULL;
-            if(header & CPK_CONTAINER_FIXED)
-                READ(8, in, &obj->container.fixed_header, obj);
-            if(header & CPK_CONTAINER_MAP)
+            obj->container.cap  = 0;
+            obj->container.hash = 0;
+            obj->container.fixed_header = 0;
+            if(info->flags & CPK_HD_FIXED)
+                READ_R(8, in, &obj->container.fixed_header, obj, NULL);
+
+            if(cpk_check_container(header, obj->container.size,
+                                   obj->container.fixed_header,
+                                   cpk_input_remaining(in), in->limits,
+                                   &in->unbacked, obj, in->buffer_read))
+                return NULL;
+
+            if(info->flags & CPK_HD_MAP)
                 obj->container.size *= 2;
+
+            /* A tmap's type object precedes its key/value pairs */
+            if(info->flags & CPK_HD_TMAP)
+                obj->container.size++;
             break;
             
         case CPK_STRING:
+            body = in->buffer_read;
+            if(reuse) {
+                data = obj->string.data;
+                cap = obj->string.cap;
+            }
+
+            obj->string.flags = 0;
+            obj->string.hash = 0;
+            obj->string.cap = 0;
             obj->string.size = cpk_decode_size(in, header, obj);
-            obj->string.data = malloc(obj->string.size+1);
-            READN(obj->string.size, in, obj->string.data, obj);
+            if(CPK_IS_ERROR(obj->header)) {
+                release_string(in, data);
+                return NULL;
+            }
+
+            if(in->string_fn && obj->string.size > in->string_threshold) {
+                release_string(in, data);
+                decode_string_stream(in, obj);
+                break;
+            }
+
+            if(data && obj->string.size <= cap &&
+               !(in->flags & CPK_DECODE_VIEWS)) {
+                obj->string.data = data;
+                obj->string.cap = cap;
+                if(cpk_read_bytes(in, data, obj->string.size) < 0) {
+                    cpk_err(obj, CPK_ERR_EOF, CPK_ERR_EOF_MSG, 0,
+                            in->buffer_read);
+                    release_string(in, data);
+                    return NULL;
+                }
+
+                data[obj->string.size] = 0;
+                break;
+            }
+
+            release_string(in, data);
+
+            if(in->fd >= 0) {
+                decode_string_grow(in, obj);
+                break;
+            }
+
+            if(!cpk_input_has(in, obj->string.size)) {
+                cpk_err(obj, CPK_ERR_EOF, CPK_ERR_EOF_MSG, 0, in->buffer_read);
+                return NULL;
+            }
+
+            if(in->flags & CPK_DECODE_VIEWS) {
+                obj->string.data = in->buffer + in->buffer_read;
+                obj->string.flags = CPK_STRING_VIEW;
+                in->buffer_read += obj->string.size;
+                CPK_STAT_ADD(in->stats, bytes_read, obj->string.size);
+                break;
+            }
+
+            obj->string.data = decode_alloc(in, obj, obj->string.size+1);
+            if(!obj->string.data) return NULL;
+            obj->string.cap = obj->string.size;
+
+            cpk_read_bytes(in, obj->string.data, obj->string.size);
             obj->string.data[obj->string.size] = 0;
             break;
 
         case CPK_REF:
         case CPK_TAG:
         case CPK_INDEX:
-            if(header & CPK_REFTAG_INLINE)
-                obj->ref.val = header & 0xF;
-            else
-                obj->ref.val = cpk_decode_size(in, header, obj);
-            
+        case CPK_POINTER:
+            obj->ref.val = cpk_decode_size(in, header, obj);
             break;
 
         case CPK_REMOTE_REF:
@@ -297,123 +870,811 @@ void cpk_decode(cpk_input_t *in, cpk_object_t *obj, int skip_header) {
             obj->symbol.name = NULL;
             obj->symbol.package = NULL;
             break;
-
-        default:
-            cpk_err(obj, CPK_ERR_BAD_HEADER, CPK_ERR_BAD_HEADER_MSG,
-                    header, in->buffer_read);
     }
+
+    /* tag.obj shares storage with an error's reason */
+    if(CPK_IS_ERROR(obj->header))
+        return NULL;
+
+    if(info->kind == CPK_TAG)
+        obj->tag.obj = NULL;
+
+    if(info->kind == CPK_STRING && hashing(in))
+        obj->string.hash = cpk_hash64(header, in->buffer + body,
+                                      in->buffer_read - body);
+
+    return info;
+}
+
+void cpk_decode(cpk_input_t *in, cpk_object_t *obj, int skip_header) {
+    decode_one(in, obj, skip_header, 0);
 }
 
+/* An error's header reads as an inline tag, and its reason is static */
 void cpk_free(cpk_object_t *obj) {
-    if(CPK_IS_NUMBER(obj->header)) {
-        if(CPK_NUMBER_TYPE(obj->header) == CPK_COMPLEX ||
-           CPK_NUMBER_TYPE(obj->header) == CPK_RATIONAL) {
-            cpk_free(obj->complex.r);
-            cpk_free(obj->complex.i);
-            
-            free(obj->complex.r);
-            free(obj->complex.i);
-        }
-    } else if(CPK_IS_STRING(obj->header)) {
-        free(obj->string.data);
-    } else if(CPK_IS_REMOTE_REF(obj->header)) {
-        cpk_free(obj->rref.val);
-        free(obj->rref.val);
-    } else if(CPK_IS_CONTAINER(obj->header) && obj->container.obj) {
-        free(obj->container.obj);
+    if(!obj || CPK_IS_ERROR(obj->header)) return;
+
+    /* Numbers own nothing unless a part was too wide to be inline */
+    if(CPK_IS_NUMBER(obj->header) &&
+       (!CPK_HEADER_INFO(obj->header)->children || obj->complex.part[0]))
+        return;
+
+    switch(cpk_decode_header(obj->header)) {
+        case CPK_NUMBER:
+            cpk_free(obj->complex.parts.obj[0]);
+            cpk_free(obj->complex.parts.obj[1]);
+
+            free(obj->complex.parts.obj[0]);
+            free(obj->complex.parts.obj[1]);
+            break;
+
+        case CPK_STRING:
+            if(!(obj->string.flags & CPK_STRING_VIEW))
+                free(obj->string.data);
+            break;
+
+        case CPK_REMOTE_REF:
+            cpk_free(obj->rref.val);
+            free(obj->rref.val);
+            break;
+
+        case CPK_TAG:
+            cpk_free(obj->tag.obj);
+            free(obj->tag.obj);
+            break;
+
+        case CPK_CONTAINER:
+            free(obj->container.obj);
+            break;
     }
 }
 
+static cpk_object_t* decode_tree(cpk_input_t *in, uint8_t header,
+                                 int skip_header);
+
+/* Tracks nesting, for max_depth and the statistics */
+static inline cpk_object_t* decode_r(cpk_input_t *in, uint8_t header,
+                                     int skip_header) {
+    cpk_object_t *obj = NULL;
+
+    in->depth++;
+    CPK_STAT_ENTER(in->stats);
+    obj = decode_tree(in, header, skip_header);
+    CPK_STAT_LEAVE(in->stats);
+    in->depth--;
+
+    return obj;
+}
+
+/* Objects holding others may not nest deeper than max_depth, counted
+   as cpk_validate counts it, so that deep input fails rather than
+   running the stack out */
+static int too_deep(cpk_input_t *in, cpk_object_t *obj) {
+    uint32_t max = in->limits && in->limits->max_depth ?
+                   in->limits->max_depth : CPK_DEFAULT_MAX_DEPTH;
+
+    if(in->depth <= max)
+        return 0;
+
+    cpk_err(obj, CPK_ERR_LIMIT, CPK_ERR_LIMIT_MSG, 0, in->buffer_read);
+    return 1;
+}
+
+/* Reads the header after a list cell's car, or makes an EOF error */
+static int next_header(cpk_input_t *in, uint8_t *header,
+                       cpk_object_t **err) {
+    if(cpk_read8(in, header) >= 0)
+        return 0;
+
+    if((*err = decode_new(in)))
+        cpk_err(*err, CPK_ERR_EOF, CPK_ERR_EOF_MSG, 0, in->buffer_read);
+    return -1;
+}
+
+
 cpk_object_t* cpk_decode_r(cpk_input_t *in) {
-    return cpk_decode_rh(in, 0);
+    decode_begin(in);
+    return decode_r(in, 0, 0);
 }
 
 cpk_object_t* cpk_decode_rh(cpk_input_t *in, uint8_t header) {
-    cpk_object_t *obj = calloc(1, sizeof(cpk_object_t)),
-                 *tmp = NULL;
-    uint32_t i = 0;
+    decode_begin(in);
+    return decode_r(in, header, header != 0);
+}
+
+/* Decodes one object and the trailer after it, summing as it goes, so
+   the check costs no second pass.  in must have CPK_DECODE_CRC set and
+   be at the start of a frame.  A mismatch drops the tree and returns
+   a CPK_ERR_CHECKSUM error positioned at the trailer; so does an input
+   without the flag, before reading anything, as it has no sum. */
+cpk_object_t* cpk_decode_crc_r(cpk_input_t *in) {
+    cpk_object_t *obj = NULL;
+    size_t pos = 0;
+
+    decode_begin(in);
+    if(!(in->flags & CPK_DECODE_CRC)) {
+        if((obj = decode_new(in)))
+            cpk_err(obj, CPK_ERR_CHECKSUM, CPK_ERR_CHECKSUM_MSG, 0,
+                    in->buffer_read);
+        return obj;
+    }
 
-    if(header)
+    obj = decode_r(in, 0, 0);
+    if(!obj || CPK_IS_ERROR(obj->header))
+        return obj;
+
+    pos = in->buffer_read;
+    if(!cpk_read_crc(in))
+        return obj;
+
+    decode_drop_r(in, obj);
+    if(!(obj = decode_new(in)))
+        return NULL;
+
+    if(in->buffer_read == pos)
+        cpk_err(obj, CPK_ERR_EOF, CPK_ERR_EOF_MSG, 0, pos);
+    else
+        cpk_err(obj, CPK_ERR_CHECKSUM, CPK_ERR_CHECKSUM_MSG, 0, pos);
+
+    return obj;
+}
+
+/* Reserves a container's element array, whose size decode_one has
+   checked: all of it when the input backs the count, or a small start
+   that decode_r doubles as elements arrive. */
+static uint32_t reserve_container(cpk_input_t *in, cpk_object_t *obj,
+                                  uint32_t size) {
+    uint32_t cap = size;
+
+    if(decode_grows(in) && cap > CPK_GROW_INITIAL)
+        cap = CPK_GROW_INITIAL;
+
+    if(cap) {
+        obj->container.obj = decode_alloc(in, obj, cap * sizeof(cpk_object_t*));
+        if(!obj->container.obj) return 0;
+    }
+
+    return cap;
+}
+
+/* skip_header is kept apart from header so that fixed containers of
+   nil (a fixed header of 0x00) still decode without per-element headers */
+static cpk_object_t* decode_tree(cpk_input_t *in, uint8_t header,
+                                 int skip_header) {
+    cpk_object_t *obj = decode_new(in), *tmp = NULL, **grown = NULL, err;
+    cpk_object_t *cell = NULL;
+    const cpk_header_info_t *info = NULL;
+    struct _cpk_hash_level level;
+    uint32_t i = 0, cap = 0, size = 0;
+    size_t body = in->buffer_read + !skip_header;
+    uint8_t next = 0;
+
+    if(!obj) return NULL;
+    if(charge(in, obj, sizeof(cpk_object_t)))
+        return obj;
+
+    if(skip_header)
         obj->header = header;
 
-    cpk_decode(in, obj, header != 0);
-    if(CPK_IS_ERROR(obj->header))
-        goto error;
+    if(!(info = decode_one(in, obj, skip_header, 0)))
+        return obj;
 
-    switch(cpk_decode_header(obj->header)) {
+    /* Scalars are complete once their header has been decoded */
+    if(!info->children && info->kind != CPK_CONTAINER)
+        return obj;
+
+    if(info->kind != CPK_NUMBER && too_deep(in, obj))
+        return obj;
+
+    switch(info->kind) {
         case CPK_REMOTE_REF:
-            tmp = cpk_decode_rh(in, 0);
-            if(CPK_IS_ERROR(tmp->header))
+            tmp = decode_r(in, 0, 0);
+            if(!tmp || CPK_IS_ERROR(tmp->header))
                 goto error;
             
             obj->rref.val = tmp;
             break;
 
+        case CPK_TAG:
+            tmp = decode_r(in, 0, 0);
+            if(!tmp || CPK_IS_ERROR(tmp->header))
+                goto error;
+
+            obj->tag.obj = tmp;
+            break;
+
+        /* Cells down the cdr are decoded here in a loop, so a long
+           list neither grows the stack nor counts as depth */
         case CPK_CONS:
-            tmp = cpk_decode_rh(in, 0);
-            if(CPK_IS_ERROR(tmp->header))
+            cell = obj;
+
+            for(;;) {
+                tmp = decode_r(in, 0, 0);
+                if(!tmp || CPK_IS_ERROR(tmp->header))
+                    goto error;
+
+                cell->cons.car = tmp;
+
+                if(next_header(in, &next, &tmp))
+                    goto error;
+                if(!CPK_IS_CONS(next))
+                    break;
+
+                if(!(tmp = decode_new(in)))
+                    goto error;
+                if(charge(in, tmp, sizeof(cpk_object_t)))
+                    goto error;
+
+                tmp->header = next;
+                decode_one(in, tmp, 1, 0);
+
+                cell->cons.cdr = tmp;
+                cell = tmp;
+            }
+
+            tmp = decode_r(in, next, 1);
+            if(!tmp || CPK_IS_ERROR(tmp->header))
                 goto error;
 
-            obj->cons.car = tmp;
+            cell->cons.cdr = tmp;
+            break;
 
-            tmp = cpk_decode_rh(in, 0);
-            if(CPK_IS_ERROR(tmp->header))
+        case CPK_PACKAGE:
+            tmp = decode_r(in, 0, 0);
+            if(!tmp || CPK_IS_ERROR(tmp->header))
                 goto error;
 
-            obj->cons.cdr = tmp;
+            obj->package.name = tmp;
+            break;
+
+        case CPK_SYMBOL:
+            tmp = decode_r(in, 0, 0);
+            if(!tmp || CPK_IS_ERROR(tmp->header))
+                goto error;
+
+            obj->symbol.name = tmp;
+
+            if(!(info->flags & CPK_HD_KEYWORD)) {
+                tmp = decode_r(in, 0, 0);
+                if(!tmp || CPK_IS_ERROR(tmp->header))
+                    goto error;
+
+                obj->symbol.package = tmp;
+            }
             break;
 
         case CPK_CONTAINER:
-            obj->container.obj = calloc(obj->container.size,
-                                        sizeof(cpk_object_t*));
-            for(i = 0; i < obj->container.size; i++) {
-                tmp = cpk_decode_rh(in, obj->container.fixed_header);
-                if(CPK_IS_ERROR(tmp->header))
+            size = obj->container.size;
+            obj->container.size = 0;
+
+            if(hashing(in))
+                hash_open(in, &level, (uint8_t)obj->header, body);
+
+            cap = reserve_container(in, obj, size);
+            if(CPK_IS_ERROR(obj->header))
+                goto error;
+
+            for(i = 0; i < size; i++) {
+                if(i == cap) {
+                    cap = (size - cap) < cap ? size : cap * 2;
+                    if(!cap) cap = size < CPK_GROW_INITIAL ? size : CPK_GROW_INITIAL;
+                    grown = decode_realloc(in, &err, obj->container.obj,
+                                           i * sizeof(cpk_object_t*),
+                                           cap * sizeof(cpk_object_t*));
+                    if(!grown) {
+                        hash_drop(in, &level);
+                        decode_drop_r(in, obj);
+                        tmp = decode_new(in);
+                        if(tmp) *tmp = err;
+                        return tmp;
+                    }
+
+                    obj->container.obj = grown;
+                }
+
+                /* The tmap type object never uses the fixed header */
+                if(i == 0 && (info->flags & CPK_HD_TMAP))
+                    tmp = decode_r(in, 0, 0);
+                else
+                    tmp = decode_r(in, obj->container.fixed_header,
+                                   info->flags & CPK_HD_FIXED);
+                if(!tmp || CPK_IS_ERROR(tmp->header))
                     goto error;
+
                 obj->container.obj[i] = tmp;
+                obj->container.size++;
             }
 
+            obj->container.cap = cap;
+            if(hashing(in))
+                obj->container.hash = hash_close(in, &level);
             break;
     }
 
- end:
     return obj;
 
  error:
+    hash_drop(in, &level);
     if(CPK_IS_ERROR(obj->header))
         return obj;
 
-    cpk_free_r(obj);
+    decode_drop_r(in, obj);
     return tmp;
 }
 
-void cpk_free_r(cpk_object_t *obj) {
-    cpk_object_t *tmp = NULL;
-    uint32_t i = 0;
-    
-    if(!obj) return;
+static cpk_object_t* decode_over_tree(cpk_input_t *in, cpk_object_t *old,
+                                      uint8_t header, int skip_header);
+
+static inline cpk_object_t* decode_over(cpk_input_t *in, cpk_object_t *old,
+                                        uint8_t header, int skip_header) {
+    cpk_object_t *obj = NULL;
+
+    in->depth++;
+    CPK_STAT_ENTER(in->stats);
+    obj = decode_over_tree(in, old, header, skip_header);
+    CPK_STAT_LEAVE(in->stats);
+    in->depth--;
+
+    return obj;
+}
+
+/* Decodes the next object over tree, a result of an earlier decode
+   from an input with the same arena (or none), and returns the new
+   tree; tree is consumed either way.  Nodes whose kind still matches
+   are overwritten in place, keeping their string buffers and element
+   arrays unless those are too small, so a stream of same-shaped
+   messages decodes without allocating once the first has been seen. */
+cpk_object_t* cpk_decode_into(cpk_input_t *in, cpk_object_t *tree) {
+    decode_begin(in);
+    return decode_over(in, tree, 0, 0);
+}
+
+static cpk_object_t* decode_over_tree(cpk_input_t *in, cpk_object_t *old,
+                                      uint8_t header, int skip_header) {
+    const cpk_header_info_t *info = NULL, *was = NULL;
+    cpk_object_t *kids[2] = { NULL, NULL }, **slot[2] = { NULL, NULL };
+    cpk_object_t **elems = NULL, **grown = NULL, *tmp = NULL, err;
+    cpk_object_t *cell = NULL;
+    struct _cpk_hash_level level;
+    uint32_t i = 0, n = 0, cap = 0, want = 0, size = 0;
+    size_t body = in->buffer_read + !skip_header;
+    uint8_t fixed = 0, next = 0;
+
+    if(!old || CPK_IS_ERROR(old->header))
+        goto fresh;
+
+    if(!skip_header) {
+        if(cpk_read8(in, &header) < 0) {
+            decode_drop_r(in, old);
+            if((old = decode_new(in)))
+                cpk_err(old, CPK_ERR_EOF, CPK_ERR_EOF_MSG, 0, in->buffer_read);
+            return old;
+        }
+
+        skip_header = 1;
+    }
+
+    info = CPK_HEADER_INFO(header);
+    was = CPK_HEADER_INFO((uint8_t)old->header);
+
+    /* Parts too wide to be inline are not reused */
+    if(!(info->flags & CPK_HD_VALID) || info->kind != was->kind ||
+       (info->kind == CPK_NUMBER && was->children && !old->complex.part[0]))
+        goto fresh;
+
+    /* Take what old holds before decode_one resets it */
+    switch(info->kind) {
+        case CPK_STRING:
+            if(old->string.flags & (CPK_STRING_VIEW | CPK_STRING_STREAMED))
+                old->string.data = NULL;
+            break;
+
+        case CPK_CONTAINER:
+            elems = old->container.obj;
+            n = old->container.size;
+            cap = old->container.cap;
+            break;
 
-    switch(cpk_decode_header(obj->header)) {
         case CPK_REMOTE_REF:
-            cpk_free_r(obj->rref.val);
+            kids[0] = old->rref.val;
+            slot[0] = &old->rref.val;
+            break;
+
+        case CPK_TAG:
+            kids[0] = old->tag.obj;
+            slot[0] = &old->tag.obj;
             break;
 
         case CPK_CONS:
-            cpk_free_r(obj->cons.car);
-            cpk_free_r(obj->cons.cdr);
+            kids[0] = old->cons.car;
+            kids[1] = old->cons.cdr;
+            slot[0] = &old->cons.car;
+            slot[1] = &old->cons.cdr;
             break;
 
-        case CPK_CONTAINER:
-            for(i = 0; i < obj->container.size; i++) {
-                if(obj->container.obj[i])
-                    cpk_free_r(obj->container.obj[i]);
-                else
-                    break;
-            }
+        case CPK_PACKAGE:
+            kids[0] = old->package.name;
+            slot[0] = &old->package.name;
+            break;
 
-            free(obj->container.obj);
+        case CPK_SYMBOL:
+            kids[0] = old->symbol.name;
+            kids[1] = old->symbol.package;
+            slot[0] = &old->symbol.name;
+            if(!(info->flags & CPK_HD_KEYWORD))
+                slot[1] = &old->symbol.package;
             break;
     }
 
-    free(obj);
+    old->header = header;
+    if(!decode_one(in, old, 1, 1))
+        goto release;
+
+    if(!info->children && info->kind != CPK_CONTAINER)
+        goto release;
+
+    if(info->kind != CPK_NUMBER && too_deep(in, old))
+        goto release;
+
+    /* A list is walked down its cdr in a loop, as decode_tree does,
+       each cell taking the place of the old list's while it has any */
+    if(info->kind == CPK_CONS) {
+        cell = old;
+
+        for(;;) {
+            tmp = decode_over(in, kids[0], 0, 0);
+            kids[0] = NULL;
+            if(!tmp || CPK_IS_ERROR(tmp->header))
+                goto error;
+
+            cell->cons.car = tmp;
+
+            if(next_header(in, &next, &tmp))
+                goto error;
+            if(!CPK_IS_CONS(next))
+                break;
+
+            if(kids[1] && !CPK_IS_ERROR(kids[1]->header) &&
+               CPK_IS_CONS((uint8_t)kids[1]->header)) {
+                tmp = kids[1];
+                kids[0] = tmp->cons.car;
+                kids[1] = tmp->cons.cdr;
+            } else {
+                if(!(tmp = decode_new(in)))
+                    goto error;
+                if(charge(in, tmp, sizeof(cpk_object_t)))
+                    goto error;
+            }
+
+            tmp->header = next;
+            decode_one(in, tmp, 1, 0);
+
+            cell->cons.cdr = tmp;
+            cell = tmp;
+        }
+
+        tmp = decode_over(in, kids[1], next, 1);
+        kids[1] = NULL;
+        if(!tmp || CPK_IS_ERROR(tmp->header))
+            goto error;
+
+        cell->cons.cdr = tmp;
+        goto release;
+    }
+
+    for(i = 0; i < 2 && slot[i]; i++) {
+        tmp = decode_over(in, kids[i], 0, 0);
+        kids[i] = NULL;
+        if(!tmp || CPK_IS_ERROR(tmp->header))
+            goto error;
+
+        *slot[i] = tmp;
+    }
+
+    if(info->kind == CPK_CONTAINER) {
+        size = old->container.size;
+        fixed = old->container.fixed_header;
+
+        /* Descriptor input grows the array as elements arrive instead */
+        if(size > cap && !decode_grows(in)) {
+            grown = decode_realloc(in, old, elems, cap * sizeof(cpk_object_t*),
+                                   size * sizeof(cpk_object_t*));
+            if(!grown)
+                goto release;
+
+            elems = grown;
+            cap = size;
+        }
+
+        if(hashing(in))
+            hash_open(in, &level, (uint8_t)old->header, body);
+
+        for(i = 0; i < size; i++) {
+            if(i == cap) {
+                want = (size - cap) < cap ? size : cap * 2;
+                if(!want) want = size < CPK_GROW_INITIAL ? size : CPK_GROW_INITIAL;
+                grown = decode_realloc(in, &err, elems,
+                                       cap * sizeof(cpk_object_t*),
+                                       want * sizeof(cpk_object_t*));
+                if(!grown) {
+                    if((tmp = decode_new(in))) *tmp = err;
+                    n = i;
+                    goto error;
+                }
+
+                elems = grown;
+                cap = want;
+            }
+
+            /* The tmap type object never uses the fixed header */
+            if(i == 0 && (info->flags & CPK_HD_TMAP))
+                tmp = decode_over(in, i < n ? elems[i] : NULL, 0, 0);
+            else
+                tmp = decode_over(in, i < n ? elems[i] : NULL, fixed,
+                                  info->flags & CPK_HD_FIXED);
+
+            if(!tmp || CPK_IS_ERROR(tmp->header)) {
+                if(i < n) elems[i] = NULL;
+                else n = i;
+                goto error;
+            }
+
+            elems[i] = tmp;
+        }
+
+        /* Elements past the new size have nothing left to be reused for */
+        for(; i < n; i++)
+            decode_drop_r(in, elems[i]);
+
+        old->container.obj = elems;
+        old->container.size = size;
+        old->container.cap = cap;
+        if(hashing(in))
+            old->container.hash = hash_close(in, &level);
+
+        elems = NULL;
+        n = 0;
+    }
+
+ release:
+    /* Whatever of old's storage was not taken over */
+    for(i = 0; i < n; i++)
+        decode_drop_r(in, elems[i]);
+    if(!in->arena)
+        free(elems);
+
+    decode_drop_r(in, kids[0]);
+    decode_drop_r(in, kids[1]);
+    return old;
+
+ error:
+    hash_drop(in, &level);
+
+    /* old holds only what was decoded into it */
+    if(info->kind == CPK_CONTAINER) {
+        old->container.obj = NULL;
+        old->container.size = 0;
+    }
+
+    decode_drop_r(in, old);
+    old = tmp;
+    goto release;
+
+ fresh:
+    decode_drop_r(in, old);
+    return decode_tree(in, header, skip_header);
+}
+
+static int discard(cpk_input_t *in, cpk_object_t *err, uint64_t len) {
+    uint8_t scratch[512];
+    size_t n = 0;
+
+    if(in->fd < 0) {
+        if(!cpk_input_has(in, len)) goto eof;
+        in->buffer_read += len;
+        CPK_STAT_ADD(in->stats, bytes_read, len);
+        return 0;
+    }
+
+    while(len) {
+        n = len < sizeof(scratch) ? len : sizeof(scratch);
+        if(cpk_read_bytes(in, scratch, n) < 0) goto eof;
+        len -= n;
+    }
+
+    return 0;
+
+ eof:
+    cpk_err(err, CPK_ERR_EOF, CPK_ERR_EOF_MSG, 0, in->buffer_read);
+    return -1;
+}
+
+static int skip_r(cpk_input_t *in, cpk_object_t *err, uint32_t depth,
+                  int skip_header, uint8_t header) {
+    const cpk_header_info_t *info = NULL;
+    uint32_t max = in->limits && in->limits->max_depth ?
+                   in->limits->max_depth : CPK_DEFAULT_MAX_DEPTH;
+    uint64_t n = 0, i = 0;
+    uint8_t fixed = 0, part = 0;
+
+    /* Loop rather than recurse on a cons cdr, as cpk_validate does */
+    for(;;) {
+        if(!skip_header)
+            READ_R(8, in, &header, err, -1);
+
+        info = CPK_HEADER_INFO(header);
+
+        if(!(info->flags & CPK_HD_VALID)) {
+            bad_header(in, err, header);
+            return -1;
+        }
+
+        if((info->flags & CPK_HD_INLINE) && !info->children)
+            return 0;
+
+        if(info->kind != CPK_NUMBER && depth >= max) {
+            cpk_err(err, CPK_ERR_LIMIT, CPK_ERR_LIMIT_MSG, 0, in->buffer_read);
+            return -1;
+        }
+
+        switch(info->kind) {
+            case CPK_NUMBER:
+                if(!info->children)
+                    return discard(in, err, info->payload);
+                break;
+
+            case CPK_TAG:
+                if(info->size) {
+                    cpk_decode_size(in, header, err);
+                    if(CPK_IS_ERROR(err->header)) return -1;
+                }
+
+                depth++;
+                skip_header = 0;
+                continue;
+
+            case CPK_STRING:
+                n = cpk_decode_size(in, header, err);
+                if(CPK_IS_ERROR(err->header)) return -1;
+                return discard(in, err, n);
+
+            case CPK_REF:
+            case CPK_INDEX:
+            case CPK_POINTER:
+                cpk_decode_size(in, header, err);
+                return CPK_IS_ERROR(err->header) ? -1 : 0;
+
+            case CPK_CONTAINER:
+                n = cpk_decode_size(in, header, err);
+                if(CPK_IS_ERROR(err->header)) return -1;
+
+                if(info->flags & CPK_HD_FIXED)
+                    READ_R(8, in, &fixed, err, -1);
+                if(cpk_check_container(header, n, fixed,
+                                       cpk_input_remaining(in), in->limits,
+                                       &in->unbacked, err, in->buffer_read))
+                    return -1;
+                if(info->flags & CPK_HD_MAP)
+                    n *= 2;
+                if((info->flags & CPK_HD_TMAP) &&
+                   skip_r(in, err, depth + 1, 0, 0))
+                    return -1;
+
+                for(i = 0; i < n; i++)
+                    if(skip_r(in, err, depth + 1,
+                              info->flags & CPK_HD_FIXED, fixed))
+                        return -1;
+                return 0;
+
+            case CPK_CONS:
+                if(skip_r(in, err, depth + 1, 0, 0)) return -1;
+                skip_header = 0;
+                continue;
+        }
+
+        /* A rational's or complex's parts must be numbers, as the
+           validator and decoder require */
+        for(i = 0; i < info->children; i++) {
+            if(info->kind == CPK_NUMBER) {
+                READ_R(8, in, &part, err, -1);
+                if(!CPK_IS_NUMBER(part)) {
+                    cpk_err(err, CPK_ERR_BAD_TYPE, CPK_ERR_BAD_TYPE_MSG,
+                            part, in->buffer_read);
+                    return -1;
+                }
+
+                if(skip_r(in, err, depth + 1, 1, part)) return -1;
+            } else if(skip_r(in, err, depth + 1, 0, 0)) {
+                return -1;
+            }
+        }
+
+        return 0;
+    }
+}
+
+int cpk_skip(cpk_input_t *in, cpk_object_t *err) {
+    cpk_object_t tmp;
+    size_t span = 0;
+
+    if(!err) err = &tmp;
+    err->header = 0;
+
+    /* Buffers are walked in place by the validator */
+    if(in->fd < 0) {
+        span = cpk_validate_span(in->buffer + in->buffer_read,
+                                 in->buffer_size - in->buffer_read,
+                                 in->limits, err);
+        if(!span) {
+            err->error.pos += in->buffer_read;
+            return CPK_ERROR;
+        }
+
+        in->buffer_read += span;
+        CPK_STAT_ADD(in->stats, bytes_read, span);
+        return 0;
+    }
+
+    return skip_r(in, err, 0, 0, 0) ? CPK_ERROR : 0;
+}
+
+/* For readers that have already taken an object's header */
+int cpk_skip_after(cpk_input_t *in, uint8_t header, cpk_object_t *err) {
+    return skip_r(in, err, 0, 1, header) ? CPK_ERROR : 0;
+}
+
+cpk_object_t* cpk_decode_after(cpk_input_t *in, uint8_t header) {
+    decode_begin(in);
+    return decode_r(in, header, 1);
+}
+
+void cpk_free_r(cpk_object_t *obj) {
+    cpk_object_t *next = NULL;
+    uint32_t i = 0;
+
+    /* Down a list's cdr in a loop, as it was decoded */
+    for(; obj; obj = next) {
+        next = NULL;
+
+        if(CPK_IS_ERROR(obj->header)) {
+            free(obj);
+            return;
+        }
+
+        switch(cpk_decode_header(obj->header)) {
+            case CPK_REMOTE_REF:
+                cpk_free_r(obj->rref.val);
+                break;
+
+            case CPK_TAG:
+                cpk_free_r(obj->tag.obj);
+                break;
+
+            case CPK_CONS:
+                cpk_free_r(obj->cons.car);
+                next = obj->cons.cdr;
+                break;
+
+            case CPK_PACKAGE:
+                cpk_free_r(obj->package.name);
+                break;
+
+            case CPK_SYMBOL:
+                cpk_free_r(obj->symbol.name);
+                cpk_free_r(obj->symbol.package);
+                break;
+
+            case CPK_CONTAINER:
+                for(i = 0; i < obj->container.size; i++)
+                    cpk_free_r(obj->container.obj[i]);
+
+                free(obj->container.obj);
+                break;
+
+            default:
+                cpk_free(obj);
+        }
+
+        free(obj);
+    }
 }
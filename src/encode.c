@@ -16,6 +16,7 @@
 
 #include "config.h"
 #include "conspack/conspack.h"
+#include "internal.h"
 
 #include <stdio.h>
 #include <memory.h>
@@ -28,6 +29,12 @@ void cpk_output_init(cpk_output_t *out) {
     out->buffer_used = 0;
     out->buffer      = malloc(CPK_DEFAULT_BUFFER);
     out->fd          = -1;
+    out->flags       = 0;
+    out->crc         = 0;
+    out->crc_pos     = 0;
+    out->string_left = 0;
+    out->stats       = NULL;
+    out->stage       = NULL;
 }
 
 void cpk_output_init_fd(cpk_output_t *out, int fd) {
@@ -35,35 +42,158 @@ void cpk_output_init_fd(cpk_output_t *out, int fd) {
     out->buffer_size = 0;
     out->buffer_used = 0;
     out->buffer      = NULL;
+    out->flags       = 0;
+    out->crc         = 0;
+    out->crc_pos     = 0;
+    out->string_left = 0;
+    out->stats       = NULL;
+    out->stage       = NULL;
 }
 
+void cpk_output_init_fixed(cpk_output_t *out, uint8_t *buf, size_t size) {
+    out->buffer_size = size;
+    out->buffer_used = 0;
+    out->buffer      = buf;
+    out->fd          = -1;
+    out->flags       = CPK_OUTPUT_FIXED;
+    out->crc         = 0;
+    out->crc_pos     = 0;
+    out->string_left = 0;
+    out->stats       = NULL;
+    out->stage       = NULL;
+}
+
+void cpk_output_set_stats(cpk_output_t *out, cpk_stats_t *stats) {
+    out->stats = stats;
+}
+
+/* Writes to a descriptor are summed as they are made.  Buffered
+   writes are summed in runs of about CRC_CHUNK bytes, while they are
+   still in cache, rather than with a call per write. */
+#define CRC_CHUNK 4096
+
+static void crc_catch_up(cpk_output_t *out) {
+    if(out->fd < 0 && out->buffer_used > out->crc_pos)
+        out->crc = cpk_crc32c(out->crc, out->buffer + out->crc_pos,
+                              out->buffer_used - out->crc_pos);
+
+    out->crc_pos = out->buffer_used;
+}
+
+/* Starts or stops summing writes, restarting the sum either way */
+void cpk_output_set_crc(cpk_output_t *out, int enable) {
+    if(enable)
+        out->flags |= CPK_OUTPUT_CRC;
+    else
+        out->flags &= ~CPK_OUTPUT_CRC;
+
+    out->crc = 0;
+    out->crc_pos = out->buffer_used;
+}
+
+uint32_t cpk_output_crc(cpk_output_t *out) {
+    if(out->flags & CPK_OUTPUT_CRC)
+        crc_catch_up(out);
+
+    return out->crc;
+}
+
+/* A staged output writes out its last block here; call
+   cpk_output_flush first to see whether that succeeds */
 void cpk_output_fini(cpk_output_t *out) {
-    if(out->buffer) {
+    if(out->stage) {
+        cpk_output_flush(out);
+        cpk_stage_free(out->stage);
+        out->stage = NULL;
+    }
+
+    if(out->flags & CPK_OUTPUT_FIXED) {
+        out->buffer = NULL;
+        out->buffer_size = 0;
+        out->buffer_used = 0;
+    } else if(out->buffer) {
         free(out->buffer);
         out->buffer_size = 0;
         out->buffer_used = 0;
     }
 }
 
+/* Anything being summed stays in the sum */
 void cpk_output_clear(cpk_output_t *out) {
+    if(out->flags & CPK_OUTPUT_CRC)
+        crc_catch_up(out);
+
     out->buffer_used = 0;
+    out->crc_pos = 0;
+    out->string_left = 0;
+    out->flags &= ~CPK_OUTPUT_OVERFLOW;
 }
 
-void cpk_ensure_buffer(cpk_output_t *out, size_t bytes_needed) {
-    if((out->buffer_used + bytes_needed) <= out->buffer_size)
-        return;
+/* Doubles until the request fits; a single write may need more than
+   one doubling.  Fixed outputs, and failed reallocs, leave the buffer
+   as it was and mark the output as overflowed. */
+int cpk_ensure_buffer(cpk_output_t *out, size_t bytes_needed) {
+    size_t size = out->buffer_size;
+    unsigned char *grown = NULL;
+
+    if(out->flags & CPK_OUTPUT_OVERFLOW)
+        return -1;
+
+    if((out->flags & CPK_OUTPUT_CRC) &&
+       out->buffer_used - out->crc_pos >= CRC_CHUNK)
+        crc_catch_up(out);
+
+    if((out->buffer_used + bytes_needed) <= size)
+        return 0;
+
+    if(out->flags & CPK_OUTPUT_FIXED)
+        goto overflow;
+
+    if(!size) size = CPK_DEFAULT_BUFFER;
+    while(size < out->buffer_used + bytes_needed)
+        size *= 2;
 
-    out->buffer_size = 2 * out->buffer_size;
-    out->buffer      = realloc(out->buffer, out->buffer_size);
+    if(!(grown = realloc(out->buffer, size)))
+        goto overflow;
+
+    out->buffer_size = size;
+    out->buffer      = grown;
+    CPK_STAT_ADD(out->stats, reallocs, 1);
+
+    return 0;
+
+ overflow:
+    out->flags |= CPK_OUTPUT_OVERFLOW;
+    return -1;
+}
+
+static int write_fd(cpk_output_t *out, const void *val, size_t len) {
+    ssize_t n = 0;
+
+    if(out->stage) {
+        n = cpk_stage_write(out, val, len);
+    } else {
+        n = write(out->fd, val, len);
+        CPK_STAT_ADD(out->stats, syscalls, 1);
+    }
+
+    if(n > 0) {
+        CPK_STAT_ADD(out->stats, bytes_written, n);
+        if(out->flags & CPK_OUTPUT_CRC)
+            out->crc = cpk_crc32c(out->crc, val, n);
+    }
+
+    return n;
 }
 
 int cpk_write8(cpk_output_t *out, uint8_t val) {
     if(out->fd >= 0)
-        return write(out->fd, &val, 1);
+        return write_fd(out, &val, 1);
     else {
-        cpk_ensure_buffer(out, 1);
+        if(cpk_ensure_buffer(out, 1)) return -1;
         out->buffer[out->buffer_used] = val;
         out->buffer_used++;
+        CPK_STAT_ADD(out->stats, bytes_written, 1);
         return 1;
     }
 }
@@ -72,11 +202,12 @@ int cpk_write16(cpk_output_t *out, uint16_t val) {
     val = net16(val);
 
     if(out->fd >= 0)
-        return write(out->fd, &val, 2);
+        return write_fd(out, &val, 2);
     else {
-        cpk_ensure_buffer(out, 2);
-        *(uint16_t*)(out->buffer + out->buffer_used) = val;
+        if(cpk_ensure_buffer(out, 2)) return -1;
+        memcpy(out->buffer + out->buffer_used, &val, 2);
         out->buffer_used += 2;
+        CPK_STAT_ADD(out->stats, bytes_written, 2);
         return 2;
     }
 }
@@ -85,11 +216,12 @@ int cpk_write32(cpk_output_t *out, uint32_t val) {
     val = net32(val);
 
     if(out->fd >= 0)
-        return write(out->fd, &val, 4);
+        return write_fd(out, &val, 4);
     else {
-        cpk_ensure_buffer(out, 4);
-        *(uint32_t*)(out->buffer + out->buffer_used) = val;
+        if(cpk_ensure_buffer(out, 4)) return -1;
+        memcpy(out->buffer + out->buffer_used, &val, 4);
         out->buffer_used += 4;
+        CPK_STAT_ADD(out->stats, bytes_written, 4);
         return 4;
     }
 }
@@ -98,11 +230,12 @@ int cpk_write64(cpk_output_t *out, uint64_t val) {
     val = net64(val);
 
     if(out->fd >= 0)
-        return write(out->fd, &val, 8);
+        return write_fd(out, &val, 8);
     else {
-        cpk_ensure_buffer(out, 8);
-        *(uint64_t*)(out->buffer + out->buffer_used) = val;
+        if(cpk_ensure_buffer(out, 8)) return -1;
+        memcpy(out->buffer + out->buffer_used, &val, 8);
         out->buffer_used += 8;
+        CPK_STAT_ADD(out->stats, bytes_written, 8);
         return 8;
     }
 }
@@ -119,11 +252,12 @@ int cpk_write_double(cpk_output_t *out, double val) {
 
 int cpk_write_bytes(cpk_output_t *out, const uint8_t *val, size_t len) {
     if(out->fd >= 0)
-        return write(out->fd, &val, len);
+        return write_fd(out, val, len);
     else {
-        cpk_ensure_buffer(out, len);
+        if(cpk_ensure_buffer(out, len)) return -1;
         memcpy(out->buffer + out->buffer_used, val, len);
         out->buffer_used += len;
+        CPK_STAT_ADD(out->stats, bytes_written, len);
         return len;
     }
 }
@@ -133,7 +267,17 @@ int cpk_write_string(cpk_output_t *out, const char *str) {
 }
 
 int cpk_print(cpk_output_t *out) {
-    return printf("%*s\n", (int)out->buffer_used, out->buffer);
+    return printf("%.*s\n", (int)out->buffer_used, out->buffer);
+}
+
+/* Ends a frame: writes the sum of everything since the last trailer
+   (or since summing started) as a 32-bit trailer, then restarts it */
+int cpk_write_crc(cpk_output_t *out) {
+    int ret = cpk_write32(out, cpk_output_crc(out));
+
+    out->crc = 0;
+    out->crc_pos = out->buffer_used;
+    return ret;
 }
 
 int cpk_snprintf(cpk_output_t *out, size_t size, const char *fmt, ...) {
@@ -141,9 +285,16 @@ int cpk_snprintf(cpk_output_t *out, size_t size, const char *fmt, ...) {
     int count = 0;
     va_start(ap, fmt);
     
-    cpk_ensure_buffer(out, size);
+    if(cpk_ensure_buffer(out, size)) {
+        va_end(ap);
+        return -1;
+    }
+
     count = vsnprintf(out->buffer + out->buffer_used, size, fmt, ap);
+    if(count < 0) count = 0;
+    if((size_t)count >= size) count = size ? size - 1 : 0;
     out->buffer_used += count; /* This excludes \0 */
+    CPK_STAT_ADD(out->stats, bytes_written, count);
     
     va_end(ap);
 
@@ -169,25 +320,241 @@ void cpk_encode_size_header(cpk_output_t *out, uint8_t header,
 
 void cpk_encode_container(cpk_output_t *out, uint8_t type,
                           uint32_t size, uint8_t fixed_header) {
-    uint8_t header = CPK_CONTAINER;
+    uint8_t header = CPK_CONTAINER | (type & CPK_CONTAINER_TYPE_MASK);
 
     if(fixed_header) header |= CPK_CONTAINER_FIXED;
 
+    CPK_STAT_VALUE(out->stats, CPK_CONTAINER);
+
     cpk_encode_size_header(out, header, size);
 
     if(fixed_header) cpk_write8(out, fixed_header);
 }
 
 void cpk_encode_string(cpk_output_t *out, const char *str) {
-    size_t len = strlen(str);
+    cpk_encode_string_bytes(out, (const uint8_t*)str, strlen(str));
+}
+
+/* Strings need not be NUL-terminated, and may hold NULs */
+void cpk_encode_string_bytes(cpk_output_t *out, const uint8_t *data,
+                             uint32_t len) {
+    CPK_STAT_VALUE(out->stats, CPK_STRING);
 
     cpk_encode_size_header(out, CPK_STRING, len);
-    cpk_write_bytes(out, str, len);
+    cpk_write_bytes(out, data, len);
+}
+
+/* Writes a string whose bytes arrive in pieces.  The size goes in the
+   header, so it must be known up front; appends past it fail without
+   writing, and cpk_encode_string_end fails if any are still owed.
+   Nothing else may be encoded in between. */
+int cpk_encode_string_begin(cpk_output_t *out, uint32_t size) {
+    if(out->string_left) return CPK_ERROR;
+
+    CPK_STAT_VALUE(out->stats, CPK_STRING);
+
+    cpk_encode_size_header(out, CPK_STRING, size);
+    out->string_left = size;
+    return 0;
+}
+
+int cpk_encode_string_append(cpk_output_t *out, const uint8_t *data,
+                             size_t len) {
+    if(len > out->string_left) return CPK_ERROR;
+
+    out->string_left -= len;
+    return cpk_write_bytes(out, data, len);
+}
+
+int cpk_encode_string_end(cpk_output_t *out) {
+    return out->string_left ? CPK_ERROR : 0;
 }
 
 void cpk_encode_ref(cpk_output_t *out, uint8_t type, uint32_t val) {
+    CPK_STAT_VALUE(out->stats, type);
+
     if(val < 16)
         cpk_write8(out, type | CPK_REFTAG_INLINE | val);
     else
         cpk_encode_size_header(out, type, val);
 }
+
+static int encode_r(cpk_output_t *out, const cpk_object_t *obj,
+                    int skip_header);
+
+/* The writes return bytes written or -1; these return 0 or -1 */
+static int encode_header(cpk_output_t *out, uint8_t header,
+                         int skip_header) {
+    return !skip_header && cpk_write8(out, header) < 0 ? -1 : 0;
+}
+
+/* Writes header and then size at the width header gives it */
+static int encode_sized(cpk_output_t *out, uint8_t header, uint32_t size,
+                        int skip_header) {
+    int ret = 0;
+
+    if(encode_header(out, header, skip_header)) return -1;
+
+    switch(CPK_HEADER_INFO(header)->size) {
+        case 1: ret = cpk_write8(out, (uint8_t)size); break;
+        case 2: ret = cpk_write16(out, (uint16_t)size); break;
+        case 4: ret = cpk_write32(out, size); break;
+    }
+
+    return ret < 0 ? -1 : 0;
+}
+
+static int encode_number(cpk_output_t *out, const cpk_object_t *obj,
+                         int skip_header) {
+    const cpk_header_info_t *info = CPK_HEADER_INFO(obj->header);
+    const cpk_number_t *n = &obj->number;
+    cpk_object_t tmp;
+    int ret = 0;
+
+    if(encode_header(out, (uint8_t)obj->header, skip_header)) return -1;
+
+    if(info->children) {
+        if(encode_r(out, cpk_number_part(obj, 0, &tmp), 0)) return -1;
+        return encode_r(out, cpk_number_part(obj, 1, &tmp), 0);
+    }
+
+    switch(info->payload) {
+        case 1: ret = cpk_write8(out, n->val.uint8); break;
+        case 2: ret = cpk_write16(out, n->val.uint16); break;
+        case 4: ret = cpk_write32(out, n->val.uint32); break;
+        case 8: ret = cpk_write64(out, n->val.uint64); break;
+
+        case 16:
+#ifdef __SIZEOF_INT128__
+            if(cpk_write64(out, (uint64_t)(n->val.uint128 >> 64)) < 0)
+                return -1;
+            ret = cpk_write64(out, (uint64_t)n->val.uint128);
+#else
+            ret = cpk_write_bytes(out, n->val.uint128_bytes, 16);
+#endif
+            break;
+
+        default:
+            return -1;
+    }
+
+    return ret < 0 ? -1 : 0;
+}
+
+static int encode_container(cpk_output_t *out, const cpk_object_t *obj,
+                            int skip_header) {
+    const cpk_container_t *c = &obj->container;
+    const cpk_header_info_t *info = CPK_HEADER_INFO(c->header);
+    uint32_t size = c->size, i = 0;
+    int fixed = 0;
+
+    /* Undo what decoding added to the size for the type and keys */
+    if(info->flags & CPK_HD_TMAP) size--;
+    if(info->flags & CPK_HD_MAP) size /= 2;
+
+    if(encode_sized(out, (uint8_t)c->header, size, skip_header))
+        return -1;
+    if((info->flags & CPK_HD_FIXED) && cpk_write8(out, c->fixed_header) < 0)
+        return -1;
+
+    for(i = 0; i < c->size; i++) {
+        /* A tmap's type object always carries its own header */
+        fixed = (info->flags & CPK_HD_FIXED) &&
+                !(i == 0 && (info->flags & CPK_HD_TMAP));
+
+        if(encode_r(out, c->obj[i], fixed)) return -1;
+    }
+
+    return 0;
+}
+
+static int encode_r(cpk_output_t *out, const cpk_object_t *obj,
+                    int skip_header) {
+    const cpk_header_info_t *info = NULL;
+    uint8_t header = 0;
+
+    /* Loop rather than recurse on a cons cdr, as decoding does */
+    for(;;) {
+        if(!obj || CPK_IS_ERROR(obj->header))
+            return -1;
+
+        header = (uint8_t)obj->header;
+        info = CPK_HEADER_INFO(header);
+
+        if(info->flags & CPK_HD_INLINE) {
+            if(encode_header(out, header, skip_header)) return -1;
+            if(info->kind != CPK_TAG) return 0;
+        }
+
+        switch(info->kind) {
+            case CPK_NUMBER:
+                return encode_number(out, obj, skip_header);
+
+            case CPK_CONTAINER:
+                return encode_container(out, obj, skip_header);
+
+            case CPK_STRING:
+                if(obj->string.flags & CPK_STRING_STREAMED)
+                    return -1;
+                if(encode_sized(out, header, obj->string.size, skip_header))
+                    return -1;
+
+                return cpk_write_bytes(out, obj->string.data,
+                                       obj->string.size) < 0 ? -1 : 0;
+
+            case CPK_REF:
+            case CPK_INDEX:
+            case CPK_POINTER:
+                return encode_sized(out, header, obj->ref.val, skip_header);
+
+            case CPK_TAG:
+                if(!(info->flags & CPK_HD_INLINE) &&
+                   encode_sized(out, header, obj->tag.val, skip_header))
+                    return -1;
+
+                obj = obj->tag.obj;
+                break;
+
+            case CPK_REMOTE_REF:
+                if(encode_header(out, header, skip_header)) return -1;
+
+                obj = obj->rref.val;
+                break;
+
+            case CPK_PACKAGE:
+                if(encode_header(out, header, skip_header)) return -1;
+
+                obj = obj->package.name;
+                break;
+
+            case CPK_SYMBOL:
+                if(encode_header(out, header, skip_header)) return -1;
+                if(!(info->flags & CPK_HD_KEYWORD) &&
+                   encode_r(out, obj->symbol.name, 0))
+                    return -1;
+
+                obj = info->flags & CPK_HD_KEYWORD ? obj->symbol.name
+                                                   : obj->symbol.package;
+                break;
+
+            case CPK_CONS:
+                if(encode_header(out, header, skip_header)) return -1;
+                if(encode_r(out, obj->cons.car, 0)) return -1;
+
+                obj = obj->cons.cdr;
+                break;
+
+            default:
+                return -1;
+        }
+
+        skip_header = 0;
+    }
+}
+
+/* Encodes a decoded tree back to the bytes it was decoded from, sizes
+   at the widths they had.  Fails on an error object or a string whose
+   bytes were streamed, with out holding whatever was written by then. */
+int cpk_encode_object(cpk_output_t *out, const cpk_object_t *obj) {
+    return encode_r(out, obj, 0) ? CPK_ERROR : 0;
+}
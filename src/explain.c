@@ -16,10 +16,9 @@
 
 #include "config.h"
 #include "conspack/conspack.h"
+#include "internal.h"
 
-#include <stdio.h>
 #include <string.h>
-#include <inttypes.h>
 
 const char *CPK_BOOL_STR = ":boolean";
 const char *CPK_NIL_STR = "nil";
@@ -27,6 +26,7 @@ const char *CPK_TRUE_STR = "t";
 const char *CPK_NUMBER_STR = ":number";
 const char *CPK_STRING_STR = ":string";
 const char *CPK_REF_STR = ":ref";
+const char *CPK_POINTER_STR = ":pointer";
 const char *CPK_REMOTE_REF_STR = ":rref";
 const char *CPK_TAG_STR = ":tag";
 const char *CPK_CONS_STR = ":cons";
@@ -49,206 +49,364 @@ const char *CPK_SINGLE_FLOAT_STR = ":single-float";
 const char *CPK_DOUBLE_FLOAT_STR = ":double-float";
 const char *CPK_COMPLEX_STR = ":complex";
 const char *CPK_RATIONAL_STR = ":rational";
+const char *CPK_ERROR_STR = ":error";
 
-static void explain_object_r(cpk_output_t *out, cpk_object_t *obj);
 
-static void explain_bool(cpk_output_t *out, cpk_object_t *obj) {
-    cpk_write_string(out, CPK_BOOL_STR);
-    cpk_write_string(out, " ");
+/* Output goes through a 4KB chunk on the stack; see format.c */
+#define EXPLAIN_CHUNK 4096
+
+typedef struct _explain {
+    cpk_writer_t w;
+
+    uint32_t max_depth;
+    uint32_t max_elements;
+    uint32_t max_string;
+    uint32_t depth;
+} explain_t;
+
+static void explain_object_r(explain_t *e, cpk_object_t *obj);
+
+static inline void emit(explain_t *e, const char *s, size_t len) {
+    cpk_writer_write(&e->w, s, len);
+}
+
+static inline void emit_char(explain_t *e, char c) {
+    cpk_writer_char(&e->w, c);
+}
+
+static inline void emit_str(explain_t *e, const char *s) {
+    cpk_writer_write(&e->w, s, strlen(s));
+}
+
+static inline void emit_u64(explain_t *e, uint64_t v) {
+    cpk_writer_u64(&e->w, v);
+}
+
+static inline void emit_i64(explain_t *e, int64_t v) {
+    cpk_writer_i64(&e->w, v);
+}
+
+static void emit_double(explain_t *e, double v) {
+    char buf[CPK_FLOAT_CHARS];
+
+    emit(e, buf, cpk_format_double(buf, v));
+}
+
+static void emit_single(explain_t *e, float v) {
+    char buf[CPK_FLOAT_CHARS];
+
+    emit(e, buf, cpk_format_single(buf, v));
+}
+
+static void explain_bool(explain_t *e, cpk_object_t *obj) {
+    emit_str(e, CPK_BOOL_STR);
+    emit_char(e, ' ');
 
     if(obj->header == CPK_NIL)
-        cpk_write_string(out, CPK_NIL_STR);
+        emit_str(e, CPK_NIL_STR);
     else
-        cpk_write_string(out, CPK_TRUE_STR);
+        emit_str(e, CPK_TRUE_STR);
 }
 
-static void explain_int(cpk_output_t *out, cpk_object_t *obj) {
+static void explain_int(explain_t *e, cpk_object_t *obj) {
     int size = obj->header ^ CPK_NUMBER;
 
     if(size < CPK_UINT8 || size == CPK_INT128)
-        cpk_write_string(out, CPK_INT_STR);
+        emit_str(e, CPK_INT_STR);
     else
-        cpk_write_string(out, CPK_UINT_STR);
+        emit_str(e, CPK_UINT_STR);
 
     switch(size) {
         case CPK_INT8:
-            cpk_snprintf(out, 20, "8 %" PRId32, (int32_t)obj->number.val.int8);
+            emit(e, "8 ", 2);
+            emit_i64(e, obj->number.val.int8);
             break;
-            
+
         case CPK_UINT8:
-            cpk_snprintf(out, 20, "8 %" PRIu32, (uint32_t)obj->number.val.uint8);
+            emit(e, "8 ", 2);
+            emit_u64(e, obj->number.val.uint8);
             break;
-            
+
         case CPK_INT16:
-            cpk_snprintf(out, 20, "16 %" PRId32, (int32_t)obj->number.val.int16);
+            emit(e, "16 ", 3);
+            emit_i64(e, obj->number.val.int16);
             break;
 
         case CPK_UINT16:
-            cpk_snprintf(out, 20, "16 %" PRIu32, (uint32_t)obj->number.val.uint16);
+            emit(e, "16 ", 3);
+            emit_u64(e, obj->number.val.uint16);
             break;
 
         case CPK_INT32:
-            cpk_snprintf(out, 20, "32 %" PRId32, (int32_t)obj->number.val.int32);
+            emit(e, "32 ", 3);
+            emit_i64(e, obj->number.val.int32);
             break;
 
         case CPK_UINT32:
-            cpk_snprintf(out, 20, "32 %" PRIu32, (uint32_t)obj->number.val.uint32);
+            emit(e, "32 ", 3);
+            emit_u64(e, obj->number.val.uint32);
             break;
 
         case CPK_INT64:
-            cpk_snprintf(out, 50, "64 %" PRId32, (int64_t)obj->number.val.int64);
+            emit(e, "64 ", 3);
+            emit_i64(e, obj->number.val.int64);
             break;
 
         case CPK_UINT64:
-            cpk_snprintf(out, 50, "64 %" PRIu32, (uint64_t)obj->number.val.uint64);
+            emit(e, "64 ", 3);
+            emit_u64(e, obj->number.val.uint64);
             break;
 
-
         case CPK_INT128:
         case CPK_UINT128:
-            cpk_write_string(out, "128");
+            emit(e, "128 ", 4);
+            cpk_writer_128(&e->w, obj);
             break;
 
         default:
-            cpk_write_string(out, "??");
+            emit(e, "??", 2);
     }
 }
 
-static void explain_number(cpk_output_t *out, cpk_object_t *obj) {
-    unsigned char numtype = CPK_NUMBER_TYPE(obj->header);
-            
-    cpk_write_string(out, CPK_NUMBER_STR);
-    cpk_write_string(out, " ");
+static void explain_number(explain_t *e, cpk_object_t *obj) {
+    unsigned char numtype = CPK_HEADER_INFO(obj->header)->numtype;
+    cpk_object_t tmp[2];
+
+    emit_str(e, CPK_NUMBER_STR);
+    emit_char(e, ' ');
 
     if(numtype < CPK_SINGLE_FLOAT ||
        numtype == CPK_INT128 ||
        numtype == CPK_UINT128)
-        explain_int(out, obj);
+        explain_int(e, obj);
     else if(numtype == CPK_SINGLE_FLOAT) {
-        cpk_write_string(out, CPK_SINGLE_FLOAT_STR);
-        cpk_snprintf(out, 10, " %.7f", obj->number.val.single_float);
+        emit_str(e, CPK_SINGLE_FLOAT_STR);
+        emit_char(e, ' ');
+        emit_single(e, obj->number.val.single_float);
     } else if(numtype == CPK_DOUBLE_FLOAT) {
-        cpk_write_string(out, CPK_DOUBLE_FLOAT_STR);
-        cpk_snprintf(out, 20, " %.16g", obj->number.val.double_float);
+        emit_str(e, CPK_DOUBLE_FLOAT_STR);
+        emit_char(e, ' ');
+        emit_double(e, obj->number.val.double_float);
     } else if(numtype == CPK_RATIONAL) {
-        cpk_write_string(out, CPK_RATIONAL_STR);
-        cpk_write_string(out, " ");
-        explain_object_r(out, obj->rational.n);
-        cpk_write_string(out, " ");
-        explain_object_r(out, obj->rational.d);
-    } else if(numtype = CPK_COMPLEX) {
-        cpk_write_string(out, CPK_COMPLEX_STR);
-        cpk_write_string(out, " ");
-        explain_object_r(out, obj->complex.r);
-        cpk_write_string(out, " ");
-        explain_object_r(out, obj->complex.i);
-    }    
-}
-
-static void explain_container(cpk_output_t *out, cpk_object_t *obj) {
-    int i = 0;
-    
+        emit_str(e, CPK_RATIONAL_STR);
+        emit_char(e, ' ');
+        explain_object_r(e, (cpk_object_t*)cpk_number_part(obj, 0, &tmp[0]));
+        emit_char(e, ' ');
+        explain_object_r(e, (cpk_object_t*)cpk_number_part(obj, 1, &tmp[1]));
+    } else if(numtype == CPK_COMPLEX) {
+        emit_str(e, CPK_COMPLEX_STR);
+        emit_char(e, ' ');
+        explain_object_r(e, (cpk_object_t*)cpk_number_part(obj, 0, &tmp[0]));
+        emit_char(e, ' ');
+        explain_object_r(e, (cpk_object_t*)cpk_number_part(obj, 1, &tmp[1]));
+    }
+}
+
+static void explain_container(explain_t *e, cpk_object_t *obj) {
+    uint32_t i = 0, n = obj->container.size;
+
     switch(obj->header & CPK_CONTAINER_TYPE_MASK) {
         case CPK_CONTAINER_VECTOR:
-            cpk_write_string(out, CPK_VECTOR_STR);
+            emit_str(e, CPK_VECTOR_STR);
             break;
 
         case CPK_CONTAINER_LIST:
-            cpk_write_string(out, CPK_LIST_STR);
+            emit_str(e, CPK_LIST_STR);
             break;
 
         case CPK_CONTAINER_MAP:
-            cpk_write_string(out, CPK_MAP_STR);
+            emit_str(e, CPK_MAP_STR);
             break;
 
         case CPK_CONTAINER_TMAP:
-            cpk_write_string(out, CPK_TMAP_STR);
+            emit_str(e, CPK_TMAP_STR);
             break;
     }
 
-    for(i = 0; i < obj->container.size; i++) {
-        cpk_write_string(out, " ");
-        explain_object_r(out, obj->container.obj[i]);
+    if(e->max_elements && n > e->max_elements)
+        n = e->max_elements;
+
+    for(i = 0; i < n && !e->w.failed; i++) {
+        emit_char(e, ' ');
+        explain_object_r(e, obj->container.obj[i]);
+    }
+
+    if(n < obj->container.size) {
+        emit(e, " ... ", 5);
+        emit_u64(e, obj->container.size - n);
+        emit(e, " more", 5);
     }
 }
 
-static void explain_string(cpk_output_t *out, cpk_object_t *obj) {
-    cpk_write_string(out, CPK_STRING_STR);
-    cpk_snprintf(out, (int)obj->string.size + 4,
-                 " \"%*s\"", (int)obj->string.size, obj->string.data);
+/* Quotes and backslashes are escaped; everything else, NULs
+   included, goes out as it is */
+static void explain_string(explain_t *e, cpk_object_t *obj) {
+    uint32_t size = obj->string.size, i = 0, run = 0;
+    const uint8_t *data = obj->string.data;
+
+    emit_str(e, CPK_STRING_STR);
+
+    if(obj->string.flags & CPK_STRING_STREAMED) {
+        emit(e, " :streamed ", 11);
+        emit_u64(e, size);
+        return;
+    }
+
+    if(e->max_string && size > e->max_string)
+        size = e->max_string;
+
+    emit(e, " \"", 2);
+
+    for(i = 0; i < size; i++) {
+        if(data[i] != '"' && data[i] != '\\') continue;
+
+        emit(e, (const char*)data + run, i - run);
+        emit_char(e, '\\');
+        run = i;
+    }
+
+    emit(e, (const char*)data + run, size - run);
+    emit_char(e, '"');
+
+    if(size < obj->string.size) {
+        emit(e, " ... ", 5);
+        emit_u64(e, obj->string.size - size);
+        emit(e, " more", 5);
+    }
 }
 
-static void explain_ref(cpk_output_t *out, cpk_object_t *obj) {
+static void explain_ref(explain_t *e, cpk_object_t *obj) {
     switch(cpk_decode_header(obj->header)) {
-        case CPK_REF: cpk_write_string(out, CPK_REF_STR); break;
-        case CPK_TAG: cpk_write_string(out, CPK_TAG_STR); break;
-        case CPK_INDEX: cpk_write_string(out, CPK_INDEX_STR); break;
+        case CPK_REF: emit_str(e, CPK_REF_STR); break;
+        case CPK_TAG: emit_str(e, CPK_TAG_STR); break;
+        case CPK_INDEX: emit_str(e, CPK_INDEX_STR); break;
+        case CPK_POINTER: emit_str(e, CPK_POINTER_STR); break;
     }
 
-    cpk_snprintf(out, 20, " %" PRIu32, obj->ref.val);
+    emit_char(e, ' ');
+    emit_u64(e, obj->ref.val);
+
+    if(CPK_IS_TAG(obj->header)) {
+        emit_char(e, ' ');
+        explain_object_r(e, obj->tag.obj);
+    }
 }
 
-static void explain_rref(cpk_output_t *out, cpk_object_t *obj) {
-    cpk_write_string(out, CPK_REMOTE_REF_STR);
-    cpk_write_string(out, " ");
+static void explain_rref(explain_t *e, cpk_object_t *obj) {
+    emit_str(e, CPK_REMOTE_REF_STR);
+    emit_char(e, ' ');
 
-    explain_object_r(out, obj->rref.val);
+    explain_object_r(e, obj->rref.val);
 }
 
-static void explain_cons(cpk_output_t *out, cpk_object_t *obj) {
-    cpk_write_string(out, CPK_CONS_STR);
-    cpk_write_string(out, " ");
-    explain_object_r(out, obj->cons.car);
-    cpk_write_string(out, " ");
-    explain_object_r(out, obj->cons.cdr);    
+static void explain_cons(explain_t *e, cpk_object_t *obj) {
+    emit_str(e, CPK_CONS_STR);
+    emit_char(e, ' ');
+    explain_object_r(e, obj->cons.car);
+    emit_char(e, ' ');
+    explain_object_r(e, obj->cons.cdr);
 }
 
-static void explain_package(cpk_output_t *out, cpk_object_t *obj) {
-    cpk_write_string(out, CPK_PACKAGE_STR);
-    cpk_write_string(out, " ");
-    explain_object_r(out, obj->package.name);
+static void explain_package(explain_t *e, cpk_object_t *obj) {
+    emit_str(e, CPK_PACKAGE_STR);
+    emit_char(e, ' ');
+    explain_object_r(e, obj->package.name);
 }
 
-static void explain_symbol(cpk_output_t *out, cpk_object_t *obj) {
-    cpk_write_string(out, CPK_SYMBOL_STR);
-    cpk_write_string(out, " ");
+static void explain_symbol(explain_t *e, cpk_object_t *obj) {
+    emit_str(e, CPK_SYMBOL_STR);
+    emit_char(e, ' ');
 
     if(CPK_IS_KEYWORD(obj->header))
-        cpk_write_string(out, CPK_KEYWORD_STR);
+        emit_str(e, CPK_KEYWORD_STR);
     else
-        explain_object_r(out, obj->symbol.package);
+        explain_object_r(e, obj->symbol.package);
 
-    cpk_write_string(out, " ");
-    explain_object_r(out, obj->symbol.name);
+    emit_char(e, ' ');
+    explain_object_r(e, obj->symbol.name);
 }
 
-static void explain_object_r(cpk_output_t *out, cpk_object_t *obj) {
+static void explain_error(explain_t *e, cpk_object_t *obj) {
+    emit_str(e, CPK_ERROR_STR);
+    emit_char(e, ' ');
+    emit_u64(e, obj->error.code);
+    emit(e, " \"", 2);
+    emit_str(e, obj->error.reason);
+    emit(e, "\" ", 2);
+    emit_u64(e, obj->error.pos);
+}
+
+static void explain_object_r(explain_t *e, cpk_object_t *obj) {
+    char tmp[3];
+
     if(!obj) return;
 
-    cpk_write_string(out, "(");
-    switch(cpk_decode_header(obj->header)) {
-        case CPK_BOOL: explain_bool(out, obj); break;
-        case CPK_NUMBER: explain_number(out, obj); break;
-        case CPK_STRING: explain_string(out, obj); break;
-        case CPK_CONTAINER: explain_container(out, obj); break;
+    if(e->max_depth && e->depth >= e->max_depth) {
+        emit(e, "...", 3);
+        return;
+    }
+
+    e->depth++;
+    emit_char(e, '(');
+
+    if(CPK_IS_ERROR(obj->header)) {
+        explain_error(e, obj);
+    } else switch(cpk_decode_header(obj->header)) {
+        case CPK_BOOL: explain_bool(e, obj); break;
+        case CPK_NUMBER: explain_number(e, obj); break;
+        case CPK_STRING: explain_string(e, obj); break;
+        case CPK_CONTAINER: explain_container(e, obj); break;
         case CPK_REF:
         case CPK_TAG:
         case CPK_INDEX:
-            explain_ref(out, obj);
+        case CPK_POINTER:
+            explain_ref(e, obj);
             break;
-        case CPK_REMOTE_REF: explain_rref(out, obj); break;
-        case CPK_CONS: explain_cons(out, obj); break;
-        case CPK_PACKAGE: explain_package(out, obj); break;
-        case CPK_SYMBOL: explain_symbol(out, obj); break;
+        case CPK_REMOTE_REF: explain_rref(e, obj); break;
+        case CPK_CONS: explain_cons(e, obj); break;
+        case CPK_PACKAGE: explain_package(e, obj); break;
+        case CPK_SYMBOL: explain_symbol(e, obj); break;
         default:
-            cpk_write_string(out, "Bad header: ");
-            cpk_snprintf(out, 4, "%.3d", obj->header);
+            emit_str(e, "Bad header: ");
+            tmp[0] = '0' + (uint8_t)obj->header / 100;
+            tmp[1] = '0' + (uint8_t)obj->header / 10 % 10;
+            tmp[2] = '0' + (uint8_t)obj->header % 10;
+            emit(e, tmp, 3);
     }
-    cpk_write_string(out, ")");
+
+    emit_char(e, ')');
+    e->depth--;
+}
+
+/* Writes the explanation of obj to fn in pieces of up to 4KB, using no
+   memory beyond the stack.  opts may be NULL for no truncation.
+   Returns CPK_ERROR if fn did; nothing more is written after that. */
+int cpk_explain_sink(cpk_object_t *obj, const cpk_explain_opts_t *opts,
+                     cpk_sink_fn_t fn, void *arg) {
+    char chunk[EXPLAIN_CHUNK];
+    explain_t e;
+
+    cpk_writer_init(&e.w, chunk, sizeof(chunk), fn, arg);
+    e.max_depth = opts ? opts->max_depth : 0;
+    e.max_elements = opts ? opts->max_elements : 0;
+    e.max_string = opts ? opts->max_string : 0;
+    e.depth = 0;
+
+    explain_object_r(&e, obj);
+    return cpk_writer_flush(&e.w);
+}
+
+int cpk_explain_fd(int fd, cpk_object_t *obj,
+                   const cpk_explain_opts_t *opts) {
+    return cpk_explain_sink(obj, opts, cpk_sink_fd, &fd);
+}
+
+static int sink_output(void *arg, const uint8_t *data, size_t len) {
+    return cpk_write_bytes(arg, data, len) < 0;
 }
 
 void cpk_explain_object(cpk_output_t *out, cpk_object_t *obj) {
     if(!out || !obj) return;
 
-    explain_object_r(out, obj);
+    cpk_explain_sink(obj, NULL, sink_output, out);
 }
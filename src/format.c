@@ -0,0 +1,557 @@
+/*
+ * libconspack
+ * Copyright (C) 2012  Ryan Pavlik
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the GNU Lesser General Public
+ * License (LGPL) version 2.1 which accompanies this distribution, and
+ * is available at http://www.gnu.org/licenses/lgpl-2.1.html
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ */
+
+#include "config.h"
+#include "conspack/conspack.h"
+#include "internal.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+/*
+ * Text output for explain and the JSON exporter.  A writer gathers
+ * output in a caller-supplied chunk and hands it to a sink whenever it
+ * fills, so memory stays the same whatever is being written.  Numbers
+ * are formatted here rather than by printf: integers two digits at a
+ * time, floats as the shortest digits that read back to the same
+ * value.
+ */
+
+void cpk_writer_init(cpk_writer_t *w, char *buf, size_t size,
+                     cpk_sink_fn_t fn, void *arg) {
+    w->fn = fn;
+    w->arg = arg;
+    w->failed = 0;
+    w->used = 0;
+    w->size = size;
+    w->buf = buf;
+}
+
+/* After the sink fails once nothing more is passed to it */
+int cpk_writer_flush(cpk_writer_t *w) {
+    if(w->used && !w->failed &&
+       w->fn(w->arg, (uint8_t*)w->buf, w->used))
+        w->failed = 1;
+
+    w->used = 0;
+    return w->failed ? CPK_ERROR : 0;
+}
+
+/* Runs bigger than the chunk skip it and go to the sink directly */
+void cpk_writer_write(cpk_writer_t *w, const char *s, size_t len) {
+    size_t n = 0;
+
+    if(len > w->size) {
+        cpk_writer_flush(w);
+        if(!w->failed && w->fn(w->arg, (const uint8_t*)s, len))
+            w->failed = 1;
+        return;
+    }
+
+    while(len) {
+        if(w->used == w->size)
+            cpk_writer_flush(w);
+
+        n = w->size - w->used;
+        if(n > len) n = len;
+
+        memcpy(w->buf + w->used, s, n);
+        w->used += n;
+        s += n;
+        len -= n;
+    }
+}
+
+static const char digit_pairs[201] =
+    "00010203040506070809101112131415161718192021222324252627282930313233"
+    "34353637383940414243444546474849505152535455565758596061626364656667"
+    "6869707172737475767778798081828384858687888990919293949596979899";
+
+/* Writes v backwards ending at end, returning where it starts */
+char* cpk_format_u64(char *end, uint64_t v) {
+    while(v >= 100) {
+        end -= 2;
+        memcpy(end, digit_pairs + (v % 100) * 2, 2);
+        v /= 100;
+    }
+
+    if(v >= 10) {
+        end -= 2;
+        memcpy(end, digit_pairs + v * 2, 2);
+    } else {
+        *--end = '0' + v;
+    }
+
+    return end;
+}
+
+/* Nine digits at a time, by long division over 32-bit words, so no
+   128-bit type is needed */
+char* cpk_format_u128(char *end, uint64_t hi, uint64_t lo) {
+    uint32_t w[4] = { hi >> 32, (uint32_t)hi, lo >> 32, (uint32_t)lo };
+    uint64_t r = 0;
+    char *stop = NULL;
+    int i = 0;
+
+    while(w[0] || w[1]) {
+        for(r = 0, i = 0; i < 4; i++) {
+            r = r << 32 | w[i];
+            w[i] = (uint32_t)(r / 1000000000);
+            r %= 1000000000;
+        }
+
+        stop = end - 9;
+        end = cpk_format_u64(end, r);
+        while(end > stop) *--end = '0';
+    }
+
+    return cpk_format_u64(end, (uint64_t)w[2] << 32 | w[3]);
+}
+
+void cpk_writer_u64(cpk_writer_t *w, uint64_t v) {
+    char tmp[20], *p = cpk_format_u64(tmp + sizeof(tmp), v);
+
+    cpk_writer_write(w, p, tmp + sizeof(tmp) - p);
+}
+
+void cpk_writer_i64(cpk_writer_t *w, int64_t v) {
+    if(v < 0) {
+        cpk_writer_char(w, '-');
+        cpk_writer_u64(w, -(uint64_t)v);
+    } else {
+        cpk_writer_u64(w, v);
+    }
+}
+
+/* A decoded int128 or uint128 */
+void cpk_writer_128(cpk_writer_t *w, const cpk_object_t *obj) {
+    char tmp[40], *p = NULL;
+    uint64_t hi = 0, lo = 0;
+#ifndef __SIZEOF_INT128__
+    int i = 0;
+#endif
+
+#ifdef __SIZEOF_INT128__
+    hi = (uint64_t)(obj->number.val.uint128 >> 64);
+    lo = (uint64_t)obj->number.val.uint128;
+#else
+    for(i = 0; i < 8; i++) {
+        hi = hi << 8 | obj->number.val.uint128_bytes[i];
+        lo = lo << 8 | obj->number.val.uint128_bytes[i + 8];
+    }
+#endif
+
+    if(CPK_NUMBER_TYPE(obj->header) == CPK_INT128 && (hi >> 63)) {
+        cpk_writer_char(w, '-');
+        lo = ~lo + 1;
+        hi = ~hi + !lo;
+    }
+
+    p = cpk_format_u128(tmp + sizeof(tmp), hi, lo);
+    cpk_writer_write(w, p, tmp + sizeof(tmp) - p);
+}
+
+/*
+ * Shortest round-trip digits, after Burger and Dybvig's free-format
+ * algorithm: with the value and the halfway points to its neighbours
+ * held exactly as r/s, (r + m+)/s and (r - m-)/s, digits are produced
+ * until the number printed so far is closer to the value than to
+ * either neighbour.  The bignums only need room for a double's range,
+ * about 2^1100.
+ */
+
+#define BIG_WORDS 40
+
+typedef struct _big {
+    uint32_t n;
+    uint32_t w[BIG_WORDS];
+} big_t;
+
+static void big_set(big_t *b, uint64_t v) {
+    b->w[0] = (uint32_t)v;
+    b->w[1] = (uint32_t)(v >> 32);
+    b->n = b->w[1] ? 2 : (b->w[0] ? 1 : 0);
+}
+
+static void big_shl(big_t *b, uint32_t bits) {
+    uint32_t words = bits / 32, shift = bits % 32, i = 0;
+
+    if(!b->n) return;
+
+    if(shift) {
+        b->w[b->n] = 0;
+        for(i = b->n; i > 0; i--)
+            b->w[i] = (b->w[i] << shift) | (b->w[i - 1] >> (32 - shift));
+        b->w[0] <<= shift;
+        if(b->w[b->n]) b->n++;
+    }
+
+    if(words) {
+        memmove(b->w + words, b->w, b->n * sizeof(uint32_t));
+        memset(b->w, 0, words * sizeof(uint32_t));
+        b->n += words;
+    }
+}
+
+static void big_mul(big_t *b, uint32_t m) {
+    uint64_t carry = 0;
+    uint32_t i = 0;
+
+    for(i = 0; i < b->n; i++) {
+        carry += (uint64_t)b->w[i] * m;
+        b->w[i] = (uint32_t)carry;
+        carry >>= 32;
+    }
+
+    if(carry) b->w[b->n++] = (uint32_t)carry;
+}
+
+static void big_pow10(big_t *b, uint32_t n) {
+    for(; n >= 9; n -= 9)
+        big_mul(b, 1000000000);
+
+    while(n--)
+        big_mul(b, 10);
+}
+
+static void big_add(big_t *dst, const big_t *a, const big_t *b) {
+    uint64_t carry = 0;
+    uint32_t i = 0, n = a->n > b->n ? a->n : b->n;
+
+    for(i = 0; i < n; i++) {
+        carry += (uint64_t)(i < a->n ? a->w[i] : 0) +
+                 (i < b->n ? b->w[i] : 0);
+        dst->w[i] = (uint32_t)carry;
+        carry >>= 32;
+    }
+
+    dst->n = n;
+    if(carry) dst->w[dst->n++] = (uint32_t)carry;
+}
+
+/* a -= b, for a >= b */
+static void big_sub(big_t *a, const big_t *b) {
+    int64_t borrow = 0;
+    uint32_t i = 0;
+
+    for(i = 0; i < a->n; i++) {
+        borrow += (int64_t)a->w[i] - (i < b->n ? b->w[i] : 0);
+        a->w[i] = (uint32_t)borrow;
+        borrow >>= 32;
+    }
+
+    while(a->n && !a->w[a->n - 1])
+        a->n--;
+}
+
+static int big_cmp(const big_t *a, const big_t *b) {
+    uint32_t i = a->n;
+
+    if(a->n != b->n)
+        return a->n < b->n ? -1 : 1;
+
+    while(i--)
+        if(a->w[i] != b->w[i])
+            return a->w[i] < b->w[i] ? -1 : 1;
+
+    return 0;
+}
+
+/* An estimate of ceil(log10(f * 2^e)) from the binary exponent that
+   is never too high; the digit loops correct it upwards */
+static int estimate_point(uint64_t f, int e) {
+    int bits = 0, k = 0;
+    double x = 0;
+
+    for(bits = 0; (f >> bits) > 1; bits++) ;
+    x = (e + bits) * 0.30102999566398114 - 1e-10;
+    k = (int)x;
+    if(k < x) k++;
+
+    return k;
+}
+
+#ifdef __SIZEOF_INT128__
+/* The same steps in 128-bit integers, which hold every quantity
+   involved when -100 < e < 60: values from about 1e-14 to 1e35,
+   where most numbers people print are */
+typedef unsigned __int128 u128_t;
+
+static int shortest_small(uint64_t f, int e, int unequal,
+                          char *digits, int *point) {
+    u128_t r = f, s = 1, mp = 1, mm = 1, scale = 1;
+    int even = !(f & 1), k = estimate_point(f, e), n = 0, i = 0;
+    int low = 0, high = 0;
+    char d = 0;
+
+    if(e >= 0) {
+        r <<= e + 1 + unequal;
+        s <<= 1 + unequal;
+        mp <<= e + unequal;
+        mm <<= e;
+    } else {
+        r <<= 1 + unequal;
+        s <<= 1 - e + unequal;
+        mp <<= unequal;
+    }
+
+    for(i = k < 0 ? -k : k; i > 0; i--)
+        scale *= 10;
+
+    if(k >= 0) {
+        s *= scale;
+    } else {
+        r *= scale;
+        mp *= scale;
+        mm *= scale;
+    }
+
+    while(even ? r + mp >= s : r + mp > s) {
+        s *= 10;
+        k++;
+    }
+
+    for(;;) {
+        r *= 10;
+        mp *= 10;
+        mm *= 10;
+
+        for(d = 0; r >= s; d++)
+            r -= s;
+
+        low = even ? r <= mm : r < mm;
+        high = even ? r + mp >= s : r + mp > s;
+
+        if(!low && !high) {
+            if(n || d) digits[n++] = '0' + d;
+            else k--;
+            continue;
+        }
+
+        if(low && high) {
+            if(r * 2 >= s) d++;
+        } else if(high) {
+            d++;
+        }
+
+        digits[n++] = '0' + d;
+        break;
+    }
+
+    *point = k;
+    return n;
+}
+#endif
+
+/* Digits of f * 2^e, for f of p bits at most and e no lower than
+   min_e.  Returns how many, with the value 0.digits * 10^*point. */
+static int shortest(uint64_t f, int e, int p, int min_e,
+                    char *digits, int *point) {
+    big_t r, s, mp, mm, t;
+    int even = !(f & 1), unequal = 0, k = 0, n = 0, c = 0;
+    int low = 0, high = 0;
+    char d = 0;
+
+    /* Just above a power of two the gap below is half the gap above */
+    unequal = f == (1ULL << (p - 1)) && e > min_e;
+
+#ifdef __SIZEOF_INT128__
+    if(e > -100 && e < 60)
+        return shortest_small(f, e, unequal, digits, point);
+#endif
+
+    big_set(&r, f);
+    big_set(&s, 1);
+    big_set(&mp, 1);
+    big_set(&mm, 1);
+
+    if(e >= 0) {
+        big_shl(&r, e + 1 + unequal);
+        big_shl(&s, 1 + unequal);
+        big_shl(&mp, e + unequal);
+        big_shl(&mm, e);
+    } else {
+        big_shl(&r, 1 + unequal);
+        big_shl(&s, 1 - e + unequal);
+        big_shl(&mp, unequal);
+    }
+
+    k = estimate_point(f, e);
+
+    if(k >= 0) {
+        big_pow10(&s, k);
+    } else {
+        big_pow10(&r, -k);
+        big_pow10(&mp, -k);
+        big_pow10(&mm, -k);
+    }
+
+    for(;;) {
+        big_add(&t, &r, &mp);
+        c = big_cmp(&t, &s);
+        if(even ? c < 0 : c <= 0) break;
+
+        big_mul(&s, 10);
+        k++;
+    }
+
+    for(;;) {
+        big_mul(&r, 10);
+        big_mul(&mp, 10);
+        big_mul(&mm, 10);
+
+        for(d = 0; big_cmp(&r, &s) >= 0; d++)
+            big_sub(&r, &s);
+
+        c = big_cmp(&r, &mm);
+        low = even ? c <= 0 : c < 0;
+
+        big_add(&t, &r, &mp);
+        c = big_cmp(&t, &s);
+        high = even ? c >= 0 : c > 0;
+
+        if(!low && !high) {
+            if(n || d) digits[n++] = '0' + d;
+            else k--;
+            continue;
+        }
+
+        if(low && high) {
+            t = r;
+            big_shl(&t, 1);
+            if(big_cmp(&t, &s) >= 0) d++;
+        } else if(high) {
+            d++;
+        }
+
+        digits[n++] = '0' + d;
+        break;
+    }
+
+    *point = k;
+    return n;
+}
+
+/* Plain notation from 1e-7 up to 1e21, scientific outside it, always
+   with a fraction so floats never read as integers */
+static size_t format_digits(char *buf, const char *digits, int n, int k) {
+    char tmp[20], *p = buf, *q = NULL;
+    int i = 0;
+
+    if(k > -7 && k <= 21) {
+        if(k <= 0) {
+            *p++ = '0';
+            *p++ = '.';
+            for(i = k; i < 0; i++) *p++ = '0';
+            memcpy(p, digits, n);
+            p += n;
+        } else if(k >= n) {
+            memcpy(p, digits, n);
+            p += n;
+            for(i = n; i < k; i++) *p++ = '0';
+            *p++ = '.';
+            *p++ = '0';
+        } else {
+            memcpy(p, digits, k);
+            p += k;
+            *p++ = '.';
+            memcpy(p, digits + k, n - k);
+            p += n - k;
+        }
+        return p - buf;
+    }
+
+    *p++ = digits[0];
+    *p++ = '.';
+    if(n > 1) {
+        memcpy(p, digits + 1, n - 1);
+        p += n - 1;
+    } else {
+        *p++ = '0';
+    }
+
+    *p++ = 'e';
+    if(k - 1 < 0) *p++ = '-';
+    q = cpk_format_u64(tmp + sizeof(tmp), k - 1 < 0 ? 1 - k : k - 1);
+    memcpy(p, q, tmp + sizeof(tmp) - q);
+    p += tmp + sizeof(tmp) - q;
+
+    return p - buf;
+}
+
+/* frac and exp are the raw IEEE fields of a float with p significant
+   bits and the given exponent bias */
+static size_t format_float(char *buf, int sign, uint64_t frac, int exp,
+                           int p, int bias, int exp_max) {
+    char digits[20];
+    int n = 0, k = 0, min_e = 2 - bias - p;
+
+    if(sign) *buf++ = '-';
+
+    if(exp == exp_max) {
+        memcpy(buf, frac ? "nan" : "inf", 3);
+        return 3 + sign;
+    }
+
+    if(!exp && !frac) {
+        memcpy(buf, "0.0", 3);
+        return 3 + sign;
+    }
+
+    if(exp)
+        n = shortest(frac | (1ULL << (p - 1)), exp - bias - (p - 1), p,
+                     min_e, digits, &k);
+    else
+        n = shortest(frac, min_e, p, min_e, digits, &k);
+
+    return format_digits(buf, digits, n, k) + sign;
+}
+
+/* buf needs CPK_FLOAT_CHARS; returns the length written, without NUL */
+size_t cpk_format_double(char *buf, double v) {
+    uint64_t bits = 0;
+
+    memcpy(&bits, &v, sizeof(bits));
+    return format_float(buf, bits >> 63, bits & ((1ULL << 52) - 1),
+                        (bits >> 52) & 0x7FF, 53, 1023, 0x7FF);
+}
+
+size_t cpk_format_single(char *buf, float v) {
+    uint32_t bits = 0;
+
+    memcpy(&bits, &v, sizeof(bits));
+    return format_float(buf, bits >> 31, bits & ((1U << 23) - 1),
+                        (bits >> 23) & 0xFF, 24, 127, 0xFF);
+}
+
+/* arg points to the descriptor */
+int cpk_sink_fd(void *arg, const uint8_t *data, size_t len) {
+    int fd = *(int*)arg;
+    ssize_t n = 0;
+
+    while(len) {
+        if((n = write(fd, data, len)) < 0) {
+            if(errno == EINTR) continue;
+            return -1;
+        }
+
+        data += n;
+        len -= n;
+    }
+
+    return 0;
+}
@@ -0,0 +1,182 @@
+/*
+ * libconspack
+ * Copyright (C) 2012  Ryan Pavlik
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the GNU Lesser General Public
+ * License (LGPL) version 2.1 which accompanies this distribution, and
+ * is available at http://www.gnu.org/licenses/lgpl-2.1.html
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ */
+
+
+#include "config.h"
+#include "conspack/conspack.h"
+#include "internal.h"
+
+#include <string.h>
+
+/* The XXH64 construction: four independent 64-bit lanes over 32-byte
+   stripes, so the multiplies pipeline, then a short tail and a final
+   avalanche.  Results match the reference implementation on either
+   byte order, so hashes can be stored and compared across hosts. */
+
+#define P1 0x9E3779B185EBCA87ULL
+#define P2 0xC2B2AE3D27D4EB4FULL
+#define P3 0x165667B19E3779F9ULL
+#define P4 0x85EBCA77C2B2AE63ULL
+#define P5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t load64(const uint8_t *p) {
+    uint64_t v;
+
+    memcpy(&v, p, 8);
+#if WORDS_BIGENDIAN
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+static inline uint32_t load32(const uint8_t *p) {
+    uint32_t v;
+
+    memcpy(&v, p, 4);
+#if WORDS_BIGENDIAN
+    v = __builtin_bswap32(v);
+#endif
+    return v;
+}
+
+static inline uint64_t round64(uint64_t acc, uint64_t v) {
+    return rotl(acc + v * P2, 31) * P1;
+}
+
+static inline uint64_t merge64(uint64_t h, uint64_t v) {
+    return (h ^ round64(0, v)) * P1 + P4;
+}
+
+static inline void stripe(uint64_t *v, const uint8_t *p) {
+    v[0] = round64(v[0], load64(p));
+    v[1] = round64(v[1], load64(p + 8));
+    v[2] = round64(v[2], load64(p + 16));
+    v[3] = round64(v[3], load64(p + 24));
+}
+
+static inline uint64_t converge(const uint64_t *v) {
+    uint64_t h = rotl(v[0], 1) + rotl(v[1], 7) + rotl(v[2], 12) +
+                 rotl(v[3], 18);
+
+    h = merge64(h, v[0]);
+    h = merge64(h, v[1]);
+    h = merge64(h, v[2]);
+    return merge64(h, v[3]);
+}
+
+/* The bytes short of a whole stripe, then the avalanche */
+static uint64_t finish(uint64_t h, const uint8_t *p, const uint8_t *end) {
+    for(; end - p >= 8; p += 8)
+        h = rotl(h ^ round64(0, load64(p)), 27) * P1 + P4;
+
+    if(end - p >= 4) {
+        h = rotl(h ^ (load32(p) * P1), 23) * P2 + P3;
+        p += 4;
+    }
+
+    for(; p < end; p++)
+        h = rotl(h ^ (*p * P5), 11) * P1;
+
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    h *= P3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+uint64_t cpk_hash64(uint64_t seed, const void *buf, size_t len) {
+    const uint8_t *p = buf, *end = p + len;
+    uint64_t h = 0, v[4];
+
+    if(len >= 32) {
+        v[0] = seed + P1 + P2;
+        v[1] = seed + P2;
+        v[2] = seed;
+        v[3] = seed - P1;
+
+        do {
+            stripe(v, p);
+            p += 32;
+        } while(end - p >= 32);
+
+        h = converge(v);
+    } else {
+        h = seed + P5;
+    }
+
+    return finish(h + len, p, end);
+}
+
+/* The same hash fed in pieces: stripes run as soon as 32 bytes are in,
+   and only the partial one is held back */
+void cpk_hash_begin(cpk_hash_state_t *s, uint64_t seed) {
+    s->v[0] = seed + P1 + P2;
+    s->v[1] = seed + P2;
+    s->v[2] = seed;
+    s->v[3] = seed - P1;
+    s->seed = seed;
+    s->total = 0;
+    s->used = 0;
+}
+
+void cpk_hash_update(cpk_hash_state_t *s, const void *buf, size_t len) {
+    const uint8_t *p = buf, *end = p + len;
+    size_t n = 0;
+
+    if(!len) return;
+
+    s->total += len;
+
+    if(s->used) {
+        n = 32 - s->used < len ? 32 - s->used : len;
+        memcpy(s->buf + s->used, p, n);
+        s->used += n;
+        p += n;
+
+        if(s->used < 32) return;
+
+        stripe(s->v, s->buf);
+        s->used = 0;
+    }
+
+    for(; end - p >= 32; p += 32)
+        stripe(s->v, p);
+
+    memcpy(s->buf, p, end - p);
+    s->used = end - p;
+}
+
+uint64_t cpk_hash_end(const cpk_hash_state_t *s) {
+    uint64_t h = s->total >= 32 ? converge(s->v) : s->seed + P5;
+
+    return finish(h + s->total, s->buf, s->buf + s->used);
+}
+
+/* Hashes one encoded value: the header byte seeds a hash of the bytes
+   after it.  Values inside fixed-header containers carry no header of
+   their own, so the decoder seeds theirs with the implied one; either
+   way a value hashes as it would if written on its own. */
+uint64_t cpk_hash_span(const uint8_t *buf, size_t len) {
+    if(!len) return cpk_hash64(0, NULL, 0);
+
+    return cpk_hash64(buf[0], buf + 1, len - 1);
+}
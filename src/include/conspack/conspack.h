@@ -17,9 +17,14 @@
 #ifndef CONSPACK_H
 #define CONSPACK_H
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
  /* Headers */
 
 #define CPK_BOOL                  0x00
@@ -71,6 +76,7 @@
 #define CPK_INDEX_MASK            0xE0
 
 #define CPK_ERROR                 -1
+#define CPK_INVALID               0xFF
 
 #define CPK_SIZE_8        0x00
 #define CPK_SIZE_16       0x01
@@ -123,23 +129,119 @@
 #define CPK_IS_CHAR(h) (((h) & CPK_CHAR_MASK) == CPK_CHAR)
 #define CPK_IS_PROPERTIES(h) (((h) & CPK_PROPERTIES_MASK) == CPK_PROPERTIES)
 #define CPK_IS_INDEX(h) (((h) & CPK_INDEX_MASK) == CPK_INDEX)
+#define CPK_IS_TMAP(h) (CPK_IS_CONTAINER(h) && \
+                        ((h) & CPK_CONTAINER_TYPE_MASK) == CPK_CONTAINER_TMAP)
 
 #define CPK_IS_ERROR(h) ((h) == CPK_ERROR)
 
- /* Encoding */
+/* Header table */
+
+#define CPK_HD_VALID    0x01   /* decodable header */
+#define CPK_HD_INLINE   0x02   /* value is held in the header itself */
+#define CPK_HD_FIXED    0x04   /* container with a fixed element header */
+#define CPK_HD_MAP      0x08   /* container of key/value pairs */
+#define CPK_HD_TMAP     0x10   /* ...preceded by a type object */
+#define CPK_HD_KEYWORD  0x20
+#define CPK_HD_BAD_SIZE 0x40   /* reserved size code */
+
+/* One entry per header byte, generated at build time by mkheaders.
+   size is the width of the size field in bytes, payload the width of
+   a number's value, value the inline value, and children the number of
+   objects that always follow (cons, symbol, rref, complex...). */
+typedef struct _cpk_header_info {
+    uint8_t kind;
+    uint8_t flags;
+    uint8_t size;
+    uint8_t payload;
+    uint8_t value;
+    uint8_t numtype;
+    uint8_t children;
+} cpk_header_info_t;
+
+extern const cpk_header_info_t cpk_header_table[256];
+
+#define CPK_HEADER_INFO(h) (&cpk_header_table[(uint8_t)(h)])
+
+ /* Statistics */
+
+#define CPK_STAT_BOOL        0
+#define CPK_STAT_NUMBER      1
+#define CPK_STAT_CONTAINER   2
+#define CPK_STAT_STRING      3
+#define CPK_STAT_REF         4
+#define CPK_STAT_REMOTE_REF  5
+#define CPK_STAT_POINTER     6
+#define CPK_STAT_TAG         7
+#define CPK_STAT_INDEX       8
+#define CPK_STAT_CONS        9
+#define CPK_STAT_PACKAGE     10
+#define CPK_STAT_SYMBOL      11
+#define CPK_STAT_KINDS       12
+
+/* Counters filled in by an input or output the stats are attached to.
+   They are only updated when the library is configured with
+   --enable-stats; otherwise attaching them is harmless and they stay
+   zero.  Nothing is reset between messages: call cpk_stats_clear.
+   values[] is indexed by CPK_STAT_*; on output only the cpk_encode_*
+   helpers count values.  depth is the current nesting while decoding. */
+typedef struct _cpk_stats {
+    uint64_t values[CPK_STAT_KINDS];
+
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+
+    uint64_t allocs;
+    uint64_t alloc_bytes;
+    uint64_t reallocs;
+
+    uint64_t syscalls;
+
+    uint32_t depth;
+    uint32_t max_depth;
+} cpk_stats_t;
+
+int cpk_stats_enabled(void);
+void cpk_stats_clear(cpk_stats_t *stats);
+int cpk_stats_slot(uint8_t kind);
+
+ /* Encoding */
 
 #define CPK_DEFAULT_BUFFER 16
 
+/* A fixed output writes into memory it does not own and never grows
+   it; a write that does not fit fails and sets CPK_OUTPUT_OVERFLOW,
+   which stays set until cpk_output_clear. */
+#define CPK_OUTPUT_FIXED    0x01
+#define CPK_OUTPUT_OVERFLOW 0x02
+
+/* Keep a CRC-32C of everything written since the sum was restarted,
+   read with cpk_output_crc; see cpk_write_crc */
+#define CPK_OUTPUT_CRC      0x04
+
+struct _cpk_stage;
+struct _cpk_hash_level;
+
 typedef struct _cpk_output {
     size_t buffer_size;
     size_t buffer_used;
     unsigned char *buffer;
 
     int fd;
+    uint32_t flags;
+    uint32_t crc;
+    size_t crc_pos;     /* buffered bytes before this are in crc */
+    uint32_t string_left; /* still owed to cpk_encode_string_begin */
+
+    cpk_stats_t *stats;
+    struct _cpk_stage *stage;
 } cpk_output_t;
 
 void cpk_output_init(cpk_output_t *out);
 void cpk_output_init_fd(cpk_output_t *out, int fd);
+void cpk_output_init_fixed(cpk_output_t *out, uint8_t *buf, size_t size);
+void cpk_output_set_stats(cpk_output_t *out, cpk_stats_t *stats);
+void cpk_output_set_crc(cpk_output_t *out, int enable);
+uint32_t cpk_output_crc(cpk_output_t *out);
 void cpk_output_fini(cpk_output_t *out);
 void cpk_output_clear(cpk_output_t *out);
 
@@ -157,13 +259,25 @@ int cpk_snprintf(cpk_output_t *out, size_t size, const char *fmt, ...);
 
 int cpk_print(cpk_output_t *out);
 
+int cpk_write_crc(cpk_output_t *out);
+
 void cpk_encode_container(cpk_output_t *out, uint8_t type,
                           uint32_t size, uint8_t fixed_header);
 
 void cpk_encode_string(cpk_output_t *out, const char *str);
+void cpk_encode_string_bytes(cpk_output_t *out, const uint8_t *data,
+                             uint32_t len);
+int cpk_encode_string_begin(cpk_output_t *out, uint32_t size);
+int cpk_encode_string_append(cpk_output_t *out, const uint8_t *data,
+                             size_t len);
+int cpk_encode_string_end(cpk_output_t *out);
 
 void cpk_encode_ref(cpk_output_t *out, uint8_t type, uint32_t val);
 
+/* Re-encodes a decoded tree; see encode.c */
+union _cpk_object;
+int cpk_encode_object(cpk_output_t *out, const union _cpk_object *obj);
+
  /* Decoding */
 
 typedef struct _cpk_bool {
@@ -171,6 +285,13 @@ typedef struct _cpk_bool {
     uint8_t val;
 } cpk_bool_t;
 
+/* Held at 8-byte alignment, so objects keep the size and alignment
+   they have without them */
+#ifdef __SIZEOF_INT128__
+__extension__ typedef __int128 cpk_int128_t __attribute__((aligned(8)));
+__extension__ typedef unsigned __int128 cpk_uint128_t __attribute__((aligned(8)));
+#endif
+
 typedef struct _cpk_number {
     int16_t header;
 
@@ -185,6 +306,11 @@ typedef struct _cpk_number {
         int32_t int32;
         int64_t int64;
 
+#ifdef __SIZEOF_INT128__
+        cpk_int128_t int128;
+        cpk_uint128_t uint128;
+#endif
+        /* Big-endian as sent, where there is no __int128 */
         uint8_t int128_bytes[16];
         uint8_t uint128_bytes[16];
 
@@ -193,33 +319,55 @@ typedef struct _cpk_number {
     } val;
 } cpk_number_t;
 
-typedef struct _cpk_rational {
-    int16_t header;
-    union _cpk_object *n, *d;
-} cpk_rational_t;
-
+/* Parts that are numbers of 64 bits or fewer are held inline, with
+   part[] their headers and parts.val their payloads as read into
+   cpk_number_t's val.  Other parts are objects of their own, pointed
+   to by parts.obj, and part[] is zero.  cpk_number_part reads both. */
 typedef struct _cpk_complex {
     int16_t header;
-    union _cpk_object *r, *i;
-} cpk_complex_t;
+    uint8_t part[2];
+
+    union {
+        union _cpk_object *obj[2];
+        uint64_t val[2];
+    } parts;
+} cpk_complex_t, cpk_rational_t;
 
 typedef struct _cpk_container {
     int16_t header;
     uint32_t size;
     uint8_t fixed_header;
+    uint32_t cap;       /* elements obj has room for */
     union _cpk_object **obj;
+    uint64_t hash;      /* see CPK_DECODE_HASH */
 } cpk_container_t;
 
+/* A view points into the input it was decoded from, is not
+   NUL-terminated, and is only valid as long as that input */
+#define CPK_STRING_VIEW 0x01
+
+/* The bytes went to the input's string callback; data is NULL */
+#define CPK_STRING_STREAMED 0x02
+
 typedef struct _cpk_string {
     int16_t header;
+    uint8_t flags;
     uint32_t size;
+    uint32_t cap;       /* bytes data has room for, less the NUL */
     uint8_t *data;
+    uint64_t hash;      /* see CPK_DECODE_HASH */
 } cpk_string_t;
 
 typedef struct _cpk_ref {
     int16_t header;
     uint32_t val;
-} cpk_ref_t, cpk_tag_t, cpk_index_t;
+} cpk_ref_t, cpk_index_t;
+
+typedef struct _cpk_tag {
+    int16_t header;
+    uint32_t val;
+    union _cpk_object *obj;
+} cpk_tag_t;
 
 typedef struct _cpk_remote_ref {
     int16_t header;
@@ -253,22 +401,41 @@ typedef struct _cpk_error {
 #define CPK_ERR_BAD_HEADER 0x01
 #define CPK_ERR_BAD_SIZE 0x02
 #define CPK_ERR_BAD_TYPE 0x03
+#define CPK_ERR_TRAILING 0x04
+#define CPK_ERR_LIMIT 0x05
+#define CPK_ERR_ALLOC 0x06
+#define CPK_ERR_CHECKSUM 0x07
+#define CPK_ERR_ABORTED 0x08
+#define CPK_ERR_SYNTAX 0x09
+#define CPK_ERR_IO 0x0A         /* value is the errno, where it fits */
 
 extern const char *CPK_ERR_EOF_MSG;
 extern const char *CPK_ERR_BAD_HEADER_MSG;
 extern const char *CPK_ERR_BAD_SIZE_MSG;
 extern const char *CPK_ERR_BAD_TYPE_MSG;
+extern const char *CPK_ERR_TRAILING_MSG;
+extern const char *CPK_ERR_LIMIT_MSG;
+extern const char *CPK_ERR_ALLOC_MSG;
+extern const char *CPK_ERR_CHECKSUM_MSG;
+extern const char *CPK_ERR_ABORTED_MSG;
+extern const char *CPK_ERR_SYNTAX_MSG;
+extern const char *CPK_ERR_IO_MSG;
 
 typedef union _cpk_object {
     int16_t header;
 
+#ifdef __cplusplus
+    cpk_bool_t boolean;     /* bool is a keyword there */
+#else
     cpk_bool_t bool;
+#endif
     cpk_number_t number;
     cpk_rational_t rational;
     cpk_complex_t complex;
     cpk_container_t container;
     cpk_string_t string;
-    cpk_ref_t ref, tag, index;
+    cpk_ref_t ref, index;
+    cpk_tag_t tag;
     cpk_remote_ref_t rref;
     cpk_cons_t cons;
     cpk_package_t package;
@@ -276,32 +443,445 @@ typedef union _cpk_object {
     cpk_error_t error;
 } cpk_object_t;
 
+#define CPK_DEFAULT_MAX_DEPTH 1024
+
+/* Elements of fixed containers whose fixed header is the whole value
+   (nil, t, inline refs) take no input, so nothing else bounds them */
+#define CPK_DEFAULT_MAX_UNBACKED (1024 * 1024)
+
+#define CPK_GROW_INITIAL 16
+#define CPK_GROW_CHUNK   65536
+
+/* Grow containers as elements arrive rather than reserving their
+   declared size; always on for descriptor input */
+#define CPK_LIMIT_GROW 0x01
+
+/* Zero in any field selects the default: CPK_DEFAULT_MAX_DEPTH for
+   max_depth, no limit for the others.  The cdr of a cons does not add
+   to the depth, so long lists are not mistaken for deep nesting.
+   max_alloc caps the bytes the decoder allocates for one message and
+   max_elements the elements validation walks; max_depth applies to
+   both.  Elements that take no input count against max_elements, or
+   against CPK_DEFAULT_MAX_UNBACKED when it is zero, in both. */
+typedef struct _cpk_limits {
+    uint32_t max_depth;
+    uint64_t max_elements;
+    uint32_t max_size;
+    uint64_t max_alloc;
+    uint32_t flags;
+} cpk_limits_t;
+
+/* Bump allocation in blocks, released all at once.  An input with an
+   arena decodes into it; such trees must not be passed to cpk_free or
+   cpk_free_r, and live until the arena is reset or finished. */
+
+#define CPK_ARENA_BLOCK 65536
+
+struct _cpk_arena_block;
+
+typedef struct _cpk_arena {
+    struct _cpk_arena_block *head;
+    size_t block_size;
+    void *last;
+} cpk_arena_t;
+
+void cpk_arena_init(cpk_arena_t *arena, size_t block_size);
+void cpk_arena_fini(cpk_arena_t *arena);
+void cpk_arena_reset(cpk_arena_t *arena);
+void* cpk_arena_alloc(cpk_arena_t *arena, size_t bytes);
+void* cpk_arena_realloc(cpk_arena_t *arena, void *ptr, size_t old_bytes,
+                        size_t bytes);
+
+/* Decode strings from a buffer as views into it rather than copies */
+#define CPK_DECODE_VIEWS 0x01
+
+/* Sum everything consumed, to be checked against the trailer
+   cpk_write_crc left; see cpk_read_crc */
+#define CPK_DECODE_CRC   0x02
+
+/* Give each string the cpk_hash_span of its encoding, and each
+   container the same over its encoding with the hash of every
+   container directly inside standing in for that container's bytes.
+   Equal subtrees hash alike however they were decoded, and each byte
+   is hashed once whatever the nesting.  Buffers only; descriptor input
+   leaves the hashes zero. */
+#define CPK_DECODE_HASH  0x04
+
+/* Strings longer than an input's threshold are not kept: their bytes
+   are passed to this in order, CPK_STRING_CHUNK at a time (less for the
+   last), with str holding the header and full size and offset the
+   position of chunk within it.  Buffer chunks point into the buffer.
+   A nonzero return stops decoding with CPK_ERR_ABORTED. */
+#define CPK_STRING_CHUNK 65536
+
+typedef int (*cpk_string_fn_t)(void *arg, const cpk_object_t *str,
+                               const uint8_t *chunk, size_t len,
+                               uint32_t offset);
+
 typedef struct _cpk_input {
     size_t buffer_size;
     size_t buffer_read;
     uint8_t *buffer;
 
     int fd;
+
+    const cpk_limits_t *limits;
+    uint64_t allocated;
+    uint64_t unbacked;
+    uint32_t depth;
+
+    cpk_stats_t *stats;
+    cpk_arena_t *arena;
+    uint32_t flags;
+    uint32_t crc;
+    size_t crc_pos;
+
+    struct _cpk_stage *stage;
+    struct _cpk_hash_level *hashing;
+
+    uint32_t string_threshold;
+    cpk_string_fn_t string_fn;
+    void *string_arg;
 } cpk_input_t;
 
 void cpk_input_init(cpk_input_t *in, uint8_t *data, size_t len);
 void cpk_input_init_fd(cpk_input_t *in, int fd);
+void cpk_input_fini(cpk_input_t *in);
+void cpk_input_set_limits(cpk_input_t *in, const cpk_limits_t *limits);
+void cpk_input_set_stats(cpk_input_t *in, cpk_stats_t *stats);
+void cpk_input_set_arena(cpk_input_t *in, cpk_arena_t *arena);
+void cpk_input_set_flags(cpk_input_t *in, uint32_t flags);
+void cpk_input_set_strings(cpk_input_t *in, uint32_t threshold,
+                           cpk_string_fn_t fn, void *arg);
+uint32_t cpk_input_crc(cpk_input_t *in);
 
 int cpk_read8(cpk_input_t *in, uint8_t *dest);
 int cpk_read16(cpk_input_t *in, uint16_t *dest);
 int cpk_read32(cpk_input_t *in, uint32_t *dest);
 int cpk_read64(cpk_input_t *in, uint64_t *dest);
 int cpk_read_bytes(cpk_input_t *in, uint8_t *dest, size_t len);
+int cpk_read_crc(cpk_input_t *in);
 
 uint8_t cpk_decode_header(uint8_t header);
 void cpk_decode(cpk_input_t *in, cpk_object_t *obj, int skip_header);
 cpk_object_t* cpk_decode_r(cpk_input_t *in);
 cpk_object_t* cpk_decode_rh(cpk_input_t *in, uint8_t header);
+cpk_object_t* cpk_decode_crc_r(cpk_input_t *in);
+cpk_object_t* cpk_decode_into(cpk_input_t *in, cpk_object_t *tree);
+const cpk_object_t* cpk_number_part(const cpk_object_t *obj, int i,
+                                    cpk_object_t *tmp);
+int cpk_skip(cpk_input_t *in, cpk_object_t *err);
 
 void cpk_free(cpk_object_t *obj);
 void cpk_free_r(cpk_object_t *obj);
 
- /* Explain */
+ /* Hashing */
+
+uint64_t cpk_hash64(uint64_t seed, const void *buf, size_t len);
+uint64_t cpk_hash_span(const uint8_t *buf, size_t len);
+
+ /* Validation */
+
+int cpk_validate(const uint8_t *buf, size_t len, const cpk_limits_t *limits);
+size_t cpk_validate_span(const uint8_t *buf, size_t len,
+                         const cpk_limits_t *limits, cpk_object_t *err);
+
+ /* Thread pool */
+
+typedef struct _cpk_pool cpk_pool_t;
+typedef void (*cpk_pool_fn_t)(void *arg, uint32_t thread);
+
+cpk_pool_t* cpk_pool_new(uint32_t nthreads);
+void cpk_pool_free(cpk_pool_t *pool);
+uint32_t cpk_pool_size(cpk_pool_t *pool);
+void cpk_pool_run(cpk_pool_t *pool, cpk_pool_fn_t fn, void *arg);
+
+ /* Rings */
+
+typedef struct _cpk_ring cpk_ring_t;
+
+cpk_ring_t* cpk_ring_new(uint32_t capacity);
+void cpk_ring_free(cpk_ring_t *ring);
+uint32_t cpk_ring_capacity(cpk_ring_t *ring);
+int cpk_ring_push(cpk_ring_t *ring, void *data);
+int cpk_ring_pop(cpk_ring_t *ring, void **data);
+uint32_t cpk_ring_depth(cpk_ring_t *ring);
+
+ /* Batches */
+
+/* Where each of a run of back-to-back messages lies in a buffer */
+typedef struct _cpk_span {
+    size_t offset;
+    size_t length;
+} cpk_span_t;
+
+typedef struct _cpk_frame {
+    size_t count;
+    size_t capacity;
+    cpk_span_t *spans;
+} cpk_frame_t;
+
+void cpk_frame_init(cpk_frame_t *frame);
+void cpk_frame_fini(cpk_frame_t *frame);
+int cpk_frame(cpk_frame_t *frame, const uint8_t *buf, size_t len,
+              const cpk_limits_t *limits, cpk_object_t *err);
+
+/* objs[i] is the tree for frame.spans[i], an error object if that
+   message failed to decode, or NULL if memory ran out.  The trees live
+   in the batch's per-thread arenas until the next cpk_decode_batch or
+   cpk_batch_fini, and must not be freed individually. */
+typedef struct _cpk_batch {
+    cpk_frame_t frame;
+    cpk_object_t **objs;
+
+    uint32_t narenas;
+    cpk_arena_t *arenas;
+} cpk_batch_t;
+
+void cpk_batch_init(cpk_batch_t *batch);
+void cpk_batch_fini(cpk_batch_t *batch);
+int cpk_decode_batch(cpk_batch_t *batch, cpk_pool_t *pool,
+                     const uint8_t *buf, size_t len,
+                     const cpk_limits_t *limits, cpk_object_t *err);
+
+ /* Pipeline */
+
+#define CPK_PIPELINE_SLOTS       8
+#define CPK_PIPELINE_READ        65536
+#define CPK_PIPELINE_MAX_MESSAGE (64 * 1024 * 1024)
+
+/* A framed message and, once a worker has decoded it, its tree (or an
+   error object).  The tree lives in the slot's arena and is gone once
+   the message is released back to the pipeline. */
+typedef struct _cpk_msg {
+    uint64_t seq;
+    cpk_object_t *obj;
+
+    uint8_t *data;
+    size_t len;
+    size_t cap;
+
+    cpk_arena_t arena;
+} cpk_msg_t;
+
+/* Stalls count waits, not the time spent waiting: the reader waiting
+   for a free slot (backpressure), workers waiting for input, and the
+   consumer waiting for a decoded message */
+typedef struct _cpk_pipeline_stats {
+    uint64_t messages;
+    uint64_t bytes;
+    uint64_t reads;
+
+    uint64_t reader_stalls;
+    uint64_t worker_stalls;
+    uint64_t consumer_stalls;
+
+    uint32_t work_depth;
+    uint32_t done_depth;
+    uint32_t max_work_depth;
+} cpk_pipeline_stats_t;
+
+typedef struct _cpk_pipeline cpk_pipeline_t;
+
+cpk_pipeline_t* cpk_pipeline_new(int fd, uint32_t workers, uint32_t slots,
+                                 const cpk_limits_t *limits);
+void cpk_pipeline_free(cpk_pipeline_t *p);
+cpk_msg_t* cpk_pipeline_next(cpk_pipeline_t *p);
+void cpk_pipeline_release(cpk_pipeline_t *p, cpk_msg_t *msg);
+const cpk_object_t* cpk_pipeline_error(cpk_pipeline_t *p);
+void cpk_pipeline_stats(cpk_pipeline_t *p, cpk_pipeline_stats_t *stats);
+
+ /* Shared memory */
+
+/* A single-producer, single-consumer message ring in a memfd that two
+   processes map; see shm.c */
+typedef struct _cpk_shm cpk_shm_t;
+
+cpk_shm_t* cpk_shm_create(size_t capacity);
+cpk_shm_t* cpk_shm_attach(int fd);
+int cpk_shm_fd(cpk_shm_t *shm);
+int cpk_shm_closed(cpk_shm_t *shm);
+void cpk_shm_close(cpk_shm_t *shm);
+
+int cpk_shm_begin(cpk_shm_t *shm, cpk_output_t *out, size_t min_bytes,
+                  int timeout_ms);
+int cpk_shm_commit(cpk_shm_t *shm, cpk_output_t *out);
+
+int cpk_shm_next(cpk_shm_t *shm, cpk_input_t *in, int timeout_ms);
+void cpk_shm_done(cpk_shm_t *shm);
+
+ /* Checksums */
+
+uint32_t cpk_crc32c(uint32_t crc, const void *buf, size_t len);
+uint32_t cpk_crc32c_combine(uint32_t crc1, uint32_t crc2, uint64_t len2);
+
+ /* Record files */
+
+/* Messages appended to a file, each behind a length prefix (and a
+   CRC-32C with CPK_RECFILE_CRC); closing the writer adds an index of
+   every stride'th record's offset, so the reader finds record n
+   without decoding anything before it.  See recfile.c. */
+#define CPK_RECFILE_CRC    0x01  /* writer: checksum every record */
+#define CPK_RECFILE_APPEND 0x02  /* writer: extend an existing file */
+#define CPK_RECFILE_VERIFY 0x04  /* reader: check checksums on access */
+
+#define CPK_RECFILE_STRIDE 16
+
+typedef struct _cpk_recwriter cpk_recwriter_t;
+
+cpk_recwriter_t* cpk_recwriter_open(const char *path, uint32_t flags,
+                                    uint32_t stride);
+int cpk_recwriter_close(cpk_recwriter_t *w);
+uint64_t cpk_recwriter_count(cpk_recwriter_t *w);
+
+cpk_output_t* cpk_recwriter_begin(cpk_recwriter_t *w);
+int cpk_recwriter_commit(cpk_recwriter_t *w);
+void cpk_recwriter_cancel(cpk_recwriter_t *w);
+int cpk_recwriter_append(cpk_recwriter_t *w, const uint8_t *data,
+                         size_t len);
+int cpk_recwriter_flush(cpk_recwriter_t *w);
+
+typedef struct _cpk_recfile cpk_recfile_t;
+
+/* Called for record n with an input over its payload; nonzero stops
+   the scan.  thread is as for cpk_pool_fn_t. */
+typedef int (*cpk_record_fn_t)(void *arg, uint32_t thread, uint64_t n,
+                               cpk_input_t *in);
+
+cpk_recfile_t* cpk_recfile_open(const char *path, uint32_t flags);
+void cpk_recfile_close(cpk_recfile_t *rf);
+uint64_t cpk_recfile_count(cpk_recfile_t *rf);
+
+int cpk_recfile_get(cpk_recfile_t *rf, uint64_t n, cpk_input_t *in,
+                    cpk_object_t *err);
+int cpk_recfile_scan(cpk_recfile_t *rf, cpk_pool_t *pool,
+                     uint64_t start, uint64_t end,
+                     cpk_record_fn_t fn, void *arg, cpk_object_t *err);
+
+ /* File ingestion */
+
+/* Reads whole files into pooled, aligned buffers, through batched
+   io_uring submissions where the kernel allows them and with pread on
+   the pool where it does not, and hands each to a callback on a pool
+   thread; see ingest.c */
+#define CPK_INGEST_DIRECT   0x01  /* read with O_DIRECT where allowed */
+#define CPK_INGEST_NO_URING 0x02  /* always use the pread path */
+
+#define CPK_INGEST_DEPTH    64
+#define CPK_INGEST_ALIGN    4096
+#define CPK_INGEST_MAX_FILE (1024 * 1024 * 1024)
+
+/* uring says whether reads go through io_uring */
+typedef struct _cpk_ingest_stats {
+    uint64_t files;
+    uint64_t failed;
+    uint64_t bytes;
+    uint64_t reads;
+    uint64_t submits;
+    int uring;
+} cpk_ingest_stats_t;
+
+typedef struct _cpk_ingest cpk_ingest_t;
+
+/* Called for paths[n] with an input over its contents, valid until fn
+   returns, or with in NULL and err saying why the file could not be
+   read (CPK_ERR_IO with the errno as its value, or CPK_ERR_LIMIT past
+   CPK_INGEST_MAX_FILE); nonzero stops the run.  thread is as for
+   cpk_pool_fn_t. */
+typedef int (*cpk_file_fn_t)(void *arg, uint32_t thread, size_t n,
+                             cpk_input_t *in, const cpk_object_t *err);
+
+cpk_ingest_t* cpk_ingest_new(uint32_t depth, uint32_t flags);
+void cpk_ingest_free(cpk_ingest_t *ig);
+int cpk_ingest_run(cpk_ingest_t *ig, cpk_pool_t *pool,
+                   const char *const *paths, size_t count,
+                   cpk_file_fn_t fn, void *arg, cpk_object_t *err);
+void cpk_ingest_stats(cpk_ingest_t *ig, cpk_ingest_stats_t *stats);
+
+ /* Decode cache */
+
+/* Decoded trees shared between callers, keyed by the bytes they were
+   decoded from and evicted least recently used first; see cache.c */
+#define CPK_CACHE_BYTES  (64 * 1024 * 1024)
+#define CPK_CACHE_SHARDS 16
+
+/* uncached counts trees returned without being kept because they
+   were too big; entries and bytes are what the cache holds now */
+typedef struct _cpk_cache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t uncached;
+
+    uint64_t entries;
+    uint64_t bytes;
+} cpk_cache_stats_t;
+
+typedef struct _cpk_cache cpk_cache_t;
+typedef struct _cpk_cache_ref cpk_cache_ref_t;
+
+cpk_cache_t* cpk_cache_new(size_t max_bytes, uint32_t shards,
+                           const cpk_limits_t *limits);
+void cpk_cache_free(cpk_cache_t *cache);
+void cpk_cache_clear(cpk_cache_t *cache);
+void cpk_cache_stats(cpk_cache_t *cache, cpk_cache_stats_t *stats);
+
+cpk_cache_ref_t* cpk_cache_decode(cpk_cache_t *cache, const uint8_t *buf,
+                                  size_t len, cpk_object_t *err);
+const cpk_object_t* cpk_cache_tree(cpk_cache_ref_t *ref);
+void cpk_cache_release(cpk_cache_ref_t *ref);
+
+ /* Compression */
+
+/* A codec compresses one block at a time with no state carried between
+   blocks.  compress returns the compressed length, or 0 if the result
+   would not fit in dst_len (the block is then stored as is).
+   decompress returns 0 only if it produced exactly dst_len bytes. */
+typedef struct _cpk_codec {
+    uint8_t id;
+    const char *name;
+
+    size_t (*bound)(size_t len);
+    size_t (*compress)(uint8_t *dst, size_t dst_len,
+                       const uint8_t *src, size_t len, int level);
+    int (*decompress)(uint8_t *dst, size_t dst_len,
+                      const uint8_t *src, size_t len);
+} cpk_codec_t;
+
+#define CPK_CODEC_NONE 0
+#define CPK_CODEC_LZ   1
+#define CPK_CODEC_ZLIB 2
+
+const cpk_codec_t* cpk_codec(uint8_t id);
+
+/* A staged output or input compresses or expands the stream in blocks
+   of block_size between the encoder and a descriptor; decoding treats
+   it as descriptor input.  Memory is a block plus its compressed form,
+   and since every block stands alone, a whole stream in memory can be
+   expanded across a pool with cpk_stage_expand.  See stage.c. */
+#define CPK_STAGE_BLOCK     65536
+#define CPK_STAGE_MAX_BLOCK (64 * 1024 * 1024)
+
+int cpk_output_init_stage(cpk_output_t *out, int fd, const cpk_codec_t *codec,
+                          size_t block_size, int level);
+int cpk_output_flush(cpk_output_t *out);
+int cpk_input_init_stage(cpk_input_t *in, int fd);
+
+int cpk_stage_expand(cpk_pool_t *pool, const uint8_t *src, size_t len,
+                     uint8_t **dst, size_t *dst_len);
+
+ /* Parallel encoding */
+
+/* Encodes entries [start, end) of a container to out; nonzero aborts */
+typedef int (*cpk_encode_range_fn_t)(cpk_output_t *out, void *arg,
+                                     uint64_t start, uint64_t end);
+
+int cpk_encode_container_parallel(cpk_output_t *out, cpk_pool_t *pool,
+                                  uint8_t type, uint32_t size,
+                                  uint8_t fixed_header,
+                                  cpk_encode_range_fn_t fn, void *arg);
+
+ /* Explain */
 
 extern const char *CPK_BOOL_STR;
 extern const char *CPK_NIL_STR;
@@ -309,6 +889,7 @@ extern const char *CPK_TRUE_STR;
 extern const char *CPK_NUMBER_STR;
 extern const char *CPK_STRING_STR;
 extern const char *CPK_REF_STR;
+extern const char *CPK_POINTER_STR;
 extern const char *CPK_REMOTE_REF_STR;
 extern const char *CPK_TAG_STR;
 extern const char *CPK_CONS_STR;
@@ -331,7 +912,98 @@ extern const char *CPK_SINGLE_FLOAT_STR;
 extern const char *CPK_DOUBLE_FLOAT_STR;
 extern const char *CPK_COMPLEX_STR;
 extern const char *CPK_RATIONAL_STR;
+extern const char *CPK_ERROR_STR;
+
+/* Receives explain output in order; nonzero stops it */
+typedef int (*cpk_sink_fn_t)(void *arg, const uint8_t *data, size_t len);
+
+/* Zero in any field means no limit.  Values nested deeper than
+   max_depth print as "...", and containers and strings past
+   max_elements or max_string bytes say how much was left out. */
+typedef struct _cpk_explain_opts {
+    uint32_t max_depth;
+    uint32_t max_elements;
+    uint32_t max_string;
+} cpk_explain_opts_t;
 
 void cpk_explain_object(cpk_output_t *out, cpk_object_t *obj);
+int cpk_explain_sink(cpk_object_t *obj, const cpk_explain_opts_t *opts,
+                     cpk_sink_fn_t fn, void *arg);
+int cpk_explain_fd(int fd, cpk_object_t *obj,
+                   const cpk_explain_opts_t *opts);
+
+ /* JSON */
+
+/* Transcodes the next value from an input to JSON text without
+   decoding it into a tree; json.c lists how each type is written */
+int cpk_to_json(cpk_input_t *in, cpk_sink_fn_t fn, void *arg,
+                cpk_object_t *err);
+int cpk_to_json_fd(cpk_input_t *in, int fd, cpk_object_t *err);
+
+/* Tag each distinct object key the first time it is written and use
+   a ref to the tag after that */
+#define CPK_JSON_TAG_KEYS 0x01
+
+/* Encodes one JSON text to out without building a tree; json.c lists
+   how each type is written.  Malformed text fails with CPK_ERR_SYNTAX. */
+int cpk_from_json(cpk_output_t *out, const char *json, size_t len,
+                  uint32_t flags, cpk_object_t *err);
+
+ /* Typed maps */
+
+/* How a registered struct's field is filled from a tmap value.  Sizes
+   come from the field: integers and booleans are stored at its width,
+   a float field of 8 bytes is a double, and a string is copied with
+   its NUL into a char array, which it must fit. */
+#define CPK_FIELD_INT    0x01
+#define CPK_FIELD_UINT   0x02
+#define CPK_FIELD_FLOAT  0x03
+#define CPK_FIELD_BOOL   0x04
+#define CPK_FIELD_CHARS  0x05
+#define CPK_FIELD_STRUCT 0x06   /* a nested tmap of field type */
+#define CPK_FIELD_OBJECT 0x07   /* anything, as a cpk_object_t* tree */
+
+#define CPK_TYPE_FIELDS   64
+#define CPK_TYPE_NAME_MAX 128
+
+typedef struct _cpk_field {
+    const char *name;
+    size_t offset;
+    size_t size;
+    uint8_t kind;
+    const struct _cpk_type *type;
+} cpk_field_t;
+
+/* name is matched against the tmap's type object: a symbol's name,
+   keyword or not, or a string */
+typedef struct _cpk_type {
+    const char *name;
+    const cpk_field_t *fields;
+    uint32_t nfields;
+    size_t size;
+} cpk_type_t;
+
+#define CPK_FIELD_KEY(type, field, key, kind) \
+    { (key), offsetof(type, field), sizeof(((type*)0)->field), (kind), NULL }
+#define CPK_FIELD(type, field, kind) \
+    CPK_FIELD_KEY(type, field, #field, kind)
+#define CPK_FIELD_NESTED(type, field, key, nested) \
+    { (key), offsetof(type, field), sizeof(((type*)0)->field), \
+      CPK_FIELD_STRUCT, &(nested) }
+
+typedef struct _cpk_registry cpk_registry_t;
+
+cpk_registry_t* cpk_registry_new(void);
+void cpk_registry_free(cpk_registry_t *reg);
+int cpk_registry_add(cpk_registry_t *reg, const cpk_type_t *type);
+
+const cpk_type_t* cpk_decode_struct(cpk_input_t *in,
+                                    const cpk_registry_t *reg,
+                                    void *dest, size_t size,
+                                    cpk_object_t *err);
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif /* CONSPACK_H */
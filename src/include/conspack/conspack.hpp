@@ -0,0 +1,787 @@
+/*
+ * libconspack
+ * Copyright (C) 2012  Ryan Pavlik
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the GNU Lesser General Public
+ * License (LGPL) version 2.1 which accompanies this distribution, and
+ * is available at http://www.gnu.org/licenses/lgpl-2.1.html
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ */
+
+#ifndef CONSPACK_HPP
+#define CONSPACK_HPP
+
+/*
+ * C++17 layer over conspack.h, all in this header.
+ *
+ * Decoding gives a tree, which owns what cpk_decode_r returned, and
+ * values, which only look at it.  Failures come back the way the C
+ * API has them, as error objects, so nothing here throws.
+ *
+ *     cpk::input in(buf, len);
+ *     cpk::tree t = in.decode();
+ *     if(!t) return t.root().error_reason();
+ *     for(auto [k, v] : t.root().pairs()) ...
+ *
+ * Encoding goes through cpk::encoder<T>, specialised for bool,
+ * integers, floats, strings, std::array, std::pair, std::tuple,
+ * std::vector and std::map/std::unordered_map.  A struct gets one by
+ * declaring a cpk_fields() next to it that ties its members:
+ *
+ *     inline auto cpk_fields(const point &p) { return std::tie(p.x, p.y); }
+ *
+ * Types whose encoding has the same length every time (numbers, and
+ * arrays, tuples and structs of them) have that length as fixed_size
+ * and are written from a stack buffer in one piece.  Arrays and
+ * tuples whose elements share a number type use a fixed-header
+ * vector, which carries the header once.
+ */
+
+#if __cplusplus < 201703L
+#  error "conspack.hpp needs C++17"
+#endif
+
+#include "conspack.h"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <map>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace cpk {
+
+ /* Views */
+
+template<class T>
+class span {
+public:
+    constexpr span() noexcept : data_(nullptr), size_(0) { }
+    constexpr span(T *data, size_t size) noexcept
+        : data_(data), size_(size) { }
+
+    constexpr T* data() const noexcept { return data_; }
+    constexpr size_t size() const noexcept { return size_; }
+    constexpr bool empty() const noexcept { return !size_; }
+    constexpr T* begin() const noexcept { return data_; }
+    constexpr T* end() const noexcept { return data_ + size_; }
+    constexpr T& operator[](size_t i) const noexcept { return data_[i]; }
+
+private:
+    T *data_;
+    size_t size_;
+};
+
+class value;
+
+namespace detail {
+
+/* Walks a container's object array, step objects at a time */
+template<class Ref, size_t Step>
+class object_iterator {
+public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = Ref;
+    using difference_type = std::ptrdiff_t;
+    using pointer = void;
+    using reference = Ref;
+
+    object_iterator() noexcept : p_(nullptr) { }
+    explicit object_iterator(cpk_object_t *const *p) noexcept : p_(p) { }
+
+    Ref operator*() const noexcept;
+
+    object_iterator& operator++() noexcept {
+        p_ += Step;
+        return *this;
+    }
+
+    object_iterator operator++(int) noexcept {
+        object_iterator old = *this;
+        p_ += Step;
+        return old;
+    }
+
+    bool operator==(const object_iterator &o) const noexcept {
+        return p_ == o.p_;
+    }
+
+    bool operator!=(const object_iterator &o) const noexcept {
+        return p_ != o.p_;
+    }
+
+private:
+    cpk_object_t *const *p_;
+};
+
+template<class It>
+class range {
+public:
+    range(It b, It e, size_t n) noexcept : b_(b), e_(e), n_(n) { }
+
+    It begin() const noexcept { return b_; }
+    It end() const noexcept { return e_; }
+    size_t size() const noexcept { return n_; }
+    bool empty() const noexcept { return !n_; }
+
+private:
+    It b_, e_;
+    size_t n_;
+};
+
+} /* namespace detail */
+
+/* A look at one object in a tree; valid as long as the tree.  Asking
+   the wrong kind of value for something gives an empty answer rather
+   than undefined behaviour. */
+class value {
+public:
+    using element_iterator = detail::object_iterator<value, 1>;
+    using pair_iterator =
+        detail::object_iterator<std::pair<value, value>, 2>;
+
+    value() noexcept : obj_(nullptr) { }
+    explicit value(const cpk_object_t *obj) noexcept : obj_(obj) { }
+
+    const cpk_object_t* get() const noexcept { return obj_; }
+    explicit operator bool() const noexcept { return obj_ != nullptr; }
+
+    int16_t header() const noexcept { return obj_ ? obj_->header : CPK_ERROR; }
+
+    /* CPK_NUMBER, CPK_STRING...; CPK_INVALID for errors */
+    uint8_t kind() const noexcept {
+        return is_error() ? CPK_INVALID
+                          : cpk_decode_header((uint8_t)obj_->header);
+    }
+
+    bool is_error() const noexcept {
+        return !obj_ || CPK_IS_ERROR(obj_->header);
+    }
+
+    bool is_nil() const noexcept { return kind() == CPK_BOOL && !obj_->header; }
+    bool is_true() const noexcept { return kind() == CPK_BOOL && obj_->header; }
+    bool is_number() const noexcept { return kind() == CPK_NUMBER; }
+    bool is_string() const noexcept { return kind() == CPK_STRING; }
+    bool is_container() const noexcept { return kind() == CPK_CONTAINER; }
+    bool is_map() const noexcept { return is_container() && (info() & CPK_HD_MAP); }
+    bool is_tmap() const noexcept { return is_container() && (info() & CPK_HD_TMAP); }
+    bool is_symbol() const noexcept { return kind() == CPK_SYMBOL; }
+
+    /* Numbers, by their C type */
+    uint8_t number_type() const noexcept {
+        return is_number() ? CPK_NUMBER_TYPE(obj_->header) : CPK_INVALID;
+    }
+
+    /* Integers that fit, whatever width they were sent at */
+    std::optional<int64_t> to_int64() const noexcept {
+        const auto &v = obj_->number.val;
+
+        switch(number_type()) {
+            case CPK_INT8:   return v.int8;
+            case CPK_INT16:  return v.int16;
+            case CPK_INT32:  return v.int32;
+            case CPK_INT64:  return v.int64;
+            case CPK_UINT8:  return v.uint8;
+            case CPK_UINT16: return v.uint16;
+            case CPK_UINT32: return v.uint32;
+            case CPK_UINT64:
+                if(v.uint64 <= (uint64_t)INT64_MAX) return (int64_t)v.uint64;
+        }
+
+        return std::nullopt;
+    }
+
+    std::optional<uint64_t> to_uint64() const noexcept {
+        if(number_type() == CPK_UINT64) return obj_->number.val.uint64;
+
+        auto i = to_int64();
+        if(i && *i >= 0) return (uint64_t)*i;
+
+        return std::nullopt;
+    }
+
+    /* Any real number, rounded if it has to be */
+    std::optional<double> to_double() const noexcept {
+        switch(number_type()) {
+            case CPK_SINGLE_FLOAT: return obj_->number.val.single_float;
+            case CPK_DOUBLE_FLOAT: return obj_->number.val.double_float;
+            case CPK_UINT64:       return (double)obj_->number.val.uint64;
+        }
+
+        if(auto i = to_int64()) return (double)*i;
+
+        return std::nullopt;
+    }
+
+    /* String bytes; empty for anything else, and for strings that
+       went to a string callback */
+    std::string_view str() const noexcept {
+        if(!is_string() || !obj_->string.data) return std::string_view();
+
+        return std::string_view((const char*)obj_->string.data,
+                                obj_->string.size);
+    }
+
+    span<const uint8_t> bytes() const noexcept {
+        if(!is_string() || !obj_->string.data) return span<const uint8_t>();
+
+        return span<const uint8_t>(obj_->string.data, obj_->string.size);
+    }
+
+    /* Elements, counting keys and values for maps and the type for
+       tmaps, as the container holds them */
+    size_t size() const noexcept {
+        return is_container() ? obj_->container.size : 0;
+    }
+
+    value operator[](size_t i) const noexcept {
+        return i < size() ? value(obj_->container.obj[i]) : value();
+    }
+
+    detail::range<element_iterator> elements() const noexcept {
+        cpk_object_t *const *p = objects();
+        return detail::range<element_iterator>(element_iterator(p),
+                                               element_iterator(p + size()),
+                                               size());
+    }
+
+    /* Key/value pairs of a map or tmap; empty otherwise */
+    detail::range<pair_iterator> pairs() const noexcept {
+        size_t skip = is_tmap(), n = is_map() ? (size() - skip) / 2 : 0;
+        cpk_object_t *const *p = objects() + skip;
+
+        return detail::range<pair_iterator>(pair_iterator(p),
+                                            pair_iterator(p + 2 * n), n);
+    }
+
+    value tmap_type() const noexcept {
+        return is_tmap() ? value(obj_->container.obj[0]) : value();
+    }
+
+    /* The value for the first string or symbol key named key */
+    value find(std::string_view key) const noexcept {
+        for(auto [k, v] : pairs()) {
+            if(k.str() == key || (k.is_symbol() && k.name() == key))
+                return v;
+        }
+
+        return value();
+    }
+
+    /* Symbols and packages by name */
+    std::string_view name() const noexcept {
+        switch(kind()) {
+            case CPK_SYMBOL:  return value(obj_->symbol.name).str();
+            case CPK_PACKAGE: return value(obj_->package.name).str();
+        }
+
+        return std::string_view();
+    }
+
+    value package() const noexcept {
+        return is_symbol() ? value(obj_->symbol.package) : value();
+    }
+
+    value car() const noexcept {
+        return kind() == CPK_CONS ? value(obj_->cons.car) : value();
+    }
+
+    value cdr() const noexcept {
+        return kind() == CPK_CONS ? value(obj_->cons.cdr) : value();
+    }
+
+    /* The object a tag or remote ref wraps */
+    value target() const noexcept {
+        switch(kind()) {
+            case CPK_TAG:        return value(obj_->tag.obj);
+            case CPK_REMOTE_REF: return value(obj_->rref.val);
+        }
+
+        return value();
+    }
+
+    /* Tag, ref, pointer and index numbers */
+    std::optional<uint32_t> id() const noexcept {
+        switch(kind()) {
+            case CPK_TAG:     return obj_->tag.val;
+            case CPK_REF:
+            case CPK_POINTER:
+            case CPK_INDEX:   return obj_->ref.val;
+        }
+
+        return std::nullopt;
+    }
+
+    uint32_t error_code() const noexcept {
+        return obj_ && CPK_IS_ERROR(obj_->header) ? obj_->error.code
+                                                  : CPK_ERR_ALLOC;
+    }
+
+    const char* error_reason() const noexcept {
+        if(!obj_) return CPK_ERR_ALLOC_MSG;
+        return CPK_IS_ERROR(obj_->header) ? obj_->error.reason : nullptr;
+    }
+
+    size_t error_pos() const noexcept {
+        return obj_ && CPK_IS_ERROR(obj_->header) ? obj_->error.pos : 0;
+    }
+
+private:
+    uint8_t info() const noexcept {
+        return cpk_header_table[(uint8_t)obj_->header].flags;
+    }
+
+    cpk_object_t *const * objects() const noexcept {
+        return is_container() ? obj_->container.obj : nullptr;
+    }
+
+    const cpk_object_t *obj_;
+};
+
+namespace detail {
+
+template<class Ref, size_t Step>
+inline Ref object_iterator<Ref, Step>::operator*() const noexcept {
+    if constexpr(Step == 1)
+        return Ref(*p_);
+    else
+        return Ref(value(p_[0]), value(p_[1]));
+}
+
+} /* namespace detail */
+
+ /* Owners */
+
+/* A decoded tree, freed with cpk_free_r when dropped.  A failed
+   decode still gives a tree, holding the error object. */
+class tree {
+public:
+    tree() noexcept : obj_(nullptr) { }
+    explicit tree(cpk_object_t *obj) noexcept : obj_(obj) { }
+    tree(tree &&o) noexcept : obj_(o.release()) { }
+    ~tree() { cpk_free_r(obj_); }
+
+    tree(const tree&) = delete;
+    tree& operator=(const tree&) = delete;
+
+    tree& operator=(tree &&o) noexcept {
+        if(this != &o) reset(o.release());
+        return *this;
+    }
+
+    /* True unless empty or an error */
+    explicit operator bool() const noexcept {
+        return obj_ && !CPK_IS_ERROR(obj_->header);
+    }
+
+    value root() const noexcept { return value(obj_); }
+    cpk_object_t* get() const noexcept { return obj_; }
+
+    cpk_object_t* release() noexcept {
+        cpk_object_t *obj = obj_;
+        obj_ = nullptr;
+        return obj;
+    }
+
+    void reset(cpk_object_t *obj = nullptr) noexcept {
+        cpk_free_r(obj_);
+        obj_ = obj;
+    }
+
+private:
+    cpk_object_t *obj_;
+};
+
+/* Decodes from a buffer, which must outlive the input and, with
+   CPK_DECODE_VIEWS, the trees too, or from a descriptor */
+class input {
+public:
+    input(const void *data, size_t len) noexcept {
+        cpk_input_init(&in_, (uint8_t*)const_cast<void*>(data), len);
+    }
+
+    explicit input(int fd) noexcept { cpk_input_init_fd(&in_, fd); }
+    ~input() { cpk_input_fini(&in_); }
+
+    input(const input&) = delete;
+    input& operator=(const input&) = delete;
+
+    tree decode() noexcept { return tree(cpk_decode_r(&in_)); }
+
+    /* Decodes over t, reusing its nodes where the shape still matches */
+    void decode_into(tree &t) noexcept {
+        t = tree(cpk_decode_into(&in_, t.release()));
+    }
+
+    bool done() const noexcept {
+        return in_.fd < 0 && in_.buffer_read >= in_.buffer_size;
+    }
+
+    cpk_input_t* get() noexcept { return &in_; }
+
+private:
+    cpk_input_t in_;
+};
+
+/* A growing buffer, or a descriptor */
+class output {
+public:
+    output() noexcept { cpk_output_init(&out_); }
+    explicit output(int fd) noexcept { cpk_output_init_fd(&out_, fd); }
+    ~output() { cpk_output_fini(&out_); }
+
+    output(output &&o) noexcept : out_(o.out_) { cpk_output_init(&o.out_); }
+
+    output(const output&) = delete;
+    output& operator=(const output&) = delete;
+    output& operator=(output&&) = delete;
+
+    const uint8_t* data() const noexcept { return out_.buffer; }
+    size_t size() const noexcept { return out_.buffer_used; }
+
+    span<const uint8_t> bytes() const noexcept {
+        return span<const uint8_t>(out_.buffer, out_.buffer_used);
+    }
+
+    /* False once a write has failed */
+    bool ok() const noexcept { return !(out_.flags & CPK_OUTPUT_OVERFLOW); }
+
+    void clear() noexcept { cpk_output_clear(&out_); }
+    cpk_output_t* get() noexcept { return &out_; }
+
+private:
+    cpk_output_t out_;
+};
+
+ /* Encoding */
+
+/* encoder<T> has
+
+     fixed_size         bytes every value takes, or 0 if it varies
+     put(p, v)          for fixed_size types: write v at p, return
+                        the end
+     encode(out, v)     write v to out
+
+   and numbers also have header, and put_payload to write the value
+   without it. */
+template<class T, class = void>
+struct encoder;
+
+namespace detail {
+
+template<size_t N>
+inline uint8_t* put_be(uint8_t *p, uint64_t v) noexcept {
+    for(size_t i = N; i > 0; i--, v >>= 8)
+        p[i - 1] = (uint8_t)v;
+
+    return p + N;
+}
+
+template<class T>
+constexpr uint8_t number_type() noexcept {
+    if constexpr(std::is_same_v<T, float>)
+        return CPK_SINGLE_FLOAT;
+    else if constexpr(std::is_same_v<T, double>)
+        return CPK_DOUBLE_FLOAT;
+    else if constexpr(sizeof(T) == 1)
+        return std::is_signed_v<T> ? CPK_INT8 : CPK_UINT8;
+    else if constexpr(sizeof(T) == 2)
+        return std::is_signed_v<T> ? CPK_INT16 : CPK_UINT16;
+    else if constexpr(sizeof(T) == 4)
+        return std::is_signed_v<T> ? CPK_INT32 : CPK_UINT32;
+    else
+        return std::is_signed_v<T> ? CPK_INT64 : CPK_UINT64;
+}
+
+/* Bytes in the header and size field of a container of n */
+constexpr size_t size_header(size_t n) noexcept {
+    return n <= UINT8_MAX ? 2 : n <= UINT16_MAX ? 3 : 5;
+}
+
+inline uint8_t* put_size_header(uint8_t *p, uint8_t header,
+                                size_t n) noexcept {
+    if(n <= UINT8_MAX) {
+        *p++ = header | CPK_SIZE_8;
+        return put_be<1>(p, n);
+    } else if(n <= UINT16_MAX) {
+        *p++ = header | CPK_SIZE_16;
+        return put_be<2>(p, n);
+    }
+
+    *p++ = header | CPK_SIZE_32;
+    return put_be<4>(p, n);
+}
+
+template<class T, class = void>
+struct has_header : std::false_type { };
+
+template<class T>
+struct has_header<T, std::void_t<decltype(encoder<T>::header)>>
+    : std::true_type { };
+
+template<class T>
+constexpr int header_of() noexcept {
+    if constexpr(has_header<T>::value)
+        return encoder<T>::header;
+    else
+        return -1;
+}
+
+/* Element types sharing one number header may use a fixed-header
+   container, which writes only their payloads */
+template<class... Ts>
+constexpr bool same_number() noexcept {
+    if constexpr(sizeof...(Ts) == 0) {
+        return false;
+    } else {
+        constexpr int h[] = { header_of<Ts>()... };
+
+        for(int x : h)
+            if(x < 0 || x != h[0]) return false;
+
+        return true;
+    }
+}
+
+/* std::array, std::pair and std::tuple alike */
+template<class Tuple, class... Ts>
+struct tuple_encoder {
+    static constexpr size_t count = sizeof...(Ts);
+    static constexpr bool fixed = same_number<Ts...>();
+    static constexpr size_t head = size_header(count) + (fixed ? 1 : 0);
+
+    static constexpr size_t fixed_size =
+        !count ? 2
+        : ((encoder<Ts>::fixed_size && ...) == false) ? 0
+        : fixed ? head + ((encoder<Ts>::fixed_size - 1) + ... + 0)
+        : head + (encoder<Ts>::fixed_size + ... + 0);
+
+    static uint8_t* put(uint8_t *p, const Tuple &v) noexcept {
+        p = put_size_header(p, CPK_CONTAINER | CPK_CONTAINER_VECTOR |
+                            (fixed ? CPK_CONTAINER_FIXED : 0), count);
+
+        return std::apply([&](const auto &...e) {
+            if constexpr(fixed) {
+                *p++ = encoder<std::decay_t<std::tuple_element_t<0, Tuple>>>::header;
+                ((p = encoder<std::decay_t<decltype(e)>>::put_payload(p, e)),
+                 ...);
+            } else {
+                ((p = encoder<std::decay_t<decltype(e)>>::put(p, e)), ...);
+            }
+            return p;
+        }, v);
+    }
+
+    static void encode(cpk_output_t *out, const Tuple &v) {
+        if constexpr(fixed_size != 0) {
+            uint8_t buf[fixed_size];
+            cpk_write_bytes(out, buf, put(buf, v) - buf);
+        } else {
+            cpk_encode_container(out, CPK_CONTAINER_VECTOR, count, 0);
+            std::apply([out](const auto &...e) {
+                (encoder<std::decay_t<decltype(e)>>::encode(out, e), ...);
+            }, v);
+        }
+    }
+};
+
+template<class T, size_t>
+using repeat = T;
+
+template<class T, size_t... I>
+auto array_encoder_for(std::index_sequence<I...>)
+    -> tuple_encoder<std::array<T, sizeof...(I)>, repeat<T, I>...>;
+
+template<class T, class = void>
+struct has_fields : std::false_type { };
+
+template<class T>
+struct has_fields<T, std::void_t<decltype(cpk_fields(std::declval<const T&>()))>>
+    : std::true_type { };
+
+/* A map from any iterable of pairs */
+template<class Map>
+struct map_encoder {
+    static constexpr size_t fixed_size = 0;
+
+    static void encode(cpk_output_t *out, const Map &m) {
+        using K = std::decay_t<typename Map::key_type>;
+        using V = std::decay_t<typename Map::mapped_type>;
+
+        cpk_encode_container(out, CPK_CONTAINER_MAP, (uint32_t)m.size(), 0);
+        for(const auto &[k, v] : m) {
+            encoder<K>::encode(out, k);
+            encoder<V>::encode(out, v);
+        }
+    }
+};
+
+} /* namespace detail */
+
+template<>
+struct encoder<bool> {
+    static constexpr size_t fixed_size = 1;
+
+    static uint8_t* put(uint8_t *p, bool v) noexcept {
+        *p = v ? CPK_TRUE : CPK_NIL;
+        return p + 1;
+    }
+
+    static void encode(cpk_output_t *out, bool v) {
+        cpk_write8(out, v ? CPK_TRUE : CPK_NIL);
+    }
+};
+
+template<class T>
+struct encoder<T, std::enable_if_t<std::is_arithmetic_v<T> &&
+                                   !std::is_same_v<T, bool>>> {
+    static_assert(sizeof(T) <= 8 && (std::is_integral_v<T> ||
+                  std::is_same_v<T, float> || std::is_same_v<T, double>),
+                  "no conspack number type for T");
+
+    static constexpr uint8_t header =
+        CPK_NUMBER | detail::number_type<T>();
+    static constexpr size_t fixed_size = 1 + sizeof(T);
+
+    static uint8_t* put_payload(uint8_t *p, T v) noexcept {
+        uint64_t bits = 0;
+
+        if constexpr(std::is_floating_point_v<T>) {
+            std::conditional_t<sizeof(T) == 4, uint32_t, uint64_t> raw;
+            std::memcpy(&raw, &v, sizeof(T));
+            bits = raw;
+        } else {
+            bits = (uint64_t)v;
+        }
+
+        return detail::put_be<sizeof(T)>(p, bits);
+    }
+
+    static uint8_t* put(uint8_t *p, T v) noexcept {
+        *p = header;
+        return put_payload(p + 1, v);
+    }
+
+    static void encode(cpk_output_t *out, T v) {
+        uint8_t buf[fixed_size];
+        cpk_write_bytes(out, buf, put(buf, v) - buf);
+    }
+};
+
+template<>
+struct encoder<std::string_view> {
+    static constexpr size_t fixed_size = 0;
+
+    static void encode(cpk_output_t *out, std::string_view v) {
+        cpk_encode_string_bytes(out, (const uint8_t*)v.data(),
+                                (uint32_t)v.size());
+    }
+};
+
+template<>
+struct encoder<std::string> : encoder<std::string_view> { };
+
+template<>
+struct encoder<const char*> : encoder<std::string_view> { };
+
+template<>
+struct encoder<char*> : encoder<std::string_view> { };
+
+template<class... Ts>
+struct encoder<std::tuple<Ts...>>
+    : detail::tuple_encoder<std::tuple<Ts...>, std::decay_t<Ts>...> { };
+
+template<class A, class B>
+struct encoder<std::pair<A, B>>
+    : detail::tuple_encoder<std::pair<A, B>, std::decay_t<A>,
+                            std::decay_t<B>> { };
+
+template<class T, size_t N>
+struct encoder<std::array<T, N>>
+    : decltype(detail::array_encoder_for<T>(std::make_index_sequence<N>())) { };
+
+/* Vectors of one number type go out as fixed-header containers, their
+   payloads written a few hundred bytes at a time */
+template<class T, class A>
+struct encoder<std::vector<T, A>> {
+    static constexpr size_t fixed_size = 0;
+
+    static void encode(cpk_output_t *out, const std::vector<T, A> &v) {
+        if constexpr(detail::has_header<T>::value) {
+            uint8_t buf[512], *p = buf;
+
+            cpk_encode_container(out, CPK_CONTAINER_VECTOR,
+                                 (uint32_t)v.size(), encoder<T>::header);
+            for(const T &e : v) {
+                if(p + sizeof(T) > buf + sizeof(buf)) {
+                    cpk_write_bytes(out, buf, p - buf);
+                    p = buf;
+                }
+                p = encoder<T>::put_payload(p, e);
+            }
+            cpk_write_bytes(out, buf, p - buf);
+        } else {
+            cpk_encode_container(out, CPK_CONTAINER_VECTOR,
+                                 (uint32_t)v.size(), 0);
+            for(const T &e : v)
+                encoder<T>::encode(out, e);
+        }
+    }
+};
+
+template<class K, class V, class C, class A>
+struct encoder<std::map<K, V, C, A>>
+    : detail::map_encoder<std::map<K, V, C, A>> { };
+
+template<class K, class V, class H, class E, class A>
+struct encoder<std::unordered_map<K, V, H, E, A>>
+    : detail::map_encoder<std::unordered_map<K, V, H, E, A>> { };
+
+/* Structs with a cpk_fields(), as the tuple of what it ties */
+template<class T>
+struct encoder<T, std::enable_if_t<detail::has_fields<T>::value>> {
+    using fields = decltype(cpk_fields(std::declval<const T&>()));
+    using base = encoder<std::decay_t<fields>>;
+
+    static constexpr size_t fixed_size = base::fixed_size;
+
+    static uint8_t* put(uint8_t *p, const T &v) noexcept {
+        return base::put(p, cpk_fields(v));
+    }
+
+    static void encode(cpk_output_t *out, const T &v) {
+        base::encode(out, cpk_fields(v));
+    }
+};
+
+template<class T>
+inline void encode(cpk_output_t *out, const T &v) {
+    if constexpr(std::is_array_v<T>)
+        encoder<const char*>::encode(out, v);
+    else
+        encoder<T>::encode(out, v);
+}
+
+template<class T>
+inline void encode(output &out, const T &v) {
+    encode(out.get(), v);
+}
+
+} /* namespace cpk */
+
+#endif /* CONSPACK_HPP */
@@ -0,0 +1,903 @@
+/*
+ * libconspack
+ * Copyright (C) 2012  Ryan Pavlik
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the GNU Lesser General Public
+ * License (LGPL) version 2.1 which accompanies this distribution, and
+ * is available at http://www.gnu.org/licenses/lgpl-2.1.html
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ */
+
+/* O_DIRECT and struct statx */
+#define _GNU_SOURCE
+
+#include "config.h"
+#include "conspack/conspack.h"
+#include "internal.h"
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_PTHREAD_H
+#  include <pthread.h>
+#  include <sched.h>
+#endif
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(HAVE_SYS_MMAN_H) && \
+    defined(HAVE_PTHREAD_H)
+#  include <linux/io_uring.h>
+#  include <sys/mman.h>
+#  include <sys/syscall.h>
+#  if defined(__NR_io_uring_setup) && defined(IO_URING_OP_SUPPORTED) && \
+      defined(STATX_SIZE)
+#    define INGEST_URING 1
+#  endif
+#endif
+
+/*
+ * With io_uring, one I/O thread keeps up to depth files in flight: it
+ * takes a slot from the free ring, queues an open and a statx for the
+ * file together, then a read of the whole file into the slot's
+ * aligned buffer once both are back, and pushes the filled slot onto
+ * the work ring.  Every batch of queued operations goes to the kernel
+ * in one io_uring_enter, which also waits for the next completion.
+ * Pool threads pop slots, hand them to the callback and push them back
+ * onto the free ring, so depth bounds both memory and I/O in flight.
+ *
+ * Without io_uring (an old kernel, a seccomp filter, or
+ * CPK_INGEST_NO_URING), pool threads claim files by index and read
+ * each with pread into a buffer of their own.
+ *
+ * Sizes come from stat, so only regular files read in full.
+ */
+
+#define STAT_INC(ig,field,n) \
+    __atomic_fetch_add(&(ig)->stats.field, (n), __ATOMIC_RELAXED)
+
+#define ROUND_UP(n) \
+    (((n) + CPK_INGEST_ALIGN - 1) & ~(size_t)(CPK_INGEST_ALIGN - 1))
+
+typedef struct _ingest_buf {
+    uint8_t *data;
+    size_t cap;
+} ingest_buf_t;
+
+#ifdef INGEST_URING
+
+/* user_data is the slot with the operation in its low bits; closes
+   carry no slot, since nothing waits for them */
+#define OP_OPEN 1
+#define OP_STAT 2
+#define OP_READ 3
+#define OP_MASK 3
+
+typedef struct _ingest_slot {
+    size_t n;
+    int fd;
+    int direct;
+    uint32_t pending;           /* open and statx not yet back */
+
+    int failed;
+    uint32_t code;
+    const char *reason;
+    int errnum;
+
+    size_t size;
+    size_t got;
+    ingest_buf_t buf;
+
+    struct statx stx;
+} ingest_slot_t;
+
+typedef struct _uring {
+    int fd;
+    uint32_t entries;
+
+    uint32_t *sq_head, *sq_tail, *sq_mask, *sq_array;
+    uint32_t *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+
+    void *sq_map, *cq_map;
+    size_t sq_len, cq_len, sqes_len;
+} uring_t;
+
+#endif
+
+struct _cpk_ingest {
+    uint32_t depth;
+    uint32_t flags;
+
+    /* pread path: one buffer per pool thread */
+    uint32_t nbufs;
+    ingest_buf_t *bufs;
+
+#ifdef INGEST_URING
+    uring_t ring;
+    ingest_slot_t *slots;
+    cpk_ring_t *free_ring;
+    cpk_ring_t *work_ring;
+#endif
+
+    cpk_ingest_stats_t stats;
+};
+
+typedef struct _ingest_job {
+    cpk_ingest_t *ig;
+    const char *const *paths;
+    size_t count;
+    cpk_file_fn_t fn;
+    void *arg;
+
+    size_t next;
+    int io_done;
+    int broken;
+
+    int ret;
+    cpk_object_t err;
+} ingest_job_t;
+
+static int buf_reserve(ingest_buf_t *buf, size_t size) {
+    size_t need = ROUND_UP(size ? size : 1);
+    void *data = NULL;
+
+    if(buf->cap >= need)
+        return 0;
+
+    if(posix_memalign(&data, CPK_INGEST_ALIGN, need))
+        return -1;
+
+    free(buf->data);
+    buf->data = data;
+    buf->cap = need;
+
+    return 0;
+}
+
+static void job_fail(ingest_job_t *job, int ret, const cpk_object_t *err) {
+    int ok = 0;
+
+    if(__atomic_compare_exchange_n(&job->ret, &ok, ret, 0,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_RELAXED) && err)
+        job->err = *err;
+}
+
+static int job_stopped(ingest_job_t *job) {
+    return __atomic_load_n(&job->ret, __ATOMIC_ACQUIRE) != 0;
+}
+
+/* Hands paths[n] to the callback: its contents, or why they could not
+   be read when err is set */
+static void deliver(ingest_job_t *job, uint32_t thread, size_t n,
+                    uint8_t *data, size_t len, const cpk_object_t *err) {
+    cpk_ingest_t *ig = job->ig;
+    cpk_input_t in;
+    int ret = 0;
+
+    if(job_stopped(job))
+        return;
+
+    if(err) {
+        STAT_INC(ig, failed, 1);
+        ret = job->fn(job->arg, thread, n, NULL, err);
+    } else {
+        STAT_INC(ig, files, 1);
+        STAT_INC(ig, bytes, len);
+
+        cpk_input_init(&in, data, len);
+        ret = job->fn(job->arg, thread, n, &in, NULL);
+    }
+
+    if(ret) job_fail(job, ret, NULL);
+}
+
+static int open_file(const char *path, int *direct) {
+    int fd = -1;
+
+    if(*direct) {
+        if((fd = open(path, O_RDONLY | O_CLOEXEC | O_DIRECT)) >= 0 ||
+           errno != EINVAL)
+            return fd;
+
+        *direct = 0;
+    }
+
+    return open(path, O_RDONLY | O_CLOEXEC);
+}
+
+/* Some filesystems accept O_DIRECT at open and refuse it on read */
+static int drop_direct(int fd) {
+    int fl = fcntl(fd, F_GETFL);
+
+    return fl < 0 ? -1 : fcntl(fd, F_SETFL, fl & ~O_DIRECT);
+}
+
+ /* pread path */
+
+static int read_file(cpk_ingest_t *ig, const char *path, ingest_buf_t *buf,
+                     size_t *len, cpk_object_t *err) {
+    struct stat st;
+    int fd = -1, direct = !!(ig->flags & CPK_INGEST_DIRECT);
+    size_t size = 0, got = 0;
+    ssize_t n = 0;
+
+    if((fd = open_file(path, &direct)) < 0) {
+        cpk_err(err, CPK_ERR_IO, CPK_ERR_IO_MSG, errno, 0);
+        return -1;
+    }
+
+    if(fstat(fd, &st)) {
+        cpk_err(err, CPK_ERR_IO, CPK_ERR_IO_MSG, errno, 0);
+        goto error;
+    }
+
+    if((uint64_t)st.st_size > CPK_INGEST_MAX_FILE) {
+        cpk_err(err, CPK_ERR_LIMIT, CPK_ERR_LIMIT_MSG, 0, 0);
+        goto error;
+    }
+
+    size = st.st_size;
+    if(buf_reserve(buf, size)) {
+        cpk_err(err, CPK_ERR_ALLOC, CPK_ERR_ALLOC_MSG, 0, 0);
+        goto error;
+    }
+
+    /* Ask for the whole rounded-up buffer, as O_DIRECT wants; the file
+       ends short of it */
+    while(got < size) {
+        n = pread(fd, buf->data + got, buf->cap - got, got);
+        STAT_INC(ig, reads, 1);
+
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            if(errno == EINVAL && direct && !drop_direct(fd)) {
+                direct = 0;
+                continue;
+            }
+
+            cpk_err(err, CPK_ERR_IO, CPK_ERR_IO_MSG, errno, got);
+            goto error;
+        }
+
+        if(!n) break;
+        got += n;
+    }
+
+    close(fd);
+    *len = got < size ? got : size;
+
+    return 0;
+
+ error:
+    close(fd);
+    return -1;
+}
+
+static void pread_worker(void *arg, uint32_t thread) {
+    ingest_job_t *job = arg;
+    cpk_ingest_t *ig = job->ig;
+    ingest_buf_t *buf = &ig->bufs[thread];
+    cpk_object_t err;
+    size_t n = 0, len = 0;
+
+    while(!job_stopped(job)) {
+        n = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        if(n >= job->count) break;
+
+        err.header = 0;
+        if(read_file(ig, job->paths[n], buf, &len, &err))
+            deliver(job, thread, n, NULL, 0, &err);
+        else
+            deliver(job, thread, n, buf->data, len, NULL);
+    }
+}
+
+#ifdef INGEST_URING
+
+ /* io_uring path */
+
+static int uring_setup(uring_t *u, uint32_t entries) {
+    struct io_uring_params p;
+    struct io_uring_probe *probe = NULL;
+    size_t probe_len = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+    static const uint8_t ops[] = { IORING_OP_OPENAT, IORING_OP_STATX,
+                                   IORING_OP_READ, IORING_OP_CLOSE };
+    uint8_t *sq = NULL, *cq = NULL;
+    uint32_t i = 0;
+
+    memset(&p, 0, sizeof(p));
+    memset(u, 0, sizeof(*u));
+    u->fd = -1;
+
+    p.flags = IORING_SETUP_CLAMP;
+    if((u->fd = syscall(__NR_io_uring_setup, entries, &p)) < 0)
+        return -1;
+
+    /* Everything here arrived in 5.6, READ last, but ask rather than
+       trust the version */
+    if(!(probe = calloc(1, probe_len)) ||
+       syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PROBE,
+               probe, 256) < 0)
+        goto error;
+
+    for(i = 0; i < sizeof(ops); i++) {
+        if(ops[i] > probe->last_op ||
+           !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+            goto error;
+    }
+
+    free(probe);
+    probe = NULL;
+
+    u->entries = p.sq_entries;
+    u->sq_len = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+    u->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    if(p.features & IORING_FEAT_SINGLE_MMAP) {
+        if(u->cq_len > u->sq_len) u->sq_len = u->cq_len;
+        u->cq_len = 0;
+    }
+
+    u->sq_map = mmap(NULL, u->sq_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if(u->sq_map == MAP_FAILED) {
+        u->sq_map = NULL;
+        goto error;
+    }
+
+    if(u->cq_len) {
+        u->cq_map = mmap(NULL, u->cq_len, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+        if(u->cq_map == MAP_FAILED) {
+            u->cq_map = NULL;
+            goto error;
+        }
+    }
+
+    u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if(u->sqes == MAP_FAILED) {
+        u->sqes = NULL;
+        goto error;
+    }
+
+    sq = u->sq_map;
+    cq = u->cq_map ? u->cq_map : u->sq_map;
+
+    u->sq_head = (uint32_t*)(sq + p.sq_off.head);
+    u->sq_tail = (uint32_t*)(sq + p.sq_off.tail);
+    u->sq_mask = (uint32_t*)(sq + p.sq_off.ring_mask);
+    u->sq_array = (uint32_t*)(sq + p.sq_off.array);
+
+    u->cq_head = (uint32_t*)(cq + p.cq_off.head);
+    u->cq_tail = (uint32_t*)(cq + p.cq_off.tail);
+    u->cq_mask = (uint32_t*)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+    return 0;
+
+ error:
+    free(probe);
+    if(u->sqes) munmap(u->sqes, u->sqes_len);
+    if(u->cq_map) munmap(u->cq_map, u->cq_len);
+    if(u->sq_map) munmap(u->sq_map, u->sq_len);
+    close(u->fd);
+    memset(u, 0, sizeof(*u));
+    u->fd = -1;
+
+    return -1;
+}
+
+/* Only once nothing is in flight: closing the descriptor does not
+   stop requests the kernel already holds from writing into slots */
+static void uring_close(uring_t *u) {
+    if(u->fd < 0) return;
+
+    munmap(u->sqes, u->sqes_len);
+    if(u->cq_map) munmap(u->cq_map, u->cq_len);
+    munmap(u->sq_map, u->sq_len);
+    close(u->fd);
+
+    memset(u, 0, sizeof(*u));
+    u->fd = -1;
+}
+
+/* The caller keeps the number in flight within entries, so there is
+   always a free SQE and the CQ, twice the size, never overflows */
+static struct io_uring_sqe* uring_sqe(uring_t *u, uint8_t op, int fd,
+                                      uint64_t data) {
+    uint32_t tail = *u->sq_tail, i = tail & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[i];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->user_data = data;
+
+    u->sq_array[i] = i;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    return sqe;
+}
+
+static int uring_enter(uring_t *u, uint32_t submit, uint32_t wait) {
+    return syscall(__NR_io_uring_enter, u->fd, submit, wait,
+                   wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+/* Spin briefly, then yield, then sleep, as the pipeline does */
+static void backoff(uint32_t *spins) {
+    struct timespec ts = { 0, 50000 };
+
+    if(*spins < 64) {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    } else if(*spins < 128) {
+        sched_yield();
+    } else {
+        nanosleep(&ts, NULL);
+    }
+
+    (*spins)++;
+}
+
+typedef struct _io_state {
+    ingest_job_t *job;
+    uring_t *u;
+    uint32_t queued;            /* prepared, not yet submitted */
+    uint32_t inflight;          /* prepared, not yet completed */
+    uint32_t active;            /* slots taken from the free ring */
+} io_state_t;
+
+static void io_prep(io_state_t *io, ingest_slot_t *slot, uint8_t op) {
+    struct io_uring_sqe *sqe = NULL;
+    uint64_t data = (uintptr_t)slot | op;
+
+    switch(op) {
+        case OP_OPEN:
+            sqe = uring_sqe(io->u, IORING_OP_OPENAT, AT_FDCWD, data);
+            sqe->addr = (uintptr_t)io->job->paths[slot->n];
+            sqe->open_flags = O_RDONLY | O_CLOEXEC |
+                              (slot->direct ? O_DIRECT : 0);
+            break;
+
+        case OP_STAT:
+            sqe = uring_sqe(io->u, IORING_OP_STATX, AT_FDCWD, data);
+            sqe->addr = (uintptr_t)io->job->paths[slot->n];
+            sqe->len = STATX_SIZE;
+            sqe->off = (uintptr_t)&slot->stx;
+            break;
+
+        case OP_READ:
+            sqe = uring_sqe(io->u, IORING_OP_READ, slot->fd, data);
+            sqe->addr = (uintptr_t)(slot->buf.data + slot->got);
+            sqe->len = slot->buf.cap - slot->got;
+            sqe->off = slot->got;
+            break;
+    }
+
+    io->queued++;
+    io->inflight++;
+}
+
+static void slot_fail(ingest_slot_t *slot, uint32_t code, const char *reason,
+                      int errnum) {
+    if(slot->failed) return;
+
+    slot->failed = 1;
+    slot->code = code;
+    slot->reason = reason;
+    slot->errnum = errnum;
+}
+
+/* Queues the close, if the file opened, and passes the slot on */
+static void slot_done(io_state_t *io, ingest_slot_t *slot) {
+    cpk_ingest_t *ig = io->job->ig;
+
+    if(slot->fd >= 0) {
+        uring_sqe(io->u, IORING_OP_CLOSE, slot->fd, 0);
+        io->queued++;
+        io->inflight++;
+        slot->fd = -1;
+    }
+
+    io->active--;
+    cpk_ring_push(ig->work_ring, slot);
+}
+
+static void slot_opened(io_state_t *io, ingest_slot_t *slot) {
+    if(!slot->failed) {
+        if(slot->stx.stx_size > CPK_INGEST_MAX_FILE)
+            slot_fail(slot, CPK_ERR_LIMIT, CPK_ERR_LIMIT_MSG, 0);
+        else if(buf_reserve(&slot->buf, slot->stx.stx_size))
+            slot_fail(slot, CPK_ERR_ALLOC, CPK_ERR_ALLOC_MSG, 0);
+        else
+            slot->size = slot->stx.stx_size;
+    }
+
+    if(slot->failed || !slot->size)
+        slot_done(io, slot);
+    else
+        io_prep(io, slot, OP_READ);
+}
+
+static void io_complete(io_state_t *io, uint64_t data, int32_t res) {
+    ingest_slot_t *slot = (ingest_slot_t*)(uintptr_t)(data & ~(uint64_t)OP_MASK);
+    cpk_ingest_t *ig = io->job->ig;
+
+    io->inflight--;
+    if(!data) return;
+
+    switch(data & OP_MASK) {
+        case OP_OPEN:
+            if(res == -EINVAL && slot->direct) {
+                slot->direct = 0;
+                io_prep(io, slot, OP_OPEN);
+                return;
+            }
+
+            if(res < 0)
+                slot_fail(slot, CPK_ERR_IO, CPK_ERR_IO_MSG, -res);
+            else
+                slot->fd = res;
+
+            if(!--slot->pending) slot_opened(io, slot);
+            break;
+
+        case OP_STAT:
+            if(res < 0)
+                slot_fail(slot, CPK_ERR_IO, CPK_ERR_IO_MSG, -res);
+
+            if(!--slot->pending) slot_opened(io, slot);
+            break;
+
+        case OP_READ:
+            STAT_INC(ig, reads, 1);
+
+            if(res == -EINTR || res == -EAGAIN ||
+               (res == -EINVAL && slot->direct && !drop_direct(slot->fd))) {
+                if(res == -EINVAL) slot->direct = 0;
+                io_prep(io, slot, OP_READ);
+                return;
+            }
+
+            if(res < 0) {
+                slot_fail(slot, CPK_ERR_IO, CPK_ERR_IO_MSG, -res);
+                slot_done(io, slot);
+                return;
+            }
+
+            slot->got += res;
+            if(res && slot->got < slot->size) {
+                io_prep(io, slot, OP_READ);
+                return;
+            }
+
+            if(slot->got < slot->size) slot->size = slot->got;
+            slot_done(io, slot);
+            break;
+    }
+}
+
+/* After the ring fails.  Closes that were queued but never submitted
+   are made here, and completions still owed are waited for, so the
+   kernel holds nothing that points into a slot when it is freed. */
+static void io_drain(io_state_t *io) {
+    uring_t *u = io->u;
+    struct io_uring_sqe *sqe = NULL;
+    struct io_uring_cqe *cqe = NULL;
+    uint32_t head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    uint32_t tail = *u->sq_tail, spins = 0;
+
+    for(; head != tail; head++) {
+        sqe = &u->sqes[u->sq_array[head & *u->sq_mask]];
+        if(sqe->opcode == IORING_OP_CLOSE) close(sqe->fd);
+        io->inflight--;
+    }
+
+    *u->sq_tail = head;
+    io->queued = 0;
+
+    while(io->inflight) {
+        head = *u->cq_head;
+        tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+
+        if(head == tail) {
+            if(uring_enter(u, 0, 1) < 0) backoff(&spins);
+            continue;
+        }
+
+        /* An open that got through still needs its descriptor closed */
+        for(; head != tail; head++) {
+            cqe = &u->cqes[head & *u->cq_mask];
+            if((cqe->user_data & OP_MASK) == OP_OPEN && cqe->res >= 0)
+                close(cqe->res);
+            io->inflight--;
+        }
+
+        __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+    }
+}
+
+static void* io_main(void *arg) {
+    ingest_job_t *job = arg;
+    cpk_ingest_t *ig = job->ig;
+    uring_t *u = &ig->ring;
+    io_state_t io = { job, u, 0, 0, 0 };
+    ingest_slot_t *slot = NULL;
+    cpk_object_t err;
+    uint32_t head = 0, tail = 0, spins = 0;
+    void *ptr = NULL;
+    int n = 0;
+
+    for(;;) {
+        /* Start files while there are slots and room for their open
+           and statx; a slot's later operations each replace one that
+           completed, so this keeps everything within the rings */
+        while(job->next < job->count && !job_stopped(job) &&
+              io.inflight + 2 <= u->entries &&
+              !cpk_ring_pop(ig->free_ring, &ptr)) {
+            slot = ptr;
+            ptr = NULL;
+
+            slot->n = job->next++;
+            slot->fd = -1;
+            slot->direct = !!(ig->flags & CPK_INGEST_DIRECT);
+            slot->pending = 2;
+            slot->failed = 0;
+            slot->size = 0;
+            slot->got = 0;
+
+            io_prep(&io, slot, OP_OPEN);
+            io_prep(&io, slot, OP_STAT);
+            io.active++;
+        }
+
+        if(!io.inflight) {
+            if(!io.active && (job->next >= job->count || job_stopped(job)))
+                break;
+
+            /* Every slot is with the workers */
+            backoff(&spins);
+            continue;
+        }
+
+        spins = 0;
+
+        if((n = uring_enter(u, io.queued, 1)) < 0) {
+            if(errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                cpk_err(&err, CPK_ERR_IO, CPK_ERR_IO_MSG, errno, 0);
+                job_fail(job, CPK_ERROR, &err);
+                job->broken = 1;
+                io_drain(&io);
+                break;
+            }
+        } else {
+            io.queued -= n;
+            STAT_INC(ig, submits, 1);
+        }
+
+        head = *u->cq_head;
+        tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+
+        for(; head != tail; head++) {
+            struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+            io_complete(&io, cqe->user_data, cqe->res);
+        }
+
+        __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    __atomic_store_n(&job->io_done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static void uring_worker(void *arg, uint32_t thread) {
+    ingest_job_t *job = arg;
+    cpk_ingest_t *ig = job->ig;
+    ingest_slot_t *slot = NULL;
+    cpk_object_t err;
+    void *ptr = NULL;
+    uint32_t spins = 0;
+
+    for(;;) {
+        if(cpk_ring_pop(ig->work_ring, &ptr)) {
+            /* The I/O thread pushes before it says it is done */
+            if(__atomic_load_n(&job->io_done, __ATOMIC_ACQUIRE) &&
+               cpk_ring_pop(ig->work_ring, &ptr))
+                break;
+
+            if(!ptr) {
+                backoff(&spins);
+                continue;
+            }
+        }
+
+        spins = 0;
+        slot = ptr;
+        ptr = NULL;
+
+        if(slot->failed) {
+            err.header = 0;
+            cpk_err(&err, slot->code, slot->reason, slot->errnum, slot->got);
+            deliver(job, thread, slot->n, NULL, 0, &err);
+        } else {
+            deliver(job, thread, slot->n, slot->buf.data, slot->size, NULL);
+        }
+
+        cpk_ring_push(ig->free_ring, slot);
+    }
+}
+
+static int uring_init(cpk_ingest_t *ig) {
+    uint32_t i = 0;
+
+    if(uring_setup(&ig->ring, ig->depth * 2))
+        return -1;
+
+    ig->slots = calloc(ig->depth, sizeof(ingest_slot_t));
+    ig->free_ring = cpk_ring_new(ig->depth);
+    ig->work_ring = cpk_ring_new(ig->depth);
+
+    if(!ig->slots || !ig->free_ring || !ig->work_ring)
+        return -1;
+
+    for(i = 0; i < ig->depth; i++) {
+        ig->slots[i].fd = -1;
+        cpk_ring_push(ig->free_ring, &ig->slots[i]);
+    }
+
+    return 0;
+}
+
+static void uring_fini(cpk_ingest_t *ig) {
+    uint32_t i = 0;
+
+    uring_close(&ig->ring);
+
+    if(ig->slots) {
+        for(i = 0; i < ig->depth; i++) {
+            if(ig->slots[i].fd >= 0) close(ig->slots[i].fd);
+            free(ig->slots[i].buf.data);
+        }
+    }
+
+    cpk_ring_free(ig->work_ring);
+    cpk_ring_free(ig->free_ring);
+    free(ig->slots);
+
+    ig->slots = NULL;
+    ig->work_ring = ig->free_ring = NULL;
+}
+
+#endif /* INGEST_URING */
+
+/* depth of 0 uses CPK_INGEST_DEPTH files in flight; it only matters
+   with io_uring.  An ingester runs one cpk_ingest_run at a time. */
+cpk_ingest_t* cpk_ingest_new(uint32_t depth, uint32_t flags) {
+    cpk_ingest_t *ig = NULL;
+
+    if(!(ig = calloc(1, sizeof(cpk_ingest_t))))
+        return NULL;
+
+    ig->depth = depth ? depth : CPK_INGEST_DEPTH;
+    ig->flags = flags;
+
+#ifdef INGEST_URING
+    ig->ring.fd = -1;
+
+    if(!(flags & CPK_INGEST_NO_URING) && uring_init(ig))
+        uring_fini(ig);
+#endif
+
+    return ig;
+}
+
+void cpk_ingest_free(cpk_ingest_t *ig) {
+    uint32_t i = 0;
+
+    if(!ig) return;
+
+#ifdef INGEST_URING
+    uring_fini(ig);
+#endif
+
+    for(i = 0; i < ig->nbufs; i++)
+        free(ig->bufs[i].data);
+
+    free(ig->bufs);
+    free(ig);
+}
+
+/* Reads paths[0..count) and calls fn on each across pool, or on the
+   caller's thread if pool is NULL, in no particular order.  A file
+   that cannot be read goes to fn as an error rather than stopping the
+   run.  Returns 0, the first nonzero value fn returned, or CPK_ERROR
+   with err set if the run itself failed. */
+int cpk_ingest_run(cpk_ingest_t *ig, cpk_pool_t *pool,
+                   const char *const *paths, size_t count,
+                   cpk_file_fn_t fn, void *arg, cpk_object_t *err) {
+    uint32_t threads = cpk_pool_size(pool);
+    ingest_buf_t *bufs = NULL;
+    ingest_job_t job;
+
+    if(err) err->header = 0;
+
+    memset(&job, 0, sizeof(job));
+    job.ig = ig;
+    job.paths = paths;
+    job.count = count;
+    job.fn = fn;
+    job.arg = arg;
+
+    if(!count)
+        return 0;
+
+#ifdef INGEST_URING
+    if(ig->ring.fd >= 0) {
+        pthread_t io;
+
+        /* Without a thread to drive the ring, read with pread */
+        if(!pthread_create(&io, NULL, io_main, &job)) {
+            cpk_pool_run(pool, uring_worker, &job);
+            pthread_join(io, NULL);
+
+            /* The I/O thread drained the ring before it gave up, so
+               the slots can go; later runs use pread */
+            if(job.broken) uring_fini(ig);
+
+            goto done;
+        }
+    }
+#endif
+
+    if(ig->nbufs < threads) {
+        if(!(bufs = realloc(ig->bufs, threads * sizeof(ingest_buf_t)))) {
+            if(err) cpk_err(err, CPK_ERR_ALLOC, CPK_ERR_ALLOC_MSG, 0, 0);
+            return CPK_ERROR;
+        }
+
+        memset(bufs + ig->nbufs, 0,
+               (threads - ig->nbufs) * sizeof(ingest_buf_t));
+        ig->bufs = bufs;
+        ig->nbufs = threads;
+    }
+
+    cpk_pool_run(pool, pread_worker, &job);
+
+#ifdef INGEST_URING
+ done:
+#endif
+    if(err && job.err.header)
+        *err = job.err;
+
+    return job.ret;
+}
+
+/* Counts cover every run so far.  submits counts io_uring_enter calls,
+   so reads per submit is the batching achieved. */
+void cpk_ingest_stats(cpk_ingest_t *ig, cpk_ingest_stats_t *stats) {
+    stats->files = __atomic_load_n(&ig->stats.files, __ATOMIC_RELAXED);
+    stats->failed = __atomic_load_n(&ig->stats.failed, __ATOMIC_RELAXED);
+    stats->bytes = __atomic_load_n(&ig->stats.bytes, __ATOMIC_RELAXED);
+    stats->reads = __atomic_load_n(&ig->stats.reads, __ATOMIC_RELAXED);
+    stats->submits = __atomic_load_n(&ig->stats.submits, __ATOMIC_RELAXED);
+
+#ifdef INGEST_URING
+    stats->uring = ig->ring.fd >= 0;
+#else
+    stats->uring = 0;
+#endif
+}
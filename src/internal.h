@@ -0,0 +1,121 @@
+/*
+ * libconspack
+ * Copyright (C) 2012  Ryan Pavlik
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the GNU Lesser General Public
+ * License (LGPL) version 2.1 which accompanies this distribution, and
+ * is available at http://www.gnu.org/licenses/lgpl-2.1.html
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ */
+
+#ifndef CPK_INTERNAL_H
+#define CPK_INTERNAL_H
+
+/* Shared between the library's translation units; not installed. */
+
+#include <sys/types.h>
+
+int cpk_input_has(cpk_input_t *in, size_t bytes);
+size_t cpk_input_remaining(cpk_input_t *in);
+
+void cpk_err(cpk_object_t *obj, uint32_t code, const char *reason,
+             uint8_t value, size_t pos);
+
+int cpk_fixed_payload(uint8_t header);
+int cpk_check_container(uint8_t header, uint32_t size, uint8_t fixed,
+                        uint64_t left, const cpk_limits_t *limits,
+                        uint64_t *unbacked, cpk_object_t *err, size_t pos);
+
+/* cpk_hash64 fed in pieces, for hashes taken as the input is read */
+typedef struct _cpk_hash_state {
+    uint64_t v[4], seed, total;
+    uint8_t buf[32];
+    size_t used;
+} cpk_hash_state_t;
+
+void cpk_hash_begin(cpk_hash_state_t *s, uint64_t seed);
+void cpk_hash_update(cpk_hash_state_t *s, const void *buf, size_t len);
+uint64_t cpk_hash_end(const cpk_hash_state_t *s);
+
+/* A container being hashed while it decodes; see CPK_DECODE_HASH */
+struct _cpk_hash_level {
+    cpk_hash_state_t state;
+    size_t from;                /* bytes before this are in state */
+    struct _cpk_hash_level *up;
+};
+
+uint32_t cpk_decode_size(cpk_input_t *in, uint8_t header, cpk_object_t *err);
+void cpk_decode_number(cpk_input_t *in, cpk_object_t *obj, uint8_t h);
+
+/* Skip or decode an object whose header a reader has already taken */
+int cpk_skip_after(cpk_input_t *in, uint8_t header, cpk_object_t *err);
+cpk_object_t* cpk_decode_after(cpk_input_t *in, uint8_t header);
+
+int cpk_ensure_buffer(cpk_output_t *out, size_t bytes_needed);
+
+/* Descriptor reads and writes go through these when a stage is set */
+typedef struct _cpk_stage cpk_stage_t;
+
+ssize_t cpk_stage_write(cpk_output_t *out, const void *buf, size_t len);
+ssize_t cpk_stage_read(cpk_input_t *in, void *buf, size_t len);
+void cpk_stage_free(cpk_stage_t *stage);
+
+/* Chunked text output to a sink, and number formatting; see format.c */
+typedef struct _cpk_writer {
+    cpk_sink_fn_t fn;
+    void *arg;
+    int failed;
+
+    size_t used, size;
+    char *buf;
+} cpk_writer_t;
+
+void cpk_writer_init(cpk_writer_t *w, char *buf, size_t size,
+                     cpk_sink_fn_t fn, void *arg);
+int cpk_writer_flush(cpk_writer_t *w);
+void cpk_writer_write(cpk_writer_t *w, const char *s, size_t len);
+void cpk_writer_u64(cpk_writer_t *w, uint64_t v);
+void cpk_writer_i64(cpk_writer_t *w, int64_t v);
+void cpk_writer_128(cpk_writer_t *w, const cpk_object_t *obj);
+
+static inline void cpk_writer_char(cpk_writer_t *w, char c) {
+    if(w->used == w->size)
+        cpk_writer_flush(w);
+
+    w->buf[w->used++] = c;
+}
+
+#define CPK_FLOAT_CHARS 32
+
+char* cpk_format_u64(char *end, uint64_t v);
+char* cpk_format_u128(char *end, uint64_t hi, uint64_t lo);
+size_t cpk_format_double(char *buf, double v);
+size_t cpk_format_single(char *buf, float v);
+
+int cpk_sink_fd(void *arg, const uint8_t *data, size_t len);
+
+/* Statistics compile away entirely unless configured with --enable-stats */
+#ifdef CPK_STATS
+#  define CPK_STAT_ADD(s,field,n) \
+    do { if(s) (s)->field += (n); } while(0)
+#  define CPK_STAT_VALUE(s,kind) \
+    do { if(s) (s)->values[cpk_stats_slot(kind)]++; } while(0)
+#  define CPK_STAT_ENTER(s) \
+    do { if((s) && ++(s)->depth > (s)->max_depth) \
+             (s)->max_depth = (s)->depth; } while(0)
+#  define CPK_STAT_LEAVE(s) \
+    do { if(s) (s)->depth--; } while(0)
+#else
+#  define CPK_STAT_ADD(s,field,n) ((void)0)
+#  define CPK_STAT_VALUE(s,kind)  ((void)0)
+#  define CPK_STAT_ENTER(s)       ((void)0)
+#  define CPK_STAT_LEAVE(s)       ((void)0)
+#endif
+
+#endif /* CPK_INTERNAL_H */
@@ -0,0 +1,1318 @@
+/*
+ * libconspack
+ * Copyright (C) 2012  Ryan Pavlik
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the GNU Lesser General Public
+ * License (LGPL) version 2.1 which accompanies this distribution, and
+ * is available at http://www.gnu.org/licenses/lgpl-2.1.html
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ */
+
+
+#include "config.h"
+#include "conspack/conspack.h"
+#include "internal.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#  include <emmintrin.h>
+#endif
+
+/*
+ * Conspack to JSON, straight from the input with no tree in between.
+ * Vectors and lists become arrays and maps become objects; the rest
+ * use objects with a "$" key:
+ *
+ *   nil, t            false, true
+ *   float NaN/inf     null
+ *   rational          {"$rational":[n,d]}
+ *   complex           {"$complex":[r,i]}
+ *   ref, index        {"$ref":n}, {"$index":n}
+ *   pointer           {"$pointer":n}
+ *   tag               {"$tag":n,"$value":v}
+ *   remote ref        {"$rref":v}
+ *   cons              {"$cons":[car,cdr]}
+ *   package           {"$package":name}
+ *   symbol            {"$symbol":name,"$package":package}
+ *   keyword           {"$keyword":name}
+ *   tmap              {"$type":type, key:value...}
+ *
+ * Keys that are strings are used as they are, symbols by their name,
+ * and anything else by its JSON text as a string.  A tagged key is
+ * the key it wraps, and refs to the tag repeat it, so the keys
+ * cpk_from_json tags with CPK_JSON_TAG_KEYS come back as written.
+ * String bytes are passed through as they are besides escaping, so
+ * output is UTF-8 when the strings are.
+ */
+
+#define JSON_CHUNK 65536
+#define JSON_KEY_TAGS 65536     /* tags past this are not remembered */
+
+typedef struct _json_key {
+    size_t at;                  /* key text starts here in key_text */
+    size_t len;                 /* 0 until the tag has been seen */
+} json_key_t;
+
+typedef struct _json {
+    cpk_input_t *in;
+    cpk_writer_t *out;          /* the output, or a key being built */
+    uint32_t depth, max_depth;
+    cpk_object_t err;
+
+    json_key_t *keys;           /* tagged keys by id */
+    uint32_t nkeys;
+    char *key_text;
+    size_t key_used, key_size;
+} json_t;
+
+static void json_value(json_t *j, uint8_t header);
+
+/* 0 for bytes that go out as they are, else the escape letter */
+static const char json_escape[256] = {
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+    'b', 't', 'n', 'u', 'f', 'r', 'u', 'u',
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+    0, 0, '"', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, '\\', 0, 0, 0,
+};
+
+/* Runs with nothing to escape are found 16 bytes at a time and
+   written in one piece */
+static void write_escaped(cpk_writer_t *w, const uint8_t *s, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    size_t i = 0, run = 0;
+    char u[6] = { '\\', 'u', '0', '0', 0, 0 }, esc[2] = { '\\', 0 };
+#ifdef __SSE2__
+    const __m128i ctl = _mm_set1_epi8(0x1F), quote = _mm_set1_epi8('"'),
+                  slash = _mm_set1_epi8('\\');
+    __m128i v, m;
+    int bits = 0;
+#endif
+
+    while(i < len) {
+#ifdef __SSE2__
+        for(; i + 16 <= len; i += 16) {
+            v = _mm_loadu_si128((const __m128i*)(s + i));
+            m = _mm_cmpeq_epi8(_mm_max_epu8(v, ctl), ctl);
+            m = _mm_or_si128(m, _mm_cmpeq_epi8(v, quote));
+            m = _mm_or_si128(m, _mm_cmpeq_epi8(v, slash));
+
+            if((bits = _mm_movemask_epi8(m))) {
+                i += __builtin_ctz(bits);
+                break;
+            }
+        }
+#endif
+        while(i < len && !json_escape[s[i]])
+            i++;
+
+        if(i == len) break;
+
+        cpk_writer_write(w, (const char*)s + run, i - run);
+
+        if(json_escape[s[i]] == 'u') {
+            u[4] = hex[s[i] >> 4];
+            u[5] = hex[s[i] & 0xF];
+            cpk_writer_write(w, u, 6);
+        } else {
+            esc[1] = json_escape[s[i]];
+            cpk_writer_write(w, esc, 2);
+        }
+
+        run = ++i;
+    }
+
+    cpk_writer_write(w, (const char*)s + run, len - run);
+}
+
+static inline void emit(json_t *j, const char *s, size_t len) {
+    cpk_writer_write(j->out, s, len);
+}
+
+static inline void emit_char(json_t *j, char c) {
+    cpk_writer_char(j->out, c);
+}
+
+static inline int failed(json_t *j) {
+    return CPK_IS_ERROR(j->err.header) || j->out->failed;
+}
+
+/* Strings arrive here in chunks as the decoder reads them */
+static int json_chunk(void *arg, const cpk_object_t *str,
+                      const uint8_t *chunk, size_t len, uint32_t offset) {
+    json_t *j = arg;
+
+    (void)str;
+
+    if(!offset) emit_char(j, '"');
+    write_escaped(j->out, chunk, len);
+
+    return j->out->failed;
+}
+
+static void json_float(json_t *j, double v, int single) {
+    char buf[CPK_FLOAT_CHARS];
+    size_t n = single ? cpk_format_single(buf, (float)v)
+                      : cpk_format_double(buf, v);
+
+    /* NaN and the infinities have no JSON form */
+    if(buf[n - 1] == 'n' || buf[n - 1] == 'f')
+        emit(j, "null", 4);
+    else
+        emit(j, buf, n);
+}
+
+/* A number already decoded into obj */
+static void json_number(json_t *j, const cpk_object_t *obj) {
+    cpk_object_t tmp;
+
+    switch(CPK_NUMBER_TYPE(obj->header)) {
+        case CPK_INT8:   cpk_writer_i64(j->out, obj->number.val.int8); break;
+        case CPK_INT16:  cpk_writer_i64(j->out, obj->number.val.int16); break;
+        case CPK_INT32:  cpk_writer_i64(j->out, obj->number.val.int32); break;
+        case CPK_INT64:  cpk_writer_i64(j->out, obj->number.val.int64); break;
+        case CPK_UINT8:  cpk_writer_u64(j->out, obj->number.val.uint8); break;
+        case CPK_UINT16: cpk_writer_u64(j->out, obj->number.val.uint16); break;
+        case CPK_UINT32: cpk_writer_u64(j->out, obj->number.val.uint32); break;
+        case CPK_UINT64: cpk_writer_u64(j->out, obj->number.val.uint64); break;
+
+        case CPK_INT128:
+        case CPK_UINT128:
+            cpk_writer_128(j->out, obj);
+            break;
+
+        case CPK_SINGLE_FLOAT:
+            json_float(j, obj->number.val.single_float, 1);
+            break;
+
+        case CPK_DOUBLE_FLOAT:
+            json_float(j, obj->number.val.double_float, 0);
+            break;
+
+        case CPK_RATIONAL:
+            emit(j, "{\"$rational\":[", 14);
+            json_number(j, cpk_number_part(obj, 0, &tmp));
+            emit_char(j, ',');
+            json_number(j, cpk_number_part(obj, 1, &tmp));
+            emit(j, "]}", 2);
+            break;
+
+        case CPK_COMPLEX:
+            emit(j, "{\"$complex\":[", 13);
+            json_number(j, cpk_number_part(obj, 0, &tmp));
+            emit_char(j, ',');
+            json_number(j, cpk_number_part(obj, 1, &tmp));
+            emit(j, "]}", 2);
+            break;
+
+        default:
+            emit(j, "null", 4);
+    }
+}
+
+static void json_next(json_t *j) {
+    uint8_t header = 0;
+
+    if(cpk_read8(j->in, &header) < 0) {
+        cpk_err(&j->err, CPK_ERR_EOF, CPK_ERR_EOF_MSG, 0,
+                j->in->buffer_read);
+        return;
+    }
+
+    json_value(j, header);
+}
+
+/* Elements of a fixed-header container all share that header; plain
+   integer and float types are read straight off the input */
+static void json_element(json_t *j, uint8_t fixed, int has_fixed) {
+    const cpk_header_info_t *info = CPK_HEADER_INFO(fixed);
+    cpk_object_t num;
+    int ok = 0;
+
+    if(!has_fixed) {
+        json_next(j);
+        return;
+    }
+
+    if(!CPK_IS_NUMBER(fixed) || info->children ||
+       !(info->payload == 1 || info->payload == 2 ||
+         info->payload == 4 || info->payload == 8)) {
+        json_value(j, fixed);
+        return;
+    }
+
+    num.header = fixed;
+
+    switch(info->payload) {
+        case 1: ok = cpk_read8(j->in, &num.number.val.uint8); break;
+        case 2: ok = cpk_read16(j->in, &num.number.val.uint16); break;
+        case 4: ok = cpk_read32(j->in, &num.number.val.uint32); break;
+        case 8: ok = cpk_read64(j->in, &num.number.val.uint64); break;
+    }
+
+    if(ok < 0) {
+        cpk_err(&j->err, CPK_ERR_EOF, CPK_ERR_EOF_MSG, 0,
+                j->in->buffer_read);
+        return;
+    }
+
+    json_number(j, &num);
+}
+
+static int sink_output(void *arg, const uint8_t *data, size_t len) {
+    return cpk_write_bytes(arg, data, len) < 0;
+}
+
+/* Keeps the text written for a tagged key so refs can repeat it */
+static int remember_key(json_t *j, uint64_t id, const uint8_t *text,
+                        size_t len) {
+    json_key_t *keys = NULL;
+    char *grown = NULL;
+    size_t size = 0;
+    uint32_t n = 0;
+
+    if(id >= JSON_KEY_TAGS) return 0;
+
+    if(id >= j->nkeys) {
+        for(n = j->nkeys ? j->nkeys : 16; n <= id; n *= 2) ;
+        if(!(keys = realloc(j->keys, n * sizeof(json_key_t))))
+            return CPK_ERROR;
+
+        memset(keys + j->nkeys, 0, (n - j->nkeys) * sizeof(json_key_t));
+        j->keys = keys;
+        j->nkeys = n;
+    }
+
+    if(j->key_used + len > j->key_size) {
+        for(size = j->key_size ? j->key_size : 256;
+            size < j->key_used + len; size *= 2) ;
+        if(!(grown = realloc(j->key_text, size)))
+            return CPK_ERROR;
+
+        j->key_text = grown;
+        j->key_size = size;
+    }
+
+    memcpy(j->key_text + j->key_used, text, len);
+    j->keys[id].at = j->key_used;
+    j->keys[id].len = len;
+    j->key_used += len;
+    return 0;
+}
+
+/* Non-string keys are written to the side first, then quoted */
+static void json_key(json_t *j, uint8_t fixed, int has_fixed) {
+    cpk_writer_t *out = j->out, side;
+    cpk_output_t key;
+    cpk_object_t obj;
+    char chunk[256];
+    uint8_t header = fixed;
+    int tagged = 0;
+
+    if(!has_fixed && cpk_read8(j->in, &header) < 0) {
+        cpk_err(&j->err, CPK_ERR_EOF, CPK_ERR_EOF_MSG, 0,
+                j->in->buffer_read);
+        return;
+    }
+
+    if(CPK_IS_STRING(header)) {
+        json_value(j, header);
+        return;
+    }
+
+    /* A symbol key is its name; the package is dropped */
+    if(CPK_IS_SYMBOL(header)) {
+        obj.header = header;
+        cpk_decode(j->in, &obj, 1);
+        if(CPK_IS_ERROR(obj.header)) {
+            j->err = obj;
+            return;
+        }
+
+        json_key(j, 0, 0);
+        if(!failed(j) && !CPK_IS_KEYWORD(header) && cpk_skip(j->in, &obj))
+            j->err = obj;
+        return;
+    }
+
+    if(CPK_IS_TAG(header) || CPK_IS_REF(header)) {
+        if(j->depth > j->max_depth) {
+            cpk_err(&j->err, CPK_ERR_LIMIT, CPK_ERR_LIMIT_MSG, header,
+                    j->in->buffer_read);
+            return;
+        }
+
+        obj.header = header;
+        cpk_decode(j->in, &obj, 1);
+        if(CPK_IS_ERROR(obj.header)) {
+            j->err = obj;
+            return;
+        }
+
+        /* A ref to a key seen tagged is that key again */
+        if(CPK_IS_REF(header)) {
+            if(obj.ref.val < j->nkeys && j->keys[obj.ref.val].len) {
+                emit(j, j->key_text + j->keys[obj.ref.val].at,
+                     j->keys[obj.ref.val].len);
+            } else {
+                emit(j, "\"{\\\"$ref\\\":", 11);
+                cpk_writer_u64(j->out, obj.ref.val);
+                emit(j, "}\"", 2);
+            }
+
+            return;
+        }
+
+        tagged = 1;
+    }
+
+    cpk_output_init(&key);
+    cpk_writer_init(&side, chunk, sizeof(chunk), sink_output, &key);
+
+    j->out = &side;
+    if(tagged) {
+        j->depth++;
+        json_key(j, 0, 0);
+        j->depth--;
+    } else {
+        json_value(j, header);
+    }
+    cpk_writer_flush(&side);
+    j->out = out;
+
+    if(side.failed && !CPK_IS_ERROR(j->err.header))
+        cpk_err(&j->err, CPK_ERR_ALLOC, CPK_ERR_ALLOC_MSG, 0,
+                j->in->buffer_read);
+
+    /* A tagged key's text is already quoted */
+    if(!tagged) {
+        emit_char(j, '"');
+        write_escaped(j->out, key.buffer, key.buffer_used);
+        emit_char(j, '"');
+    } else if(!failed(j)) {
+        emit(j, (const char*)key.buffer, key.buffer_used);
+        if(remember_key(j, obj.tag.val, key.buffer, key.buffer_used))
+            cpk_err(&j->err, CPK_ERR_ALLOC, CPK_ERR_ALLOC_MSG, 0,
+                    j->in->buffer_read);
+    }
+
+    cpk_output_fini(&key);
+}
+
+static void json_container(json_t *j, cpk_object_t *obj) {
+    const cpk_header_info_t *info = CPK_HEADER_INFO(obj->header);
+    uint32_t n = obj->container.size, i = 0;
+    uint8_t fixed = obj->container.fixed_header;
+    int has_fixed = !!(info->flags & CPK_HD_FIXED);
+
+    if(!(info->flags & CPK_HD_MAP)) {
+        emit_char(j, '[');
+        for(i = 0; i < n && !failed(j); i++) {
+            if(i) emit_char(j, ',');
+            json_element(j, fixed, has_fixed);
+        }
+        emit_char(j, ']');
+        return;
+    }
+
+    emit_char(j, '{');
+
+    /* The tmap type object never uses the fixed header */
+    if(info->flags & CPK_HD_TMAP) {
+        emit(j, "\"$type\":", 8);
+        json_next(j);
+        n--;
+    }
+
+    for(i = 0; i < n && !failed(j); i += 2) {
+        if(i || (info->flags & CPK_HD_TMAP)) emit_char(j, ',');
+        json_key(j, fixed, has_fixed);
+        if(failed(j)) break;
+        emit_char(j, ':');
+        json_element(j, fixed, has_fixed);
+    }
+
+    emit_char(j, '}');
+}
+
+static void json_value(json_t *j, uint8_t header) {
+    cpk_object_t obj;
+
+    if(failed(j)) return;
+
+    /* Scalars inside max_depth containers are at max_depth, and are
+       allowed, as in cpk_validate and the decoder */
+    if(j->depth > j->max_depth) {
+        cpk_err(&j->err, CPK_ERR_LIMIT, CPK_ERR_LIMIT_MSG, header,
+                j->in->buffer_read);
+        return;
+    }
+
+    obj.header = header;
+    cpk_decode(j->in, &obj, 1);
+    if(CPK_IS_ERROR(obj.header)) {
+        j->err = obj;
+        return;
+    }
+
+    j->depth++;
+
+    switch(cpk_decode_header(header)) {
+        case CPK_BOOL:
+            if(header == CPK_NIL) emit(j, "false", 5);
+            else emit(j, "true", 4);
+            break;
+
+        case CPK_NUMBER:
+            json_number(j, &obj);
+            cpk_free(&obj);
+            break;
+
+        case CPK_STRING:
+            if(obj.string.flags & CPK_STRING_STREAMED) {
+                emit_char(j, '"');
+                break;
+            }
+
+            emit_char(j, '"');
+            write_escaped(j->out, obj.string.data, obj.string.size);
+            emit_char(j, '"');
+            cpk_free(&obj);
+            break;
+
+        case CPK_CONTAINER:
+            json_container(j, &obj);
+            break;
+
+        case CPK_REF:
+            emit(j, "{\"$ref\":", 8);
+            cpk_writer_u64(j->out, obj.ref.val);
+            emit_char(j, '}');
+            break;
+
+        case CPK_INDEX:
+            emit(j, "{\"$index\":", 10);
+            cpk_writer_u64(j->out, obj.ref.val);
+            emit_char(j, '}');
+            break;
+
+        case CPK_POINTER:
+            emit(j, "{\"$pointer\":", 12);
+            cpk_writer_u64(j->out, obj.ref.val);
+            emit_char(j, '}');
+            break;
+
+        case CPK_TAG:
+            emit(j, "{\"$tag\":", 8);
+            cpk_writer_u64(j->out, obj.tag.val);
+            emit(j, ",\"$value\":", 10);
+            json_next(j);
+            emit_char(j, '}');
+            break;
+
+        case CPK_REMOTE_REF:
+            emit(j, "{\"$rref\":", 9);
+            json_next(j);
+            emit_char(j, '}');
+            break;
+
+        case CPK_CONS:
+            emit(j, "{\"$cons\":[", 10);
+            json_next(j);
+            emit_char(j, ',');
+            json_next(j);
+            emit(j, "]}", 2);
+            break;
+
+        case CPK_PACKAGE:
+            emit(j, "{\"$package\":", 12);
+            json_next(j);
+            emit_char(j, '}');
+            break;
+
+        case CPK_SYMBOL:
+            if(CPK_IS_KEYWORD(header)) {
+                emit(j, "{\"$keyword\":", 12);
+                json_next(j);
+            } else {
+                emit(j, "{\"$symbol\":", 11);
+                json_next(j);
+                emit(j, ",\"$package\":", 12);
+                json_next(j);
+            }
+            emit_char(j, '}');
+            break;
+    }
+
+    j->depth--;
+}
+
+/* Writes the next value from in to fn as JSON, in pieces of up to
+   64KB.  Strings are escaped as they stream through and never held
+   whole.  Returns 0, or CPK_ERROR with err set (CPK_ERR_ABORTED if fn
+   failed); the text written by then is incomplete. */
+int cpk_to_json(cpk_input_t *in, cpk_sink_fn_t fn, void *arg,
+                cpk_object_t *err) {
+    cpk_writer_t w;
+    json_t j;
+    char *chunk = NULL;
+    uint32_t flags = in->flags, threshold = in->string_threshold;
+    cpk_string_fn_t string_fn = in->string_fn;
+    void *string_arg = in->string_arg;
+    cpk_arena_t *arena = in->arena;
+
+    if(err) err->header = 0;
+
+    if(!(chunk = malloc(JSON_CHUNK))) {
+        if(err) cpk_err(err, CPK_ERR_ALLOC, CPK_ERR_ALLOC_MSG, 0, 0);
+        return CPK_ERROR;
+    }
+
+    cpk_writer_init(&w, chunk, JSON_CHUNK, fn, arg);
+
+    j.in = in;
+    j.out = &w;
+    j.depth = 0;
+    j.max_depth = in->limits && in->limits->max_depth ?
+                  in->limits->max_depth : CPK_DEFAULT_MAX_DEPTH;
+    j.err.header = 0;
+    j.keys = NULL;
+    j.nkeys = 0;
+    j.key_text = NULL;
+    j.key_used = j.key_size = 0;
+
+    /* The per-message budgets start over, as in cpk_decode_r */
+    in->allocated = 0;
+    in->unbacked = 0;
+
+    /* Every string goes through json_chunk; what is left (empty
+       strings) is viewed in place where it can be */
+    in->flags |= in->fd < 0 ? CPK_DECODE_VIEWS : 0;
+    in->string_threshold = 0;
+    in->string_fn = json_chunk;
+    in->string_arg = &j;
+    in->arena = NULL;
+
+    json_next(&j);
+    cpk_writer_flush(&w);
+
+    in->flags = flags;
+    in->string_threshold = threshold;
+    in->string_fn = string_fn;
+    in->string_arg = string_arg;
+    in->arena = arena;
+
+    free(chunk);
+    free(j.keys);
+    free(j.key_text);
+
+    if(w.failed && !CPK_IS_ERROR(j.err.header))
+        cpk_err(&j.err, CPK_ERR_ABORTED, CPK_ERR_ABORTED_MSG, 0,
+                in->buffer_read);
+
+    if(CPK_IS_ERROR(j.err.header)) {
+        if(err) *err = j.err;
+        return CPK_ERROR;
+    }
+
+    return 0;
+}
+
+int cpk_to_json_fd(cpk_input_t *in, int fd, cpk_object_t *err) {
+    return cpk_to_json(in, cpk_sink_fd, &fd, err);
+}
+
+/*
+ * JSON to conspack, written straight into an output.  Arrays become
+ * vectors and objects maps with string keys; true is t, and false and
+ * null are both nil.  Integers take the narrowest type that holds
+ * them (unsigned unless negative); other numbers are singles when a
+ * single holds them exactly, else doubles.  Numbers are read with
+ * strtod, so LC_NUMERIC must be "C".
+ *
+ * Counts go out as 32-bit placeholders and are filled in when the
+ * container closes, so the output buffer is written behind its end.
+ * Outputs that cannot take that (descriptors, or a running CRC that
+ * may already have summed the placeholder) are given the whole value
+ * in one write from a side buffer instead.
+ */
+
+#define JSON_TAGS_MAX    65536  /* distinct keys tagged per call */
+#define JSON_TAG_KEY_MAX 128    /* longer keys are never tagged */
+
+typedef struct _json_tag {
+    uint64_t hash;
+    size_t at;                  /* key bytes start here in keys */
+    uint32_t len;
+    uint32_t id;                /* one more than the tag; 0 is empty */
+} json_tag_t;
+
+typedef struct _json_in {
+    const uint8_t *p, *start, *end;
+    cpk_output_t *out;
+    uint32_t flags, depth;
+
+    uint8_t *scratch;           /* unescaped strings, number text */
+    size_t scratch_size;
+
+    json_tag_t *tags;
+    uint32_t tag_count, tag_slots;
+    uint8_t *keys;
+    size_t keys_used, keys_size;
+
+    cpk_object_t err;
+} json_in_t;
+
+static int from_value(json_in_t *j);
+
+static int from_fail(json_in_t *j, uint32_t code, const char *msg) {
+    if(!CPK_IS_ERROR(j->err.header))
+        cpk_err(&j->err, code, msg, j->p < j->end ? *j->p : 0,
+                j->p - j->start);
+
+    return CPK_ERROR;
+}
+
+static inline int syntax(json_in_t *j) {
+    if(j->p >= j->end)
+        return from_fail(j, CPK_ERR_EOF, CPK_ERR_EOF_MSG);
+
+    return from_fail(j, CPK_ERR_SYNTAX, CPK_ERR_SYNTAX_MSG);
+}
+
+static inline void skip_space(json_in_t *j) {
+    while(j->p < j->end &&
+          (*j->p == ' ' || *j->p == '\n' || *j->p == '\r' || *j->p == '\t'))
+        j->p++;
+}
+
+static int grow(uint8_t **buf, size_t *size, size_t need) {
+    size_t n = *size ? *size : 256;
+    uint8_t *grown;
+
+    if(need <= *size) return 0;
+
+    while(n < need) n *= 2;
+
+    if(!(grown = realloc(*buf, n))) return CPK_ERROR;
+
+    *buf = grown;
+    *size = n;
+    return 0;
+}
+
+/* Values are written straight into the buffer: room() makes space
+   for the most a value can need and put() keeps what was used */
+static inline uint8_t* room(cpk_output_t *out, size_t n) {
+    if(out->buffer_used + n > out->buffer_size && cpk_ensure_buffer(out, n))
+        return NULL;
+
+    return out->buffer + out->buffer_used;
+}
+
+static inline void put(cpk_output_t *out, size_t n) {
+    out->buffer_used += n;
+    CPK_STAT_ADD(out->stats, bytes_written, n);
+}
+
+/* The low size bytes of bits, big-endian, after the header */
+static void put_number(cpk_output_t *out, uint8_t type, uint64_t bits,
+                       int size) {
+    uint8_t *p = room(out, 9);
+    int i;
+
+    if(!p) return;
+
+    CPK_STAT_VALUE(out->stats, CPK_NUMBER);
+
+    p[0] = CPK_NUMBER | type;
+    for(i = size; i > 0; i--, bits >>= 8)
+        p[i] = (uint8_t)bits;
+
+    put(out, size + 1);
+}
+
+static void put_string(cpk_output_t *out, const uint8_t *s, uint32_t len) {
+    uint8_t *p = room(out, (size_t)len + 5);
+    size_t n;
+
+    if(!p) return;
+
+    CPK_STAT_VALUE(out->stats, CPK_STRING);
+
+    if(len <= UINT8_MAX) {
+        p[0] = CPK_STRING | CPK_SIZE_8;
+        p[1] = len;
+        n = 2;
+    } else if(len <= UINT16_MAX) {
+        p[0] = CPK_STRING | CPK_SIZE_16;
+        p[1] = len >> 8;
+        p[2] = len;
+        n = 3;
+    } else {
+        p[0] = CPK_STRING | CPK_SIZE_32;
+        p[1] = len >> 24;
+        p[2] = len >> 16;
+        p[3] = len >> 8;
+        p[4] = len;
+        n = 5;
+    }
+
+    memcpy(p + n, s, len);
+    put(out, n + len);
+}
+
+/* Ids stay below JSON_TAGS_MAX, so 16 bits always hold them */
+static void put_ref(cpk_output_t *out, uint8_t type, uint32_t id) {
+    uint8_t *p = room(out, 3);
+
+    if(!p) return;
+
+    CPK_STAT_VALUE(out->stats, type);
+
+    if(id < 16) {
+        p[0] = type | CPK_REFTAG_INLINE | id;
+        put(out, 1);
+    } else if(id <= UINT8_MAX) {
+        p[0] = type | CPK_SIZE_8;
+        p[1] = id;
+        put(out, 2);
+    } else {
+        p[0] = type | CPK_SIZE_16;
+        p[1] = id >> 8;
+        p[2] = id;
+        put(out, 3);
+    }
+}
+
+/* First quote, backslash or control byte at or after p, or end; the
+   same test as write_escaped, 16 bytes at a time */
+static const uint8_t* string_stop(const uint8_t *p, const uint8_t *end) {
+#ifdef __SSE2__
+    const __m128i ctl = _mm_set1_epi8(0x1F), quote = _mm_set1_epi8('"'),
+                  slash = _mm_set1_epi8('\\');
+    __m128i v, m;
+    int bits;
+
+    for(; end - p >= 16; p += 16) {
+        v = _mm_loadu_si128((const __m128i*)p);
+        m = _mm_cmpeq_epi8(_mm_max_epu8(v, ctl), ctl);
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, quote));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, slash));
+
+        if((bits = _mm_movemask_epi8(m)))
+            return p + __builtin_ctz(bits);
+    }
+#endif
+    while(p < end && !json_escape[*p])
+        p++;
+
+    return p;
+}
+
+static int hex4(const uint8_t *p, uint32_t *cp) {
+    int i;
+
+    *cp = 0;
+    for(i = 0; i < 4; i++) {
+        *cp <<= 4;
+
+        if(p[i] >= '0' && p[i] <= '9')      *cp |= p[i] - '0';
+        else if(p[i] >= 'a' && p[i] <= 'f') *cp |= p[i] - 'a' + 10;
+        else if(p[i] >= 'A' && p[i] <= 'F') *cp |= p[i] - 'A' + 10;
+        else return CPK_ERROR;
+    }
+
+    return 0;
+}
+
+/* Reads the escape at j->p into s as UTF-8; returns the byte count.
+   Surrogates must come in pairs. */
+static int unescape(json_in_t *j, uint8_t *s) {
+    const uint8_t *p = j->p;
+    uint32_t cp, lo;
+
+    if(j->end - p < 2) return CPK_ERROR;
+
+    j->p += 2;
+    switch(p[1]) {
+        case '"':  *s = '"';  return 1;
+        case '\\': *s = '\\'; return 1;
+        case '/':  *s = '/';  return 1;
+        case 'b':  *s = '\b'; return 1;
+        case 'f':  *s = '\f'; return 1;
+        case 'n':  *s = '\n'; return 1;
+        case 'r':  *s = '\r'; return 1;
+        case 't':  *s = '\t'; return 1;
+        case 'u':  break;
+        default:   j->p = p; return CPK_ERROR;
+    }
+
+    if(j->end - p < 6 || hex4(p + 2, &cp)) {
+        j->p = p;
+        return CPK_ERROR;
+    }
+    j->p = p + 6;
+
+    if(cp >= 0xDC00 && cp <= 0xDFFF) {
+        j->p = p;
+        return CPK_ERROR;
+    }
+
+    if(cp >= 0xD800 && cp <= 0xDBFF) {
+        if(j->end - p < 12 || p[6] != '\\' || p[7] != 'u' ||
+           hex4(p + 8, &lo) || lo < 0xDC00 || lo > 0xDFFF) {
+            j->p = p;
+            return CPK_ERROR;
+        }
+
+        j->p = p + 12;
+        cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+    }
+
+    if(cp < 0x80) {
+        s[0] = cp;
+        return 1;
+    } else if(cp < 0x800) {
+        s[0] = 0xC0 | (cp >> 6);
+        s[1] = 0x80 | (cp & 0x3F);
+        return 2;
+    } else if(cp < 0x10000) {
+        s[0] = 0xE0 | (cp >> 12);
+        s[1] = 0x80 | ((cp >> 6) & 0x3F);
+        s[2] = 0x80 | (cp & 0x3F);
+        return 3;
+    }
+
+    s[0] = 0xF0 | (cp >> 18);
+    s[1] = 0x80 | ((cp >> 12) & 0x3F);
+    s[2] = 0x80 | ((cp >> 6) & 0x3F);
+    s[3] = 0x80 | (cp & 0x3F);
+    return 4;
+}
+
+/* The first time a key is seen it is tagged, and after that it is a
+   ref to the tag; ids start from 0 in each call */
+static void from_key(json_in_t *j, const uint8_t *s, uint32_t len) {
+    uint64_t hash;
+    uint32_t i, mask;
+    json_tag_t *t, *old;
+
+    if(len > JSON_TAG_KEY_MAX) goto plain;
+
+    hash = cpk_hash64(0, s, len);
+    mask = j->tag_slots - 1;
+
+    for(i = hash & mask; j->tag_slots && j->tags[i].id; i = (i + 1) & mask) {
+        t = &j->tags[i];
+        if(t->hash == hash && t->len == len &&
+           !memcmp(j->keys + t->at, s, len)) {
+            put_ref(j->out, CPK_REF, t->id - 1);
+            return;
+        }
+    }
+
+    if(j->tag_count == JSON_TAGS_MAX) goto plain;
+
+    /* Half full at most, so probes stay short */
+    if((j->tag_count + 1) * 2 > j->tag_slots) {
+        uint32_t n = j->tag_slots ? j->tag_slots * 2 : 64, k;
+
+        old = j->tags;
+        if(!(j->tags = calloc(n, sizeof(*j->tags)))) {
+            j->tags = old;
+            goto plain;
+        }
+
+        for(k = 0; k < j->tag_slots; k++) {
+            if(!old[k].id) continue;
+            for(i = old[k].hash & (n - 1); j->tags[i].id; i = (i + 1) & (n - 1));
+            j->tags[i] = old[k];
+        }
+
+        free(old);
+        j->tag_slots = n;
+        mask = n - 1;
+        for(i = hash & mask; j->tags[i].id; i = (i + 1) & mask);
+    }
+
+    if(grow(&j->keys, &j->keys_size, j->keys_used + len))
+        goto plain;
+
+    t = &j->tags[i];
+    t->hash = hash;
+    t->at = j->keys_used;
+    t->len = len;
+    t->id = ++j->tag_count;
+
+    if(len) memcpy(j->keys + j->keys_used, s, len);
+    j->keys_used += len;
+
+    put_ref(j->out, CPK_TAG, t->id - 1);
+
+ plain:
+    put_string(j->out, s, len);
+}
+
+static int from_string(json_in_t *j, int key) {
+    const uint8_t *s = ++j->p, *stop = string_stop(s, j->end);
+    size_t len = stop - s;
+    int n;
+
+    /* Nothing to unescape: straight from the input */
+    if(stop < j->end && *stop == '"') {
+        j->p = stop + 1;
+        goto emit;
+    }
+
+    if(grow(&j->scratch, &j->scratch_size, len + 64))
+        return from_fail(j, CPK_ERR_ALLOC, CPK_ERR_ALLOC_MSG);
+
+    memcpy(j->scratch, s, len);
+    j->p = stop;
+
+    for(;;) {
+        if(j->p >= j->end) return syntax(j);
+
+        if(*j->p == '"') break;
+        if(*j->p < 0x20) return syntax(j);
+
+        if(grow(&j->scratch, &j->scratch_size, len + 4))
+            return from_fail(j, CPK_ERR_ALLOC, CPK_ERR_ALLOC_MSG);
+
+        if(*j->p == '\\') {
+            if((n = unescape(j, j->scratch + len)) < 0)
+                return syntax(j);
+            len += n;
+            continue;
+        }
+
+        stop = string_stop(j->p, j->end);
+        if(grow(&j->scratch, &j->scratch_size, len + (stop - j->p)))
+            return from_fail(j, CPK_ERR_ALLOC, CPK_ERR_ALLOC_MSG);
+
+        memcpy(j->scratch + len, j->p, stop - j->p);
+        len += stop - j->p;
+        j->p = stop;
+    }
+
+    j->p++;
+    s = j->scratch;
+
+ emit:
+    if(len > UINT32_MAX)
+        return from_fail(j, CPK_ERR_LIMIT, CPK_ERR_LIMIT_MSG);
+
+    if(key && (j->flags & CPK_JSON_TAG_KEYS))
+        from_key(j, s, len);
+    else
+        put_string(j->out, s, len);
+
+    return 0;
+}
+
+static void from_int(json_in_t *j, int neg, uint64_t v) {
+    uint64_t sv = ~v + 1;
+
+    if(!neg || !v) {
+        if(v <= UINT8_MAX)       put_number(j->out, CPK_UINT8, v, 1);
+        else if(v <= UINT16_MAX) put_number(j->out, CPK_UINT16, v, 2);
+        else if(v <= UINT32_MAX) put_number(j->out, CPK_UINT32, v, 4);
+        else                     put_number(j->out, CPK_UINT64, v, 8);
+    } else if(v <= (uint64_t)INT8_MAX + 1) {
+        put_number(j->out, CPK_INT8, sv, 1);
+    } else if(v <= (uint64_t)INT16_MAX + 1) {
+        put_number(j->out, CPK_INT16, sv, 2);
+    } else if(v <= (uint64_t)INT32_MAX + 1) {
+        put_number(j->out, CPK_INT32, sv, 4);
+    } else {
+        put_number(j->out, CPK_INT64, sv, 8);
+    }
+}
+
+static inline int digit(json_in_t *j) {
+    return j->p < j->end && *j->p >= '0' && *j->p <= '9';
+}
+
+/* Powers of ten that doubles hold exactly */
+static const double exact_pow10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static int from_number(json_in_t *j) {
+    const uint8_t *s = j->p;
+    uint64_t v = 0, bits;
+    int neg = 0, big = 0, real = 0, eneg = 0, scale = 0, d;
+    uint32_t e = 0;
+    double dv;
+    float sv;
+
+    if(*j->p == '-') {
+        neg = 1;
+        j->p++;
+    }
+
+    if(!digit(j)) return syntax(j);
+
+    /* Integer and fraction digits both go into v while they fit */
+    if(*j->p == '0') {
+        j->p++;
+    } else {
+        for(; digit(j); j->p++) {
+            d = *j->p - '0';
+            if(v > (UINT64_MAX - d) / 10) big = 1;
+            else if(!big) v = v * 10 + d;
+        }
+    }
+
+    if(j->p < j->end && *j->p == '.') {
+        real = 1;
+        j->p++;
+        if(!digit(j)) return syntax(j);
+
+        for(; digit(j); j->p++) {
+            d = *j->p - '0';
+            if(v > (UINT64_MAX - d) / 10) big = 1;
+            else if(!big) {
+                v = v * 10 + d;
+                scale++;
+            }
+        }
+    }
+
+    if(j->p < j->end && (*j->p == 'e' || *j->p == 'E')) {
+        real = 1;
+        j->p++;
+        if(j->p < j->end && (*j->p == '+' || *j->p == '-'))
+            eneg = *j->p++ == '-';
+        if(!digit(j)) return syntax(j);
+
+        for(; digit(j); j->p++)
+            if(e < 100000) e = e * 10 + (*j->p - '0');
+    }
+
+    if(!real) {
+        if(!big && (!neg || v <= (uint64_t)INT64_MAX + 1)) {
+            from_int(j, neg, v);
+            return 0;
+        }
+    } else if(!big && v <= (1ULL << 53)) {
+        int ex = (eneg ? -(int)e : (int)e) - scale;
+
+        /* Both exact, so one rounding: the same as strtod */
+        if(ex >= -22 && ex <= 22) {
+            dv = ex < 0 ? (double)v / exact_pow10[-ex]
+                        : (double)v * exact_pow10[ex];
+            if(neg) dv = -dv;
+            goto put;
+        }
+    }
+
+    /* strtod wants a terminated copy */
+    if(grow(&j->scratch, &j->scratch_size, j->p - s + 1))
+        return from_fail(j, CPK_ERR_ALLOC, CPK_ERR_ALLOC_MSG);
+
+    memcpy(j->scratch, s, j->p - s);
+    j->scratch[j->p - s] = 0;
+
+    dv = strtod((const char*)j->scratch, NULL);
+
+ put:
+    sv = (float)dv;
+
+    if((double)sv == dv) {
+        uint32_t b32;
+
+        memcpy(&b32, &sv, 4);
+        put_number(j->out, CPK_SINGLE_FLOAT, b32, 4);
+    } else {
+        memcpy(&bits, &dv, 8);
+        put_number(j->out, CPK_DOUBLE_FLOAT, bits, 8);
+    }
+
+    return 0;
+}
+
+static int from_literal(json_in_t *j, const char *word, size_t len,
+                        uint8_t header) {
+    uint8_t *p;
+
+    if((size_t)(j->end - j->p) < len || memcmp(j->p, word, len))
+        return syntax(j);
+
+    j->p += len;
+
+    if((p = room(j->out, 1))) {
+        CPK_STAT_VALUE(j->out->stats, CPK_BOOL);
+        *p = header;
+        put(j->out, 1);
+    }
+
+    return 0;
+}
+
+/* Arrays and objects; the count is filled in at the close */
+static int from_container(json_in_t *j, uint8_t type, uint8_t close) {
+    cpk_output_t *out = j->out;
+    uint8_t *p;
+    size_t at;
+    uint32_t count = 0;
+
+    if(++j->depth > CPK_DEFAULT_MAX_DEPTH)
+        return from_fail(j, CPK_ERR_LIMIT, CPK_ERR_LIMIT_MSG);
+
+    j->p++;
+    skip_space(j);
+
+    if(j->p < j->end && *j->p == close) {
+        j->p++;
+        j->depth--;
+        cpk_encode_container(out, type, 0, 0);
+        return 0;
+    }
+
+    if(!(p = room(out, 5)))
+        return CPK_ERROR;
+
+    CPK_STAT_VALUE(out->stats, CPK_CONTAINER);
+    *p = CPK_CONTAINER | type | CPK_SIZE_32;
+    put(out, 5);
+    at = out->buffer_used - 4;
+
+    for(;;) {
+        if(out->flags & CPK_OUTPUT_OVERFLOW)
+            return CPK_ERROR;
+
+        if(count == UINT32_MAX)
+            return from_fail(j, CPK_ERR_LIMIT, CPK_ERR_LIMIT_MSG);
+
+        if(type == CPK_CONTAINER_MAP) {
+            skip_space(j);
+            if(j->p >= j->end || *j->p != '"') return syntax(j);
+            if(from_string(j, 1)) return CPK_ERROR;
+
+            skip_space(j);
+            if(j->p >= j->end || *j->p != ':') return syntax(j);
+            j->p++;
+        }
+
+        if(from_value(j)) return CPK_ERROR;
+        count++;
+
+        skip_space(j);
+        if(j->p >= j->end) return syntax(j);
+
+        if(*j->p == ',') {
+            j->p++;
+            continue;
+        }
+
+        if(*j->p != close) return syntax(j);
+        j->p++;
+        break;
+    }
+
+    if(!(out->flags & CPK_OUTPUT_OVERFLOW)) {
+        out->buffer[at]     = count >> 24;
+        out->buffer[at + 1] = count >> 16;
+        out->buffer[at + 2] = count >> 8;
+        out->buffer[at + 3] = count;
+    }
+
+    j->depth--;
+    return 0;
+}
+
+static int from_value(json_in_t *j) {
+    skip_space(j);
+    if(j->p >= j->end) return syntax(j);
+
+    switch(*j->p) {
+        case '{': return from_container(j, CPK_CONTAINER_MAP, '}');
+        case '[': return from_container(j, CPK_CONTAINER_VECTOR, ']');
+        case '"': return from_string(j, 0);
+        case 't': return from_literal(j, "true", 4, CPK_TRUE);
+        case 'f': return from_literal(j, "false", 5, CPK_NIL);
+        case 'n': return from_literal(j, "null", 4, CPK_NIL);
+        case '-':
+        case '0': case '1': case '2': case '3': case '4':
+        case '5': case '6': case '7': case '8': case '9':
+            return from_number(j);
+    }
+
+    return syntax(j);
+}
+
+/* Encodes the one JSON value in json[0..len) to out; only whitespace
+   may follow it.  Returns 0, or CPK_ERROR with err set and nothing
+   written to out. */
+int cpk_from_json(cpk_output_t *out, const char *json, size_t len,
+                  uint32_t flags, cpk_object_t *err) {
+    cpk_output_t side;
+    json_in_t j;
+    size_t start = out->buffer_used;
+    uint32_t overflow = out->flags & CPK_OUTPUT_OVERFLOW;
+    int direct = out->fd < 0 && !(out->flags & CPK_OUTPUT_CRC);
+
+    if(err) err->header = 0;
+
+    memset(&j, 0, sizeof(j));
+    j.p = j.start = (const uint8_t*)json;
+    j.end = j.p + len;
+    j.flags = flags;
+
+    if(direct) {
+        j.out = out;
+    } else {
+        cpk_output_init(&side);
+        j.out = &side;
+    }
+
+    if(!from_value(&j)) {
+        skip_space(&j);
+        if(j.p < j.end)
+            from_fail(&j, CPK_ERR_TRAILING, CPK_ERR_TRAILING_MSG);
+    }
+
+    if(!CPK_IS_ERROR(j.err.header) && (j.out->flags & CPK_OUTPUT_OVERFLOW)) {
+        if(j.out->flags & CPK_OUTPUT_FIXED)
+            from_fail(&j, CPK_ERR_LIMIT, CPK_ERR_LIMIT_MSG);
+        else
+            from_fail(&j, CPK_ERR_ALLOC, CPK_ERR_ALLOC_MSG);
+    }
+
+    if(!direct) {
+        if(!CPK_IS_ERROR(j.err.header) &&
+           cpk_write_bytes(out, side.buffer, side.buffer_used) < 0)
+            /* or the descriptor write failed; errno tells which */
+            from_fail(&j, CPK_ERR_ALLOC, CPK_ERR_ALLOC_MSG);
+
+        cpk_output_fini(&side);
+    } else if(CPK_IS_ERROR(j.err.header)) {
+        out->buffer_used = start;
+        out->flags = (out->flags & ~CPK_OUTPUT_OVERFLOW) | overflow;
+    }
+
+    free(j.scratch);
+    free(j.tags);
+    free(j.keys);
+
+    if(CPK_IS_ERROR(j.err.header)) {
+        if(err) *err = j.err;
+        return CPK_ERROR;
+    }
+
+    return 0;
+}
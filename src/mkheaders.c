@@ -0,0 +1,169 @@
+/*
+ * libconspack
+ * Copyright (C) 2012  Ryan Pavlik
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the GNU Lesser General Public
+ * License (LGPL) version 2.1 which accompanies this distribution, and
+ * is available at http://www.gnu.org/licenses/lgpl-2.1.html
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ */
+
+/*
+ * Build-time generator for cpk_header_table.  Every header byte is
+ * classified once, here, using the masks in conspack.h; the library
+ * then dispatches on the resulting table instead of testing masks.
+ */
+
+#include "conspack/conspack.h"
+
+#include <stdio.h>
+
+static const uint8_t number_size[16] = {
+    1, 2, 4, 8,         /* int8 .. int64 */
+    1, 2, 4, 8,         /* uint8 .. uint64 */
+    4, 8,               /* single, double */
+    16, 16,             /* int128, uint128 */
+    0, 0, 0, 0          /* complex, unassigned, unassigned, rational */
+};
+
+static uint8_t classify(unsigned h) {
+    if(CPK_IS_BOOL(h))       return CPK_BOOL;
+    if(CPK_IS_NUMBER(h))     return CPK_NUMBER;
+    if(CPK_IS_CONTAINER(h))  return CPK_CONTAINER;
+    if(CPK_IS_STRING(h))     return CPK_STRING;
+    if(CPK_IS_REMOTE_REF(h)) return CPK_REMOTE_REF;
+    if(CPK_IS_POINTER(h))    return CPK_POINTER;
+    if(CPK_IS_REF(h))        return CPK_REF;
+    if(CPK_IS_TAG(h))        return CPK_TAG;
+    if(CPK_IS_INDEX(h))      return CPK_INDEX;
+    if(CPK_IS_CONS(h))       return CPK_CONS;
+    if(CPK_IS_PACKAGE(h))    return CPK_PACKAGE;
+    if(CPK_IS_SYMBOL(h))     return CPK_SYMBOL;
+    if(CPK_IS_CHAR(h))       return CPK_CHAR;
+    if(CPK_IS_PROPERTIES(h)) return CPK_PROPERTIES;
+
+    return CPK_INVALID;
+}
+
+/* Width of the size field, or 0 for the reserved size code */
+static uint8_t size_width(unsigned h) {
+    switch(h & CPK_SIZE_MASK) {
+        case CPK_SIZE_8:  return 1;
+        case CPK_SIZE_16: return 2;
+        case CPK_SIZE_32: return 4;
+    }
+
+    return 0;
+}
+
+static void describe(unsigned h, cpk_header_info_t *info) {
+    info->kind = classify(h);
+    info->flags = CPK_HD_VALID;
+    info->size = 0;
+    info->payload = 0;
+    info->value = 0;
+    info->numtype = 0;
+    info->children = 0;
+
+    switch(info->kind) {
+        case CPK_BOOL:
+            info->flags |= CPK_HD_INLINE;
+            info->value = h & CPK_TRUE;
+            break;
+
+        case CPK_NUMBER:
+            info->numtype = CPK_NUMBER_TYPE(h);
+            info->payload = number_size[info->numtype];
+
+            if(info->numtype == CPK_COMPLEX || info->numtype == CPK_RATIONAL)
+                info->children = 2;
+            else if(!info->payload)
+                info->flags = 0;
+            break;
+
+        case CPK_CONTAINER:
+            if(h & CPK_CONTAINER_FIXED)
+                info->flags |= CPK_HD_FIXED;
+            if(h & CPK_CONTAINER_MAP)
+                info->flags |= CPK_HD_MAP;
+            if((h & CPK_CONTAINER_TYPE_MASK) == CPK_CONTAINER_TMAP)
+                info->flags |= CPK_HD_TMAP;
+            /* fall through */
+
+        case CPK_STRING:
+        case CPK_POINTER:
+            info->size = size_width(h);
+            break;
+
+        case CPK_REF:
+        case CPK_TAG:
+        case CPK_INDEX:
+            if(h & CPK_REFTAG_INLINE) {
+                info->flags |= CPK_HD_INLINE;
+                info->value = h & 0xF;
+            } else {
+                info->size = size_width(h);
+            }
+
+            /* A tag is followed by the object it tags */
+            if(info->kind == CPK_TAG)
+                info->children = 1;
+            break;
+
+        case CPK_REMOTE_REF:
+        case CPK_PACKAGE:
+            info->children = 1;
+            break;
+
+        case CPK_CONS:
+            info->children = 2;
+            break;
+
+        case CPK_SYMBOL:
+            if(CPK_IS_KEYWORD(h)) {
+                info->flags |= CPK_HD_KEYWORD;
+                info->children = 1;
+            } else {
+                info->children = 2;
+            }
+            break;
+
+        default:
+            /* Characters and properties are recognized but not decoded */
+            info->flags = 0;
+    }
+
+    if((info->flags & CPK_HD_VALID) && !(info->flags & CPK_HD_INLINE) &&
+       (info->kind == CPK_CONTAINER || info->kind == CPK_STRING ||
+        info->kind == CPK_POINTER || info->kind == CPK_REF ||
+        info->kind == CPK_TAG || info->kind == CPK_INDEX) && !info->size)
+        info->flags = CPK_HD_BAD_SIZE;
+}
+
+int main() {
+    cpk_header_info_t info;
+    unsigned h = 0;
+
+    printf("/* Generated by mkheaders from the masks in conspack.h.  "
+           "Do not edit. */\n\n");
+    printf("#include \"conspack/conspack.h\"\n\n");
+    printf("const cpk_header_info_t cpk_header_table[256] = {\n");
+    printf("    /*       kind  flags size pay  val  num  kids */\n");
+
+    for(h = 0; h < 256; h++) {
+        describe(h, &info);
+        printf("    /* %02X */ { 0x%02X, 0x%02X, %u, %2u, %2u, 0x%X, %u }%s\n",
+               h, info.kind, info.flags, info.size, info.payload,
+               info.value, info.numtype, info.children,
+               h < 255 ? "," : "");
+    }
+
+    printf("};\n");
+    return 0;
+}
@@ -0,0 +1,447 @@
+/*
+ * libconspack
+ * Copyright (C) 2012  Ryan Pavlik
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the GNU Lesser General Public
+ * License (LGPL) version 2.1 which accompanies this distribution, and
+ * is available at http://www.gnu.org/licenses/lgpl-2.1.html
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ */
+
+#include "config.h"
+#include "conspack/conspack.h"
+#include "internal.h"
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+
+#ifdef HAVE_PTHREAD_H
+#  include <pthread.h>
+#  include <sched.h>
+#endif
+
+/*
+ * A reader thread frames messages from a descriptor into preallocated
+ * slots taken from a free ring and pushes them onto a work ring;
+ * decode workers pop them, decode each into its slot's arena and push
+ * the slot onto a completion ring for the consumer.  A slot goes back
+ * on the free ring when the consumer releases it, so the number of
+ * slots bounds memory and makes the reader wait when consumers fall
+ * behind.  Every ring can hold all the slots, so only the free ring
+ * can ever run dry.
+ */
+
+#ifdef HAVE_PTHREAD_H
+
+struct _cpk_pipeline {
+    int fd;
+    const cpk_limits_t *limits;
+
+    uint32_t nworkers;
+    uint32_t nslots;
+    cpk_msg_t *slots;
+
+    cpk_ring_t *free_ring;
+    cpk_ring_t *work_ring;
+    cpk_ring_t *done_ring;
+
+    pthread_t reader;
+    pthread_t *workers;
+
+    int stop;
+    int reader_done;
+    uint32_t workers_live;
+
+    cpk_pipeline_stats_t stats;
+
+    int failed;
+    cpk_object_t err;
+};
+
+#define STAT_INC(p,field,n) \
+    __atomic_fetch_add(&(p)->stats.field, (n), __ATOMIC_RELAXED)
+
+/* Spin briefly, then yield, then sleep; waits here are expected to be
+   short, but a stalled stage must not burn a core indefinitely */
+static void backoff(uint32_t *spins) {
+    struct timespec ts = { 0, 50000 };
+
+    if(*spins < 64) {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    } else if(*spins < 128) {
+        sched_yield();
+    } else {
+        nanosleep(&ts, NULL);
+    }
+
+    (*spins)++;
+}
+
+static void reader_fail(cpk_pipeline_t *p, uint32_t code, const char *msg,
+                        uint8_t value, size_t pos) {
+    cpk_err(&p->err, code, msg, value, pos);
+    p->failed = 1;
+}
+
+static cpk_msg_t* reader_slot(cpk_pipeline_t *p) {
+    void *msg = NULL;
+    uint32_t spins = 0;
+
+    while(cpk_ring_pop(p->free_ring, &msg)) {
+        if(__atomic_load_n(&p->stop, __ATOMIC_ACQUIRE))
+            return NULL;
+
+        if(!spins) STAT_INC(p, reader_stalls, 1);
+        backoff(&spins);
+    }
+
+    return msg;
+}
+
+static int reader_publish(cpk_pipeline_t *p, const uint8_t *data,
+                          size_t len, uint64_t seq) {
+    cpk_msg_t *msg = NULL;
+    uint8_t *grown = NULL;
+    uint32_t depth = 0;
+
+    if(!(msg = reader_slot(p)))
+        return -1;
+
+    if(msg->cap < len) {
+        if(!(grown = realloc(msg->data, len))) {
+            cpk_ring_push(p->free_ring, msg);
+            return -1;
+        }
+
+        msg->data = grown;
+        msg->cap = len;
+    }
+
+    memcpy(msg->data, data, len);
+    msg->len = len;
+    msg->seq = seq;
+    msg->obj = NULL;
+
+    cpk_ring_push(p->work_ring, msg);
+
+    depth = cpk_ring_depth(p->work_ring);
+    if(depth > __atomic_load_n(&p->stats.max_work_depth, __ATOMIC_RELAXED))
+        __atomic_store_n(&p->stats.max_work_depth, depth, __ATOMIC_RELAXED);
+
+    STAT_INC(p, messages, 1);
+    STAT_INC(p, bytes, len);
+    return 0;
+}
+
+static void* reader_main(void *arg) {
+    cpk_pipeline_t *p = arg;
+    cpk_object_t err;
+    uint8_t *buf = NULL, *grown = NULL;
+    size_t cap = CPK_PIPELINE_READ, start = 0, end = 0, span = 0, pos = 0;
+    uint64_t seq = 0;
+    ssize_t n = 0;
+    int eof = 0;
+
+    if(!(buf = malloc(cap))) {
+        reader_fail(p, CPK_ERR_ALLOC, CPK_ERR_ALLOC_MSG, 0, 0);
+        goto done;
+    }
+
+    while(!__atomic_load_n(&p->stop, __ATOMIC_ACQUIRE)) {
+        /* Publish every complete message in the buffer */
+        while(start < end) {
+            err.header = 0;
+            span = cpk_validate_span(buf + start, end - start, p->limits, &err);
+
+            if(!span) {
+                if(err.error.code == CPK_ERR_EOF && !eof) break;
+
+                reader_fail(p, err.error.code, err.error.reason,
+                            err.error.value, pos + err.error.pos);
+                goto done;
+            }
+
+            if(reader_publish(p, buf + start, span, seq++)) {
+                if(!__atomic_load_n(&p->stop, __ATOMIC_ACQUIRE))
+                    reader_fail(p, CPK_ERR_ALLOC, CPK_ERR_ALLOC_MSG, 0, pos);
+                goto done;
+            }
+
+            start += span;
+            pos += span;
+        }
+
+        if(eof) break;
+
+        /* Keep the partial message at the front, growing the buffer
+           when it fills it entirely */
+        if(start) {
+            memmove(buf, buf + start, end - start);
+            end -= start;
+            start = 0;
+        }
+
+        if(end == cap) {
+            if(cap >= CPK_PIPELINE_MAX_MESSAGE) {
+                reader_fail(p, CPK_ERR_LIMIT, CPK_ERR_LIMIT_MSG, 0, pos);
+                goto done;
+            }
+
+            if(!(grown = realloc(buf, cap * 2))) {
+                reader_fail(p, CPK_ERR_ALLOC, CPK_ERR_ALLOC_MSG, 0, pos);
+                goto done;
+            }
+
+            buf = grown;
+            cap *= 2;
+        }
+
+        n = read(p->fd, buf + end, cap - end);
+        STAT_INC(p, reads, 1);
+
+        if(n < 0) {
+            if(errno == EINTR) continue;
+
+            reader_fail(p, CPK_ERR_IO, CPK_ERR_IO_MSG, errno, pos);
+            goto done;
+        }
+
+        if(!n) eof = 1;
+        end += n;
+    }
+
+ done:
+    free(buf);
+    __atomic_store_n(&p->reader_done, 1, __ATOMIC_RELEASE);
+
+    return NULL;
+}
+
+static void* worker_main(void *arg) {
+    cpk_pipeline_t *p = arg;
+    cpk_input_t in;
+    cpk_msg_t *msg = NULL;
+    void *ptr = NULL;
+    uint32_t spins = 0;
+
+    for(;;) {
+        if(cpk_ring_pop(p->work_ring, &ptr)) {
+            /* The reader pushes before it says it is done, so an empty
+               ring after that really is the end */
+            if(__atomic_load_n(&p->reader_done, __ATOMIC_ACQUIRE) &&
+               cpk_ring_pop(p->work_ring, &ptr))
+                break;
+
+            if(!ptr) {
+                if(!spins) STAT_INC(p, worker_stalls, 1);
+                backoff(&spins);
+                continue;
+            }
+        }
+
+        spins = 0;
+        msg = ptr;
+        ptr = NULL;
+
+        cpk_arena_reset(&msg->arena);
+        cpk_input_init(&in, msg->data, msg->len);
+        cpk_input_set_limits(&in, p->limits);
+        cpk_input_set_arena(&in, &msg->arena);
+
+        msg->obj = cpk_decode_r(&in);
+
+        cpk_ring_push(p->done_ring, msg);
+    }
+
+    __atomic_fetch_sub(&p->workers_live, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/* workers of 0 uses one per online processor; slots of 0 gives each
+   worker CPK_PIPELINE_SLOTS messages in flight.  The pipeline owns
+   neither the descriptor nor the limits. */
+cpk_pipeline_t* cpk_pipeline_new(int fd, uint32_t workers, uint32_t slots,
+                                 const cpk_limits_t *limits) {
+    cpk_pipeline_t *p = NULL;
+    uint32_t i = 0;
+
+    if(!workers) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = n > 0 ? (uint32_t)n : 1;
+    }
+
+    if(!slots) slots = workers * CPK_PIPELINE_SLOTS;
+
+    if(!(p = calloc(1, sizeof(cpk_pipeline_t))))
+        return NULL;
+
+    p->fd = fd;
+    p->limits = limits;
+    p->nslots = slots;
+
+    p->slots = calloc(slots, sizeof(cpk_msg_t));
+    p->workers = calloc(workers, sizeof(pthread_t));
+    p->free_ring = cpk_ring_new(slots);
+    p->work_ring = cpk_ring_new(slots);
+    p->done_ring = cpk_ring_new(slots);
+
+    if(!p->slots || !p->workers || !p->free_ring ||
+       !p->work_ring || !p->done_ring)
+        goto error;
+
+    for(i = 0; i < slots; i++) {
+        cpk_arena_init(&p->slots[i].arena, 0);
+        cpk_ring_push(p->free_ring, &p->slots[i]);
+    }
+
+    for(i = 0; i < workers; i++) {
+        if(pthread_create(&p->workers[i], NULL, worker_main, p))
+            break;
+
+        p->nworkers++;
+        p->workers_live++;
+    }
+
+    if(!p->nworkers || pthread_create(&p->reader, NULL, reader_main, p)) {
+        __atomic_store_n(&p->reader_done, 1, __ATOMIC_RELEASE);
+
+        for(i = 0; i < p->nworkers; i++)
+            pthread_join(p->workers[i], NULL);
+        p->nworkers = 0;
+
+        goto error;
+    }
+
+    return p;
+
+ error:
+    cpk_ring_free(p->done_ring);
+    cpk_ring_free(p->work_ring);
+    cpk_ring_free(p->free_ring);
+    free(p->workers);
+    free(p->slots);
+    free(p);
+
+    return NULL;
+}
+
+/* Returns the next decoded message, in completion order (see seq), or
+   NULL once the input is exhausted or the reader has failed */
+cpk_msg_t* cpk_pipeline_next(cpk_pipeline_t *p) {
+    void *msg = NULL;
+    uint32_t spins = 0;
+
+    for(;;) {
+        if(!cpk_ring_pop(p->done_ring, &msg))
+            return msg;
+
+        if(!__atomic_load_n(&p->workers_live, __ATOMIC_ACQUIRE))
+            return cpk_ring_pop(p->done_ring, &msg) ? NULL : msg;
+
+        if(!spins) STAT_INC(p, consumer_stalls, 1);
+        backoff(&spins);
+    }
+}
+
+/* Hands a message's slot back to the reader; its tree goes with it */
+void cpk_pipeline_release(cpk_pipeline_t *p, cpk_msg_t *msg) {
+    msg->obj = NULL;
+    cpk_ring_push(p->free_ring, msg);
+}
+
+const cpk_object_t* cpk_pipeline_error(cpk_pipeline_t *p) {
+    if(!__atomic_load_n(&p->reader_done, __ATOMIC_ACQUIRE) || !p->failed)
+        return NULL;
+
+    return &p->err;
+}
+
+void cpk_pipeline_stats(cpk_pipeline_t *p, cpk_pipeline_stats_t *stats) {
+    stats->messages = __atomic_load_n(&p->stats.messages, __ATOMIC_RELAXED);
+    stats->bytes = __atomic_load_n(&p->stats.bytes, __ATOMIC_RELAXED);
+    stats->reads = __atomic_load_n(&p->stats.reads, __ATOMIC_RELAXED);
+
+    stats->reader_stalls =
+        __atomic_load_n(&p->stats.reader_stalls, __ATOMIC_RELAXED);
+    stats->worker_stalls =
+        __atomic_load_n(&p->stats.worker_stalls, __ATOMIC_RELAXED);
+    stats->consumer_stalls =
+        __atomic_load_n(&p->stats.consumer_stalls, __ATOMIC_RELAXED);
+
+    stats->work_depth = cpk_ring_depth(p->work_ring);
+    stats->done_depth = cpk_ring_depth(p->done_ring);
+    stats->max_work_depth =
+        __atomic_load_n(&p->stats.max_work_depth, __ATOMIC_RELAXED);
+}
+
+/* Stops the pipeline and releases every slot.  The reader is joined,
+   so if it may be blocked on a descriptor that will not reach EOF,
+   shut the descriptor down first. */
+void cpk_pipeline_free(cpk_pipeline_t *p) {
+    uint32_t i = 0;
+
+    if(!p) return;
+
+    __atomic_store_n(&p->stop, 1, __ATOMIC_RELEASE);
+    pthread_join(p->reader, NULL);
+
+    for(i = 0; i < p->nworkers; i++)
+        pthread_join(p->workers[i], NULL);
+
+    for(i = 0; i < p->nslots; i++) {
+        cpk_arena_fini(&p->slots[i].arena);
+        free(p->slots[i].data);
+    }
+
+    cpk_ring_free(p->done_ring);
+    cpk_ring_free(p->work_ring);
+    cpk_ring_free(p->free_ring);
+    free(p->workers);
+    free(p->slots);
+    free(p);
+}
+
+#else /* !HAVE_PTHREAD_H */
+
+/* The pipeline needs threads; without them there is nothing to run */
+
+cpk_pipeline_t* cpk_pipeline_new(int fd, uint32_t workers, uint32_t slots,
+                                 const cpk_limits_t *limits) {
+    (void)fd; (void)workers; (void)slots; (void)limits;
+    return NULL;
+}
+
+cpk_msg_t* cpk_pipeline_next(cpk_pipeline_t *p) {
+    (void)p;
+    return NULL;
+}
+
+void cpk_pipeline_release(cpk_pipeline_t *p, cpk_msg_t *msg) {
+    (void)p; (void)msg;
+}
+
+const cpk_object_t* cpk_pipeline_error(cpk_pipeline_t *p) {
+    (void)p;
+    return NULL;
+}
+
+void cpk_pipeline_stats(cpk_pipeline_t *p, cpk_pipeline_stats_t *stats) {
+    (void)p;
+    memset(stats, 0, sizeof(*stats));
+}
+
+void cpk_pipeline_free(cpk_pipeline_t *p) {
+    (void)p;
+}
+
+#endif /* HAVE_PTHREAD_H */
@@ -0,0 +1,198 @@
+/*
+ * libconspack
+ * Copyright (C) 2012  Ryan Pavlik
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the GNU Lesser General Public
+ * License (LGPL) version 2.1 which accompanies this distribution, and
+ * is available at http://www.gnu.org/licenses/lgpl-2.1.html
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ */
+
+#include "config.h"
+#include "conspack/conspack.h"
+
+#include <unistd.h>
+
+#ifdef HAVE_PTHREAD_H
+#  include <pthread.h>
+#endif
+
+/* A fixed set of workers that all run the same function on each
+   cpk_pool_run; the caller's thread takes part as thread 0.  How the
+   work is divided is up to the function, usually by claiming items
+   from a shared atomic index. */
+struct _cpk_pool {
+    uint32_t nthreads;
+
+#ifdef HAVE_PTHREAD_H
+    pthread_t *threads;
+
+    pthread_mutex_t run_lock;
+    pthread_mutex_t lock;
+    pthread_cond_t start, done;
+
+    uint64_t generation;
+    uint32_t running;
+    int stop;
+
+    cpk_pool_fn_t fn;
+    void *arg;
+#endif
+};
+
+#ifdef HAVE_PTHREAD_H
+typedef struct _pool_worker {
+    cpk_pool_t *pool;
+    uint32_t index;
+} pool_worker_t;
+
+static void* pool_worker(void *ptr) {
+    pool_worker_t self = *(pool_worker_t*)ptr;
+    cpk_pool_t *pool = self.pool;
+    uint64_t seen = 0;
+    cpk_pool_fn_t fn = NULL;
+    void *arg = NULL;
+
+    free(ptr);
+
+    pthread_mutex_lock(&pool->lock);
+
+    for(;;) {
+        while(pool->generation == seen && !pool->stop)
+            pthread_cond_wait(&pool->start, &pool->lock);
+
+        if(pool->stop) break;
+
+        seen = pool->generation;
+        fn = pool->fn;
+        arg = pool->arg;
+        pthread_mutex_unlock(&pool->lock);
+
+        fn(arg, self.index);
+
+        pthread_mutex_lock(&pool->lock);
+        if(!--pool->running)
+            pthread_cond_signal(&pool->done);
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+#endif
+
+/* nthreads of 0 uses one thread per online processor */
+cpk_pool_t* cpk_pool_new(uint32_t nthreads) {
+    cpk_pool_t *pool = NULL;
+#ifdef HAVE_PTHREAD_H
+    pool_worker_t *w = NULL;
+    uint32_t i = 0;
+#endif
+
+    if(!nthreads) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = n > 0 ? (uint32_t)n : 1;
+    }
+
+    if(!(pool = calloc(1, sizeof(cpk_pool_t))))
+        return NULL;
+
+#ifndef HAVE_PTHREAD_H
+    pool->nthreads = 1;
+#else
+    pool->nthreads = nthreads;
+
+    if(nthreads > 1 &&
+       !(pool->threads = calloc(nthreads - 1, sizeof(pthread_t)))) {
+        free(pool);
+        return NULL;
+    }
+
+    pthread_mutex_init(&pool->run_lock, NULL);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    /* A pool short of threads still works, just with fewer of them */
+    for(i = 1; i < nthreads; i++) {
+        if(!(w = malloc(sizeof(*w)))) break;
+
+        w->pool = pool;
+        w->index = i;
+
+        if(pthread_create(&pool->threads[i - 1], NULL, pool_worker, w)) {
+            free(w);
+            break;
+        }
+    }
+
+    pool->nthreads = i;
+#endif
+
+    return pool;
+}
+
+void cpk_pool_free(cpk_pool_t *pool) {
+#ifdef HAVE_PTHREAD_H
+    uint32_t i = 0;
+#endif
+
+    if(!pool) return;
+
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    for(i = 1; i < pool->nthreads; i++)
+        pthread_join(pool->threads[i - 1], NULL);
+
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->start);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_mutex_destroy(&pool->run_lock);
+    free(pool->threads);
+#endif
+
+    free(pool);
+}
+
+uint32_t cpk_pool_size(cpk_pool_t *pool) {
+    return pool ? pool->nthreads : 1;
+}
+
+/* Calls fn(arg, i) once on every thread i of the pool and returns when
+   all have finished.  A NULL pool runs fn on the caller alone. */
+void cpk_pool_run(cpk_pool_t *pool, cpk_pool_fn_t fn, void *arg) {
+    if(!pool || pool->nthreads == 1) {
+        fn(arg, 0);
+        return;
+    }
+
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_lock(&pool->run_lock);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->fn = fn;
+    pool->arg = arg;
+    pool->running = pool->nthreads - 1;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    fn(arg, 0);
+
+    pthread_mutex_lock(&pool->lock);
+    while(pool->running)
+        pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+
+    pthread_mutex_unlock(&pool->run_lock);
+#endif
+}
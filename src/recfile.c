@@ -0,0 +1,727 @@
+/*
+ * libconspack
+ * Copyright (C) 2012  Ryan Pavlik
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the GNU Lesser General Public
+ * License (LGPL) version 2.1 which accompanies this distribution, and
+ * is available at http://www.gnu.org/licenses/lgpl-2.1.html
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ */
+
+#include "config.h"
+#include "conspack/conspack.h"
+#include "internal.h"
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_SYS_MMAN_H
+#  include <sys/mman.h>
+#endif
+
+/*
+ * A record file, with every integer big-endian as elsewhere in conspack:
+ *
+ *   header   "CPKF", u8 version, u8 flags, u16 reserved
+ *   records  u32 length, u32 CRC-32C of the payload if CPK_RECFILE_CRC,
+ *            then the payload
+ *   index    u64 offset of records 0, stride, 2 * stride, ...
+ *   trailer  u64 index offset, u64 record count, u32 stride,
+ *            u32 CRC-32C of the index and the three fields before it
+ *            (of the index alone in version 1), u32 reserved, "CPKX"
+ *
+ * The index and trailer are only written when the writer closes.  A
+ * file without them, because its writer died, is still readable: the
+ * reader walks the records to rebuild the index and stops at a torn
+ * last record (which, without checksums, it can only spot by length).
+ */
+
+#define RECFILE_MAGIC   0x43504B46  /* "CPKF" */
+#define RECFILE_XMAGIC  0x43504B58  /* "CPKX" */
+#define RECFILE_VERSION 2
+#define RECFILE_HEADER  8
+#define RECFILE_TRAILER 32
+
+/* Records are buffered and written out in batches of about this much */
+#define RECFILE_FLUSH   65536
+
+/* Index groups claimed per scan chunk is the group count divided by
+   this many per thread, as for batches */
+#define RECFILE_CHUNKS_PER_THREAD 16
+
+typedef struct _recfile_index {
+    uint32_t flags;
+    uint32_t stride;
+    uint64_t count;
+    uint64_t end;       /* first byte past the last record */
+
+    size_t n;
+    size_t capacity;
+    uint64_t *offsets;
+} recfile_index_t;
+
+struct _cpk_recfile {
+    uint8_t *map;
+    size_t size;
+    int mapped;
+    uint32_t flags;
+
+    recfile_index_t idx;
+};
+
+struct _cpk_recwriter {
+    int fd;
+    int failed;
+    uint32_t prefix;
+
+    cpk_output_t out;
+    uint64_t base;      /* file offset of out.buffer[0] */
+    size_t mark;        /* start of the open record in out */
+    int open;
+
+    recfile_index_t idx;
+};
+
+static uint32_t get32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return net32(v);
+}
+
+static uint64_t get64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return net64(v);
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+    v = net32(v);
+    memcpy(p, &v, 4);
+}
+
+static uint32_t record_prefix(uint32_t flags) {
+    return flags & CPK_RECFILE_CRC ? 8 : 4;
+}
+
+static int index_push(recfile_index_t *idx, uint64_t offset) {
+    uint64_t *offsets = NULL;
+    size_t cap = idx->capacity;
+
+    if(idx->n == cap) {
+        cap = cap ? cap * 2 : 64;
+        if(!(offsets = realloc(idx->offsets, cap * sizeof(uint64_t))))
+            return -1;
+
+        idx->offsets = offsets;
+        idx->capacity = cap;
+    }
+
+    idx->offsets[idx->n++] = offset;
+    return 0;
+}
+
+/* Rebuilds the index by walking records up to limit */
+static int index_walk(recfile_index_t *idx, const uint8_t *map,
+                      uint64_t limit) {
+    uint32_t prefix = record_prefix(idx->flags), len = 0;
+    uint64_t off = RECFILE_HEADER;
+
+    idx->n = 0;
+    idx->count = 0;
+
+    while(limit - off >= prefix) {
+        len = get32(map + off);
+        if(limit - off - prefix < len)
+            break;
+
+        if((idx->flags & CPK_RECFILE_CRC) &&
+           cpk_crc32c(0, map + off + prefix, len) != get32(map + off + 4))
+            break;
+
+        if(!(idx->count % idx->stride) && index_push(idx, off))
+            return -1;
+
+        idx->count++;
+        off += prefix + len;
+    }
+
+    idx->end = off;
+    return 0;
+}
+
+/* Reads the footer index if it is intact, and walks the records if not */
+static int index_load(recfile_index_t *idx, const uint8_t *map,
+                      uint64_t size) {
+    const uint8_t *t = NULL;
+    uint64_t ioff = 0, count = 0, n = 0, i = 0, limit = size;
+    uint32_t stride = 0, summed = 0;
+
+    if(size < RECFILE_HEADER || get32(map) != RECFILE_MAGIC ||
+       !map[4] || map[4] > RECFILE_VERSION) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    idx->flags = map[5] & CPK_RECFILE_CRC;
+    if(!idx->stride) idx->stride = CPK_RECFILE_STRIDE;
+
+    if(size < RECFILE_HEADER + RECFILE_TRAILER ||
+       get32(map + size - 4) != RECFILE_XMAGIC)
+        return index_walk(idx, map, limit);
+
+    t = map + size - RECFILE_TRAILER;
+
+    ioff = get64(t);
+    count = get64(t + 8);
+    stride = get32(t + 16);
+
+    if(ioff < RECFILE_HEADER || ioff > size - RECFILE_TRAILER)
+        return index_walk(idx, map, limit);
+
+    limit = ioff;
+    if(!stride)
+        return index_walk(idx, map, limit);
+
+    /* The index ends where the trailer starts, so one sum covers both */
+    n = count / stride + (count % stride != 0);
+    summed = map[4] > 1 ? 20 : 0;
+    if((size - RECFILE_TRAILER - ioff) / 8 != n ||
+       (size - RECFILE_TRAILER - ioff) % 8 ||
+       cpk_crc32c(0, map + ioff, n * 8 + summed) != get32(t + 20))
+        return index_walk(idx, map, limit);
+
+    idx->n = 0;
+    for(i = 0; i < n; i++) {
+        uint64_t off = get64(map + ioff + i * 8);
+
+        if(off >= ioff || (i && off <= idx->offsets[i - 1]) ||
+           (!i && off != RECFILE_HEADER))
+            return index_walk(idx, map, limit);
+
+        if(index_push(idx, off))
+            return -1;
+    }
+
+    idx->stride = stride;
+    idx->count = count;
+    idx->end = ioff;
+    return 0;
+}
+
+static int map_file(int fd, uint8_t **map, size_t *size, int *mapped) {
+    struct stat st;
+    size_t got = 0;
+    ssize_t n = 0;
+
+    if(fstat(fd, &st))
+        return -1;
+
+    *size = st.st_size;
+    *mapped = 0;
+    if(!*size) {
+        *map = NULL;
+        return 0;
+    }
+
+#ifdef HAVE_SYS_MMAN_H
+    *map = mmap(NULL, *size, PROT_READ, MAP_SHARED, fd, 0);
+    if(*map != MAP_FAILED) {
+        *mapped = 1;
+        return 0;
+    }
+#endif
+
+    if(!(*map = malloc(*size)))
+        return -1;
+
+    while(got < *size) {
+        n = pread(fd, *map + got, *size - got, got);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) {
+            free(*map);
+            *map = NULL;
+            if(!n) errno = EIO;
+            return -1;
+        }
+        got += n;
+    }
+
+    return 0;
+}
+
+static void unmap_file(uint8_t *map, size_t size, int mapped) {
+#ifdef HAVE_SYS_MMAN_H
+    if(mapped) {
+        munmap(map, size);
+        return;
+    }
+#endif
+    free(map);
+}
+
+static int write_all(int fd, const uint8_t *buf, size_t len) {
+    ssize_t n = 0;
+
+    while(len) {
+        n = write(fd, buf, len);
+        if(n < 0 && errno == EINTR) continue;
+        if(n < 0) return -1;
+
+        buf += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+ /* Writing */
+
+static int writer_header(cpk_recwriter_t *w) {
+    cpk_write32(&w->out, RECFILE_MAGIC);
+    cpk_write8(&w->out, RECFILE_VERSION);
+    cpk_write8(&w->out, w->idx.flags);
+    cpk_write16(&w->out, 0);
+
+    return w->out.flags & CPK_OUTPUT_OVERFLOW ? -1 : 0;
+}
+
+/* Picks up the index of an existing file and drops its footer, so new
+   records follow the old ones.  An older file is marked current, as
+   its new footer will be. */
+static int writer_reopen(cpk_recwriter_t *w) {
+    uint8_t *map = NULL, version = RECFILE_VERSION;
+    size_t mapsize = 0;
+    int mapped = 0, ret = 0, old = 0;
+
+    if(map_file(w->fd, &map, &mapsize, &mapped))
+        return -1;
+
+    ret = index_load(&w->idx, map, mapsize);
+    if(!ret) old = map[4] != RECFILE_VERSION;
+    unmap_file(map, mapsize, mapped);
+    if(ret) return -1;
+
+    w->base = w->idx.end;
+    if((old && pwrite(w->fd, &version, 1, 4) != 1) ||
+       ftruncate(w->fd, w->base) ||
+       lseek(w->fd, w->base, SEEK_SET) < 0)
+        return -1;
+
+    return 0;
+}
+
+/* Opens path for writing, truncating it unless flags has
+   CPK_RECFILE_APPEND.  Appending keeps the existing file's checksum
+   setting and stride.  A stride of 0 selects CPK_RECFILE_STRIDE;
+   larger strides shrink the index and lengthen lookups. */
+cpk_recwriter_t* cpk_recwriter_open(const char *path, uint32_t flags,
+                                    uint32_t stride) {
+    cpk_recwriter_t *w = NULL;
+    struct stat st;
+    int oflags = O_RDWR | O_CREAT;
+
+    if(!(w = calloc(1, sizeof(cpk_recwriter_t))))
+        return NULL;
+
+    w->idx.flags = flags & CPK_RECFILE_CRC;
+    w->idx.stride = stride ? stride : CPK_RECFILE_STRIDE;
+    cpk_output_init(&w->out);
+
+    if(!(flags & CPK_RECFILE_APPEND))
+        oflags |= O_TRUNC;
+
+    if((w->fd = open(path, oflags | O_CLOEXEC, 0666)) < 0)
+        goto error;
+
+    if(fstat(w->fd, &st))
+        goto error;
+
+    if(st.st_size) {
+        if(writer_reopen(w))
+            goto error;
+    } else if(writer_header(w))
+        goto error;
+
+    w->prefix = record_prefix(w->idx.flags);
+    return w;
+
+ error:
+    if(w->fd >= 0) close(w->fd);
+    cpk_output_fini(&w->out);
+    free(w->idx.offsets);
+    free(w);
+    return NULL;
+}
+
+uint64_t cpk_recwriter_count(cpk_recwriter_t *w) {
+    return w->idx.count;
+}
+
+/* Starts a record and returns the output to encode it into; only the
+   cpk_write and cpk_encode functions may be used on it, and it is only
+   valid until the record is committed or cancelled */
+cpk_output_t* cpk_recwriter_begin(cpk_recwriter_t *w) {
+    if(w->failed)
+        return NULL;
+
+    cpk_recwriter_cancel(w);
+
+    w->mark = w->out.buffer_used;
+    cpk_write32(&w->out, 0);
+    if(w->idx.flags & CPK_RECFILE_CRC) {
+        cpk_write32(&w->out, 0);
+        cpk_output_set_crc(&w->out, 1);
+    }
+
+    if(w->out.flags & CPK_OUTPUT_OVERFLOW) {
+        cpk_recwriter_cancel(w);
+        return NULL;
+    }
+
+    w->open = 1;
+    return &w->out;
+}
+
+/* Drops the open record, if any */
+void cpk_recwriter_cancel(cpk_recwriter_t *w) {
+    if(w->open || (w->out.flags & CPK_OUTPUT_OVERFLOW)) {
+        w->out.buffer_used = w->mark;
+        w->out.flags &= ~CPK_OUTPUT_OVERFLOW;
+    }
+
+    w->open = 0;
+}
+
+/* Fills in the open record's prefix and indexes it.  A record that
+   failed to encode or is over 4GB is dropped and CPK_ERROR returned,
+   but the writer remains usable. */
+int cpk_recwriter_commit(cpk_recwriter_t *w) {
+    uint8_t *rec = w->out.buffer + w->mark;
+    uint64_t len = 0;
+
+    if(!w->open || w->failed || (w->out.flags & CPK_OUTPUT_OVERFLOW))
+        goto drop;
+
+    len = w->out.buffer_used - w->mark - w->prefix;
+    if(len > UINT32_MAX)
+        goto drop;
+
+    if(!(w->idx.count % w->idx.stride) &&
+       index_push(&w->idx, w->base + w->mark))
+        goto drop;
+
+    /* The payload was summed as it was encoded */
+    put32(rec, len);
+    if(w->idx.flags & CPK_RECFILE_CRC)
+        put32(rec + 4, cpk_output_crc(&w->out));
+
+    w->idx.count++;
+    w->open = 0;
+
+    if(w->out.buffer_used >= RECFILE_FLUSH)
+        return cpk_recwriter_flush(w);
+
+    return 0;
+
+ drop:
+    cpk_recwriter_cancel(w);
+    return CPK_ERROR;
+}
+
+int cpk_recwriter_append(cpk_recwriter_t *w, const uint8_t *data,
+                         size_t len) {
+    cpk_output_t *out = NULL;
+
+    if(!(out = cpk_recwriter_begin(w)))
+        return CPK_ERROR;
+
+    cpk_write_bytes(out, data, len);
+    return cpk_recwriter_commit(w);
+}
+
+/* Writes out committed records; an open record stays buffered.  After
+   a failed write the writer only accepts cpk_recwriter_close. */
+int cpk_recwriter_flush(cpk_recwriter_t *w) {
+    size_t done = w->open ? w->mark : w->out.buffer_used;
+
+    if(w->failed)
+        return CPK_ERROR;
+
+    if(write_all(w->fd, w->out.buffer, done)) {
+        w->failed = 1;
+        return CPK_ERROR;
+    }
+
+    cpk_output_crc(&w->out);
+    memmove(w->out.buffer, w->out.buffer + done, w->out.buffer_used - done);
+    w->out.buffer_used -= done;
+    w->out.crc_pos = w->out.buffer_used;
+    w->base += done;
+    if(w->open) w->mark = 0;
+
+    return 0;
+}
+
+/* Drops any open record, writes the rest, the index and the trailer,
+   and frees w */
+int cpk_recwriter_close(cpk_recwriter_t *w) {
+    recfile_index_t *idx = &w->idx;
+    uint8_t *buf = NULL;
+    size_t i = 0;
+    int ret = 0;
+
+    cpk_recwriter_cancel(w);
+    cpk_output_set_crc(&w->out, 0);
+    if(cpk_recwriter_flush(w))
+        goto done;
+
+    for(i = 0; i < idx->n; i++)
+        cpk_write64(&w->out, idx->offsets[i]);
+
+    cpk_write64(&w->out, w->base);
+    cpk_write64(&w->out, idx->count);
+    cpk_write32(&w->out, idx->stride);
+    cpk_write32(&w->out, 0);
+    cpk_write32(&w->out, 0);
+    cpk_write32(&w->out, RECFILE_XMAGIC);
+
+    if(w->out.flags & CPK_OUTPUT_OVERFLOW) {
+        w->failed = 1;
+        goto done;
+    }
+
+    buf = w->out.buffer;
+    put32(buf + idx->n * 8 + 20, cpk_crc32c(0, buf, idx->n * 8 + 20));
+
+    if(write_all(w->fd, buf, w->out.buffer_used))
+        w->failed = 1;
+
+ done:
+    ret = w->failed ? CPK_ERROR : 0;
+    if(close(w->fd)) ret = CPK_ERROR;
+
+    cpk_output_fini(&w->out);
+    free(idx->offsets);
+    free(w);
+    return ret;
+}
+
+ /* Reading */
+
+/* Maps path and loads its index.  With CPK_RECFILE_VERIFY, every
+   record handed out is checked against its checksum (if the file has
+   them) first. */
+cpk_recfile_t* cpk_recfile_open(const char *path, uint32_t flags) {
+    cpk_recfile_t *rf = NULL;
+    int fd = -1;
+
+    if(!(rf = calloc(1, sizeof(cpk_recfile_t))))
+        return NULL;
+
+    rf->flags = flags & CPK_RECFILE_VERIFY;
+
+    if((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+        goto error;
+
+    if(map_file(fd, &rf->map, &rf->size, &rf->mapped))
+        goto error;
+
+    close(fd);
+    fd = -1;
+
+    if(index_load(&rf->idx, rf->map, rf->size))
+        goto error;
+
+    return rf;
+
+ error:
+    if(fd >= 0) close(fd);
+    cpk_recfile_close(rf);
+    return NULL;
+}
+
+void cpk_recfile_close(cpk_recfile_t *rf) {
+    if(!rf) return;
+
+    if(rf->map)
+        unmap_file(rf->map, rf->size, rf->mapped);
+
+    free(rf->idx.offsets);
+    free(rf);
+}
+
+uint64_t cpk_recfile_count(cpk_recfile_t *rf) {
+    return rf->idx.count;
+}
+
+/* Points in at record n, which is at *off, and advances *off past it;
+   err's position is the record number */
+static int record_at(cpk_recfile_t *rf, uint64_t n, uint64_t *off,
+                     int verify, cpk_input_t *in, cpk_object_t *err) {
+    recfile_index_t *idx = &rf->idx;
+    uint32_t prefix = record_prefix(idx->flags), len = 0;
+    uint8_t *rec = rf->map + *off;
+
+    if(idx->end - *off < prefix ||
+       idx->end - *off - prefix < (len = get32(rec))) {
+        cpk_err(err, CPK_ERR_BAD_SIZE, CPK_ERR_BAD_SIZE_MSG, 0, n);
+        return CPK_ERROR;
+    }
+
+    if(verify && (rf->flags & CPK_RECFILE_VERIFY) &&
+       (idx->flags & CPK_RECFILE_CRC) &&
+       cpk_crc32c(0, rec + prefix, len) != get32(rec + 4)) {
+        cpk_err(err, CPK_ERR_CHECKSUM, CPK_ERR_CHECKSUM_MSG, 0, n);
+        return CPK_ERROR;
+    }
+
+    cpk_input_init(in, rec + prefix, len);
+    *off += prefix + len;
+    return 0;
+}
+
+/* Points in at the payload of record n, which stays valid until rf is
+   closed.  On CPK_ERROR, err (if not NULL) says why, with the number
+   of the damaged record as its position. */
+int cpk_recfile_get(cpk_recfile_t *rf, uint64_t n, cpk_input_t *in,
+                    cpk_object_t *err) {
+    recfile_index_t *idx = &rf->idx;
+    cpk_object_t local;
+    uint64_t off = 0, i = 0;
+
+    if(!err) err = &local;
+    err->header = 0;
+
+    if(n >= idx->count) {
+        cpk_err(err, CPK_ERR_EOF, CPK_ERR_EOF_MSG, 0, n);
+        return CPK_ERROR;
+    }
+
+    i = n - n % idx->stride;
+    off = idx->offsets[n / idx->stride];
+    for(; i < n; i++)
+        if(record_at(rf, i, &off, 0, in, err))
+            return CPK_ERROR;
+
+    return record_at(rf, n, &off, 1, in, err);
+}
+
+typedef struct _scan_job {
+    cpk_recfile_t *rf;
+    uint64_t start;
+    uint64_t end;
+
+    cpk_record_fn_t fn;
+    void *arg;
+
+    size_t next;
+    size_t last;
+    size_t chunk;
+
+    int ret;
+    cpk_object_t err;
+} scan_job_t;
+
+static void scan_fail(scan_job_t *job, int ret, cpk_object_t *err) {
+    int ok = 0;
+
+    if(__atomic_compare_exchange_n(&job->ret, &ok, ret, 0,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_RELAXED) && err)
+        job->err = *err;
+}
+
+/* Threads claim chunks of index groups, and walk each group's records
+   in order from its indexed offset */
+static void scan_worker(void *arg, uint32_t thread) {
+    scan_job_t *job = arg;
+    recfile_index_t *idx = &job->rf->idx;
+    cpk_object_t err;
+    cpk_input_t in;
+    uint64_t n = 0, stop = 0, off = 0;
+    size_t g = 0;
+    int ret = 0;
+
+    for(;;) {
+        g = __atomic_fetch_add(&job->next, job->chunk, __ATOMIC_RELAXED);
+        if(g > job->last) break;
+
+        n = (uint64_t)g * idx->stride;
+        stop = (uint64_t)(g + job->chunk) * idx->stride;
+        if(stop > job->end) stop = job->end;
+        off = idx->offsets[g];
+
+        for(; n < stop; n++) {
+            if(__atomic_load_n(&job->ret, __ATOMIC_RELAXED))
+                return;
+
+            if(record_at(job->rf, n, &off, n >= job->start, &in, &err)) {
+                scan_fail(job, CPK_ERROR, &err);
+                return;
+            }
+
+            if(n >= job->start && (ret = job->fn(job->arg, thread, n, &in))) {
+                scan_fail(job, ret, NULL);
+                return;
+            }
+        }
+    }
+}
+
+/* Calls fn on records [start, end) across pool, or on the caller's
+   thread if pool is NULL.  Each thread sees its records in order, but
+   threads run in no particular order.  Returns 0, the first nonzero
+   value fn returned, or CPK_ERROR with err set, as for
+   cpk_recfile_get, if a record is damaged. */
+int cpk_recfile_scan(cpk_recfile_t *rf, cpk_pool_t *pool,
+                     uint64_t start, uint64_t end,
+                     cpk_record_fn_t fn, void *arg, cpk_object_t *err) {
+    recfile_index_t *idx = &rf->idx;
+    uint32_t threads = cpk_pool_size(pool);
+    scan_job_t job;
+
+    if(err) err->header = 0;
+
+    if(end > idx->count) end = idx->count;
+    if(start >= end)
+        return 0;
+
+    job.rf = rf;
+    job.start = start;
+    job.end = end;
+    job.fn = fn;
+    job.arg = arg;
+    job.next = start / idx->stride;
+    job.last = (end - 1) / idx->stride;
+    job.chunk = (job.last - job.next + 1) /
+                (threads * RECFILE_CHUNKS_PER_THREAD);
+    if(!job.chunk) job.chunk = 1;
+    job.ret = 0;
+    job.err.header = 0;
+
+#if defined(HAVE_SYS_MMAN_H) && defined(MADV_WILLNEED)
+    if(rf->mapped) {
+        size_t page = sysconf(_SC_PAGESIZE);
+        uint64_t from = idx->offsets[job.next] & ~(uint64_t)(page - 1);
+        uint64_t to = job.last + 1 < idx->n ? idx->offsets[job.last + 1]
+                                            : idx->end;
+
+        madvise(rf->map + from, to - from, MADV_WILLNEED);
+    }
+#endif
+
+    cpk_pool_run(pool, scan_worker, &job);
+
+    if(err && job.err.header)
+        *err = job.err;
+
+    return job.ret;
+}
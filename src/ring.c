@@ -0,0 +1,145 @@
+/*
+ * libconspack
+ * Copyright (C) 2012  Ryan Pavlik
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the GNU Lesser General Public
+ * License (LGPL) version 2.1 which accompanies this distribution, and
+ * is available at http://www.gnu.org/licenses/lgpl-2.1.html
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ */
+
+#include "config.h"
+#include "conspack/conspack.h"
+
+/*
+ * Bounded multi-producer, multi-consumer queue of pointers, after
+ * Dmitry Vyukov's design: each cell carries a sequence number that
+ * says whether it is ready to be written or read for a given lap, so
+ * producers and consumers only contend on their own position counter.
+ * With a single producer and consumer it degrades to a plain SPSC
+ * ring with no extra cost on the fast path.
+ */
+
+#define RING_LINE 64
+
+typedef struct _ring_cell {
+    uint64_t seq;
+    void *data;
+} ring_cell_t;
+
+struct _cpk_ring {
+    uint64_t mask;
+    ring_cell_t *cells;
+
+    uint8_t pad0[RING_LINE];
+    uint64_t head;              /* next position to push */
+    uint8_t pad1[RING_LINE - sizeof(uint64_t)];
+    uint64_t tail;              /* next position to pop */
+    uint8_t pad2[RING_LINE - sizeof(uint64_t)];
+};
+
+/* capacity is rounded up to a power of two */
+cpk_ring_t* cpk_ring_new(uint32_t capacity) {
+    cpk_ring_t *ring = NULL;
+    uint64_t size = 2, i = 0;
+
+    while(size < capacity)
+        size *= 2;
+
+    if(!(ring = calloc(1, sizeof(cpk_ring_t))))
+        return NULL;
+
+    if(!(ring->cells = malloc(size * sizeof(ring_cell_t)))) {
+        free(ring);
+        return NULL;
+    }
+
+    for(i = 0; i < size; i++) {
+        ring->cells[i].seq = i;
+        ring->cells[i].data = NULL;
+    }
+
+    ring->mask = size - 1;
+    return ring;
+}
+
+void cpk_ring_free(cpk_ring_t *ring) {
+    if(!ring) return;
+
+    free(ring->cells);
+    free(ring);
+}
+
+uint32_t cpk_ring_capacity(cpk_ring_t *ring) {
+    return ring->mask + 1;
+}
+
+/* Returns CPK_ERROR when the ring is full */
+int cpk_ring_push(cpk_ring_t *ring, void *data) {
+    ring_cell_t *cell = NULL;
+    uint64_t pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED), seq = 0;
+    int64_t diff = 0;
+
+    for(;;) {
+        cell = &ring->cells[pos & ring->mask];
+        seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        diff = (int64_t)(seq - pos);
+
+        if(!diff) {
+            if(__atomic_compare_exchange_n(&ring->head, &pos, pos + 1, 1,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if(diff < 0) {
+            return CPK_ERROR;
+        } else {
+            pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+        }
+    }
+
+    cell->data = data;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/* Returns CPK_ERROR when the ring is empty */
+int cpk_ring_pop(cpk_ring_t *ring, void **data) {
+    ring_cell_t *cell = NULL;
+    uint64_t pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED), seq = 0;
+    int64_t diff = 0;
+
+    for(;;) {
+        cell = &ring->cells[pos & ring->mask];
+        seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        diff = (int64_t)(seq - (pos + 1));
+
+        if(!diff) {
+            if(__atomic_compare_exchange_n(&ring->tail, &pos, pos + 1, 1,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if(diff < 0) {
+            return CPK_ERROR;
+        } else {
+            pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    *data = cell->data;
+    __atomic_store_n(&cell->seq, pos + ring->mask + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/* Approximate while other threads are pushing or popping */
+uint32_t cpk_ring_depth(cpk_ring_t *ring) {
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+
+    return head > tail ? (uint32_t)(head - tail) : 0;
+}
@@ -0,0 +1,1110 @@
+/*
+ * libconspack
+ * Copyright (C) 2012  Ryan Pavlik
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the GNU Lesser General Public
+ * License (LGPL) version 2.1 which accompanies this distribution, and
+ * is available at http://www.gnu.org/licenses/lgpl-2.1.html
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ */
+
+/*
+ * cpk-schemac: generates C that decodes conspack straight into native
+ * structs, and encodes from them, for messages of a known shape.
+ *
+ *     cpk-schemac [-i include] -o base schema
+ *
+ * writes base.h and base.c.  A schema is a list of records:
+ *
+ *     # comment
+ *     tuple point {               # a vector, by position
+ *         int32 x;
+ *         int32 y;
+ *     }
+ *
+ *     struct sample {             # a map, keyed by field name
+ *         uint64 id;
+ *         string name = "Name";   # ...or by the key given
+ *         vector<double> values;
+ *         point at;
+ *     }
+ *
+ * Types are bool, int8..int64, uint8..uint64, float, double, string,
+ * vector<type> and any record declared before.  Each record NAME gets
+ * NAME_t and
+ *
+ *     size_t NAME_decode(const uint8_t *buf, size_t len, NAME_t *v,
+ *                        cpk_arena_t *arena, cpk_object_t *err);
+ *     int NAME_encode(cpk_output_t *out, const NAME_t *v);
+ *
+ * Decoding returns the bytes used, or 0 with err set at the first
+ * byte that does not fit the schema.  Integers are taken at any width
+ * that holds them, doubles from singles too, and struct keys in any
+ * order; anything else is a mismatch.  Strings are cpk_bytes_t views
+ * into buf, and vectors are allocated from arena.  Encoding writes
+ * the narrowest size fields, vectors of numbers as fixed-header
+ * containers, and tuples of one number type likewise.
+ */
+
+#include "conspack/conspack.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_FIELDS 64           /* one bit each when decoding structs */
+
+enum {
+    T_BOOL, T_INT8, T_INT16, T_INT32, T_INT64,
+    T_UINT8, T_UINT16, T_UINT32, T_UINT64,
+    T_FLOAT, T_DOUBLE, T_STRING, T_VECTOR, T_RECORD
+};
+
+typedef struct _scalar {
+    const char *name, *ctype;
+    uint8_t numtype;            /* for numbers */
+    uint8_t width;
+} scalar_t;
+
+static const scalar_t scalars[] = {
+    { "bool",   "uint8_t",     0,                0 },
+    { "int8",   "int8_t",      CPK_INT8,         1 },
+    { "int16",  "int16_t",     CPK_INT16,        2 },
+    { "int32",  "int32_t",     CPK_INT32,        4 },
+    { "int64",  "int64_t",     CPK_INT64,        8 },
+    { "uint8",  "uint8_t",     CPK_UINT8,        1 },
+    { "uint16", "uint16_t",    CPK_UINT16,       2 },
+    { "uint32", "uint32_t",    CPK_UINT32,       4 },
+    { "uint64", "uint64_t",    CPK_UINT64,       8 },
+    { "float",  "float",       CPK_SINGLE_FLOAT, 4 },
+    { "double", "double",      CPK_DOUBLE_FLOAT, 8 },
+    { "string", "cpk_bytes_t", 0,                0 },
+};
+
+#define IS_NUMBER(t) ((t)->kind >= T_INT8 && (t)->kind <= T_DOUBLE)
+
+struct _record;
+
+typedef struct _type {
+    int kind;
+    struct _type *elem;         /* vectors */
+    struct _record *rec;        /* records */
+} type_t;
+
+typedef struct _field {
+    char *name, *key;
+    type_t *type;
+} field_t;
+
+typedef struct _record {
+    char *name;
+    int tuple;
+    field_t fields[MAX_FIELDS];
+    int nfields;
+    struct _record *next;
+} record_t;
+
+ /* Parsing */
+
+typedef struct _parser {
+    const char *file;
+    char *src, *p;
+    int line;
+    char tok[256];
+    int is_string;
+    record_t *records, **tail;
+} parser_t;
+
+static void fail(parser_t *ps, const char *fmt, ...) {
+    va_list ap;
+
+    fprintf(stderr, "%s:%d: ", ps->file, ps->line);
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+    exit(1);
+}
+
+static void* xalloc(size_t n) {
+    void *p = calloc(1, n);
+
+    if(!p) {
+        perror("cpk-schemac");
+        exit(1);
+    }
+
+    return p;
+}
+
+static char* xstrdup(const char *s) {
+    return strcpy(xalloc(strlen(s) + 1), s);
+}
+
+/* The next token in ps->tok; empty at the end */
+static const char* next(parser_t *ps) {
+    size_t n = 0;
+
+    for(;;) {
+        while(isspace((unsigned char)*ps->p))
+            if(*ps->p++ == '\n') ps->line++;
+
+        if(*ps->p != '#') break;
+        while(*ps->p && *ps->p != '\n') ps->p++;
+    }
+
+    ps->is_string = 0;
+
+    if(*ps->p == '"') {
+        ps->is_string = 1;
+        for(ps->p++; *ps->p != '"'; ps->p++) {
+            if(!*ps->p || *ps->p == '\n') fail(ps, "unterminated string");
+            if(*ps->p == '\\' && ps->p[1]) ps->p++;
+            if(n == sizeof(ps->tok) - 1) fail(ps, "string too long");
+            ps->tok[n++] = *ps->p;
+        }
+        ps->p++;
+    } else if(isalpha((unsigned char)*ps->p) || *ps->p == '_') {
+        while(isalnum((unsigned char)*ps->p) || *ps->p == '_') {
+            if(n == sizeof(ps->tok) - 1) fail(ps, "name too long");
+            ps->tok[n++] = *ps->p++;
+        }
+    } else if(*ps->p) {
+        ps->tok[n++] = *ps->p++;
+    }
+
+    ps->tok[n] = 0;
+    return ps->tok;
+}
+
+static void expect(parser_t *ps, const char *what) {
+    if(strcmp(next(ps), what))
+        fail(ps, "expected '%s', not '%s'", what, ps->tok);
+}
+
+static int is_name(parser_t *ps) {
+    return !ps->is_string &&
+           (isalpha((unsigned char)ps->tok[0]) || ps->tok[0] == '_');
+}
+
+static record_t* find_record(parser_t *ps, const char *name) {
+    record_t *r;
+
+    for(r = ps->records; r; r = r->next)
+        if(!strcmp(r->name, name)) return r;
+
+    return NULL;
+}
+
+static type_t* parse_type(parser_t *ps) {
+    type_t *t = xalloc(sizeof(*t));
+    size_t i;
+
+    if(!is_name(ps)) fail(ps, "expected a type, not '%s'", ps->tok);
+
+    for(i = 0; i < sizeof(scalars) / sizeof(*scalars); i++) {
+        if(!strcmp(ps->tok, scalars[i].name)) {
+            t->kind = i;
+            return t;
+        }
+    }
+
+    if(!strcmp(ps->tok, "vector")) {
+        t->kind = T_VECTOR;
+        expect(ps, "<");
+        next(ps);
+        t->elem = parse_type(ps);
+        expect(ps, ">");
+        return t;
+    }
+
+    if(!(t->rec = find_record(ps, ps->tok)))
+        fail(ps, "unknown type '%s'", ps->tok);
+
+    t->kind = T_RECORD;
+    return t;
+}
+
+static int reserved(const char *name) {
+    size_t i;
+
+    for(i = 0; i < sizeof(scalars) / sizeof(*scalars); i++)
+        if(!strcmp(name, scalars[i].name)) return 1;
+
+    return !strcmp(name, "vector") || !strcmp(name, "struct") ||
+           !strcmp(name, "tuple");
+}
+
+static void parse_record(parser_t *ps, int tuple) {
+    record_t *r = xalloc(sizeof(*r));
+    field_t *f;
+    int i;
+
+    next(ps);
+    if(!is_name(ps) || reserved(ps->tok))
+        fail(ps, "bad record name '%s'", ps->tok);
+    if(find_record(ps, ps->tok))
+        fail(ps, "'%s' is already declared", ps->tok);
+
+    r->name = xstrdup(ps->tok);
+    r->tuple = tuple;
+    expect(ps, "{");
+
+    while(strcmp(next(ps), "}")) {
+        if(!*ps->tok) fail(ps, "unterminated record '%s'", r->name);
+        if(r->nfields == MAX_FIELDS)
+            fail(ps, "more than %d fields in '%s'", MAX_FIELDS, r->name);
+
+        f = &r->fields[r->nfields];
+        f->type = parse_type(ps);
+
+        next(ps);
+        if(!is_name(ps)) fail(ps, "expected a field name, not '%s'", ps->tok);
+        f->name = f->key = xstrdup(ps->tok);
+
+        for(i = 0; i < r->nfields; i++)
+            if(!strcmp(r->fields[i].name, f->name))
+                fail(ps, "field '%s' appears twice", f->name);
+
+        if(!strcmp(next(ps), "=")) {
+            if(tuple) fail(ps, "tuple fields have no keys");
+            next(ps);
+            if(!ps->is_string) fail(ps, "expected a key string");
+            f->key = xstrdup(ps->tok);
+            next(ps);
+        }
+
+        if(strcmp(ps->tok, ";")) fail(ps, "expected ';', not '%s'", ps->tok);
+
+        for(i = 0; i < r->nfields && !tuple; i++)
+            if(!strcmp(r->fields[i].key, f->key))
+                fail(ps, "key \"%s\" appears twice", f->key);
+
+        r->nfields++;
+    }
+
+    if(!r->nfields) fail(ps, "'%s' has no fields", r->name);
+
+    *ps->tail = r;
+    ps->tail = &r->next;
+}
+
+static void parse(parser_t *ps) {
+    while(*next(ps)) {
+        if(!strcmp(ps->tok, "struct"))
+            parse_record(ps, 0);
+        else if(!strcmp(ps->tok, "tuple"))
+            parse_record(ps, 1);
+        else
+            fail(ps, "expected 'struct' or 'tuple', not '%s'", ps->tok);
+    }
+
+    if(!ps->records) fail(ps, "no records");
+}
+
+ /* Output */
+
+static FILE *out;
+
+static void emit(int indent, const char *fmt, ...) {
+    va_list ap;
+
+    if(*fmt) fprintf(out, "%*s", indent * 4, "");
+
+    va_start(ap, fmt);
+    vfprintf(out, fmt, ap);
+    va_end(ap);
+    fputc('\n', out);
+}
+
+/* The C type, split around where the name goes */
+static void ctype(const type_t *t, char *buf, size_t size) {
+    char elem[512];
+
+    switch(t->kind) {
+        case T_VECTOR:
+            ctype(t->elem, elem, sizeof(elem));
+            snprintf(buf, size, "struct { %s *data; uint32_t size; }", elem);
+            break;
+        case T_RECORD:
+            snprintf(buf, size, "%s_t", t->rec->name);
+            break;
+        default:
+            snprintf(buf, size, "%s", scalars[t->kind].ctype);
+    }
+}
+
+/* s as the inside of a C string literal */
+static const char* c_string(const char *s, char *buf, size_t size) {
+    size_t n = 0;
+
+    for(; *s && n + 5 < size; s++) {
+        if(*s == '"' || *s == '\\') {
+            buf[n++] = '\\';
+            buf[n++] = *s;
+        } else if(isprint((unsigned char)*s)) {
+            buf[n++] = *s;
+        } else {
+            n += sprintf(buf + n, "\\%03o", (unsigned char)*s);
+        }
+    }
+
+    buf[n] = 0;
+    return buf;
+}
+
+static uint8_t number_header(const type_t *t) {
+    return CPK_NUMBER | scalars[t->kind].numtype;
+}
+
+/* A size field's worth of header: the header byte and its size */
+static size_t size_header(uint8_t *buf, uint8_t header, uint32_t n) {
+    if(n <= 0xFF) {
+        buf[0] = header | CPK_SIZE_8;
+        buf[1] = n;
+        return 2;
+    } else if(n <= 0xFFFF) {
+        buf[0] = header | CPK_SIZE_16;
+        buf[1] = n >> 8;
+        buf[2] = n;
+        return 3;
+    }
+
+    buf[0] = header | CPK_SIZE_32;
+    buf[1] = n >> 24;
+    buf[2] = n >> 16;
+    buf[3] = n >> 8;
+    buf[4] = n;
+    return 5;
+}
+
+static void emit_bytes(int indent, const char *name, const uint8_t *b,
+                       size_t n) {
+    size_t i;
+
+    fprintf(out, "%*sstatic const uint8_t %s[%zu] = {", indent * 4, "",
+            name, n);
+    for(i = 0; i < n; i++)
+        fprintf(out, "%s0x%02X", i % 12 ? ", " : i ? ",\n        " : " ", b[i]);
+    fprintf(out, " };\n");
+}
+
+static void emit_header_file(record_t *records, const char *include,
+                             const char *guard, const char *schema) {
+    record_t *r;
+    char buf[1024];
+    int i;
+
+    emit(0, "/* Generated by cpk-schemac from %s; do not edit */", schema);
+    emit(0, "");
+    emit(0, "#ifndef %s", guard);
+    emit(0, "#define %s", guard);
+    emit(0, "");
+    emit(0, "#include \"%s\"", include);
+    emit(0, "");
+    emit(0, "#ifdef __cplusplus");
+    emit(0, "extern \"C\" {");
+    emit(0, "#endif");
+    emit(0, "");
+    emit(0, "#ifndef CPK_BYTES_T");
+    emit(0, "#define CPK_BYTES_T");
+    emit(0, "typedef struct _cpk_bytes {");
+    emit(1, "const uint8_t *data;");
+    emit(1, "uint32_t size;");
+    emit(0, "} cpk_bytes_t;");
+    emit(0, "#endif");
+
+    for(r = records; r; r = r->next) {
+        emit(0, "");
+        emit(0, "typedef struct %s {", r->name);
+        for(i = 0; i < r->nfields; i++) {
+            ctype(r->fields[i].type, buf, sizeof(buf));
+            emit(1, "%s %s;", buf, r->fields[i].name);
+        }
+        emit(0, "} %s_t;", r->name);
+        emit(0, "");
+        emit(0, "size_t %s_decode(const uint8_t *buf, size_t len, %s_t *v,",
+             r->name, r->name);
+        emit(0, "%*scpk_arena_t *arena, cpk_object_t *err);",
+             (int)strlen(r->name) + 15, "");
+        emit(0, "int %s_encode(cpk_output_t *out, const %s_t *v);",
+             r->name, r->name);
+    }
+
+    emit(0, "");
+    emit(0, "#ifdef __cplusplus");
+    emit(0, "}");
+    emit(0, "#endif");
+    emit(0, "");
+    emit(0, "#endif /* %s */", guard);
+}
+
+/* Support shared by every generated decoder and encoder */
+static const char *prelude =
+"typedef struct _sc_dec {\n"
+"    const uint8_t *start, *p, *end;\n"
+"    cpk_arena_t *arena;\n"
+"    cpk_object_t *err;\n"
+"} sc_dec_t;\n"
+"\n"
+"typedef struct _sc_enc {\n"
+"    cpk_output_t *out;\n"
+"    int failed;\n"
+"    size_t used;\n"
+"    uint8_t buf[512];\n"
+"} sc_enc_t;\n"
+"\n"
+"static int sc_fail(sc_dec_t *d, uint32_t code, const char *msg) {\n"
+"    if(d->err) {\n"
+"        d->err->header = CPK_ERROR;\n"
+"        d->err->error.code = code;\n"
+"        d->err->error.reason = (char*)msg;\n"
+"        d->err->error.value = d->p < d->end ? *d->p : 0;\n"
+"        d->err->error.pos = d->p - d->start;\n"
+"    }\n"
+"\n"
+"    return -1;\n"
+"}\n"
+"\n"
+"#define SC_NEED(d,n) \\\n"
+"    if((size_t)((d)->end - (d)->p) < (size_t)(n)) \\\n"
+"        return sc_fail((d), CPK_ERR_EOF, CPK_ERR_EOF_MSG)\n"
+"\n"
+"#define SC_MISMATCH(d) sc_fail((d), CPK_ERR_BAD_TYPE, CPK_ERR_BAD_TYPE_MSG)\n"
+"\n"
+"static inline uint64_t sc_be(const uint8_t *p, int n) {\n"
+"    uint64_t v = 0;\n"
+"\n"
+"    while(n--) v = v << 8 | *p++;\n"
+"    return v;\n"
+"}\n"
+"\n"
+"/* The element header: the container's fixed one, or the next byte */\n"
+"static inline int sc_next(sc_dec_t *d, int fh, uint8_t *h) {\n"
+"    if(fh >= 0) {\n"
+"        *h = fh;\n"
+"        return 0;\n"
+"    }\n"
+"\n"
+"    SC_NEED(d, 1);\n"
+"    *h = *d->p++;\n"
+"    return 0;\n"
+"}\n"
+"\n"
+"static inline int sc_size(sc_dec_t *d, uint8_t h, uint32_t *n) {\n"
+"    switch(h & CPK_SIZE_MASK) {\n"
+"        case CPK_SIZE_8:  SC_NEED(d, 1); *n = d->p[0]; d->p += 1; break;\n"
+"        case CPK_SIZE_16: SC_NEED(d, 2); *n = sc_be(d->p, 2); d->p += 2; break;\n"
+"        case CPK_SIZE_32: SC_NEED(d, 4); *n = sc_be(d->p, 4); d->p += 4; break;\n"
+"        default: return sc_fail(d, CPK_ERR_BAD_SIZE, CPK_ERR_BAD_SIZE_MSG);\n"
+"    }\n"
+"\n"
+"    return 0;\n"
+"}\n"
+"\n"
+"/* A container of type, and its fixed element header or -1 */\n"
+"static inline int sc_container(sc_dec_t *d, uint8_t h, uint8_t type,\n"
+"                               uint32_t *n, int *fh) {\n"
+"    if(!CPK_IS_CONTAINER(h) || (h & CPK_CONTAINER_TYPE_MASK) != type)\n"
+"        return SC_MISMATCH(d);\n"
+"\n"
+"    if(sc_size(d, h, n)) return -1;\n"
+"\n"
+"    *fh = -1;\n"
+"    if(h & CPK_CONTAINER_FIXED) {\n"
+"        SC_NEED(d, 1);\n"
+"        *fh = *d->p++;\n"
+"    }\n"
+"\n"
+"    return 0;\n"
+"}\n"
+"\n"
+"/* Room for n elements of size bytes each, if the input could hold\n"
+"   that many; elements with no bytes at all are capped at 65536 */\n"
+"static inline void* sc_alloc(sc_dec_t *d, uint32_t n, int fh, size_t size) {\n"
+"    size_t left = d->end - d->p, each = 1;\n"
+"    void *p;\n"
+"\n"
+"    if(fh >= 0)\n"
+"        each = cpk_header_table[fh].size + cpk_header_table[fh].payload;\n"
+"\n"
+"    if(each ? n > left / each : n > 65536) {\n"
+"        sc_fail(d, CPK_ERR_LIMIT, CPK_ERR_LIMIT_MSG);\n"
+"        return NULL;\n"
+"    }\n"
+"\n"
+"    if(!d->arena || n > SIZE_MAX / size ||\n"
+"       !(p = cpk_arena_alloc(d->arena, n * size))) {\n"
+"        sc_fail(d, CPK_ERR_ALLOC, CPK_ERR_ALLOC_MSG);\n"
+"        return NULL;\n"
+"    }\n"
+"\n"
+"    return p;\n"
+"}\n"
+"\n"
+"/* Any integer, as two's complement; *neg if it is below zero */\n"
+"static inline int sc_integer(sc_dec_t *d, uint8_t h, uint64_t *v, int *neg) {\n"
+"    static const uint8_t width[8] = { 1, 2, 4, 8, 1, 2, 4, 8 };\n"
+"    int t = h & 0xF, w;\n"
+"\n"
+"    if(!CPK_IS_NUMBER(h) || t > CPK_UINT64) return SC_MISMATCH(d);\n"
+"\n"
+"    w = width[t];\n"
+"    SC_NEED(d, w);\n"
+"    *v = sc_be(d->p, w);\n"
+"    d->p += w;\n"
+"\n"
+"    *neg = 0;\n"
+"    if(t < CPK_UINT8 && w < 8 && (*v >> (w * 8 - 1)))\n"
+"        *v |= ~0ULL << (w * 8);\n"
+"    if(t < CPK_UINT8) *neg = (int64_t)*v < 0;\n"
+"\n"
+"    return 0;\n"
+"}\n"
+"\n"
+"/* The header that matches exactly is read directly; other widths\n"
+"   are taken if the value fits */\n"
+"#define SC_INT(name, ctype, numtype, w, lo, hi) \\\n"
+"static inline int sc_##name(sc_dec_t *d, uint8_t h, ctype *v) { \\\n"
+"    uint64_t u; \\\n"
+"    int neg; \\\n"
+"    if(h == (CPK_NUMBER | numtype)) { \\\n"
+"        SC_NEED(d, w); \\\n"
+"        *v = (ctype)sc_be(d->p, w); \\\n"
+"        d->p += w; \\\n"
+"        return 0; \\\n"
+"    } \\\n"
+"    if(sc_integer(d, h, &u, &neg)) return -1; \\\n"
+"    if(neg ? (int64_t)u < (int64_t)(lo) : u > (uint64_t)(hi)) \\\n"
+"        return sc_fail(d, CPK_ERR_LIMIT, CPK_ERR_LIMIT_MSG); \\\n"
+"    *v = (ctype)u; \\\n"
+"    return 0; \\\n"
+"}\n"
+"\n"
+"SC_INT(int8,   int8_t,   CPK_INT8,   1, INT8_MIN,  INT8_MAX)\n"
+"SC_INT(int16,  int16_t,  CPK_INT16,  2, INT16_MIN, INT16_MAX)\n"
+"SC_INT(int32,  int32_t,  CPK_INT32,  4, INT32_MIN, INT32_MAX)\n"
+"SC_INT(int64,  int64_t,  CPK_INT64,  8, INT64_MIN, INT64_MAX)\n"
+"SC_INT(uint8,  uint8_t,  CPK_UINT8,  1, 0, UINT8_MAX)\n"
+"SC_INT(uint16, uint16_t, CPK_UINT16, 2, 0, UINT16_MAX)\n"
+"SC_INT(uint32, uint32_t, CPK_UINT32, 4, 0, UINT32_MAX)\n"
+"SC_INT(uint64, uint64_t, CPK_UINT64, 8, 0, UINT64_MAX)\n"
+"\n"
+"/* Integers are widened, as JSON and most encoders write whole numbers\n"
+"   that way */\n"
+"static inline int sc_double(sc_dec_t *d, uint8_t h, double *v) {\n"
+"    uint64_t b64, u;\n"
+"    uint32_t b32;\n"
+"    float f;\n"
+"    int neg;\n"
+"\n"
+"    if(h == (CPK_NUMBER | CPK_DOUBLE_FLOAT)) {\n"
+"        SC_NEED(d, 8);\n"
+"        b64 = sc_be(d->p, 8);\n"
+"        memcpy(v, &b64, 8);\n"
+"        d->p += 8;\n"
+"    } else if(h == (CPK_NUMBER | CPK_SINGLE_FLOAT)) {\n"
+"        SC_NEED(d, 4);\n"
+"        b32 = sc_be(d->p, 4);\n"
+"        memcpy(&f, &b32, 4);\n"
+"        *v = f;\n"
+"        d->p += 4;\n"
+"    } else {\n"
+"        if(sc_integer(d, h, &u, &neg)) return -1;\n"
+"        *v = neg ? (double)(int64_t)u : (double)u;\n"
+"    }\n"
+"\n"
+"    return 0;\n"
+"}\n"
+"\n"
+"static inline int sc_float(sc_dec_t *d, uint8_t h, float *v) {\n"
+"    uint64_t u;\n"
+"    uint32_t b32;\n"
+"    int neg;\n"
+"\n"
+"    if(h != (CPK_NUMBER | CPK_SINGLE_FLOAT)) {\n"
+"        if(sc_integer(d, h, &u, &neg)) return -1;\n"
+"        *v = neg ? (float)(int64_t)u : (float)u;\n"
+"        return 0;\n"
+"    }\n"
+"\n"
+"    SC_NEED(d, 4);\n"
+"    b32 = sc_be(d->p, 4);\n"
+"    memcpy(v, &b32, 4);\n"
+"    d->p += 4;\n"
+"    return 0;\n"
+"}\n"
+"\n"
+"static inline int sc_bool(sc_dec_t *d, uint8_t h, uint8_t *v) {\n"
+"    if(h != CPK_NIL && h != CPK_TRUE) return SC_MISMATCH(d);\n"
+"\n"
+"    *v = h;\n"
+"    return 0;\n"
+"}\n"
+"\n"
+"static inline int sc_string(sc_dec_t *d, uint8_t h, cpk_bytes_t *v) {\n"
+"    uint32_t n;\n"
+"\n"
+"    if(!CPK_IS_STRING(h)) return SC_MISMATCH(d);\n"
+"    if(sc_size(d, h, &n)) return -1;\n"
+"\n"
+"    SC_NEED(d, n);\n"
+"    v->data = d->p;\n"
+"    v->size = n;\n"
+"    d->p += n;\n"
+"    return 0;\n"
+"}\n"
+"\n"
+"/* Struct keys usually come in order, so the expected one is tried\n"
+"   before the rest */\n"
+"static inline int sc_key(const cpk_bytes_t *k, const cpk_bytes_t *keys,\n"
+"                         int n, int hint) {\n"
+"    int i;\n"
+"\n"
+"    if(hint < n && k->size == keys[hint].size &&\n"
+"       !memcmp(k->data, keys[hint].data, k->size))\n"
+"        return hint;\n"
+"\n"
+"    for(i = 0; i < n; i++)\n"
+"        if(k->size == keys[i].size && !memcmp(k->data, keys[i].data, k->size))\n"
+"            return i;\n"
+"\n"
+"    return -1;\n"
+"}\n"
+"\n"
+"static inline void sc_flush(sc_enc_t *e) {\n"
+"    if(e->used && cpk_write_bytes(e->out, e->buf, e->used) < 0)\n"
+"        e->failed = 1;\n"
+"\n"
+"    e->used = 0;\n"
+"}\n"
+"\n"
+"static inline uint8_t* sc_room(sc_enc_t *e, size_t n) {\n"
+"    if(e->used + n > sizeof(e->buf)) sc_flush(e);\n"
+"    return e->buf + e->used;\n"
+"}\n"
+"\n"
+"static inline void sc_put(sc_enc_t *e, uint64_t v, int n) {\n"
+"    uint8_t *p = sc_room(e, n);\n"
+"\n"
+"    e->used += n;\n"
+"    while(n--) {\n"
+"        p[n] = (uint8_t)v;\n"
+"        v >>= 8;\n"
+"    }\n"
+"}\n"
+"\n"
+"static inline void sc_bytes(sc_enc_t *e, const void *s, size_t n) {\n"
+"    if(n > sizeof(e->buf) / 2) {\n"
+"        sc_flush(e);\n"
+"        if(cpk_write_bytes(e->out, s, n) < 0) e->failed = 1;\n"
+"        return;\n"
+"    }\n"
+"\n"
+"    memcpy(sc_room(e, n), s, n);\n"
+"    e->used += n;\n"
+"}\n"
+"\n"
+"static inline void sc_size_header(sc_enc_t *e, uint8_t h, uint32_t n) {\n"
+"    if(n <= 0xFF) {\n"
+"        sc_put(e, (uint64_t)(h | CPK_SIZE_8) << 8 | n, 2);\n"
+"    } else if(n <= 0xFFFF) {\n"
+"        sc_put(e, (uint64_t)(h | CPK_SIZE_16) << 16 | n, 3);\n"
+"    } else {\n"
+"        sc_put(e, (uint64_t)(h | CPK_SIZE_32) << 32 | n, 5);\n"
+"    }\n"
+"}\n"
+"\n"
+"static inline void sc_put_float(sc_enc_t *e, float v) {\n"
+"    uint32_t b;\n"
+"\n"
+"    memcpy(&b, &v, 4);\n"
+"    sc_put(e, b, 4);\n"
+"}\n"
+"\n"
+"static inline void sc_put_double(sc_enc_t *e, double v) {\n"
+"    uint64_t b;\n"
+"\n"
+"    memcpy(&b, &v, 8);\n"
+"    sc_put(e, b, 8);\n"
+"}\n";
+
+/* Statements decoding header h into lv */
+static void gen_decode(const type_t *t, const char *h, const char *lv,
+                       int depth, int indent) {
+    char elem[600], eh[16];
+
+    switch(t->kind) {
+        case T_VECTOR:
+            snprintf(eh, sizeof(eh), "eh%d", depth);
+            snprintf(elem, sizeof(elem), "%s.data[i%d]", lv, depth);
+
+            emit(indent, "{");
+            emit(indent + 1, "uint32_t n%d, i%d;", depth, depth);
+            emit(indent + 1, "int fh%d;", depth);
+            emit(indent + 1, "uint8_t eh%d;", depth);
+            emit(0, "");
+            emit(indent + 1, "if(sc_container(d, %s, CPK_CONTAINER_VECTOR, "
+                 "&n%d, &fh%d)) return -1;", h, depth, depth);
+            emit(indent + 1, "%s.size = n%d;", lv, depth);
+            emit(indent + 1, "%s.data = NULL;", lv);
+            emit(indent + 1, "if(n%d && !(%s.data = sc_alloc(d, n%d, fh%d, "
+                 "sizeof(*%s.data)))) return -1;", depth, lv, depth, depth, lv);
+            emit(0, "");
+            emit(indent + 1, "for(i%d = 0; i%d < n%d; i%d++) {",
+                 depth, depth, depth, depth);
+            emit(indent + 2, "if(sc_next(d, fh%d, &%s)) return -1;", depth, eh);
+            gen_decode(t->elem, eh, elem, depth + 1, indent + 2);
+            emit(indent + 1, "}");
+            emit(indent, "}");
+            break;
+
+        case T_RECORD:
+            emit(indent, "if(%s_dec(d, %s, &%s)) return -1;",
+                 t->rec->name, h, lv);
+            break;
+
+        default:
+            emit(indent, "if(sc_%s(d, %s, &%s)) return -1;",
+                 scalars[t->kind].name, h, lv);
+    }
+}
+
+/* Statements encoding rv; numbers without their header if bare */
+static void gen_encode(const type_t *t, const char *rv, int bare,
+                       int depth, int indent) {
+    char elem[600];
+
+    if(IS_NUMBER(t)) {
+        if(!bare) emit(indent, "sc_put(e, 0x%02X, 1);", number_header(t));
+
+        if(t->kind == T_FLOAT)
+            emit(indent, "sc_put_float(e, %s);", rv);
+        else if(t->kind == T_DOUBLE)
+            emit(indent, "sc_put_double(e, %s);", rv);
+        else
+            emit(indent, "sc_put(e, (uint64_t)%s, %d);", rv,
+                 scalars[t->kind].width);
+        return;
+    }
+
+    switch(t->kind) {
+        case T_BOOL:
+            emit(indent, "sc_put(e, %s ? CPK_TRUE : CPK_NIL, 1);", rv);
+            break;
+
+        case T_STRING:
+            emit(indent, "sc_size_header(e, CPK_STRING, %s.size);", rv);
+            emit(indent, "sc_bytes(e, %s.data, %s.size);", rv, rv);
+            break;
+
+        case T_RECORD:
+            emit(indent, "%s_enc(e, &%s);", t->rec->name, rv);
+            break;
+
+        case T_VECTOR:
+            snprintf(elem, sizeof(elem), "%s.data[i%d]", rv, depth);
+
+            emit(indent, "{");
+            emit(indent + 1, "uint32_t i%d;", depth);
+            emit(0, "");
+
+            if(IS_NUMBER(t->elem)) {
+                emit(indent + 1, "sc_size_header(e, CPK_CONTAINER | "
+                     "CPK_CONTAINER_VECTOR | CPK_CONTAINER_FIXED, %s.size);", rv);
+                emit(indent + 1, "sc_put(e, 0x%02X, 1);", number_header(t->elem));
+            } else {
+                emit(indent + 1, "sc_size_header(e, CPK_CONTAINER | "
+                     "CPK_CONTAINER_VECTOR, %s.size);", rv);
+            }
+
+            emit(indent + 1, "for(i%d = 0; i%d < %s.size; i%d++) {",
+                 depth, depth, rv, depth);
+            gen_encode(t->elem, elem, IS_NUMBER(t->elem), depth + 1, indent + 2);
+            emit(indent + 1, "}");
+            emit(indent, "}");
+            break;
+    }
+}
+
+/* Tuples whose fields share one number type are fixed-header vectors */
+static int tuple_fixed(const record_t *r) {
+    int i;
+
+    if(!r->tuple || !r->nfields || !IS_NUMBER(r->fields[0].type))
+        return 0;
+
+    for(i = 1; i < r->nfields; i++)
+        if(r->fields[i].type->kind != r->fields[0].type->kind)
+            return 0;
+
+    return 1;
+}
+
+static void gen_record(const record_t *r) {
+    const field_t *f;
+    uint8_t buf[600];
+    char lv[300], name[300];
+    size_t n;
+    int i, fixed = tuple_fixed(r);
+
+    /* Decoding */
+
+    if(!r->tuple) {
+        emit(0, "static const cpk_bytes_t %s_keys[%d] = {", r->name, r->nfields);
+        for(i = 0; i < r->nfields; i++)
+            emit(1, "{ (const uint8_t*)\"%s\", %zu },",
+                 c_string(r->fields[i].key, (char*)buf, sizeof(buf)),
+                 strlen(r->fields[i].key));
+        emit(0, "};");
+        emit(0, "");
+    }
+
+    emit(0, "static int %s_dec(sc_dec_t *d, uint8_t h, %s_t *v) {",
+         r->name, r->name);
+    emit(1, "uint32_t n;");
+    emit(1, "int fh;");
+    emit(1, "uint8_t eh;");
+    if(!r->tuple) {
+        emit(1, "uint32_t i;");
+        emit(1, "uint64_t seen = 0;");
+        emit(1, "cpk_bytes_t k;");
+        emit(1, "int f;");
+    }
+    emit(0, "");
+
+    emit(1, "if(sc_container(d, h, %s, &n, &fh)) return -1;",
+         r->tuple ? "CPK_CONTAINER_VECTOR" : "CPK_CONTAINER_MAP");
+    emit(1, "if(n != %d) return SC_MISMATCH(d);", r->nfields);
+    emit(0, "");
+
+    if(r->tuple) {
+        for(i = 0; i < r->nfields; i++) {
+            snprintf(lv, sizeof(lv), "v->%s", r->fields[i].name);
+            emit(1, "if(sc_next(d, fh, &eh)) return -1;");
+            gen_decode(r->fields[i].type, "eh", lv, 0, 1);
+        }
+    } else {
+        emit(1, "for(i = 0; i < n; i++) {");
+        emit(2, "if(sc_next(d, fh, &eh) || sc_string(d, eh, &k)) return -1;");
+        emit(2, "if((f = sc_key(&k, %s_keys, %d, i)) < 0 || (seen >> f & 1))",
+             r->name, r->nfields);
+        emit(3, "return SC_MISMATCH(d);");
+        emit(2, "seen |= 1ULL << f;");
+        emit(0, "");
+        emit(2, "if(sc_next(d, fh, &eh)) return -1;");
+        emit(0, "");
+        emit(2, "switch(f) {");
+        for(i = 0; i < r->nfields; i++) {
+            snprintf(lv, sizeof(lv), "v->%s", r->fields[i].name);
+            emit(3, "case %d:", i);
+            gen_decode(r->fields[i].type, "eh", lv, 0, 4);
+            emit(4, "break;");
+        }
+        emit(2, "}");
+        emit(1, "}");
+    }
+
+    emit(0, "");
+    emit(1, "return 0;");
+    emit(0, "}");
+    emit(0, "");
+
+    /* Encoding: each field starts with whatever of it is constant */
+
+    emit(0, "static void %s_enc(sc_enc_t *e, const %s_t *v) {", r->name, r->name);
+
+    n = size_header(buf, CPK_CONTAINER | (r->tuple ? CPK_CONTAINER_VECTOR
+                                                   : CPK_CONTAINER_MAP) |
+                    (fixed ? CPK_CONTAINER_FIXED : 0), r->nfields);
+    if(fixed) buf[n++] = number_header(r->fields[0].type);
+    emit_bytes(1, "head", buf, n);
+    emit(0, "");
+    emit(1, "sc_bytes(e, head, sizeof(head));");
+
+    for(i = 0; i < r->nfields; i++) {
+        f = &r->fields[i];
+        snprintf(lv, sizeof(lv), "v->%s", f->name);
+
+        n = 0;
+        if(!r->tuple) {
+            n = size_header(buf, CPK_STRING, strlen(f->key));
+            memcpy(buf + n, f->key, strlen(f->key));
+            n += strlen(f->key);
+        }
+        if(IS_NUMBER(f->type) && !fixed)
+            buf[n++] = number_header(f->type);
+
+        emit(0, "");
+        if(n) {
+            snprintf(name, sizeof(name), "%s_pre", f->name);
+            emit(1, "{");
+            emit_bytes(2, name, buf, n);
+            emit(2, "sc_bytes(e, %s, sizeof(%s));", name, name);
+            emit(1, "}");
+        }
+        gen_encode(f->type, lv, IS_NUMBER(f->type), 0, 1);
+    }
+
+    emit(0, "}");
+    emit(0, "");
+
+    /* Entry points */
+
+    emit(0, "size_t %s_decode(const uint8_t *buf, size_t len, %s_t *v,",
+         r->name, r->name);
+    emit(0, "%*scpk_arena_t *arena, cpk_object_t *err) {",
+         (int)strlen(r->name) + 15, "");
+    emit(1, "sc_dec_t d;");
+    emit(1, "uint8_t h;");
+    emit(0, "");
+    emit(1, "if(err) err->header = 0;");
+    emit(0, "");
+    emit(1, "d.start = d.p = buf;");
+    emit(1, "d.end = buf + len;");
+    emit(1, "d.arena = arena;");
+    emit(1, "d.err = err;");
+    emit(0, "");
+    emit(1, "if(sc_next(&d, -1, &h) || %s_dec(&d, h, v)) return 0;", r->name);
+    emit(0, "");
+    emit(1, "return d.p - d.start;");
+    emit(0, "}");
+    emit(0, "");
+    emit(0, "int %s_encode(cpk_output_t *out, const %s_t *v) {", r->name, r->name);
+    emit(1, "sc_enc_t e;");
+    emit(0, "");
+    emit(1, "e.out = out;");
+    emit(1, "e.failed = 0;");
+    emit(1, "e.used = 0;");
+    emit(0, "");
+    emit(1, "%s_enc(&e, v);", r->name);
+    emit(1, "sc_flush(&e);");
+    emit(0, "");
+    emit(1, "return e.failed || (out->flags & CPK_OUTPUT_OVERFLOW) ? "
+         "CPK_ERROR : 0;");
+    emit(0, "}");
+}
+
+static void emit_source_file(record_t *records, const char *header,
+                             const char *schema) {
+    record_t *r;
+
+    emit(0, "/* Generated by cpk-schemac from %s; do not edit */", schema);
+    emit(0, "");
+    emit(0, "#include \"%s\"", header);
+    emit(0, "");
+    emit(0, "#include <string.h>");
+    emit(0, "");
+    fputs(prelude, out);
+
+    for(r = records; r; r = r->next) {
+        emit(0, "");
+        gen_record(r);
+    }
+}
+
+static char* read_file(const char *path) {
+    FILE *f = fopen(path, "rb");
+    char *buf = NULL;
+    size_t size = 0, used = 0, n;
+
+    if(!f) return NULL;
+
+    do {
+        if(used + 4096 + 1 > size) {
+            size = size ? size * 2 : 8192;
+            if(!(buf = realloc(buf, size))) {
+                perror("cpk-schemac");
+                exit(1);
+            }
+        }
+        used += (n = fread(buf + used, 1, size - used - 1, f));
+    } while(n);
+
+    fclose(f);
+    buf[used] = 0;
+    return buf;
+}
+
+static void open_output(const char *path) {
+    if(!(out = fopen(path, "w"))) {
+        fprintf(stderr, "cpk-schemac: %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+}
+
+static void close_output(const char *path) {
+    if(ferror(out) | fclose(out)) {
+        fprintf(stderr, "cpk-schemac: %s: write failed\n", path);
+        exit(1);
+    }
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: cpk-schemac [-i include] -o base schema\n");
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    parser_t ps;
+    const char *base = NULL, *include = "conspack.h", *slash;
+    char *path, *guard, *g;
+    size_t n;
+    int c;
+
+    while((c = getopt(argc, argv, "i:o:")) != -1) {
+        switch(c) {
+            case 'i': include = optarg; break;
+            case 'o': base = optarg; break;
+            default: usage();
+        }
+    }
+
+    if(!base || optind != argc - 1) usage();
+
+    memset(&ps, 0, sizeof(ps));
+    ps.file = argv[optind];
+    ps.line = 1;
+    ps.tail = &ps.records;
+
+    if(!(ps.src = ps.p = read_file(ps.file))) {
+        fprintf(stderr, "cpk-schemac: %s: %s\n", ps.file, strerror(errno));
+        return 1;
+    }
+
+    parse(&ps);
+
+    n = strlen(base);
+    path = xalloc(n + 3);
+    slash = strrchr(base, '/');
+    guard = xalloc(n + 3);
+
+    for(g = guard, slash = slash ? slash + 1 : base; *slash; slash++)
+        *g++ = isalnum((unsigned char)*slash) ? toupper((unsigned char)*slash)
+                                              : '_';
+    strcpy(g, "_H");
+
+    snprintf(path, n + 3, "%s.h", base);
+    open_output(path);
+    emit_header_file(ps.records, include, guard, ps.file);
+    close_output(path);
+
+    snprintf(path, n + 3, "%s.c", base);
+    open_output(path);
+    slash = strrchr(base, '/');
+    snprintf(path, n + 3, "%s.h", slash ? slash + 1 : base);
+    emit_source_file(ps.records, path, ps.file);
+    sprintf(path, "%s.c", base);
+    close_output(path);
+
+    return 0;
+}
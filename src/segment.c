@@ -0,0 +1,272 @@
+/*
+ * libconspack
+ * Copyright (C) 2012  Ryan Pavlik
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the GNU Lesser General Public
+ * License (LGPL) version 2.1 which accompanies this distribution, and
+ * is available at http://www.gnu.org/licenses/lgpl-2.1.html
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ */
+
+#include "config.h"
+#include "conspack/conspack.h"
+#include "internal.h"
+
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#ifndef IOV_MAX
+#  define IOV_MAX 1024
+#endif
+
+/* Segments per pool thread; more than one lets fast threads pick up
+   the slack when element sizes vary across the container */
+#define SEGMENTS_PER_THREAD 4
+
+/* Below this many entries per segment, threading costs more than it saves */
+#define SEGMENT_MIN_ENTRIES 4096
+
+typedef struct _segment_job {
+    cpk_encode_range_fn_t fn;
+    void *arg;
+
+    uint64_t size;
+    uint32_t nsegments;
+    cpk_output_t *segments;
+
+    uint32_t next;
+    int failed;
+} segment_job_t;
+
+static void segment_worker(void *arg, uint32_t thread) {
+    segment_job_t *job = arg;
+    uint64_t start = 0, end = 0;
+    uint32_t i = 0;
+
+    (void)thread;
+
+    for(;;) {
+        i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        if(i >= job->nsegments) break;
+        if(__atomic_load_n(&job->failed, __ATOMIC_RELAXED)) break;
+
+        start = job->size * i / job->nsegments;
+        end = job->size * (i + 1) / job->nsegments;
+
+        if(job->fn(&job->segments[i], job->arg, start, end))
+            __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+
+        cpk_output_crc(&job->segments[i]);
+    }
+}
+
+/* Writes every iovec, following short writes and splitting at IOV_MAX */
+static int write_all(cpk_output_t *out, struct iovec *iov, int count) {
+    ssize_t n = 0;
+    int batch = 0;
+
+    for(;;) {
+        /* Empty segments first, so a batch always has bytes to write */
+        while(count && !iov->iov_len) {
+            iov++;
+            count--;
+        }
+
+        if(!count) break;
+
+        batch = count < IOV_MAX ? count : IOV_MAX;
+
+        n = writev(out->fd, iov, batch);
+        CPK_STAT_ADD(out->stats, syscalls, 1);
+
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            return -1;
+        }
+
+        /* No progress would only repeat */
+        if(!n) {
+            errno = EIO;
+            return -1;
+        }
+
+        CPK_STAT_ADD(out->stats, bytes_written, n);
+
+        while(count && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+
+        if(count) {
+            iov->iov_base = (uint8_t*)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+
+    return 0;
+}
+
+/* Joins the sums the parts kept while they were encoded onto out's,
+   rather than summing the bytes again as they are copied */
+static void stitch_crc(cpk_output_t *out, cpk_output_t *parts, uint32_t n) {
+    uint32_t i = 0;
+
+    if(!(out->flags & CPK_OUTPUT_CRC))
+        return;
+
+    for(i = 0; i < n; i++)
+        out->crc = cpk_crc32c_combine(out->crc, cpk_output_crc(&parts[i]),
+                                      parts[i].buffer_used);
+
+    out->crc_pos = out->buffer_used;
+}
+
+static int stitch(cpk_output_t *out, cpk_output_t *header,
+                  cpk_output_t *segments, uint32_t nsegments) {
+    struct iovec *iov = NULL;
+    size_t total = 0;
+    uint32_t i = 0;
+    int ret = 0;
+
+    if(out->fd < 0) {
+        for(i = 0; i < nsegments; i++)
+            total += segments[i].buffer_used;
+
+        if(cpk_write_bytes(out, header->buffer, header->buffer_used) < 0 ||
+           cpk_ensure_buffer(out, total))
+            return -1;
+
+        cpk_output_crc(out);
+
+        for(i = 0; i < nsegments; i++) {
+            memcpy(out->buffer + out->buffer_used, segments[i].buffer,
+                   segments[i].buffer_used);
+            out->buffer_used += segments[i].buffer_used;
+        }
+
+        stitch_crc(out, segments, nsegments);
+        CPK_STAT_ADD(out->stats, bytes_written, total);
+        return 0;
+    }
+
+    /* A staged output has to take the pieces through its blocks */
+    if(out->stage) {
+        if(cpk_write_bytes(out, header->buffer, header->buffer_used) < 0)
+            return -1;
+
+        for(i = 0; i < nsegments; i++)
+            if(cpk_write_bytes(out, segments[i].buffer,
+                               segments[i].buffer_used) < 0)
+                return -1;
+
+        return 0;
+    }
+
+    if(!(iov = malloc((nsegments + 1) * sizeof(struct iovec))))
+        return -1;
+
+    iov[0].iov_base = header->buffer;
+    iov[0].iov_len = header->buffer_used;
+
+    for(i = 0; i < nsegments; i++) {
+        iov[i + 1].iov_base = segments[i].buffer;
+        iov[i + 1].iov_len = segments[i].buffer_used;
+    }
+
+    ret = write_all(out, iov, nsegments + 1);
+    free(iov);
+
+    if(!ret) {
+        stitch_crc(out, header, 1);
+        stitch_crc(out, segments, nsegments);
+    }
+
+    return ret;
+}
+
+/* Encodes a container of size entries (pairs, for a map) by calling fn
+   on disjoint ranges of entries across pool, each into its own buffer,
+   then writes the header and the buffers in order.  The bytes are
+   those fn would produce called once over [0, size).  fn returns
+   nonzero to abandon the encode; a buffer output is then left as it
+   was, though a descriptor may have received part of a container that
+   was too small to split.  Tmaps are not supported, since their type
+   object precedes the entries. */
+int cpk_encode_container_parallel(cpk_output_t *out, cpk_pool_t *pool,
+                                  uint8_t type, uint32_t size,
+                                  uint8_t fixed_header,
+                                  cpk_encode_range_fn_t fn, void *arg) {
+    cpk_output_t header;
+    segment_job_t job;
+    uint32_t threads = cpk_pool_size(pool), i = 0;
+    size_t used = 0, crc_pos = 0;
+    uint32_t crc = 0;
+    int ret = 0;
+
+    if((type & CPK_CONTAINER_TYPE_MASK) == CPK_CONTAINER_TMAP)
+        return CPK_ERROR;
+
+    job.nsegments = threads * SEGMENTS_PER_THREAD;
+    while(job.nsegments > 1 && size / job.nsegments < SEGMENT_MIN_ENTRIES)
+        job.nsegments /= 2;
+
+    /* Not worth splitting: encode straight into out */
+    if(threads == 1 || job.nsegments <= 1) {
+        used = out->buffer_used;
+        crc = out->crc;
+        crc_pos = out->crc_pos;
+        cpk_encode_container(out, type, size, fixed_header);
+
+        if(fn(out, arg, 0, size)) {
+            out->buffer_used = used;
+            out->crc = crc;
+            out->crc_pos = crc_pos;
+            return CPK_ERROR;
+        }
+
+        return 0;
+    }
+
+    job.fn = fn;
+    job.arg = arg;
+    job.size = size;
+    job.next = 0;
+    job.failed = 0;
+
+    if(!(job.segments = malloc(job.nsegments * sizeof(cpk_output_t))))
+        return CPK_ERROR;
+
+    for(i = 0; i < job.nsegments; i++) {
+        cpk_output_init(&job.segments[i]);
+        if(out->flags & CPK_OUTPUT_CRC)
+            cpk_output_set_crc(&job.segments[i], 1);
+    }
+
+    cpk_pool_run(pool, segment_worker, &job);
+
+    cpk_output_init(&header);
+    if(out->flags & CPK_OUTPUT_CRC)
+        cpk_output_set_crc(&header, 1);
+    cpk_encode_container(&header, type, size, fixed_header);
+
+    if(job.failed || stitch(out, &header, job.segments, job.nsegments))
+        ret = CPK_ERROR;
+
+    cpk_output_fini(&header);
+
+    for(i = 0; i < job.nsegments; i++)
+        cpk_output_fini(&job.segments[i]);
+    free(job.segments);
+
+    return ret;
+}
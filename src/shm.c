@@ -0,0 +1,445 @@
+/*
+ * libconspack
+ * Copyright (C) 2012  Ryan Pavlik
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the GNU Lesser General Public
+ * License (LGPL) version 2.1 which accompanies this distribution, and
+ * is available at http://www.gnu.org/licenses/lgpl-2.1.html
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ */
+
+#include "config.h"
+#include "conspack/conspack.h"
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+
+#if defined(HAVE_LINUX_FUTEX_H) && defined(HAVE_SYS_MMAN_H)
+
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+/*
+ * The memfd holds a header page followed by the ring, and the ring is
+ * mapped twice back to back, so a record that runs off the end simply
+ * continues into the second mapping: writers and readers always see a
+ * message as one contiguous span and encode or decode it in place.
+ *
+ * Each record is an 8-byte prefix (the payload length) and the payload,
+ * padded to 8 bytes.  head and tail only ever grow; the producer owns
+ * head, the consumer owns tail.  A side that finds nothing to do spins
+ * briefly, then sets its waiting flag and sleeps on a futex that the
+ * other side only bumps and wakes when that flag is set, so a busy
+ * ring makes no syscalls at all.
+ */
+
+#define SHM_MAGIC   0x63706B72  /* "cpkr" */
+#define SHM_VERSION 1
+#define SHM_LINE    64
+
+/* Polls before sleeping; a pause is tens of cycles, so this is a few
+   microseconds, and pointless with one CPU, where the peer cannot run
+   while we spin */
+#define SHM_SPIN    256
+
+#define RECORD_PREFIX 8
+#define RECORD_ALIGN(n) (((n) + 7) & ~(uint64_t)7)
+
+typedef struct _shm_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t capacity;
+    uint32_t closed;
+    uint8_t pad0[SHM_LINE - 20];
+
+    uint64_t head;
+    uint32_t data_futex;
+    uint32_t consumer_waiting;
+    uint8_t pad1[SHM_LINE - 16];
+
+    uint64_t tail;
+    uint32_t space_futex;
+    uint32_t producer_waiting;
+    uint8_t pad2[SHM_LINE - 16];
+} shm_header_t;
+
+struct _cpk_shm {
+    int fd;
+    size_t page;
+    uint64_t capacity;
+
+    shm_header_t *hdr;
+    uint8_t *ring;
+
+    uint64_t pending;   /* length of the record the consumer holds */
+    uint32_t spin;
+};
+
+static int futex_wait(uint32_t *addr, uint32_t val, const struct timespec *ts) {
+    return syscall(SYS_futex, addr, FUTEX_WAIT, val, ts, NULL, 0);
+}
+
+static void futex_wake(uint32_t *addr) {
+    syscall(SYS_futex, addr, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+static int make_memfd(void) {
+#if defined(HAVE_MEMFD_CREATE)
+    return memfd_create("conspack", MFD_CLOEXEC);
+#elif defined(SYS_memfd_create)
+    return syscall(SYS_memfd_create, "conspack", 1 /* MFD_CLOEXEC */);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+static void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+static cpk_shm_t* shm_map(int fd, uint64_t capacity) {
+    cpk_shm_t *shm = NULL;
+    uint8_t *base = NULL;
+    size_t page = sysconf(_SC_PAGESIZE);
+
+    if(!(shm = calloc(1, sizeof(cpk_shm_t))))
+        return NULL;
+
+    shm->fd = fd;
+    shm->page = page;
+    shm->capacity = capacity;
+    shm->spin = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SHM_SPIN : 0;
+
+    shm->hdr = mmap(NULL, page, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(shm->hdr == MAP_FAILED) goto error;
+
+    /* Reserve twice the ring, then map the ring over both halves */
+    base = mmap(NULL, 2 * capacity, PROT_NONE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(base == MAP_FAILED) goto error;
+
+    if(mmap(base, capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+            fd, page) == MAP_FAILED ||
+       mmap(base + capacity, capacity, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_FIXED, fd, page) == MAP_FAILED) {
+        munmap(base, 2 * capacity);
+        goto error;
+    }
+
+    shm->ring = base;
+    return shm;
+
+ error:
+    if(shm->hdr && shm->hdr != MAP_FAILED)
+        munmap(shm->hdr, page);
+    free(shm);
+
+    return NULL;
+}
+
+/* capacity is rounded up to a whole number of pages */
+cpk_shm_t* cpk_shm_create(size_t capacity) {
+    cpk_shm_t *shm = NULL;
+    size_t page = sysconf(_SC_PAGESIZE);
+    int fd = -1;
+
+    capacity = (capacity + page - 1) / page * page;
+    if(!capacity) capacity = page;
+
+    if((fd = make_memfd()) < 0)
+        return NULL;
+
+    if(ftruncate(fd, page + capacity) || !(shm = shm_map(fd, capacity))) {
+        close(fd);
+        return NULL;
+    }
+
+    memset(shm->hdr, 0, sizeof(shm_header_t));
+    shm->hdr->magic = SHM_MAGIC;
+    shm->hdr->version = SHM_VERSION;
+    shm->hdr->capacity = capacity;
+
+    return shm;
+}
+
+/* Maps a ring made by cpk_shm_create in another process, typically
+   from a descriptor passed over a Unix socket or inherited; the
+   descriptor is owned by the result */
+cpk_shm_t* cpk_shm_attach(int fd) {
+    shm_header_t *hdr = NULL;
+    size_t page = sysconf(_SC_PAGESIZE);
+    uint64_t capacity = 0;
+    struct stat st;
+
+    if(fstat(fd, &st) || (size_t)st.st_size <= page)
+        return NULL;
+
+    hdr = mmap(NULL, page, PROT_READ, MAP_SHARED, fd, 0);
+    if(hdr == MAP_FAILED) return NULL;
+
+    if(hdr->magic == SHM_MAGIC && hdr->version == SHM_VERSION &&
+       hdr->capacity % page == 0 && hdr->capacity + page == (size_t)st.st_size)
+        capacity = hdr->capacity;
+
+    munmap(hdr, page);
+
+    return capacity ? shm_map(fd, capacity) : NULL;
+}
+
+int cpk_shm_fd(cpk_shm_t *shm) {
+    return shm->fd;
+}
+
+int cpk_shm_closed(cpk_shm_t *shm) {
+    return __atomic_load_n(&shm->hdr->closed, __ATOMIC_ACQUIRE);
+}
+
+/* Tells the other side no more messages are coming or being taken,
+   waking it if it sleeps, and unmaps */
+void cpk_shm_close(cpk_shm_t *shm) {
+    if(!shm) return;
+
+    __atomic_store_n(&shm->hdr->closed, 1, __ATOMIC_SEQ_CST);
+    __atomic_fetch_add(&shm->hdr->data_futex, 1, __ATOMIC_SEQ_CST);
+    __atomic_fetch_add(&shm->hdr->space_futex, 1, __ATOMIC_SEQ_CST);
+    futex_wake(&shm->hdr->data_futex);
+    futex_wake(&shm->hdr->space_futex);
+
+    munmap(shm->ring, 2 * shm->capacity);
+    munmap(shm->hdr, shm->page);
+    close(shm->fd);
+    free(shm);
+}
+
+static uint64_t used_bytes(cpk_shm_t *shm) {
+    return __atomic_load_n(&shm->hdr->head, __ATOMIC_ACQUIRE) -
+           __atomic_load_n(&shm->hdr->tail, __ATOMIC_ACQUIRE);
+}
+
+/* Puts the time left until deadline in ts; 0 once it has passed */
+static int remaining(const struct timespec *deadline, struct timespec *ts) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    ts->tv_sec = deadline->tv_sec - now.tv_sec;
+    ts->tv_nsec = deadline->tv_nsec - now.tv_nsec;
+    if(ts->tv_nsec < 0) {
+        ts->tv_sec--;
+        ts->tv_nsec += 1000000000L;
+    }
+
+    return ts->tv_sec >= 0;
+}
+
+/* Waits until ready(shm, need) holds.  The flag is raised before the
+   final check, and the other side bumps the futex word after changing
+   its position and before looking at the flag, so a wakeup cannot be
+   lost between the check and the sleep. */
+static int shm_wait(cpk_shm_t *shm, int (*ready)(cpk_shm_t*, uint64_t),
+                    uint64_t need, uint32_t *futex, uint32_t *waiting,
+                    int timeout_ms) {
+    struct timespec deadline, ts;
+    uint32_t seen = 0, spins = 0;
+
+    for(spins = 0; spins < shm->spin; spins++) {
+        if(ready(shm, need)) return 0;
+        cpu_relax();
+    }
+
+    if(timeout_ms >= 0) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+        if(deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+
+    for(;;) {
+        seen = __atomic_load_n(futex, __ATOMIC_SEQ_CST);
+        __atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+
+        if(ready(shm, need)) break;
+        if(cpk_shm_closed(shm)) goto fail;
+
+        if(timeout_ms >= 0) {
+            if(!remaining(&deadline, &ts)) goto fail;
+            futex_wait(futex, seen, &ts);
+        } else {
+            futex_wait(futex, seen, NULL);
+        }
+    }
+
+    __atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+    return 0;
+
+ fail:
+    __atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+    return CPK_ERROR;
+}
+
+static int has_space(cpk_shm_t *shm, uint64_t need) {
+    return shm->capacity - used_bytes(shm) >= need;
+}
+
+static int has_data(cpk_shm_t *shm, uint64_t need) {
+    (void)need;
+    return used_bytes(shm) > 0;
+}
+
+static void shm_signal(uint32_t *futex, uint32_t *waiting) {
+    if(__atomic_load_n(waiting, __ATOMIC_SEQ_CST)) {
+        __atomic_fetch_add(futex, 1, __ATOMIC_SEQ_CST);
+        futex_wake(futex);
+    }
+}
+
+/* Waits for room for a message of at least min_bytes, then points out
+   at all the free space in the ring as a fixed output.  Encode into
+   out, then publish with cpk_shm_commit. */
+int cpk_shm_begin(cpk_shm_t *shm, cpk_output_t *out, size_t min_bytes,
+                  int timeout_ms) {
+    shm_header_t *hdr = shm->hdr;
+    uint64_t need = 0, head = 0, avail = 0;
+
+    if(min_bytes > shm->capacity - RECORD_PREFIX || cpk_shm_closed(shm))
+        return CPK_ERROR;
+
+    need = RECORD_ALIGN(RECORD_PREFIX + min_bytes);
+    if(need > shm->capacity)
+        return CPK_ERROR;
+
+    if(shm_wait(shm, has_space, need, &hdr->space_futex,
+                &hdr->producer_waiting, timeout_ms))
+        return CPK_ERROR;
+
+    head = __atomic_load_n(&hdr->head, __ATOMIC_RELAXED);
+    avail = shm->capacity - used_bytes(shm);
+
+    cpk_output_init_fixed(out, shm->ring + (head % shm->capacity) + RECORD_PREFIX,
+                          avail - RECORD_PREFIX);
+    return 0;
+}
+
+/* Publishes what was encoded since cpk_shm_begin.  Fails, publishing
+   nothing, if the message outgrew the space it was given; begin again
+   with a larger min_bytes. */
+int cpk_shm_commit(cpk_shm_t *shm, cpk_output_t *out) {
+    shm_header_t *hdr = shm->hdr;
+    uint64_t head = __atomic_load_n(&hdr->head, __ATOMIC_RELAXED);
+    uint64_t len = out->buffer_used;
+
+    if(out->flags & CPK_OUTPUT_OVERFLOW)
+        return CPK_ERROR;
+
+    *(uint64_t*)(shm->ring + (head % shm->capacity)) = len;
+    __atomic_store_n(&hdr->head, head + RECORD_ALIGN(RECORD_PREFIX + len),
+                     __ATOMIC_SEQ_CST);
+
+    shm_signal(&hdr->data_futex, &hdr->consumer_waiting);
+    return 0;
+}
+
+/* Waits for the next message and points in at it, in place.  It stays
+   valid, along with any views decoded from it, until cpk_shm_done.
+   Messages still in the ring are delivered after the producer closes. */
+int cpk_shm_next(cpk_shm_t *shm, cpk_input_t *in, int timeout_ms) {
+    shm_header_t *hdr = shm->hdr;
+    uint64_t tail = 0, len = 0, used = 0;
+    uint8_t *rec = NULL;
+
+    if(shm_wait(shm, has_data, 0, &hdr->data_futex,
+                &hdr->consumer_waiting, timeout_ms))
+        return CPK_ERROR;
+
+    tail = __atomic_load_n(&hdr->tail, __ATOMIC_RELAXED);
+    rec = shm->ring + (tail % shm->capacity);
+    len = *(uint64_t*)rec;
+    used = used_bytes(shm);
+
+    /* The length is the producer's word; keep it from wrapping */
+    if(used < RECORD_PREFIX || len > used - RECORD_PREFIX ||
+       RECORD_ALIGN(RECORD_PREFIX + len) > used)
+        return CPK_ERROR;
+
+    cpk_input_init(in, rec + RECORD_PREFIX, len);
+    shm->pending = RECORD_ALIGN(RECORD_PREFIX + len);
+
+    return 0;
+}
+
+/* Gives the message from cpk_shm_next back to the producer */
+void cpk_shm_done(cpk_shm_t *shm) {
+    shm_header_t *hdr = shm->hdr;
+    uint64_t tail = __atomic_load_n(&hdr->tail, __ATOMIC_RELAXED);
+
+    if(!shm->pending) return;
+
+    __atomic_store_n(&hdr->tail, tail + shm->pending, __ATOMIC_SEQ_CST);
+    shm->pending = 0;
+
+    shm_signal(&hdr->space_futex, &hdr->producer_waiting);
+}
+
+#else /* no futexes or mmap */
+
+cpk_shm_t* cpk_shm_create(size_t capacity) {
+    (void)capacity;
+    return NULL;
+}
+
+cpk_shm_t* cpk_shm_attach(int fd) {
+    (void)fd;
+    return NULL;
+}
+
+int cpk_shm_fd(cpk_shm_t *shm) {
+    (void)shm;
+    return -1;
+}
+
+int cpk_shm_closed(cpk_shm_t *shm) {
+    (void)shm;
+    return 1;
+}
+
+void cpk_shm_close(cpk_shm_t *shm) {
+    (void)shm;
+}
+
+int cpk_shm_begin(cpk_shm_t *shm, cpk_output_t *out, size_t min_bytes,
+                  int timeout_ms) {
+    (void)shm; (void)out; (void)min_bytes; (void)timeout_ms;
+    return CPK_ERROR;
+}
+
+int cpk_shm_commit(cpk_shm_t *shm, cpk_output_t *out) {
+    (void)shm; (void)out;
+    return CPK_ERROR;
+}
+
+int cpk_shm_next(cpk_shm_t *shm, cpk_input_t *in, int timeout_ms) {
+    (void)shm; (void)in; (void)timeout_ms;
+    return CPK_ERROR;
+}
+
+void cpk_shm_done(cpk_shm_t *shm) {
+    (void)shm;
+}
+
+#endif
@@ -0,0 +1,434 @@
+/*
+ * libconspack
+ * Copyright (C) 2012  Ryan Pavlik
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the GNU Lesser General Public
+ * License (LGPL) version 2.1 which accompanies this distribution, and
+ * is available at http://www.gnu.org/licenses/lgpl-2.1.html
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ */
+
+#include "config.h"
+#include "conspack/conspack.h"
+#include "internal.h"
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+/*
+ * A staged stream is a header followed by blocks, integers big-endian:
+ *
+ *   header  "CPKZ", u8 version, u8 codec id, u16 reserved,
+ *           u32 block size
+ *   block   u32 stored length, with the top bit set if the block is
+ *           stored as is; u32 expanded length; the stored bytes
+ *
+ * Blocks never refer to one another, so any block can be expanded on
+ * its own once its start is known.  A block that does not shrink is
+ * stored as is.  Blocks carry no checksum; sum the expanded stream with
+ * CPK_OUTPUT_CRC and CPK_DECODE_CRC for that.
+ */
+
+#define STAGE_MAGIC        0x43504B5A  /* "CPKZ" */
+#define STAGE_VERSION      1
+#define STAGE_HEADER       12
+#define STAGE_BLOCK_HEADER 8
+#define STAGE_STORED       0x80000000u
+
+struct _cpk_stage {
+    const cpk_codec_t *codec;
+    int level;
+    size_t block_size;
+
+    uint8_t *raw;       /* the block being filled, or drained */
+    size_t used;        /* bytes in raw */
+    size_t pos;         /* bytes of raw already read */
+
+    uint8_t *packed;    /* a block's compressed form */
+    size_t packed_size;
+};
+
+static uint32_t get32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return net32(v);
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+    v = net32(v);
+    memcpy(p, &v, 4);
+}
+
+static cpk_stage_t* stage_new(const cpk_codec_t *codec, size_t block_size,
+                              int level) {
+    cpk_stage_t *stage = NULL;
+
+    if(!(stage = calloc(1, sizeof(cpk_stage_t))))
+        return NULL;
+
+    stage->codec = codec;
+    stage->level = level;
+    stage->block_size = block_size;
+    stage->packed_size = codec->bound ? codec->bound(block_size) : 0;
+
+    if(!(stage->raw = malloc(block_size)) ||
+       (stage->packed_size && !(stage->packed = malloc(stage->packed_size)))) {
+        cpk_stage_free(stage);
+        return NULL;
+    }
+
+    return stage;
+}
+
+void cpk_stage_free(cpk_stage_t *stage) {
+    if(!stage) return;
+
+    free(stage->raw);
+    free(stage->packed);
+    free(stage);
+}
+
+static int write_all(cpk_output_t *out, const uint8_t *buf, size_t len) {
+    ssize_t n = 0;
+
+    while(len) {
+        n = write(out->fd, buf, len);
+        CPK_STAT_ADD(out->stats, syscalls, 1);
+        if(n < 0 && errno == EINTR) continue;
+        if(n < 0) return -1;
+
+        buf += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/* Reads up to len bytes, stopping early only at the end of input;
+   returns the count, or -1 on error */
+static ssize_t read_full(cpk_input_t *in, uint8_t *buf, size_t len) {
+    size_t got = 0;
+    ssize_t n = 0;
+
+    while(got < len) {
+        n = read(in->fd, buf + got, len - got);
+        CPK_STAT_ADD(in->stats, syscalls, 1);
+        if(n < 0 && errno == EINTR) continue;
+        if(n < 0) return -1;
+        if(!n) break;
+
+        got += n;
+    }
+
+    return got;
+}
+
+ /* Output */
+
+/* Makes out a descriptor output that compresses into fd in blocks of
+   block_size (0 for CPK_STAGE_BLOCK) with codec, at level (0 for the
+   codec's default), and writes the stream header */
+int cpk_output_init_stage(cpk_output_t *out, int fd, const cpk_codec_t *codec,
+                          size_t block_size, int level) {
+    uint8_t header[STAGE_HEADER];
+
+    cpk_output_init_fd(out, fd);
+
+    if(!codec) codec = cpk_codec(CPK_CODEC_NONE);
+    if(!block_size) block_size = CPK_STAGE_BLOCK;
+    if(block_size > CPK_STAGE_MAX_BLOCK)
+        return CPK_ERROR;
+
+    put32(header, STAGE_MAGIC);
+    header[4] = STAGE_VERSION;
+    header[5] = codec->id;
+    header[6] = header[7] = 0;
+    put32(header + 8, block_size);
+
+    if(!(out->stage = stage_new(codec, block_size, level)))
+        return CPK_ERROR;
+
+    if(write_all(out, header, STAGE_HEADER)) {
+        cpk_stage_free(out->stage);
+        out->stage = NULL;
+        return CPK_ERROR;
+    }
+
+    return 0;
+}
+
+static int stage_block(cpk_output_t *out) {
+    cpk_stage_t *stage = out->stage;
+    uint8_t header[STAGE_BLOCK_HEADER];
+    const uint8_t *data = stage->packed;
+    size_t n = 0;
+
+    if(!stage->used)
+        return 0;
+
+    if(stage->codec->compress)
+        n = stage->codec->compress(stage->packed, stage->packed_size,
+                                   stage->raw, stage->used, stage->level);
+
+    if(!n || n >= stage->used) {
+        data = stage->raw;
+        n = stage->used;
+        put32(header, n | STAGE_STORED);
+    } else {
+        put32(header, n);
+    }
+
+    put32(header + 4, stage->used);
+    stage->used = 0;
+
+    if(write_all(out, header, STAGE_BLOCK_HEADER) || write_all(out, data, n))
+        return -1;
+
+    return 0;
+}
+
+/* Called for every write to a staged output; takes all of buf */
+ssize_t cpk_stage_write(cpk_output_t *out, const void *buf, size_t len) {
+    cpk_stage_t *stage = out->stage;
+    const uint8_t *p = buf;
+    size_t n = 0;
+
+    while(len) {
+        n = stage->block_size - stage->used;
+        if(n > len) n = len;
+
+        memcpy(stage->raw + stage->used, p, n);
+        stage->used += n;
+        p += n;
+        len -= n;
+
+        if(stage->used == stage->block_size && stage_block(out))
+            return -1;
+    }
+
+    return p - (const uint8_t*)buf;
+}
+
+/* Ends the current block early, for instance after a message that a
+   reader is waiting on.  A no-op for outputs without a stage. */
+int cpk_output_flush(cpk_output_t *out) {
+    if(!out->stage)
+        return 0;
+
+    return stage_block(out) ? CPK_ERROR : 0;
+}
+
+ /* Input */
+
+/* Makes in a descriptor input that expands the staged stream on fd,
+   reading its header first; release it with cpk_input_fini */
+int cpk_input_init_stage(cpk_input_t *in, int fd) {
+    uint8_t header[STAGE_HEADER];
+    const cpk_codec_t *codec = NULL;
+    uint32_t block_size = 0;
+
+    cpk_input_init_fd(in, fd);
+
+    if(read_full(in, header, STAGE_HEADER) != STAGE_HEADER ||
+       get32(header) != STAGE_MAGIC || header[4] != STAGE_VERSION ||
+       !(codec = cpk_codec(header[5])))
+        return CPK_ERROR;
+
+    block_size = get32(header + 8);
+    if(!block_size || block_size > CPK_STAGE_MAX_BLOCK)
+        return CPK_ERROR;
+
+    if(!(in->stage = stage_new(codec, block_size, 0)))
+        return CPK_ERROR;
+
+    return 0;
+}
+
+/* Loads the next block; 0 at the end of the stream, -1 on a bad block */
+static int stage_load(cpk_input_t *in) {
+    cpk_stage_t *stage = in->stage;
+    uint8_t header[STAGE_BLOCK_HEADER];
+    uint32_t stored = 0, len = 0;
+    ssize_t n = 0;
+
+    n = read_full(in, header, STAGE_BLOCK_HEADER);
+    if(n <= 0) return n;
+    if(n != STAGE_BLOCK_HEADER) return -1;
+
+    stored = get32(header);
+    len = get32(header + 4);
+    if(len > stage->block_size)
+        return -1;
+
+    if(stored & STAGE_STORED) {
+        if((stored & ~STAGE_STORED) != len ||
+           read_full(in, stage->raw, len) != len)
+            return -1;
+    } else {
+        /* A codec that does not compress only writes stored blocks */
+        if(!stage->codec->decompress || stored > stage->packed_size ||
+           read_full(in, stage->packed, stored) != stored ||
+           stage->codec->decompress(stage->raw, len, stage->packed, stored))
+            return -1;
+    }
+
+    stage->used = len;
+    stage->pos = 0;
+    return 1;
+}
+
+/* Called for every read from a staged input; returns what the current
+   block holds up to len, 0 at the end of the stream, or -1 */
+ssize_t cpk_stage_read(cpk_input_t *in, void *buf, size_t len) {
+    cpk_stage_t *stage = in->stage;
+    size_t n = 0;
+    int ret = 0;
+
+    while(stage->pos == stage->used)
+        if((ret = stage_load(in)) <= 0)
+            return ret;
+
+    n = stage->used - stage->pos;
+    if(n > len) n = len;
+
+    memcpy(buf, stage->raw + stage->pos, n);
+    stage->pos += n;
+
+    return n;
+}
+
+ /* Expanding in parallel */
+
+typedef struct _stage_block {
+    size_t src;
+    uint32_t stored;
+    uint32_t len;
+    size_t dst;
+} stage_block_t;
+
+typedef struct _expand_job {
+    const cpk_codec_t *codec;
+    const uint8_t *src;
+    uint8_t *dst;
+
+    stage_block_t *blocks;
+    size_t nblocks;
+
+    size_t next;
+    int failed;
+} expand_job_t;
+
+static void expand_worker(void *arg, uint32_t thread) {
+    expand_job_t *job = arg;
+    stage_block_t *b = NULL;
+    size_t i = 0;
+
+    (void)thread;
+
+    for(;;) {
+        i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        if(i >= job->nblocks) break;
+        if(__atomic_load_n(&job->failed, __ATOMIC_RELAXED)) break;
+
+        b = &job->blocks[i];
+
+        if(b->stored & STAGE_STORED)
+            memcpy(job->dst + b->dst, job->src + b->src, b->len);
+        else if(job->codec->decompress(job->dst + b->dst, b->len,
+                                       job->src + b->src, b->stored))
+            __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/* Expands a whole staged stream held in memory, a block per task
+   across pool (or on the caller's thread if pool is NULL), into a new
+   buffer returned in dst, which the caller frees */
+int cpk_stage_expand(cpk_pool_t *pool, const uint8_t *src, size_t len,
+                     uint8_t **dst, size_t *dst_len) {
+    stage_block_t *blocks = NULL, *grown = NULL;
+    size_t nblocks = 0, cap = 0, pos = STAGE_HEADER, total = 0, packed = 0;
+    uint32_t block_size = 0, stored = 0, n = 0;
+    expand_job_t job;
+
+    *dst = NULL;
+    *dst_len = 0;
+
+    if(len < STAGE_HEADER || get32(src) != STAGE_MAGIC ||
+       src[4] != STAGE_VERSION || !(job.codec = cpk_codec(src[5])))
+        return CPK_ERROR;
+
+    block_size = get32(src + 8);
+    if(!block_size || block_size > CPK_STAGE_MAX_BLOCK)
+        return CPK_ERROR;
+
+    packed = job.codec->bound ? job.codec->bound(block_size) : 0;
+
+    /* Find every block first; only their headers are read */
+    while(pos < len) {
+        if(len - pos < STAGE_BLOCK_HEADER)
+            goto error;
+
+        stored = get32(src + pos);
+        n = get32(src + pos + 4);
+        pos += STAGE_BLOCK_HEADER;
+
+        if(n > block_size)
+            goto error;
+
+        if(stored & STAGE_STORED) {
+            if((stored & ~STAGE_STORED) != n || len - pos < n)
+                goto error;
+        } else if(!job.codec->decompress || stored > packed ||
+                  len - pos < stored) {
+            goto error;
+        }
+
+        if(nblocks == cap) {
+            cap = cap ? cap * 2 : 64;
+            if(!(grown = realloc(blocks, cap * sizeof(stage_block_t))))
+                goto error;
+            blocks = grown;
+        }
+
+        blocks[nblocks].src = pos;
+        blocks[nblocks].stored = stored;
+        blocks[nblocks].len = n;
+        blocks[nblocks].dst = total;
+        nblocks++;
+
+        pos += stored & ~STAGE_STORED;
+        total += n;
+    }
+
+    if(!(*dst = malloc(total ? total : 1)))
+        goto error;
+
+    job.src = src;
+    job.dst = *dst;
+    job.blocks = blocks;
+    job.nblocks = nblocks;
+    job.next = 0;
+    job.failed = 0;
+
+    cpk_pool_run(pool, expand_worker, &job);
+
+    if(job.failed)
+        goto error;
+
+    free(blocks);
+    *dst_len = total;
+    return 0;
+
+ error:
+    free(blocks);
+    free(*dst);
+    *dst = NULL;
+    return CPK_ERROR;
+}
@@ -0,0 +1,53 @@
+/*
+ * libconspack
+ * Copyright (C) 2012  Ryan Pavlik
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the GNU Lesser General Public
+ * License (LGPL) version 2.1 which accompanies this distribution, and
+ * is available at http://www.gnu.org/licenses/lgpl-2.1.html
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ */
+
+#include "config.h"
+#include "conspack/conspack.h"
+#include "internal.h"
+
+#include <string.h>
+
+int cpk_stats_enabled(void) {
+#ifdef CPK_STATS
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+void cpk_stats_clear(cpk_stats_t *stats) {
+    memset(stats, 0, sizeof(*stats));
+}
+
+/* Maps a kind from cpk_decode_header to its cpk_stats_t.values slot */
+int cpk_stats_slot(uint8_t kind) {
+    switch(kind) {
+        case CPK_BOOL:       return CPK_STAT_BOOL;
+        case CPK_NUMBER:     return CPK_STAT_NUMBER;
+        case CPK_CONTAINER:  return CPK_STAT_CONTAINER;
+        case CPK_STRING:     return CPK_STAT_STRING;
+        case CPK_REF:        return CPK_STAT_REF;
+        case CPK_REMOTE_REF: return CPK_STAT_REMOTE_REF;
+        case CPK_POINTER:    return CPK_STAT_POINTER;
+        case CPK_TAG:        return CPK_STAT_TAG;
+        case CPK_INDEX:      return CPK_STAT_INDEX;
+        case CPK_CONS:       return CPK_STAT_CONS;
+        case CPK_PACKAGE:    return CPK_STAT_PACKAGE;
+        case CPK_SYMBOL:     return CPK_STAT_SYMBOL;
+    }
+
+    return CPK_STAT_BOOL;
+}
@@ -0,0 +1,509 @@
+/*
+ * libconspack
+ * Copyright (C) 2012  Ryan Pavlik
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the GNU Lesser General Public
+ * License (LGPL) version 2.1 which accompanies this distribution, and
+ * is available at http://www.gnu.org/licenses/lgpl-2.1.html
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ */
+
+/*
+ * cpk-bench: runs each API over each synthetic corpus and prints one
+ * JSON object per line, so runs from different commits can be diffed
+ * or loaded into anything that reads JSON lines.
+ *
+ * Throughput is always given against the corpus' encoded size, so the
+ * MB/s of different APIs over one corpus are comparable.  Allocations
+ * per message need a library configured with --enable-stats and are
+ * null otherwise; instruction and branch-miss counts are null where
+ * perf counters are unavailable.  Peak RSS is each run's own, from a
+ * high-water mark reset before it, and null where /proc cannot reset
+ * one.
+ */
+
+#include "config.h"
+#include "conspack/conspack.h"
+#include "corpus.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#ifdef HAVE_LINUX_PERF_EVENT_H
+#  include <linux/perf_event.h>
+#  include <sys/ioctl.h>
+#  include <sys/syscall.h>
+#endif
+
+#define BENCH_SEED 0x636F6E737061636BULL
+
+typedef struct _bench_corpus {
+    const cpk_corpus_t *corpus;
+    cpk_output_t out;
+    uint32_t messages;
+    uint64_t values;
+
+    cpk_object_t **trees;
+} bench_corpus_t;
+
+typedef struct _bench_result {
+    uint64_t reps;
+    double seconds;
+
+    cpk_stats_t stats;
+
+    int have_perf;
+    uint64_t instructions;
+    uint64_t branch_misses;
+
+    long peak_rss_kb;       /* -1 if unknown */
+} bench_result_t;
+
+typedef void (*bench_fn_t)(bench_corpus_t *bc, cpk_stats_t *stats);
+
+static uint32_t scale = 1;
+static double min_seconds = 0.25;
+static const char *label = "";
+static cpk_pool_t *pool = NULL;
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* The process' peak RSS only ever grows, so each run resets the
+   high-water mark (Linux 4.0 and later) and reads it back after */
+static int peak_rss_reset(void) {
+    FILE *f = fopen("/proc/self/clear_refs", "w");
+    int ok = 0;
+
+    if(!f) return -1;
+
+    ok = fputs("5", f) >= 0;
+    if(fclose(f)) ok = 0;
+    return ok ? 0 : -1;
+}
+
+static long peak_rss_kb(void) {
+    FILE *f = fopen("/proc/self/status", "r");
+    char line[256];
+    long kb = -1;
+
+    if(!f) return -1;
+
+    while(fgets(line, sizeof(line), f))
+        if(sscanf(line, "VmHWM: %ld kB", &kb) == 1)
+            break;
+
+    fclose(f);
+    return kb;
+}
+
+/* Writes s as a JSON string */
+static void json_string(const char *s) {
+    putchar('"');
+
+    for(; *s; s++) {
+        if(*s == '"' || *s == '\\')
+            printf("\\%c", *s);
+        else if((unsigned char)*s < 0x20)
+            printf("\\u%04x", (unsigned char)*s);
+        else
+            putchar(*s);
+    }
+
+    putchar('"');
+}
+
+ /* Perf counters */
+
+typedef struct _bench_perf {
+    int insns;
+    int misses;
+} bench_perf_t;
+
+#ifdef HAVE_LINUX_PERF_EVENT_H
+static int perf_open(uint64_t config, int group) {
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.disabled = group < 0;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    return syscall(__NR_perf_event_open, &attr, 0, -1, group, 0);
+}
+#endif
+
+static void perf_start(bench_perf_t *p) {
+    p->insns = p->misses = -1;
+
+#ifdef HAVE_LINUX_PERF_EVENT_H
+    p->insns = perf_open(PERF_COUNT_HW_INSTRUCTIONS, -1);
+    if(p->insns < 0) return;
+
+    p->misses = perf_open(PERF_COUNT_HW_BRANCH_MISSES, p->insns);
+    if(p->misses < 0) {
+        close(p->insns);
+        p->insns = -1;
+        return;
+    }
+
+    ioctl(p->insns, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(p->insns, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+#endif
+}
+
+static void perf_stop(bench_perf_t *p, bench_result_t *r) {
+    r->have_perf = 0;
+
+#ifdef HAVE_LINUX_PERF_EVENT_H
+    if(p->insns < 0) return;
+
+    ioctl(p->insns, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+    if(read(p->insns, &r->instructions, 8) == 8 &&
+       read(p->misses, &r->branch_misses, 8) == 8)
+        r->have_perf = 1;
+
+    close(p->misses);
+    close(p->insns);
+#endif
+}
+
+ /* APIs under test */
+
+static void bench_decode(bench_corpus_t *bc, cpk_stats_t *stats) {
+    cpk_input_t in;
+    cpk_object_t *obj = NULL;
+    uint32_t m = 0;
+
+    cpk_input_init(&in, bc->out.buffer, bc->out.buffer_used);
+    cpk_input_set_stats(&in, stats);
+
+    for(m = 0; m < bc->messages; m++) {
+        obj = cpk_decode_r(&in);
+        cpk_free_r(obj);
+    }
+}
+
+/* Frames the whole corpus and decodes it across the pool (-j) */
+static void bench_batch(bench_corpus_t *bc, cpk_stats_t *stats) {
+    cpk_batch_t batch;
+
+    cpk_batch_init(&batch);
+    cpk_decode_batch(&batch, pool, bc->out.buffer, bc->out.buffer_used,
+                     NULL, NULL);
+
+    if(stats) stats->bytes_read += bc->out.buffer_used;
+    cpk_batch_fini(&batch);
+}
+
+static void bench_validate(bench_corpus_t *bc, cpk_stats_t *stats) {
+    size_t pos = 0, span = 0;
+
+    while(pos < bc->out.buffer_used) {
+        span = cpk_validate_span(bc->out.buffer + pos,
+                                 bc->out.buffer_used - pos, NULL, NULL);
+        if(!span) break;
+
+        pos += span;
+    }
+
+    if(stats) stats->bytes_read += pos;
+}
+
+static void bench_skip(bench_corpus_t *bc, cpk_stats_t *stats) {
+    cpk_input_t in;
+    uint32_t m = 0;
+
+    cpk_input_init(&in, bc->out.buffer, bc->out.buffer_used);
+    cpk_input_set_stats(&in, stats);
+
+    for(m = 0; m < bc->messages; m++)
+        cpk_skip(&in, NULL);
+}
+
+static void bench_encode(bench_corpus_t *bc, cpk_stats_t *stats) {
+    cpk_output_t out;
+
+    cpk_output_init(&out);
+    cpk_output_set_stats(&out, stats);
+
+    bc->corpus->generate(&out, scale, BENCH_SEED);
+
+    cpk_output_fini(&out);
+}
+
+static void bench_explain(bench_corpus_t *bc, cpk_stats_t *stats) {
+    cpk_output_t out;
+    uint32_t m = 0;
+
+    cpk_output_init(&out);
+    cpk_output_set_stats(&out, stats);
+
+    for(m = 0; m < bc->messages; m++) {
+        cpk_output_clear(&out);
+        cpk_explain_object(&out, bc->trees[m]);
+    }
+
+    cpk_output_fini(&out);
+}
+
+typedef struct _bench_api {
+    const char *name;
+    bench_fn_t run;
+} bench_api_t;
+
+static const bench_api_t apis[] = {
+    { "decode",   bench_decode },
+    { "batch",    bench_batch },
+    { "validate", bench_validate },
+    { "skip",     bench_skip },
+    { "encode",   bench_encode },
+    { "explain",  bench_explain },
+    { NULL, NULL }
+};
+
+ /* Harness */
+
+static uint64_t count_values(cpk_object_t *obj) {
+    cpk_object_t tmp;
+    uint64_t n = 1, i = 0;
+
+    if(!obj) return 0;
+
+    switch(cpk_decode_header(obj->header)) {
+        case CPK_NUMBER:
+            if(CPK_HEADER_INFO(obj->header)->children)
+                for(i = 0; i < 2; i++)
+                    n += count_values((cpk_object_t*)
+                                      cpk_number_part(obj, i, &tmp));
+            break;
+
+        case CPK_CONTAINER:
+            for(i = 0; i < obj->container.size; i++)
+                n += count_values(obj->container.obj[i]);
+            break;
+
+        case CPK_TAG:
+            n += count_values(obj->tag.obj);
+            break;
+
+        case CPK_REMOTE_REF:
+            n += count_values(obj->rref.val);
+            break;
+
+        case CPK_CONS:
+            n += count_values(obj->cons.car) + count_values(obj->cons.cdr);
+            break;
+
+        case CPK_PACKAGE:
+            n += count_values(obj->package.name);
+            break;
+
+        case CPK_SYMBOL:
+            n += count_values(obj->symbol.name) + count_values(obj->symbol.package);
+            break;
+    }
+
+    return n;
+}
+
+static int corpus_load(bench_corpus_t *bc, const cpk_corpus_t *corpus) {
+    cpk_input_t in;
+    uint32_t m = 0;
+
+    bc->corpus = corpus;
+    bc->values = 0;
+
+    cpk_output_init(&bc->out);
+    bc->messages = corpus->generate(&bc->out, scale, BENCH_SEED);
+
+    bc->trees = calloc(bc->messages, sizeof(cpk_object_t*));
+    if(!bc->trees) return -1;
+
+    cpk_input_init(&in, bc->out.buffer, bc->out.buffer_used);
+
+    for(m = 0; m < bc->messages; m++) {
+        bc->trees[m] = cpk_decode_r(&in);
+
+        if(!bc->trees[m] || CPK_IS_ERROR(bc->trees[m]->header)) {
+            fprintf(stderr, "cpk-bench: corpus %s: message %u does not decode\n",
+                    corpus->name, m);
+            return -1;
+        }
+
+        bc->values += count_values(bc->trees[m]);
+    }
+
+    if(in.buffer_read != bc->out.buffer_used) {
+        fprintf(stderr, "cpk-bench: corpus %s: trailing bytes\n", corpus->name);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void corpus_unload(bench_corpus_t *bc) {
+    uint32_t m = 0;
+
+    for(m = 0; m < bc->messages; m++)
+        cpk_free_r(bc->trees[m]);
+
+    free(bc->trees);
+    cpk_output_fini(&bc->out);
+}
+
+/* Runs the API until min_seconds have passed, then once more with
+   statistics attached so that counting stays out of the timings */
+static void run(bench_corpus_t *bc, const bench_api_t *api, bench_result_t *r) {
+    bench_perf_t perf;
+    double start = 0;
+    int reset = 0;
+
+    memset(r, 0, sizeof(*r));
+
+    reset = peak_rss_reset();
+    api->run(bc, NULL);
+
+    perf_start(&perf);
+    start = now();
+
+    do {
+        api->run(bc, NULL);
+        r->reps++;
+        r->seconds = now() - start;
+    } while(r->seconds < min_seconds);
+
+    perf_stop(&perf, r);
+
+    cpk_stats_clear(&r->stats);
+    api->run(bc, &r->stats);
+
+    r->peak_rss_kb = reset ? -1 : peak_rss_kb();
+}
+
+static void report(bench_corpus_t *bc, const bench_api_t *api,
+                   bench_result_t *r) {
+    double per_rep = r->seconds / r->reps;
+    double values = (double)bc->values * r->reps;
+
+    printf("{\"label\":");
+    json_string(label);
+    printf(",\"version\":");
+    json_string(PACKAGE_VERSION);
+    printf(",\"corpus\":");
+    json_string(bc->corpus->name);
+    printf(",\"api\":");
+    json_string(api->name);
+
+    printf(",\"threads\":%u,\"scale\":%u,\"messages\":%u,\"bytes\":%zu,"
+           "\"values\":%llu,\"reps\":%llu,\"seconds\":%.6f,",
+           cpk_pool_size(pool), scale,
+           bc->messages, bc->out.buffer_used,
+           (unsigned long long)bc->values, (unsigned long long)r->reps,
+           r->seconds);
+
+    printf("\"mb_s\":%.2f,\"ns_per_value\":%.2f,",
+           bc->out.buffer_used / per_rep / 1e6,
+           r->seconds * 1e9 / values);
+
+    if(cpk_stats_enabled())
+        printf("\"allocs_per_msg\":%.2f,\"alloc_bytes_per_msg\":%.1f,",
+               (double)(r->stats.allocs + r->stats.reallocs) / bc->messages,
+               (double)r->stats.alloc_bytes / bc->messages);
+    else
+        printf("\"allocs_per_msg\":null,\"alloc_bytes_per_msg\":null,");
+
+    if(r->have_perf)
+        printf("\"insns_per_value\":%.2f,\"branch_misses_per_value\":%.4f,",
+               r->instructions / values, r->branch_misses / values);
+    else
+        printf("\"insns_per_value\":null,\"branch_misses_per_value\":null,");
+
+    if(r->peak_rss_kb >= 0)
+        printf("\"peak_rss_kb\":%ld}\n", r->peak_rss_kb);
+    else
+        printf("\"peak_rss_kb\":null}\n");
+    fflush(stdout);
+}
+
+static void usage(FILE *f) {
+    const cpk_corpus_t *c = NULL;
+
+    fprintf(f, "usage: cpk-bench [-s scale] [-t seconds] [-c corpus] "
+               "[-a api] [-l label] [-j threads]\n\ncorpora:\n");
+
+    for(c = cpk_corpora; c->name; c++)
+        fprintf(f, "  %-10s %s\n", c->name, c->description);
+
+    fprintf(f, "\napis: decode batch validate skip encode explain\n"
+               "\n-j sets the threads used by batch; 0 is one per cpu\n");
+}
+
+int main(int argc, char **argv) {
+    const cpk_corpus_t *c = NULL;
+    const bench_api_t *api = NULL;
+    const char *only_corpus = NULL, *only_api = NULL;
+    bench_corpus_t bc;
+    bench_result_t r;
+    uint32_t threads = 1;
+    int opt = 0;
+
+    while((opt = getopt(argc, argv, "s:t:c:a:l:j:h")) != -1) {
+        switch(opt) {
+            case 's': scale = strtoul(optarg, NULL, 10); break;
+            case 't': min_seconds = strtod(optarg, NULL); break;
+            case 'c': only_corpus = optarg; break;
+            case 'a': only_api = optarg; break;
+            case 'l': label = optarg; break;
+            case 'j': threads = strtoul(optarg, NULL, 10); break;
+            case 'h': usage(stdout); return 0;
+            default:  usage(stderr); return 2;
+        }
+    }
+
+    if(!scale) scale = 1;
+
+    if(only_corpus && !cpk_corpus_find(only_corpus)) {
+        fprintf(stderr, "cpk-bench: no corpus named %s\n", only_corpus);
+        return 2;
+    }
+
+    pool = cpk_pool_new(threads);
+
+    for(c = cpk_corpora; c->name; c++) {
+        if(only_corpus && strcmp(only_corpus, c->name))
+            continue;
+
+        if(corpus_load(&bc, c))
+            return 1;
+
+        for(api = apis; api->name; api++) {
+            if(only_api && strcmp(only_api, api->name))
+                continue;
+
+            run(&bc, api, &r);
+            report(&bc, api, &r);
+        }
+
+        corpus_unload(&bc);
+    }
+
+    cpk_pool_free(pool);
+    return 0;
+}
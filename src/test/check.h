@@ -0,0 +1,39 @@
+/*
+ * libconspack
+ * Copyright (C) 2012  Ryan Pavlik
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the GNU Lesser General Public
+ * License (LGPL) version 2.1 which accompanies this distribution, and
+ * is available at http://www.gnu.org/licenses/lgpl-2.1.html
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ */
+
+#ifndef CPK_CHECK_H
+#define CPK_CHECK_H
+
+#include <stdio.h>
+
+/* Each test-*.c is a program that runs its cases in order, reports
+   every failed CHECK and exits with CHECK_STATUS, which is what
+   automake's test driver reads: 0 passes, 77 skips. */
+
+static int check_failed = 0;
+
+#define CHECK(cond) do {                                            \
+        if(!(cond)) {                                               \
+            fprintf(stderr, "%s:%d: failed: %s\n", __FILE__,        \
+                    __LINE__, #cond);                               \
+            check_failed++;                                         \
+        }                                                           \
+    } while(0)
+
+#define CHECK_STATUS (check_failed ? 1 : 0)
+#define CHECK_SKIP   77
+
+#endif /* CPK_CHECK_H */
@@ -0,0 +1,215 @@
+/*
+ * libconspack
+ * Copyright (C) 2012  Ryan Pavlik
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the GNU Lesser General Public
+ * License (LGPL) version 2.1 which accompanies this distribution, and
+ * is available at http://www.gnu.org/licenses/lgpl-2.1.html
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ */
+
+#include "config.h"
+#include "corpus.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/* xorshift64*; good enough to vary shapes, and stable across libcs */
+static uint64_t next(uint64_t *state) {
+    uint64_t x = *state;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+static uint32_t range(uint64_t *state, uint32_t lo, uint32_t hi) {
+    return lo + (uint32_t)(next(state) % (hi - lo + 1));
+}
+
+static void encode_int(cpk_output_t *out, int64_t val) {
+    if(val >= INT8_MIN && val <= INT8_MAX) {
+        cpk_write8(out, CPK_NUMBER | CPK_INT8);
+        cpk_write8(out, (uint8_t)val);
+    } else if(val >= INT16_MIN && val <= INT16_MAX) {
+        cpk_write8(out, CPK_NUMBER | CPK_INT16);
+        cpk_write16(out, (uint16_t)val);
+    } else if(val >= INT32_MIN && val <= INT32_MAX) {
+        cpk_write8(out, CPK_NUMBER | CPK_INT32);
+        cpk_write32(out, (uint32_t)val);
+    } else {
+        cpk_write8(out, CPK_NUMBER | CPK_INT64);
+        cpk_write64(out, (uint64_t)val);
+    }
+}
+
+static void random_text(uint64_t *state, char *buf, uint32_t len) {
+    static const char alphabet[] =
+        "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789 -_";
+    uint32_t i = 0;
+
+    for(i = 0; i < len; i++)
+        buf[i] = alphabet[next(state) % (sizeof(alphabet) - 1)];
+
+    buf[len] = 0;
+}
+
+/* Vectors of numbers: fixed int32 and double vectors, which decode
+   without per-element headers, and mixed-width unfixed vectors */
+static uint32_t gen_numeric(cpk_output_t *out, uint32_t scale, uint64_t seed) {
+    uint32_t messages = 64 * scale, m = 0, i = 0, n = 0;
+    double d = 0;
+
+    for(m = 0; m < messages; m++) {
+        n = range(&seed, 256, 1024);
+
+        switch(m % 3) {
+            case 0:
+                cpk_encode_container(out, CPK_CONTAINER_VECTOR, n,
+                                     CPK_NUMBER | CPK_INT32);
+                for(i = 0; i < n; i++)
+                    cpk_write32(out, (uint32_t)next(&seed));
+                break;
+
+            case 1:
+                cpk_encode_container(out, CPK_CONTAINER_VECTOR, n,
+                                     CPK_NUMBER | CPK_DOUBLE_FLOAT);
+                for(i = 0; i < n; i++) {
+                    d = (double)(next(&seed) >> 11) / 9007199254740992.0;
+                    cpk_write_double(out, d * 1000.0);
+                }
+                break;
+
+            default:
+                cpk_encode_container(out, CPK_CONTAINER_VECTOR, n, 0);
+                for(i = 0; i < n; i++)
+                    encode_int(out, (int64_t)next(&seed) >> range(&seed, 0, 62));
+        }
+    }
+
+    return messages;
+}
+
+/* Records as maps of short keys to strings of mixed length */
+static uint32_t gen_strings(cpk_output_t *out, uint32_t scale, uint64_t seed) {
+    uint32_t messages = 64 * scale, m = 0, i = 0, n = 0;
+    char key[32], val[257];
+
+    for(m = 0; m < messages; m++) {
+        n = range(&seed, 16, 64);
+        cpk_encode_container(out, CPK_CONTAINER_MAP, n, 0);
+
+        for(i = 0; i < n; i++) {
+            snprintf(key, sizeof(key), "field-%u", i);
+            random_text(&seed, val, range(&seed, 4, 256));
+
+            cpk_encode_string(out, key);
+            cpk_encode_string(out, val);
+        }
+    }
+
+    return messages;
+}
+
+/* Proper lists built from cons cells, as Lisp senders produce them */
+static uint32_t gen_conslist(cpk_output_t *out, uint32_t scale, uint64_t seed) {
+    uint32_t messages = 64 * scale, m = 0, i = 0, n = 0;
+
+    for(m = 0; m < messages; m++) {
+        n = range(&seed, 64, 512);
+
+        for(i = 0; i < n; i++) {
+            cpk_write8(out, CPK_CONS);
+            encode_int(out, range(&seed, 0, 100000));
+        }
+
+        cpk_write8(out, CPK_NIL);
+    }
+
+    return messages;
+}
+
+/* Graphs: every node is tagged, and points at earlier nodes by ref */
+static uint32_t gen_refgraph(cpk_output_t *out, uint32_t scale, uint64_t seed) {
+    uint32_t messages = 64 * scale, m = 0, i = 0, j = 0, n = 0, edges = 0;
+
+    for(m = 0; m < messages; m++) {
+        n = range(&seed, 32, 256);
+        cpk_encode_container(out, CPK_CONTAINER_VECTOR, n, 0);
+
+        for(i = 0; i < n; i++) {
+            edges = i ? range(&seed, 1, 6) : 0;
+
+            cpk_encode_ref(out, CPK_TAG, i);
+            cpk_encode_container(out, CPK_CONTAINER_VECTOR, edges + 1, 0);
+            encode_int(out, i);
+
+            for(j = 0; j < edges; j++)
+                cpk_encode_ref(out, CPK_REF, range(&seed, 0, i - 1));
+        }
+    }
+
+    return messages;
+}
+
+/* Many small messages, where per-message overhead dominates */
+static uint32_t gen_tiny(cpk_output_t *out, uint32_t scale, uint64_t seed) {
+    uint32_t messages = 16384 * scale, m = 0;
+    char text[17];
+
+    for(m = 0; m < messages; m++) {
+        switch(next(&seed) % 5) {
+            case 0:
+                encode_int(out, range(&seed, 0, 1000));
+                break;
+
+            case 1:
+                cpk_write8(out, next(&seed) & 1 ? CPK_TRUE : CPK_NIL);
+                break;
+
+            case 2:
+                random_text(&seed, text, range(&seed, 1, 16));
+                cpk_encode_string(out, text);
+                break;
+
+            case 3:
+                cpk_encode_ref(out, CPK_INDEX, range(&seed, 0, 40));
+                break;
+
+            default:
+                cpk_encode_container(out, CPK_CONTAINER_VECTOR, 2, 0);
+                encode_int(out, m);
+                cpk_write8(out, CPK_TRUE);
+        }
+    }
+
+    return messages;
+}
+
+const cpk_corpus_t cpk_corpora[] = {
+    { "numeric",  "fixed and mixed-width number vectors", gen_numeric },
+    { "strings",  "string-heavy maps",                    gen_strings },
+    { "conslist", "long cons lists",                      gen_conslist },
+    { "refgraph", "tagged nodes linked by refs",          gen_refgraph },
+    { "tiny",     "many one-value messages",              gen_tiny },
+    { NULL, NULL, NULL }
+};
+
+const cpk_corpus_t* cpk_corpus_find(const char *name) {
+    const cpk_corpus_t *c = NULL;
+
+    for(c = cpk_corpora; c->name; c++)
+        if(!strcmp(c->name, name))
+            return c;
+
+    return NULL;
+}
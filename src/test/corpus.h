@@ -0,0 +1,39 @@
+/*
+ * libconspack
+ * Copyright (C) 2012  Ryan Pavlik
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the GNU Lesser General Public
+ * License (LGPL) version 2.1 which accompanies this distribution, and
+ * is available at http://www.gnu.org/licenses/lgpl-2.1.html
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ */
+
+#ifndef CPK_CORPUS_H
+#define CPK_CORPUS_H
+
+#include "conspack/conspack.h"
+
+/* Synthetic message corpora for benchmarking.  A generator appends
+   its messages back to back to out and returns how many it wrote;
+   the same seed always produces the same bytes. */
+
+typedef uint32_t (*cpk_corpus_gen_t)(cpk_output_t *out, uint32_t scale,
+                                     uint64_t seed);
+
+typedef struct _cpk_corpus {
+    const char *name;
+    const char *description;
+    cpk_corpus_gen_t generate;
+} cpk_corpus_t;
+
+extern const cpk_corpus_t cpk_corpora[];
+
+const cpk_corpus_t* cpk_corpus_find(const char *name);
+
+#endif /* CPK_CORPUS_H */
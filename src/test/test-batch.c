@@ -0,0 +1,203 @@
+/*
+ * libconspack
+ * Copyright (C) 2012  Ryan Pavlik
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the GNU Lesser General Public
+ * License (LGPL) version 2.1 which accompanies this distribution, and
+ * is available at http://www.gnu.org/licenses/lgpl-2.1.html
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ */
+
+/*
+ * test-batch: back-to-back messages framed into spans and decoded
+ * across a pool, with a malformed or over-deep message part way that
+ * stops framing there, and batches reused across calls.
+ */
+
+#include "config.h"
+#include "conspack/conspack.h"
+#include "check.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define MESSAGES 3000
+
+typedef struct _stream {
+    cpk_output_t out;
+    size_t offsets[MESSAGES];
+    size_t ends[MESSAGES];
+} stream_t;
+
+/* Message i is the uint16 i, a string of i % 20 bytes, or the list
+   (i . "x"), in turn */
+static void emit(cpk_output_t *out, uint32_t i) {
+    char str[32];
+
+    switch(i % 3) {
+        case 0:
+            cpk_write8(out, 0x15);
+            cpk_write16(out, i);
+            break;
+
+        case 1:
+            memset(str, 'a' + i % 26, i % 20);
+            str[i % 20] = 0;
+            cpk_encode_string(out, str);
+            break;
+
+        case 2:
+            cpk_encode_container(out, CPK_CONTAINER_LIST, 2, 0);
+            cpk_write8(out, 0x15);
+            cpk_write16(out, i);
+            cpk_encode_string(out, "x");
+            break;
+    }
+}
+
+static int is_message(const cpk_object_t *obj, uint32_t i) {
+    if(!obj || CPK_IS_ERROR(obj->header))
+        return 0;
+
+    switch(i % 3) {
+        case 0:
+            return obj->header == 0x15 && obj->number.val.uint16 == i;
+
+        case 1:
+            return CPK_IS_STRING(obj->header) &&
+                   obj->string.size == i % 20;
+
+        default:
+            return CPK_IS_CONTAINER(obj->header) &&
+                   obj->container.size == 2 &&
+                   obj->container.obj[0]->number.val.uint16 == i;
+    }
+}
+
+/* Writes messages [0, n), with bad[] spliced in before message at */
+static void build(stream_t *s, uint32_t n, uint32_t at,
+                  const uint8_t *bad, size_t bad_len) {
+    uint32_t i = 0;
+
+    cpk_output_init(&s->out);
+    for(i = 0; i < n; i++) {
+        if(i == at)
+            cpk_write_bytes(&s->out, bad, bad_len);
+
+        s->offsets[i] = s->out.buffer_used;
+        emit(&s->out, i);
+        s->ends[i] = s->out.buffer_used;
+    }
+}
+
+static void check_batch(cpk_batch_t *batch, stream_t *s, uint32_t n) {
+    uint32_t i = 0;
+    int bad = 0;
+
+    CHECK(batch->frame.count == n);
+    if(batch->frame.count != n) return;
+
+    for(i = 0; i < n; i++) {
+        if(batch->frame.spans[i].offset != s->offsets[i] ||
+           batch->frame.spans[i].length != s->ends[i] - s->offsets[i] ||
+           !is_message(batch->objs[i], i))
+            bad++;
+    }
+
+    CHECK(bad == 0);
+}
+
+static void test_good(cpk_pool_t *pool) {
+    cpk_batch_t batch;
+    cpk_object_t err;
+    stream_t *s = malloc(sizeof(stream_t));
+
+    if(!s) return;
+
+    build(s, MESSAGES, MESSAGES, NULL, 0);
+    cpk_batch_init(&batch);
+
+    CHECK(cpk_decode_batch(&batch, pool, s->out.buffer, s->out.buffer_used,
+                           NULL, &err) == 0);
+    CHECK(err.header == 0);
+    check_batch(&batch, s, MESSAGES);
+
+    /* Again on the same batch, whose arenas are reset and reused */
+    CHECK(cpk_decode_batch(&batch, pool, s->out.buffer, s->out.buffer_used,
+                           NULL, &err) == 0);
+    check_batch(&batch, s, MESSAGES);
+
+    /* Nothing at all */
+    CHECK(cpk_decode_batch(&batch, pool, s->out.buffer, 0, NULL, &err) == 0);
+    CHECK(batch.frame.count == 0);
+
+    cpk_batch_fini(&batch);
+    cpk_output_fini(&s->out);
+    free(s);
+}
+
+/* Messages before bad are framed and decoded; framing stops at it */
+static void test_bad(cpk_pool_t *pool, const uint8_t *bad, size_t len,
+                     const cpk_limits_t *limits, uint32_t code) {
+    cpk_batch_t batch;
+    cpk_frame_t frame;
+    cpk_object_t err;
+    stream_t *s = malloc(sizeof(stream_t));
+    uint32_t at = MESSAGES / 2 + 1;
+    size_t start = 0;
+
+    if(!s) return;
+
+    build(s, MESSAGES, at, bad, len);
+    start = s->offsets[at] - len;
+    cpk_batch_init(&batch);
+
+    CHECK(cpk_decode_batch(&batch, pool, s->out.buffer, s->out.buffer_used,
+                           limits, &err) == CPK_ERROR);
+    CHECK(CPK_IS_ERROR(err.header) && err.error.code == code);
+    CHECK(err.error.pos >= start && err.error.pos <= start + len);
+    check_batch(&batch, s, at);
+
+    /* The spans alone, from cpk_frame */
+    cpk_frame_init(&frame);
+    CHECK(cpk_frame(&frame, s->out.buffer, s->out.buffer_used, limits,
+                    &err) == CPK_ERROR);
+    CHECK(frame.count == at && err.error.code == code);
+    cpk_frame_fini(&frame);
+
+    cpk_batch_fini(&batch);
+    cpk_output_fini(&s->out);
+    free(s);
+}
+
+int main(void) {
+    /* A rational whose denominator is a tag, and a header that means
+       nothing */
+    static const uint8_t rational[] = { 0x1F, 0x10, 0x01, 0xE0, 0x00 };
+    static const uint8_t invalid[] = { 0x05 };
+    /* Vectors four deep */
+    static const uint8_t deep[] = { 0x20, 0x01, 0x20, 0x01, 0x20, 0x01,
+                                    0x20, 0x00 };
+    cpk_limits_t limits;
+    cpk_pool_t *pool = cpk_pool_new(4);
+
+    memset(&limits, 0, sizeof(limits));
+    limits.max_depth = 3;
+
+    test_good(pool);
+    test_good(NULL);
+
+    test_bad(pool, rational, sizeof(rational), NULL, CPK_ERR_BAD_TYPE);
+    test_bad(NULL, rational, sizeof(rational), NULL, CPK_ERR_BAD_TYPE);
+    test_bad(pool, invalid, sizeof(invalid), NULL, CPK_ERR_BAD_HEADER);
+    test_bad(pool, deep, sizeof(deep), &limits, CPK_ERR_LIMIT);
+
+    cpk_pool_free(pool);
+    return CHECK_STATUS;
+}
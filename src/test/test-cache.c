@@ -0,0 +1,262 @@
+/*
+ * libconspack
+ * Copyright (C) 2012  Ryan Pavlik
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the GNU Lesser General Public
+ * License (LGPL) version 2.1 which accompanies this distribution, and
+ * is available at http://www.gnu.org/licenses/lgpl-2.1.html
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ */
+
+/*
+ * test-cache: decoded trees shared on a hit, evicted oldest first
+ * once a shard's budget is spent, kept alive by references held past
+ * eviction, clearing and the cache itself, and looked up from many
+ * threads at once.
+ */
+
+#include "config.h"
+#include "conspack/conspack.h"
+#include "check.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define MESSAGES 64
+#define LOOKUPS  20000
+
+typedef struct _message {
+    uint8_t data[32];
+    size_t len;
+} message_t;
+
+static message_t messages[MESSAGES];
+
+/* Message i is a fixed-header vector of the uint32s i .. i + 3 */
+static void make_messages(void) {
+    cpk_output_t out;
+    uint32_t i = 0, k = 0;
+
+    for(i = 0; i < MESSAGES; i++) {
+        cpk_output_init_fixed(&out, messages[i].data,
+                              sizeof(messages[i].data));
+        cpk_encode_container(&out, CPK_CONTAINER_VECTOR, 4, 0x16);
+        for(k = 0; k < 4; k++)
+            cpk_write32(&out, i + k);
+        messages[i].len = out.buffer_used;
+    }
+}
+
+static int is_message(const cpk_object_t *tree, uint32_t i) {
+    uint32_t k = 0;
+
+    if(!tree || tree->header != 0x24 || tree->container.size != 4)
+        return 0;
+
+    for(k = 0; k < 4; k++)
+        if(tree->container.obj[k]->number.val.uint32 != i + k)
+            return 0;
+
+    return 1;
+}
+
+static cpk_cache_ref_t* lookup(cpk_cache_t *cache, uint32_t i) {
+    cpk_object_t err;
+    cpk_cache_ref_t *ref = cpk_cache_decode(cache, messages[i].data,
+                                            messages[i].len, &err);
+
+    CHECK(ref && is_message(cpk_cache_tree(ref), i));
+    return ref;
+}
+
+/* Bytes one message is charged, from a cache holding only it */
+static size_t entry_bytes(void) {
+    cpk_cache_t *cache = cpk_cache_new(1024 * 1024, 1, NULL);
+    cpk_cache_stats_t stats;
+
+    cpk_cache_release(lookup(cache, 0));
+    cpk_cache_stats(cache, &stats);
+    cpk_cache_free(cache);
+
+    return stats.bytes;
+}
+
+static void test_hits(void) {
+    cpk_cache_t *cache = cpk_cache_new(0, 0, NULL);
+    cpk_cache_ref_t *a = NULL, *b = NULL;
+    cpk_cache_stats_t stats;
+    cpk_object_t err;
+    uint8_t bad[] = { 0x40, 0x05, 'a' };
+    uint8_t trailing[40];
+
+    a = lookup(cache, 3);
+    b = lookup(cache, 3);
+    CHECK(a == b && cpk_cache_tree(a) == cpk_cache_tree(b));
+
+    cpk_cache_stats(cache, &stats);
+    CHECK(stats.hits == 1 && stats.misses == 1 && stats.entries == 1);
+
+    /* Failures are not kept */
+    CHECK(!cpk_cache_decode(cache, bad, sizeof(bad), &err));
+    CHECK(err.error.code == CPK_ERR_EOF);
+
+    memcpy(trailing, messages[3].data, messages[3].len);
+    trailing[messages[3].len] = 0x00;
+    CHECK(!cpk_cache_decode(cache, trailing, messages[3].len + 1, &err));
+    CHECK(err.error.code == CPK_ERR_TRAILING);
+
+    cpk_cache_stats(cache, &stats);
+    CHECK(stats.entries == 1 && stats.misses == 3);
+
+    cpk_cache_release(a);
+    cpk_cache_release(b);
+    cpk_cache_free(cache);
+}
+
+static void test_eviction(size_t bytes) {
+    cpk_cache_t *cache = cpk_cache_new(3 * bytes, 1, NULL);
+    cpk_cache_ref_t *held = NULL;
+    cpk_cache_stats_t stats;
+
+    held = lookup(cache, 0);
+    cpk_cache_release(lookup(cache, 1));
+    cpk_cache_release(lookup(cache, 2));
+
+    /* A hit makes 1 the newest, so 0 and then 2 go first */
+    cpk_cache_release(lookup(cache, 1));
+    cpk_cache_release(lookup(cache, 3));
+
+    cpk_cache_stats(cache, &stats);
+    CHECK(stats.evictions == 1 && stats.entries == 3);
+    CHECK(stats.bytes <= 3 * bytes);
+
+    /* Evicted while held, and still whole */
+    CHECK(is_message(cpk_cache_tree(held), 0));
+    cpk_cache_release(held);
+
+    cpk_cache_release(lookup(cache, 1));
+    cpk_cache_release(lookup(cache, 3));
+    cpk_cache_stats(cache, &stats);
+    CHECK(stats.hits == 3 && stats.misses == 4);
+
+    cpk_cache_release(lookup(cache, 4));
+    cpk_cache_release(lookup(cache, 2));
+    cpk_cache_stats(cache, &stats);
+    CHECK(stats.evictions == 3 && stats.misses == 6);
+
+    cpk_cache_free(cache);
+}
+
+static void test_uncached(size_t bytes) {
+    cpk_cache_t *cache = cpk_cache_new(bytes - 1, 1, NULL);
+    cpk_cache_ref_t *a = NULL, *b = NULL;
+    cpk_cache_stats_t stats;
+
+    a = lookup(cache, 5);
+    b = lookup(cache, 5);
+    CHECK(a != b);
+
+    cpk_cache_stats(cache, &stats);
+    CHECK(stats.uncached == 2 && stats.entries == 0 && stats.bytes == 0);
+
+    cpk_cache_release(a);
+    cpk_cache_release(b);
+    cpk_cache_free(cache);
+}
+
+static void test_clear(void) {
+    cpk_cache_t *cache = cpk_cache_new(0, 4, NULL);
+    cpk_cache_ref_t *held[8];
+    cpk_cache_stats_t stats;
+    uint32_t i = 0;
+
+    for(i = 0; i < 8; i++)
+        held[i] = lookup(cache, i);
+
+    cpk_cache_clear(cache);
+    cpk_cache_stats(cache, &stats);
+    CHECK(stats.entries == 0 && stats.bytes == 0);
+
+    for(i = 0; i < 4; i++) {
+        CHECK(is_message(cpk_cache_tree(held[i]), i));
+        cpk_cache_release(held[i]);
+    }
+
+    /* Released after the cache is gone */
+    cpk_cache_free(cache);
+    for(i = 4; i < 8; i++) {
+        CHECK(is_message(cpk_cache_tree(held[i]), i));
+        cpk_cache_release(held[i]);
+    }
+}
+
+typedef struct _stress {
+    cpk_cache_t *cache;
+    uint32_t threads;
+    int bad;
+} stress_t;
+
+/* Each thread walks the messages in its own order, holding a few refs
+   at a time, against a budget that keeps evicting */
+static void stress_worker(void *arg, uint32_t thread) {
+    stress_t *s = arg;
+    cpk_cache_ref_t *held[4] = { NULL, NULL, NULL, NULL };
+    cpk_object_t err;
+    uint32_t n = 0, i = 0, seed = thread * 7919 + 1;
+
+    for(n = 0; n < LOOKUPS; n++) {
+        seed = seed * 1103515245 + 12345;
+        i = (seed >> 16) % MESSAGES;
+
+        cpk_cache_release(held[n % 4]);
+        held[n % 4] = cpk_cache_decode(s->cache, messages[i].data,
+                                       messages[i].len, &err);
+        if(!held[n % 4] || !is_message(cpk_cache_tree(held[n % 4]), i))
+            __atomic_add_fetch(&s->bad, 1, __ATOMIC_RELAXED);
+    }
+
+    for(n = 0; n < 4; n++)
+        cpk_cache_release(held[n]);
+}
+
+static void test_threads(size_t bytes) {
+    cpk_pool_t *pool = cpk_pool_new(4);
+    cpk_cache_stats_t stats;
+    stress_t s;
+
+    s.cache = cpk_cache_new(16 * bytes, 4, NULL);
+    s.bad = 0;
+
+    cpk_pool_run(pool, stress_worker, &s);
+    CHECK(s.bad == 0);
+
+    cpk_cache_stats(s.cache, &stats);
+    CHECK(stats.hits + stats.misses ==
+          (uint64_t)cpk_pool_size(pool) * LOOKUPS);
+    CHECK(stats.evictions > 0 && stats.bytes <= 16 * bytes);
+
+    cpk_cache_free(s.cache);
+    cpk_pool_free(pool);
+}
+
+int main(void) {
+    size_t bytes = 0;
+
+    make_messages();
+    bytes = entry_bytes();
+    CHECK(bytes > messages[0].len);
+
+    test_hits();
+    test_eviction(bytes);
+    test_uncached(bytes);
+    test_clear();
+    test_threads(bytes);
+
+    return CHECK_STATUS;
+}
@@ -0,0 +1,150 @@
+/*
+ * libconspack
+ * Copyright (C) 2012  Ryan Pavlik
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the GNU Lesser General Public
+ * License (LGPL) version 2.1 which accompanies this distribution, and
+ * is available at http://www.gnu.org/licenses/lgpl-2.1.html
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ */
+
+/*
+ * test-cxx: the C++ layer in conspack.hpp, which nothing else builds.
+ * Values are encoded through cpk::encoder and read back through
+ * cpk::value, so a break in either shows up here.
+ */
+
+/* As a program using the installed header would, without config.h */
+#include "conspack/conspack.hpp"
+#include "check.h"
+
+#include <array>
+#include <map>
+#include <string>
+#include <tuple>
+#include <vector>
+
+namespace {
+
+struct point {
+    int32_t x, y;
+};
+
+inline auto cpk_fields(const point &p) { return std::tie(p.x, p.y); }
+
+struct shape {
+    std::string name;
+    std::vector<point> points;
+    std::vector<double> weights;
+    bool closed;
+};
+
+inline auto cpk_fields(const shape &s) {
+    return std::tie(s.name, s.points, s.weights, s.closed);
+}
+
+/* Numbers of one type share a header; mixed ones each have their own */
+static_assert(cpk::encoder<point>::fixed_size == 2 + 1 + 2 * 4,
+              "point is a fixed-header vector of two int32s");
+static_assert(cpk::encoder<std::tuple<uint8_t, int16_t>>::fixed_size ==
+              2 + 2 + 3, "a mixed tuple carries each header");
+static_assert(cpk::encoder<shape>::fixed_size == 0,
+              "strings make a struct variable-sized");
+
+void test_round_trip() {
+    shape s{"triangle", {{0, 0}, {4, 0}, {0, -3}}, {0.5, 1.5, 2.5}, true};
+    std::map<std::string, shape> shapes{{"a", s}, {"b", shape{}}};
+    cpk::output out;
+
+    cpk::encode(out, shapes);
+    CHECK(out.ok() && out.size() > 0);
+
+    cpk::input in(out.data(), out.size());
+    cpk::tree t = in.decode();
+    CHECK(t && in.done());
+    if(!t) return;
+
+    cpk::value root = t.root();
+    CHECK(root.is_map() && root.pairs().size() == 2);
+
+    cpk::value a = root.find("a");
+    CHECK(a.is_container() && a.size() == 4);
+    CHECK(a[0].str() == "triangle");
+    CHECK(a[3].is_true());
+    CHECK(root.find("b")[3].is_nil());
+    CHECK(!root.find("c"));
+
+    /* Points come back as fixed-header vectors of int32 */
+    cpk::value points = a[1];
+    CHECK(points.size() == 3);
+
+    size_t i = 0;
+    for(cpk::value p : points.elements()) {
+        CHECK(p.size() == 2);
+        CHECK(p[0].number_type() == CPK_INT32);
+        CHECK(p[0].to_int64() == s.points[i].x);
+        CHECK(p[1].to_int64() == s.points[i].y);
+        i++;
+    }
+    CHECK(i == 3);
+
+    cpk::value weights = a[2];
+    CHECK(weights.size() == 3 && weights[1].to_double() == 1.5);
+    CHECK(!weights[1].to_int64());
+    CHECK(!a[0].to_double() && a[0][0].is_error());
+}
+
+void test_numbers() {
+    std::array<uint16_t, 3> arr{1, 300, 65535};
+    std::tuple<int8_t, uint64_t, float, const char*> tup{-5, 1ULL << 63,
+                                                          0.25f, "x"};
+    cpk::output out;
+
+    cpk::encode(out, arr);
+    cpk::encode(out, tup);
+
+    cpk::input in(out.data(), out.size());
+    cpk::tree t = in.decode();
+
+    CHECK(t.root().size() == 3);
+    CHECK(t.root()[2].to_uint64() == 65535u);
+    CHECK(t.root()[2].number_type() == CPK_UINT16);
+
+    /* Over the first tree, whose shape differs */
+    in.decode_into(t);
+    CHECK(t && in.done());
+
+    cpk::value v = t.root();
+    CHECK(v.size() == 4);
+    CHECK(v[0].to_int64() == -5 && !v[0].to_uint64());
+    CHECK(!v[1].to_int64() && v[1].to_uint64() == 1ULL << 63);
+    CHECK(v[2].to_double() == 0.25);
+    CHECK(v[3].str() == "x");
+}
+
+void test_errors() {
+    static const uint8_t truncated[] = { 0x40, 0x05, 'a' };
+    cpk::input in(truncated, sizeof(truncated));
+    cpk::tree t = in.decode();
+
+    CHECK(!t);
+    CHECK(t.root().is_error() && t.root().error_code() == CPK_ERR_EOF);
+    CHECK(t.root().error_reason() != nullptr);
+    CHECK(t.root().str().empty() && t.root().size() == 0);
+}
+
+} /* namespace */
+
+int main() {
+    test_round_trip();
+    test_numbers();
+    test_errors();
+
+    return CHECK_STATUS;
+}
@@ -0,0 +1,378 @@
+/*
+ * libconspack
+ * Copyright (C) 2012  Ryan Pavlik
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the GNU Lesser General Public
+ * License (LGPL) version 2.1 which accompanies this distribution, and
+ * is available at http://www.gnu.org/licenses/lgpl-2.1.html
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ */
+
+/*
+ * test-decode: truncated and malformed input decoded into errors that
+ * explain cleanly, with buffer and descriptor input agreeing on what
+ * is valid, hostile input held to the decoder's limits, and trees
+ * reused by cpk_decode_into across messages of changing shape.
+ */
+
+#include "config.h"
+#include "conspack/conspack.h"
+#include "check.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static int sink(void *arg, const uint8_t *data, size_t len) {
+    return cpk_write_bytes(arg, data, len) < 0;
+}
+
+/* Decodes data and checks it fails with code, and explains as such */
+static void decode_fails(const uint8_t *data, size_t len, uint8_t code) {
+    cpk_output_t out;
+    cpk_input_t in;
+    cpk_object_t *obj = NULL;
+
+    cpk_input_init(&in, (uint8_t*)data, len);
+    obj = cpk_decode_r(&in);
+
+    CHECK(obj && CPK_IS_ERROR(obj->header));
+    if(!obj || !CPK_IS_ERROR(obj->header)) {
+        cpk_free_r(obj);
+        return;
+    }
+
+    CHECK(obj->error.code == code);
+    CHECK(obj->error.reason != NULL);
+
+    cpk_output_init(&out);
+    CHECK(cpk_explain_sink(obj, NULL, sink, &out) == 0);
+    cpk_write8(&out, 0);
+    CHECK(!strncmp((char*)out.buffer, "(:error ", 8));
+    cpk_output_fini(&out);
+
+    cpk_free_r(obj);
+}
+
+static void test_truncated(void) {
+    /* Tags with a size field that is not there */
+    static const uint8_t tag8[] = { 0xE0 };
+    static const uint8_t tag16[] = { 0xE1, 0x01 };
+    static const uint8_t fixed_tags[] = { 0x24, 0x02, 0xE2, 0x00 };
+    static const uint8_t string[] = { 0x40, 0x05, 'a', 'b' };
+
+    decode_fails(tag8, sizeof(tag8), CPK_ERR_EOF);
+    decode_fails(tag16, sizeof(tag16), CPK_ERR_EOF);
+    decode_fails(fixed_tags, sizeof(fixed_tags), CPK_ERR_EOF);
+    decode_fails(string, sizeof(string), CPK_ERR_EOF);
+}
+
+/* Skips data from a pipe, returning the error code or -1 for none */
+static int skip_fd(const uint8_t *data, size_t len) {
+    cpk_input_t in;
+    cpk_object_t err;
+    int fds[2], ret = 0;
+
+    if(pipe(fds)) return -2;
+    if(write(fds[1], data, len) != (ssize_t)len) ret = -2;
+    close(fds[1]);
+
+    cpk_input_init_fd(&in, fds[0]);
+    if(!ret)
+        ret = cpk_skip(&in, &err) ? err.error.code : -1;
+    close(fds[0]);
+
+    return ret;
+}
+
+static int skip_buffer(const uint8_t *data, size_t len) {
+    cpk_input_t in;
+    cpk_object_t err;
+
+    cpk_input_init(&in, (uint8_t*)data, len);
+    return cpk_skip(&in, &err) ? err.error.code : -1;
+}
+
+static void test_skip(void) {
+    /* A rational of two int8s, then one whose denominator is a tag */
+    static const uint8_t good[] = { 0x1F, 0x10, 0x01, 0x10, 0x02 };
+    static const uint8_t bad[] = { 0x1F, 0x10, 0xDD, 0xB9 };
+
+    CHECK(cpk_validate(good, sizeof(good), NULL) == 0);
+    CHECK(skip_buffer(good, sizeof(good)) == -1);
+    CHECK(skip_fd(good, sizeof(good)) == -1);
+
+    CHECK(cpk_validate(bad, sizeof(bad), NULL) != 0);
+    CHECK(skip_buffer(bad, sizeof(bad)) == CPK_ERR_BAD_TYPE);
+    CHECK(skip_fd(bad, sizeof(bad)) == CPK_ERR_BAD_TYPE);
+    decode_fails(bad, sizeof(bad), CPK_ERR_BAD_TYPE);
+}
+
+/* Decodes buf with limits from a buffer and from a pipe, and checks
+   both give code, or a tree if code is -1 */
+static void decode_limited(const uint8_t *buf, size_t len,
+                           const cpk_limits_t *limits, int code) {
+    cpk_input_t in;
+    cpk_object_t *obj = NULL;
+    int fds[2], fd = 0;
+
+    for(fd = 0; fd < 2; fd++) {
+        if(fd) {
+            /* Bigger inputs would fill the pipe before it is read */
+            if(len > 60000 || pipe(fds)) break;
+            if(write(fds[1], buf, len) != (ssize_t)len) {
+                close(fds[0]);
+                close(fds[1]);
+                break;
+            }
+            close(fds[1]);
+            cpk_input_init_fd(&in, fds[0]);
+        } else {
+            cpk_input_init(&in, (uint8_t*)buf, len);
+        }
+
+        cpk_input_set_limits(&in, limits);
+        obj = cpk_decode_r(&in);
+
+        CHECK(obj != NULL);
+        if(obj && code < 0)
+            CHECK(!CPK_IS_ERROR(obj->header));
+        else if(obj)
+            CHECK(CPK_IS_ERROR(obj->header) && obj->error.code == code);
+
+        cpk_free_r(obj);
+        if(fd) close(fds[0]);
+    }
+}
+
+static void test_limits(void) {
+    static const uint8_t nils[] = { 0x26, 0xFF, 0xFF, 0xFF, 0xFF, 0x00 };
+    static const uint8_t trues[] = { 0x26, 0x00, 0x10, 0x00, 0x01, 0x01 };
+    /* Sizes far beyond the input behind them */
+    static const uint8_t string[] = { 0x42, 0x7F, 0xFF, 0xFF, 0xFF, 'a' };
+    static const uint8_t vector[] = { 0x22, 0x7F, 0xFF, 0xFF, 0xFF, 0x00 };
+    cpk_output_t out;
+    cpk_limits_t limits;
+    cpk_input_t in;
+    cpk_object_t *obj = NULL;
+    uint32_t i = 0;
+
+    memset(&limits, 0, sizeof(limits));
+    cpk_output_init(&out);
+
+    /* Containers nest max_depth deep, as cpk_validate allows */
+    limits.max_depth = 8;
+    for(i = 0; i < 8; i++)
+        cpk_encode_container(&out, CPK_CONTAINER_VECTOR, 1, 0);
+    cpk_write8(&out, 0x00);
+    decode_limited(out.buffer, out.buffer_used, &limits, -1);
+
+    cpk_output_clear(&out);
+    for(i = 0; i < 9; i++)
+        cpk_encode_container(&out, CPK_CONTAINER_VECTOR, 1, 0);
+    cpk_write8(&out, 0x00);
+    decode_limited(out.buffer, out.buffer_used, &limits, CPK_ERR_LIMIT);
+
+    /* The default stops nesting that would exhaust the stack */
+    cpk_output_clear(&out);
+    for(i = 0; i < 1000000; i++)
+        cpk_encode_container(&out, CPK_CONTAINER_VECTOR, 1, 0);
+    cpk_write8(&out, 0x00);
+    decode_limited(out.buffer, out.buffer_used, NULL, CPK_ERR_LIMIT);
+
+    /* and decoding over a tree is held to it too */
+    cpk_input_init(&in, out.buffer, out.buffer_used);
+    obj = cpk_decode_into(&in, NULL);
+    CHECK(obj && CPK_IS_ERROR(obj->header) &&
+          obj->error.code == CPK_ERR_LIMIT);
+    cpk_free_r(obj);
+
+    /* Elements that take no input are counted, not allocated */
+    decode_limited(nils, sizeof(nils), NULL, CPK_ERR_LIMIT);
+    decode_limited(trues, sizeof(trues), NULL, CPK_ERR_LIMIT);
+
+    limits.max_elements = 1000;
+    cpk_output_clear(&out);
+    cpk_encode_container(&out, CPK_CONTAINER_VECTOR, 500, 0x01);
+    decode_limited(out.buffer, out.buffer_used, &limits, -1);
+    cpk_output_clear(&out);
+    cpk_encode_container(&out, CPK_CONTAINER_VECTOR, 1001, 0x01);
+    decode_limited(out.buffer, out.buffer_used, &limits, CPK_ERR_LIMIT);
+
+    /* Declared sizes are checked against the input before anything
+       is allocated for them */
+    decode_limited(string, sizeof(string), NULL, CPK_ERR_EOF);
+    decode_limited(vector, sizeof(vector), NULL, CPK_ERR_EOF);
+
+    /* max_alloc bounds what one message may allocate */
+    memset(&limits, 0, sizeof(limits));
+    cpk_output_clear(&out);
+    cpk_encode_container(&out, CPK_CONTAINER_VECTOR, 1000, 0);
+    for(i = 0; i < 1000; i++)
+        cpk_encode_string(&out, "0123456789");
+
+    limits.max_alloc = 1024 * 1024;
+    decode_limited(out.buffer, out.buffer_used, &limits, -1);
+    limits.max_alloc = 4096;
+    decode_limited(out.buffer, out.buffer_used, &limits, CPK_ERR_LIMIT);
+    limits.flags = CPK_LIMIT_GROW;
+    decode_limited(out.buffer, out.buffer_used, &limits, CPK_ERR_LIMIT);
+
+    cpk_output_fini(&out);
+}
+
+/* Message i of a stream whose shape changes from one to the next */
+static void emit(cpk_output_t *out, uint32_t i) {
+    char str[64];
+    uint32_t k = 0, n = i % 7;
+
+    memset(str, 'a' + i % 26, sizeof(str) - 1);
+    str[sizeof(str) - 1] = 0;
+    str[(i * 5) % sizeof(str)] = 0;
+
+    switch(i % 6) {
+        case 0:     /* a vector of strings, growing and shrinking */
+            cpk_encode_container(out, CPK_CONTAINER_VECTOR, n, 0);
+            for(k = 0; k < n; k++)
+                cpk_encode_string(out, str + k);
+            break;
+
+        case 1:     /* a map of numbers of mixed widths */
+            cpk_encode_container(out, CPK_CONTAINER_MAP, n, 0);
+            for(k = 0; k < n; k++) {
+                cpk_encode_string(out, str + k);
+                if(k % 2) {
+                    cpk_write8(out, 0x17);
+                    cpk_write64(out, (uint64_t)i << 40 | k);
+                } else {
+                    cpk_write8(out, 0x10);
+                    cpk_write8(out, (uint8_t)-(int)k);
+                }
+            }
+            break;
+
+        case 2:     /* a list, decoded as cons cells */
+            cpk_encode_container(out, CPK_CONTAINER_LIST, n + 2, 0);
+            for(k = 0; k < n + 2; k++) {
+                cpk_write8(out, 0x14);
+                cpk_write8(out, k);
+            }
+            break;
+
+        case 3:     /* a fixed-header vector inside a tagged vector */
+            cpk_write8(out, 0xF0 | (i % 16));
+            cpk_encode_container(out, CPK_CONTAINER_VECTOR, 2, 0);
+            cpk_encode_container(out, CPK_CONTAINER_VECTOR, n, 0x15);
+            for(k = 0; k < n; k++)
+                cpk_write16(out, i + k);
+            cpk_write8(out, 0x70 | (i % 16));
+            break;
+
+        case 4:     /* a rational, a keyword and a cons */
+            cpk_encode_container(out, CPK_CONTAINER_VECTOR, 3, 0);
+            cpk_write8(out, 0x1F);
+            cpk_write8(out, 0x10);
+            cpk_write8(out, i);
+            cpk_write8(out, 0x10);
+            cpk_write8(out, n + 1);
+            cpk_write8(out, 0x83);
+            cpk_encode_string(out, str);
+            cpk_write8(out, 0x80);
+            cpk_write8(out, 0x01);
+            cpk_write8(out, 0x00);
+            break;
+
+        case 5:     /* a bare string */
+            cpk_encode_string(out, str);
+            break;
+    }
+}
+
+static void explain(cpk_output_t *out, cpk_object_t *obj) {
+    cpk_output_clear(out);
+    CHECK(cpk_explain_sink(obj, NULL, sink, out) == 0);
+}
+
+/* Each tree decoded over the last must read the same as a fresh
+   decode of the same bytes */
+static void test_into(void) {
+    cpk_output_t msgs, fresh, reused;
+    cpk_input_t in, ref;
+    cpk_object_t *tree = NULL, *obj = NULL, *first = NULL;
+    uint8_t truncated[] = { 0x20, 0x03, 0x40, 0x01, 'a', 0x40, 0x09, 'b' };
+    uint32_t i = 0;
+    int bad = 0;
+
+    cpk_output_init(&msgs);
+    cpk_output_init(&fresh);
+    cpk_output_init(&reused);
+
+    for(i = 0; i < 600; i++)
+        emit(&msgs, i);
+
+    cpk_input_init(&in, msgs.buffer, msgs.buffer_used);
+    cpk_input_init(&ref, msgs.buffer, msgs.buffer_used);
+
+    for(i = 0; i < 600; i++) {
+        tree = cpk_decode_into(&in, tree);
+        obj = cpk_decode_r(&ref);
+
+        if(!tree || CPK_IS_ERROR(tree->header)) {
+            bad++;
+            cpk_free_r(obj);
+            break;
+        }
+
+        explain(&fresh, obj);
+        explain(&reused, tree);
+        if(fresh.buffer_used != reused.buffer_used ||
+           memcmp(fresh.buffer, reused.buffer, fresh.buffer_used))
+            bad++;
+
+        cpk_free_r(obj);
+    }
+
+    CHECK(bad == 0);
+    CHECK(in.buffer_read == msgs.buffer_used);
+
+    /* The same shape again keeps the root node */
+    cpk_output_clear(&msgs);
+    emit(&msgs, 6);
+    emit(&msgs, 48);
+    cpk_input_init(&in, msgs.buffer, msgs.buffer_used);
+
+    tree = cpk_decode_into(&in, tree);
+    first = tree;
+    tree = cpk_decode_into(&in, tree);
+    CHECK(tree == first && tree->container.size == 6);
+
+    /* A failure consumes the tree and returns the error */
+    cpk_input_init(&in, truncated, sizeof(truncated));
+    tree = cpk_decode_into(&in, tree);
+    CHECK(tree && CPK_IS_ERROR(tree->header) &&
+          tree->error.code == CPK_ERR_EOF);
+
+    /* and an error is as good a tree to decode over as any */
+    cpk_input_init(&in, msgs.buffer, msgs.buffer_used);
+    tree = cpk_decode_into(&in, tree);
+    CHECK(tree && tree->container.size == 6);
+
+    cpk_free_r(tree);
+    cpk_output_fini(&msgs);
+    cpk_output_fini(&fresh);
+    cpk_output_fini(&reused);
+}
+
+int main(void) {
+    test_truncated();
+    test_skip();
+    test_limits();
+    test_into();
+    return CHECK_STATUS;
+}
@@ -0,0 +1,227 @@
+/*
+ * libconspack
+ * Copyright (C) 2012  Ryan Pavlik
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the GNU Lesser General Public
+ * License (LGPL) version 2.1 which accompanies this distribution, and
+ * is available at http://www.gnu.org/licenses/lgpl-2.1.html
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ */
+
+/*
+ * test-ingest: files read through each path, with and without a pool,
+ * including empty, large, missing and unreadable ones, and a callback
+ * that stops the run.
+ */
+
+#include "config.h"
+#include "conspack/conspack.h"
+#include "check.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define FILES 8
+
+/* Not a multiple of CPK_INGEST_ALIGN, so the last read ends short */
+#define LARGE_SIZE (3 * 1024 * 1024 + 77)
+
+static char dir[] = "test-ingest-XXXXXX";
+static char paths[FILES + 3][64];
+
+typedef struct _seen {
+    uint32_t calls[FILES + 3];
+    size_t size[FILES + 3];
+    uint32_t sum[FILES + 3];
+    cpk_object_t err[FILES + 3];
+    size_t stop;
+} seen_t;
+
+/* File n holds n * 1000 bytes, so file 0 is empty, and the last is
+   the large one */
+static size_t file_size(size_t n) {
+    return n == FILES - 1 ? LARGE_SIZE : n * 1000;
+}
+
+static uint8_t file_byte(size_t n, size_t i) {
+    return (uint8_t)(n * 31 + i * 7 + (i >> 12));
+}
+
+static uint32_t sum(const uint8_t *p, size_t len) {
+    uint32_t s = 0;
+    size_t i = 0;
+
+    for(i = 0; i < len; i++)
+        s = s * 33 + p[i];
+    return s;
+}
+
+static int make_files(void) {
+    uint8_t *data = malloc(LARGE_SIZE);
+    FILE *f = NULL;
+    size_t n = 0, i = 0;
+
+    if(!data || !mkdtemp(dir)) {
+        free(data);
+        return -1;
+    }
+
+    for(n = 0; n < FILES; n++) {
+        snprintf(paths[n], sizeof(paths[n]), "%s/file-%zu", dir, n);
+        for(i = 0; i < file_size(n); i++)
+            data[i] = file_byte(n, i);
+
+        if(!(f = fopen(paths[n], "wb")) ||
+           fwrite(data, 1, file_size(n), f) != file_size(n) || fclose(f)) {
+            free(data);
+            return -1;
+        }
+    }
+
+    /* Missing, and a directory, which opens but cannot be read */
+    snprintf(paths[FILES], sizeof(paths[FILES]), "%s/missing", dir);
+    snprintf(paths[FILES + 1], sizeof(paths[FILES + 1]), "%s", dir);
+    snprintf(paths[FILES + 2], sizeof(paths[FILES + 2]), "%s/file-1", dir);
+
+    free(data);
+    return 0;
+}
+
+static void remove_files(void) {
+    size_t n = 0;
+
+    for(n = 0; n < FILES; n++)
+        unlink(paths[n]);
+    rmdir(dir);
+}
+
+static int on_file(void *arg, uint32_t thread, size_t n, cpk_input_t *in,
+                   const cpk_object_t *err) {
+    seen_t *seen = arg;
+
+    (void)thread;
+
+    seen->calls[n]++;
+    if(in) {
+        seen->size[n] = in->buffer_size - in->buffer_read;
+        seen->sum[n] = sum(in->buffer + in->buffer_read, seen->size[n]);
+    } else {
+        seen->err[n] = *err;
+    }
+
+    return n == seen->stop ? 7 : 0;
+}
+
+static uint32_t expected_sum(size_t n) {
+    uint32_t s = 0;
+    size_t i = 0;
+
+    for(i = 0; i < file_size(n); i++)
+        s = s * 33 + file_byte(n, i);
+    return s;
+}
+
+static void run_all(uint32_t flags, cpk_pool_t *pool) {
+    cpk_ingest_t *ig = cpk_ingest_new(3, flags);
+    const char *list[FILES + 3];
+    cpk_ingest_stats_t stats;
+    cpk_object_t err;
+    seen_t *seen = calloc(1, sizeof(seen_t));
+    size_t n = 0;
+
+    CHECK(ig != NULL && seen != NULL);
+    if(!ig || !seen) {
+        cpk_ingest_free(ig);
+        free(seen);
+        return;
+    }
+
+    for(n = 0; n < FILES + 3; n++)
+        list[n] = paths[n];
+    seen->stop = (size_t)-1;
+
+    /* Every file once; the unreadable ones as errors, not failures */
+    CHECK(cpk_ingest_run(ig, pool, list, FILES + 3, on_file, seen,
+                         &err) == 0);
+    CHECK(err.header == 0);
+
+    for(n = 0; n < FILES; n++) {
+        CHECK(seen->calls[n] == 1);
+        CHECK(seen->size[n] == file_size(n));
+        CHECK(seen->sum[n] == expected_sum(n));
+    }
+
+    CHECK(seen->calls[FILES] == 1);
+    CHECK(CPK_IS_ERROR(seen->err[FILES].header) &&
+          seen->err[FILES].error.code == CPK_ERR_IO &&
+          seen->err[FILES].error.value == ENOENT);
+    CHECK(seen->calls[FILES + 1] == 1);
+    CHECK(CPK_IS_ERROR(seen->err[FILES + 1].header) &&
+          seen->err[FILES + 1].error.code == CPK_ERR_IO);
+
+    /* The same file twice is read twice */
+    CHECK(seen->calls[FILES + 2] == 1);
+    CHECK(seen->sum[FILES + 2] == expected_sum(1));
+
+    cpk_ingest_stats(ig, &stats);
+    CHECK(stats.files == FILES + 1 && stats.failed == 2);
+    CHECK(stats.bytes == LARGE_SIZE + 1000 * (FILES - 2) * (FILES - 1) / 2
+          + 1000);
+    CHECK(stats.reads >= FILES);
+
+    /* Nothing to read */
+    CHECK(cpk_ingest_run(ig, pool, list, 0, on_file, seen, &err) == 0);
+
+    /* A callback that stops the run has its value returned, and no
+       file is delivered twice */
+    memset(seen, 0, sizeof(seen_t));
+    seen->stop = 2;
+    CHECK(cpk_ingest_run(ig, pool, list, FILES + 3, on_file, seen,
+                         &err) == 7);
+    CHECK(seen->calls[2] == 1);
+    for(n = 0; n < FILES + 3; n++)
+        CHECK(seen->calls[n] <= 1);
+
+    /* The ingester is usable after a stopped run */
+    memset(seen, 0, sizeof(seen_t));
+    seen->stop = (size_t)-1;
+    CHECK(cpk_ingest_run(ig, pool, list, FILES, on_file, seen, &err) == 0);
+    for(n = 0; n < FILES; n++)
+        CHECK(seen->calls[n] == 1 && seen->sum[n] == expected_sum(n));
+
+    cpk_ingest_free(ig);
+    free(seen);
+}
+
+int main(void) {
+    cpk_pool_t *pool = NULL;
+
+    if(make_files()) {
+        perror("test-ingest");
+        remove_files();
+        return 1;
+    }
+
+    pool = cpk_pool_new(4);
+    CHECK(pool != NULL);
+
+    /* io_uring where the kernel allows it, pread where it does not */
+    run_all(0, NULL);
+    run_all(0, pool);
+    run_all(CPK_INGEST_NO_URING, NULL);
+    run_all(CPK_INGEST_NO_URING, pool);
+    run_all(CPK_INGEST_NO_URING | CPK_INGEST_DIRECT, pool);
+    run_all(CPK_INGEST_DIRECT, pool);
+
+    cpk_pool_free(pool);
+    remove_files();
+    return CHECK_STATUS;
+}
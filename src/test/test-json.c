@@ -0,0 +1,336 @@
+/*
+ * libconspack
+ * Copyright (C) 2012  Ryan Pavlik
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the GNU Lesser General Public
+ * License (LGPL) version 2.1 which accompanies this distribution, and
+ * is available at http://www.gnu.org/licenses/lgpl-2.1.html
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ */
+
+/*
+ * test-json: conspack to JSON for each kind of value, strings that
+ * stream through in chunks, and inputs that must stop with an error
+ * rather than run away; JSON to conspack and back, with and without
+ * tagged keys, and text that must be refused leaving the output as it
+ * was.
+ */
+
+#include "config.h"
+#include "conspack/conspack.h"
+#include "check.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static int sink(void *arg, const uint8_t *data, size_t len) {
+    return cpk_write_bytes(arg, data, len) < 0;
+}
+
+static int refuse(void *arg, const uint8_t *data, size_t len) {
+    (void)arg;
+    (void)data;
+    (void)len;
+    return 1;
+}
+
+/* The JSON for the first value in buf, compared with expect */
+static int to_json_is(const uint8_t *buf, size_t len, const char *expect) {
+    cpk_output_t text;
+    cpk_input_t in;
+    cpk_object_t err;
+    int ok = 0;
+
+    cpk_output_init(&text);
+    cpk_input_init(&in, (uint8_t*)buf, len);
+
+    ok = !cpk_to_json(&in, sink, &text, &err) &&
+         text.buffer_used == strlen(expect) &&
+         !memcmp(text.buffer, expect, text.buffer_used);
+
+    if(!ok)
+        fprintf(stderr, "wanted %s, got %.*s\n", expect,
+                (int)(text.buffer_used > 200 ? 200 : text.buffer_used),
+                (char*)text.buffer);
+
+    cpk_output_fini(&text);
+    return ok;
+}
+
+/* The error cpk_to_json stops with on buf, or 0xFF if it succeeds */
+static uint32_t to_json_error(uint8_t *buf, size_t len,
+                              const cpk_limits_t *limits) {
+    cpk_output_t text;
+    cpk_input_t in;
+    cpk_object_t err;
+    uint32_t code = 0xFF;
+
+    cpk_output_init(&text);
+    cpk_input_init(&in, buf, len);
+    cpk_input_set_limits(&in, limits);
+
+    if(cpk_to_json(&in, sink, &text, &err))
+        code = err.error.code;
+
+    cpk_output_fini(&text);
+    return code;
+}
+
+#define BYTES(...) (const uint8_t[]){ __VA_ARGS__ }, \
+                   sizeof((const uint8_t[]){ __VA_ARGS__ })
+
+static void test_values(void) {
+    CHECK(to_json_is(BYTES(0x00), "false"));
+    CHECK(to_json_is(BYTES(0x01), "true"));
+    CHECK(to_json_is(BYTES(0x10, 0xFF), "-1"));
+    CHECK(to_json_is(BYTES(0x15, 0x01, 0x00), "256"));
+    CHECK(to_json_is(BYTES(0x20, 0x03, 0x14, 0x01, 0x14, 0x02, 0x14, 0x03),
+                     "[1,2,3]"));
+    CHECK(to_json_is(BYTES(0x24, 0x03, 0x14, 0x01, 0x02, 0x03), "[1,2,3]"));
+    CHECK(to_json_is(BYTES(0x20, 0x00), "[]"));
+    CHECK(to_json_is(BYTES(0x30, 0x02, 0x40, 0x01, 'a', 0x14, 0x01,
+                           0x40, 0x01, 'b', 0x01),
+                     "{\"a\":1,\"b\":true}"));
+    CHECK(to_json_is(BYTES(0x40, 0x05, 'a', '"', '\\', '\n', 0x01),
+                     "\"a\\\"\\\\\\n\\u0001\""));
+    CHECK(to_json_is(BYTES(0xF3, 0x14, 0x07), "{\"$tag\":3,\"$value\":7}"));
+    CHECK(to_json_is(BYTES(0x73), "{\"$ref\":3}"));
+}
+
+/* A string well over a chunk goes out whole, and its escapes are not
+   lost at chunk edges */
+static void test_long_string(void) {
+    size_t n = 200000, i = 0;
+    uint8_t *buf = malloc(5 + n);
+    char *expect = malloc(n + n / 1000 + 3);
+    size_t e = 0;
+
+    if(!buf || !expect) {
+        CHECK(0);
+        free(buf);
+        free(expect);
+        return;
+    }
+
+    buf[0] = 0x42;
+    buf[1] = n >> 24;
+    buf[2] = n >> 16;
+    buf[3] = n >> 8;
+    buf[4] = n;
+
+    expect[e++] = '"';
+    for(i = 0; i < n; i++) {
+        buf[5 + i] = i % 1000 == 999 ? '"' : 'x';
+        if(buf[5 + i] == '"') expect[e++] = '\\';
+        expect[e++] = buf[5 + i];
+    }
+    expect[e++] = '"';
+    expect[e] = 0;
+
+    CHECK(to_json_is(buf, 5 + n, expect));
+
+    free(expect);
+    free(buf);
+}
+
+static void test_hostile(void) {
+    uint8_t huge[] = { 0x26, 0x84, 0x03, 0xBA, 0x55, 0x79 };
+    uint8_t cut[] = { 0x20, 0x03, 0x14, 0x01 };
+    uint8_t one[] = { 0x14, 0x01 };
+    cpk_limits_t limits;
+    cpk_input_t in;
+    cpk_object_t err;
+    uint8_t *deep = NULL;
+    size_t i = 0, n = 2000;
+
+    /* Billions of elements that take no input: the unbacked budget
+       stops it rather than the text growing without end */
+    CHECK(to_json_error(huge, sizeof(huge), NULL) == CPK_ERR_LIMIT);
+    CHECK(to_json_error(cut, sizeof(cut), NULL) == CPK_ERR_EOF);
+
+    if((deep = malloc(2 * n + 1))) {
+        for(i = 0; i < n; i++) {
+            deep[2 * i] = 0x20;
+            deep[2 * i + 1] = 0x01;
+        }
+        deep[2 * n] = 0x00;
+
+        CHECK(to_json_error(deep, 2 * n + 1, NULL) == CPK_ERR_LIMIT);
+
+        /* As deep as cpk_validate allows and no deeper */
+        memset(&limits, 0, sizeof(limits));
+        limits.max_depth = 3;
+        CHECK(cpk_validate(deep + 2 * (n - 3), 7, &limits) == 0);
+        CHECK(to_json_error(deep + 2 * (n - 3), 7, &limits) == 0xFF);
+        CHECK(to_json_error(deep + 2 * (n - 4), 9, &limits) ==
+              CPK_ERR_LIMIT);
+        free(deep);
+    }
+
+    cpk_input_init(&in, one, sizeof(one));
+    CHECK(cpk_to_json(&in, refuse, NULL, &err) == CPK_ERROR);
+    CHECK(err.error.code == CPK_ERR_ABORTED);
+}
+
+/* Budgets are per message: two messages each under the unbacked
+   limit, together over it, both go through */
+static void test_budgets(void) {
+    uint32_t count = CPK_DEFAULT_MAX_UNBACKED * 3 / 5;
+    uint8_t msgs[12];
+    cpk_output_t text;
+    cpk_input_t in;
+    cpk_object_t err;
+    int i = 0;
+
+    for(i = 0; i < 2; i++) {
+        msgs[6 * i] = 0x26;
+        msgs[6 * i + 1] = count >> 24;
+        msgs[6 * i + 2] = count >> 16;
+        msgs[6 * i + 3] = count >> 8;
+        msgs[6 * i + 4] = count;
+        msgs[6 * i + 5] = 0x01;
+    }
+
+    cpk_output_init(&text);
+    cpk_input_init(&in, msgs, sizeof(msgs));
+
+    CHECK(cpk_to_json(&in, sink, &text, &err) == 0);
+    CHECK(text.buffer_used == 1 + 5 * count);
+    CHECK(cpk_to_json(&in, sink, &text, &err) == 0);
+    CHECK(in.buffer_read == sizeof(msgs));
+
+    cpk_output_fini(&text);
+}
+
+/* JSON text encoded and written back out, which should give text */
+static int round_trip_is(const char *json, uint32_t flags, const char *text,
+                         size_t *encoded) {
+    cpk_output_t out;
+    int ok = 0;
+
+    cpk_output_init(&out);
+
+    ok = !cpk_from_json(&out, json, strlen(json), flags, NULL) &&
+         to_json_is(out.buffer, out.buffer_used, text);
+
+    if(encoded) *encoded = out.buffer_used;
+    cpk_output_fini(&out);
+    return ok;
+}
+
+static void test_from_json(void) {
+    const char *keys = "[{\"k\":1,\"\":2},{\"k\":3,\"\":4,\"m\":{\"k\":5}}]";
+    size_t plain = 0, tagged = 0;
+
+    CHECK(round_trip_is("[1,-2,\"x\",{\"a\":[true,false,null]},0.5,65536,-129]",
+                        0, "[1,-2,\"x\",{\"a\":[true,false,false]},0.5,65536,-129]",
+                        NULL));
+    CHECK(round_trip_is(" { } ", 0, "{}", NULL));
+    CHECK(round_trip_is("\"\\u00e9\\ud83d\\ude00\\n\"", 0,
+                        "\"\xc3\xa9\xf0\x9f\x98\x80\\n\"", NULL));
+
+    /* Tagged keys come back as written, empty ones included */
+    CHECK(round_trip_is(keys, 0, keys, &plain));
+    CHECK(round_trip_is(keys, CPK_JSON_TAG_KEYS, keys, &tagged));
+    CHECK(tagged < plain);
+    CHECK(round_trip_is("{\"\":1}", CPK_JSON_TAG_KEYS, "{\"\":1}", NULL));
+}
+
+/* The error cpk_from_json stops with on json, or 0xFF if it succeeds;
+   either way out must hold only what it held before, or the value */
+static uint32_t from_json_error(const char *json) {
+    cpk_output_t out;
+    cpk_object_t err;
+    uint32_t code = 0xFF;
+
+    cpk_output_init(&out);
+    cpk_write8(&out, 0x01);
+
+    if(cpk_from_json(&out, json, strlen(json), 0, &err)) {
+        code = err.error.code;
+        CHECK(out.buffer_used == 1 && !(out.flags & CPK_OUTPUT_OVERFLOW));
+    }
+
+    cpk_output_fini(&out);
+    return code;
+}
+
+static void test_from_json_refused(void) {
+    uint8_t small[16];
+    cpk_output_t out;
+    cpk_object_t err;
+    char *deep = NULL;
+    size_t i = 0, n = 2000;
+
+    CHECK(from_json_error("[1,2]") == 0xFF);
+    CHECK(from_json_error("1 2") == CPK_ERR_TRAILING);
+    CHECK(from_json_error("01") == CPK_ERR_TRAILING);
+    CHECK(from_json_error("[1,") == CPK_ERR_EOF);
+    CHECK(from_json_error("{\"a\" 1}") == CPK_ERR_SYNTAX);
+    CHECK(from_json_error("tru") == CPK_ERR_SYNTAX);
+    CHECK(from_json_error("\"\\ud83d\"") == CPK_ERR_SYNTAX);
+    CHECK(from_json_error("\"a\nb\"") == CPK_ERR_SYNTAX);
+    CHECK(from_json_error("") != 0xFF);
+
+    if((deep = malloc(2 * n + 1))) {
+        for(i = 0; i < n; i++) {
+            deep[i] = '[';
+            deep[n + i] = ']';
+        }
+        deep[2 * n] = 0;
+
+        CHECK(from_json_error(deep) == CPK_ERR_LIMIT);
+        free(deep);
+    }
+
+    /* Too big for a fixed output: nothing written, and the overflow
+       flag as the caller left it.  Counts take 32 bits until their
+       container closes and numbers are given room for 64, so even
+       "[1]" needs 14 bytes on the way. */
+    cpk_output_init_fixed(&out, small, sizeof(small));
+    CHECK(cpk_from_json(&out, "[1,2,3,4,5]", 11, 0, &err) == CPK_ERROR);
+    CHECK(err.error.code == CPK_ERR_LIMIT);
+    CHECK(out.buffer_used == 0 && !(out.flags & CPK_OUTPUT_OVERFLOW));
+    CHECK(cpk_from_json(&out, "[1]", 3, 0, &err) == 0);
+    CHECK(to_json_is(small, out.buffer_used, "[1]"));
+    cpk_output_fini(&out);
+}
+
+/* A running CRC sends the value through a side buffer; the bytes must
+   be the same */
+static void test_from_json_crc(void) {
+    const char *json = "{\"a\":[1,2,{\"b\":\"c\"}],\"d\":null}";
+    cpk_output_t direct, summed;
+
+    cpk_output_init(&direct);
+    cpk_output_init(&summed);
+    cpk_output_set_crc(&summed, 1);
+
+    CHECK(cpk_from_json(&direct, json, strlen(json), 0, NULL) == 0);
+    CHECK(cpk_from_json(&summed, json, strlen(json), 0, NULL) == 0);
+    CHECK(direct.buffer_used == summed.buffer_used &&
+          !memcmp(direct.buffer, summed.buffer, direct.buffer_used));
+    CHECK(cpk_output_crc(&summed) ==
+          cpk_crc32c(0, direct.buffer, direct.buffer_used));
+
+    cpk_output_fini(&direct);
+    cpk_output_fini(&summed);
+}
+
+int main(void) {
+    test_values();
+    test_long_string();
+    test_hostile();
+    test_budgets();
+    test_from_json();
+    test_from_json_refused();
+    test_from_json_crc();
+
+    return CHECK_STATUS;
+}
@@ -0,0 +1,241 @@
+/*
+ * libconspack
+ * Copyright (C) 2012  Ryan Pavlik
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the GNU Lesser General Public
+ * License (LGPL) version 2.1 which accompanies this distribution, and
+ * is available at http://www.gnu.org/licenses/lgpl-2.1.html
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ */
+
+/*
+ * test-recfile: record files written, reopened and appended to, and
+ * read back after damage to a payload, the trailer and the tail.
+ */
+
+#include "config.h"
+#include "conspack/conspack.h"
+#include "check.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define RECORDS 100
+
+/* Record n is the uint16 n and a pad byte, so 4 bytes of payload
+   behind 8 of prefix with checksums */
+#define RECORD_SIZE 12
+#define HEADER_SIZE 8
+#define TRAILER_SIZE 32
+
+static char path[] = "test-recfile-XXXXXX";
+
+static int append(cpk_recwriter_t *w, uint32_t n) {
+    cpk_output_t *out = cpk_recwriter_begin(w);
+
+    if(!out) return -1;
+
+    cpk_write8(out, 0x15);
+    cpk_write16(out, n);
+    cpk_write8(out, 0);
+    return cpk_recwriter_commit(w);
+}
+
+static int write_file(uint32_t flags, uint32_t from, uint32_t to) {
+    cpk_recwriter_t *w = cpk_recwriter_open(path, flags, 4);
+    uint32_t n = 0;
+
+    if(!w) return -1;
+
+    for(n = from; n < to; n++)
+        if(append(w, n)) break;
+
+    return cpk_recwriter_close(w) || n < to ? -1 : 0;
+}
+
+static int record_is(cpk_input_t *in, uint32_t n) {
+    return in->buffer_size == 4 && in->buffer[0] == 0x15 &&
+           in->buffer[1] == (n >> 8) && in->buffer[2] == (n & 0xFF);
+}
+
+static void poke(long off, int whence, uint8_t byte) {
+    FILE *f = fopen(path, "r+b");
+
+    CHECK(f != NULL);
+    if(!f) return;
+
+    CHECK(!fseek(f, off, whence) && fputc(byte, f) == byte);
+    fclose(f);
+}
+
+static uint8_t peek(long off, int whence) {
+    FILE *f = fopen(path, "rb");
+    int c = 0;
+
+    if(!f) return 0;
+
+    fseek(f, off, whence);
+    c = fgetc(f);
+    fclose(f);
+    return c;
+}
+
+typedef struct _seen {
+    uint64_t count;
+    int wrong;
+} seen_t;
+
+static int see(void *arg, uint32_t thread, uint64_t n, cpk_input_t *in) {
+    seen_t *s = arg;
+
+    (void)thread;
+    if(!record_is(in, n))
+        __atomic_store_n(&s->wrong, 1, __ATOMIC_RELAXED);
+
+    __atomic_fetch_add(&s->count, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static void test_round_trip(cpk_pool_t *pool) {
+    cpk_recfile_t *rf = NULL;
+    cpk_object_t err;
+    cpk_input_t in;
+    seen_t seen;
+    uint32_t n = 0;
+    int bad = 0;
+
+    CHECK(write_file(CPK_RECFILE_CRC, 0, RECORDS / 2) == 0);
+    CHECK(write_file(CPK_RECFILE_CRC | CPK_RECFILE_APPEND,
+                     RECORDS / 2, RECORDS) == 0);
+
+    rf = cpk_recfile_open(path, CPK_RECFILE_VERIFY);
+    CHECK(rf != NULL);
+    if(!rf) return;
+
+    CHECK(cpk_recfile_count(rf) == RECORDS);
+
+    for(n = 0; n < RECORDS; n++)
+        if(cpk_recfile_get(rf, n, &in, &err) || !record_is(&in, n))
+            bad++;
+    CHECK(bad == 0);
+
+    CHECK(cpk_recfile_get(rf, RECORDS, &in, &err) == CPK_ERROR);
+    CHECK(err.error.code == CPK_ERR_EOF);
+
+    memset(&seen, 0, sizeof(seen));
+    CHECK(cpk_recfile_scan(rf, pool, 10, RECORDS, see, &seen, &err) == 0);
+    CHECK(seen.count == RECORDS - 10 && !seen.wrong);
+
+    cpk_recfile_close(rf);
+}
+
+/* A payload that no longer matches its checksum is refused when
+   verifying, by number, and handed out as is when not */
+static void test_damaged_record(cpk_pool_t *pool) {
+    long off = HEADER_SIZE + 37 * RECORD_SIZE + 8 + 3;
+    cpk_recfile_t *rf = NULL;
+    cpk_object_t err;
+    cpk_input_t in;
+    seen_t seen;
+
+    CHECK(write_file(CPK_RECFILE_CRC, 0, RECORDS) == 0);
+    poke(off, SEEK_SET, 0xFF);
+
+    rf = cpk_recfile_open(path, CPK_RECFILE_VERIFY);
+    CHECK(rf != NULL);
+    if(!rf) return;
+
+    CHECK(cpk_recfile_count(rf) == RECORDS);
+    CHECK(cpk_recfile_get(rf, 36, &in, &err) == 0);
+    CHECK(cpk_recfile_get(rf, 38, &in, &err) == 0);
+
+    CHECK(cpk_recfile_get(rf, 37, &in, &err) == CPK_ERROR);
+    CHECK(err.error.code == CPK_ERR_CHECKSUM && err.error.pos == 37);
+
+    memset(&seen, 0, sizeof(seen));
+    CHECK(cpk_recfile_scan(rf, pool, 0, RECORDS, see, &seen, &err) ==
+          CPK_ERROR);
+    CHECK(err.error.code == CPK_ERR_CHECKSUM && err.error.pos == 37);
+
+    cpk_recfile_close(rf);
+
+    rf = cpk_recfile_open(path, 0);
+    CHECK(rf != NULL);
+    if(!rf) return;
+
+    CHECK(cpk_recfile_get(rf, 37, &in, &err) == 0 && in.buffer[3] == 0xFF);
+    cpk_recfile_close(rf);
+}
+
+/* The trailer's fields are summed, so a wrong count is not believed
+   and the records are walked instead */
+static void test_damaged_trailer(void) {
+    cpk_recfile_t *rf = NULL;
+    cpk_input_t in;
+
+    CHECK(write_file(CPK_RECFILE_CRC, 0, RECORDS) == 0);
+    CHECK(peek(-TRAILER_SIZE + 15, SEEK_END) == RECORDS);
+    poke(-TRAILER_SIZE + 15, SEEK_END, RECORDS + 1);
+
+    rf = cpk_recfile_open(path, CPK_RECFILE_VERIFY);
+    CHECK(rf != NULL);
+    if(!rf) return;
+
+    CHECK(cpk_recfile_count(rf) == RECORDS);
+    CHECK(cpk_recfile_get(rf, RECORDS, &in, NULL) == CPK_ERROR);
+    cpk_recfile_close(rf);
+}
+
+/* A writer that died leaves no footer and perhaps half a record;
+   the whole records before it are still read */
+static void test_torn_tail(void) {
+    cpk_recfile_t *rf = NULL;
+    cpk_input_t in;
+
+    CHECK(write_file(CPK_RECFILE_CRC, 0, RECORDS) == 0);
+    CHECK(truncate(path, HEADER_SIZE + 60 * RECORD_SIZE + 5) == 0);
+
+    rf = cpk_recfile_open(path, CPK_RECFILE_VERIFY);
+    CHECK(rf != NULL);
+    if(!rf) return;
+
+    CHECK(cpk_recfile_count(rf) == 60);
+    CHECK(cpk_recfile_get(rf, 59, &in, NULL) == 0 && record_is(&in, 59));
+    cpk_recfile_close(rf);
+
+    /* Appending picks up after the last whole record */
+    CHECK(write_file(CPK_RECFILE_APPEND, 60, RECORDS) == 0);
+
+    rf = cpk_recfile_open(path, CPK_RECFILE_VERIFY);
+    CHECK(rf != NULL);
+    if(!rf) return;
+
+    CHECK(cpk_recfile_count(rf) == RECORDS);
+    CHECK(cpk_recfile_get(rf, 60, &in, NULL) == 0 && record_is(&in, 60));
+    cpk_recfile_close(rf);
+}
+
+int main(void) {
+    cpk_pool_t *pool = cpk_pool_new(4);
+    int fd = mkstemp(path);
+
+    if(fd < 0) return 1;
+    close(fd);
+
+    test_round_trip(pool);
+    test_round_trip(NULL);
+    test_damaged_record(pool);
+    test_damaged_trailer();
+    test_torn_tail();
+
+    unlink(path);
+    cpk_pool_free(pool);
+    return CHECK_STATUS;
+}
@@ -0,0 +1,261 @@
+/*
+ * libconspack
+ * Copyright (C) 2012  Ryan Pavlik
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the GNU Lesser General Public
+ * License (LGPL) version 2.1 which accompanies this distribution, and
+ * is available at http://www.gnu.org/licenses/lgpl-2.1.html
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ */
+
+/*
+ * test-segment: containers encoded in parallel segments, checked
+ * byte for byte, CRC included, against one serial encode into a
+ * buffer, a descriptor and a staged output, and callbacks that fail
+ * part way.
+ */
+
+#include "config.h"
+#include "conspack/conspack.h"
+#include "check.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+/* Enough entries that four threads split them into many segments */
+#define ENTRIES 100000
+#define BLOCK   4096
+
+static char path[] = "test-segment-XXXXXX";
+
+typedef struct _encode_arg {
+    uint8_t type;
+    uint8_t fixed;
+    uint64_t fail_at;
+} encode_arg_t;
+
+/* Entry i varies in width so segments differ in length: a string of
+   i % 13 bytes for vectors, a uint16 key and that string for maps, or
+   a bare uint32 payload under a fixed header */
+static int encode_range(cpk_output_t *out, void *arg, uint64_t start,
+                        uint64_t end) {
+    encode_arg_t *a = arg;
+    char str[16];
+    uint64_t i = 0;
+
+    for(i = start; i < end; i++) {
+        if(i == a->fail_at)
+            return 1;
+
+        if(a->fixed) {
+            cpk_write32(out, (uint32_t)(i * 2654435761u));
+            continue;
+        }
+
+        if(a->type == CPK_CONTAINER_MAP) {
+            cpk_write8(out, 0x15);
+            cpk_write16(out, (uint16_t)i);
+        }
+
+        memset(str, 'a' + i % 26, i % 13);
+        str[i % 13] = 0;
+        cpk_encode_string(out, str);
+    }
+
+    return 0;
+}
+
+/* The string "before", ahead of the container */
+#define PREFIX_SIZE 8
+
+static void prefix(cpk_output_t *out) {
+    cpk_output_set_crc(out, 1);
+    cpk_encode_string(out, "before");
+}
+
+/* One serial encode, as the reference */
+static void serial(cpk_output_t *out, encode_arg_t *a) {
+    cpk_output_init(out);
+    prefix(out);
+    cpk_encode_container(out, a->type, ENTRIES, a->fixed);
+    encode_range(out, a, 0, ENTRIES);
+    cpk_write_crc(out);
+}
+
+static int read_all(int fd, uint8_t **buf, size_t *len) {
+    off_t size = lseek(fd, 0, SEEK_END);
+
+    *buf = NULL;
+    *len = 0;
+    if(size < 0 || lseek(fd, 0, SEEK_SET) < 0 ||
+       !(*buf = malloc(size ? size : 1)))
+        return -1;
+
+    if(read(fd, *buf, size) != size) {
+        free(*buf);
+        *buf = NULL;
+        return -1;
+    }
+
+    *len = size;
+    return 0;
+}
+
+static int fresh(void) {
+    int fd = open(path, O_RDWR | O_TRUNC);
+
+    CHECK(fd >= 0);
+    return fd;
+}
+
+static int same(const cpk_output_t *ref, const uint8_t *buf, size_t len) {
+    return len == ref->buffer_used && !memcmp(buf, ref->buffer, len);
+}
+
+static void test_buffer(cpk_pool_t *pool, encode_arg_t *a,
+                        const cpk_output_t *ref) {
+    cpk_output_t out;
+
+    cpk_output_init(&out);
+    prefix(&out);
+    CHECK(cpk_encode_container_parallel(&out, pool, a->type, ENTRIES,
+                                        a->fixed, encode_range, a) == 0);
+    cpk_write_crc(&out);
+
+    CHECK(same(ref, out.buffer, out.buffer_used));
+    cpk_output_fini(&out);
+}
+
+static void test_fd(cpk_pool_t *pool, encode_arg_t *a,
+                    const cpk_output_t *ref) {
+    cpk_output_t out;
+    uint8_t *buf = NULL;
+    size_t len = 0;
+    int fd = fresh();
+
+    if(fd < 0) return;
+
+    cpk_output_init_fd(&out, fd);
+    prefix(&out);
+    CHECK(cpk_encode_container_parallel(&out, pool, a->type, ENTRIES,
+                                        a->fixed, encode_range, a) == 0);
+    cpk_write_crc(&out);
+    cpk_output_fini(&out);
+
+    CHECK(read_all(fd, &buf, &len) == 0);
+    CHECK(same(ref, buf, len));
+
+    free(buf);
+    close(fd);
+}
+
+static void test_staged(cpk_pool_t *pool, encode_arg_t *a,
+                        const cpk_output_t *ref) {
+    cpk_output_t out;
+    uint8_t *buf = NULL, *expanded = NULL;
+    size_t len = 0, expanded_len = 0;
+    int fd = fresh();
+
+    if(fd < 0) return;
+
+    CHECK(cpk_output_init_stage(&out, fd, cpk_codec(CPK_CODEC_NONE),
+                                BLOCK, 0) == 0);
+    prefix(&out);
+    CHECK(cpk_encode_container_parallel(&out, pool, a->type, ENTRIES,
+                                        a->fixed, encode_range, a) == 0);
+    cpk_write_crc(&out);
+    CHECK(cpk_output_flush(&out) == 0);
+    cpk_output_fini(&out);
+
+    CHECK(read_all(fd, &buf, &len) == 0);
+    CHECK(cpk_stage_expand(pool, buf, len, &expanded, &expanded_len) == 0);
+    CHECK(same(ref, expanded, expanded_len));
+
+    free(expanded);
+    free(buf);
+    close(fd);
+}
+
+/* A failure leaves a buffer output as it was, sum included */
+static void test_failure(cpk_pool_t *pool, encode_arg_t *a) {
+    cpk_output_t out, ref;
+    encode_arg_t failing = *a;
+    uint64_t at[] = { 0, ENTRIES / 2, ENTRIES - 1 };
+    size_t i = 0;
+
+    cpk_output_init(&ref);
+    prefix(&ref);
+    cpk_write_crc(&ref);
+
+    for(i = 0; i < sizeof(at) / sizeof(at[0]); i++) {
+        failing.fail_at = at[i];
+
+        cpk_output_init(&out);
+        prefix(&out);
+        CHECK(cpk_encode_container_parallel(&out, pool, a->type, ENTRIES,
+                                            a->fixed, encode_range,
+                                            &failing) == CPK_ERROR);
+        cpk_write_crc(&out);
+
+        CHECK(same(&ref, out.buffer, out.buffer_used));
+        cpk_output_fini(&out);
+    }
+
+    cpk_output_fini(&ref);
+}
+
+int main(void) {
+    encode_arg_t args[] = {
+        { CPK_CONTAINER_VECTOR, 0, ~0ULL },
+        { CPK_CONTAINER_LIST, 0, ~0ULL },
+        { CPK_CONTAINER_MAP, 0, ~0ULL },
+        { CPK_CONTAINER_VECTOR, 0x16, ~0ULL },
+    };
+    cpk_pool_t *pool = cpk_pool_new(4);
+    cpk_output_t ref;
+    size_t i = 0;
+    int fd = mkstemp(path);
+
+    CHECK(pool != NULL);
+    if(fd < 0) {
+        perror("test-segment");
+        return 1;
+    }
+    close(fd);
+
+    for(i = 0; i < sizeof(args) / sizeof(args[0]); i++) {
+        serial(&ref, &args[i]);
+        CHECK(cpk_validate(ref.buffer + PREFIX_SIZE,
+                           ref.buffer_used - PREFIX_SIZE - 4, NULL) == 0);
+
+        /* Split across the pool, and in one piece without it */
+        test_buffer(pool, &args[i], &ref);
+        test_buffer(NULL, &args[i], &ref);
+        test_fd(pool, &args[i], &ref);
+        test_staged(pool, &args[i], &ref);
+        test_failure(pool, &args[i]);
+        test_failure(NULL, &args[i]);
+
+        cpk_output_fini(&ref);
+    }
+
+    /* Tmaps are refused, since their type precedes the entries */
+    cpk_output_init(&ref);
+    CHECK(cpk_encode_container_parallel(&ref, pool, CPK_CONTAINER_TMAP,
+                                        ENTRIES, 0, encode_range,
+                                        &args[0]) == CPK_ERROR);
+    CHECK(ref.buffer_used == 0);
+    cpk_output_fini(&ref);
+
+    cpk_pool_free(pool);
+    unlink(path);
+    return CHECK_STATUS;
+}
@@ -0,0 +1,149 @@
+/*
+ * libconspack
+ * Copyright (C) 2012  Ryan Pavlik
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the GNU Lesser General Public
+ * License (LGPL) version 2.1 which accompanies this distribution, and
+ * is available at http://www.gnu.org/licenses/lgpl-2.1.html
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ */
+
+/*
+ * test-shm: messages through the ring in one process, producer and
+ * consumer taking turns, and a ring whose length word was scribbled
+ * on by a hostile producer.
+ */
+
+#include "config.h"
+#include "conspack/conspack.h"
+#include "check.h"
+
+#include <string.h>
+#include <unistd.h>
+
+/* A uint8 vector of n elements, all n */
+static int produce(cpk_shm_t *shm, uint8_t n) {
+    cpk_output_t out;
+    uint8_t i = 0;
+
+    if(cpk_shm_begin(shm, &out, 3 + n, 0))
+        return -1;
+
+    cpk_write8(&out, 0x24);
+    cpk_write8(&out, n);
+    cpk_write8(&out, 0x14);
+    for(i = 0; i < n; i++)
+        cpk_write8(&out, n);
+
+    return cpk_shm_commit(shm, &out);
+}
+
+static int consume(cpk_shm_t *shm, uint8_t n) {
+    cpk_input_t in;
+    cpk_object_t *obj = NULL;
+    int ok = 0;
+
+    if(cpk_shm_next(shm, &in, 0))
+        return -1;
+
+    obj = cpk_decode_r(&in);
+    ok = obj && obj->header == 0x24 && obj->container.size == n &&
+         in.buffer_read == in.buffer_size;
+
+    cpk_free_r(obj);
+    cpk_shm_done(shm);
+    return ok ? 0 : -1;
+}
+
+static void test_round_trip(void) {
+    cpk_shm_t *shm = cpk_shm_create(1);
+    uint32_t i = 0;
+    int bad = 0;
+
+    CHECK(shm != NULL);
+    if(!shm) return;
+
+    /* A page holds a few dozen of these, so this wraps many times */
+    for(i = 0; i < 5000; i++) {
+        if(produce(shm, i % 200) || consume(shm, i % 200))
+            bad++;
+    }
+    CHECK(bad == 0);
+
+    /* Nothing left */
+    {
+        cpk_input_t in;
+        CHECK(cpk_shm_next(shm, &in, 0) == CPK_ERROR);
+    }
+
+    cpk_shm_close(shm);
+}
+
+static void test_begin_limits(void) {
+    cpk_shm_t *shm = cpk_shm_create(1);
+    size_t page = sysconf(_SC_PAGESIZE);
+    cpk_output_t out;
+
+    CHECK(shm != NULL);
+    if(!shm) return;
+
+    /* These would wrap or round past the ring if not refused first */
+    CHECK(cpk_shm_begin(shm, &out, (size_t)-1, 0) == CPK_ERROR);
+    CHECK(cpk_shm_begin(shm, &out, (size_t)-7, 0) == CPK_ERROR);
+    CHECK(cpk_shm_begin(shm, &out, page - 7, 0) == CPK_ERROR);
+    CHECK(cpk_shm_begin(shm, &out, page - 8, 0) == 0);
+
+    cpk_shm_close(shm);
+}
+
+/* The consumer must not trust a length that runs past what was
+   published; the first record's prefix starts the ring, which follows
+   the header page */
+static void test_hostile_length(void) {
+    uint64_t lens[] = { (uint64_t)-1, (uint64_t)-8, (uint64_t)-3, 64, 9 };
+    size_t page = sysconf(_SC_PAGESIZE), i = 0;
+    cpk_shm_t *producer = NULL, *consumer = NULL;
+    uint64_t fixed = 4;
+    cpk_input_t in;
+
+    for(i = 0; i < sizeof(lens) / sizeof(lens[0]); i++) {
+        producer = cpk_shm_create(1);
+        CHECK(producer != NULL);
+        if(!producer) return;
+
+        consumer = cpk_shm_attach(dup(cpk_shm_fd(producer)));
+        CHECK(consumer != NULL);
+
+        if(consumer) {
+            CHECK(produce(producer, 1) == 0);
+            CHECK(pwrite(cpk_shm_fd(producer), &lens[i], 8, page) == 8);
+            CHECK(cpk_shm_next(consumer, &in, 0) == CPK_ERROR);
+
+            /* Put right, the same record is delivered */
+            CHECK(pwrite(cpk_shm_fd(producer), &fixed, 8, page) == 8);
+            CHECK(consume(consumer, 1) == 0);
+        }
+
+        cpk_shm_close(consumer);
+        cpk_shm_close(producer);
+    }
+}
+
+int main(void) {
+    cpk_shm_t *shm = cpk_shm_create(1);
+
+    if(!shm) return CHECK_SKIP;
+    cpk_shm_close(shm);
+
+    test_round_trip();
+    test_begin_limits();
+    test_hostile_length();
+
+    return CHECK_STATUS;
+}
@@ -0,0 +1,255 @@
+/*
+ * libconspack
+ * Copyright (C) 2012  Ryan Pavlik
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the GNU Lesser General Public
+ * License (LGPL) version 2.1 which accompanies this distribution, and
+ * is available at http://www.gnu.org/licenses/lgpl-2.1.html
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ */
+
+/*
+ * test-stage: messages through a staged output and back with every
+ * codec built, read as a stream and expanded whole across a pool,
+ * and hand-made streams that must fail cleanly.
+ */
+
+#include "config.h"
+#include "conspack/conspack.h"
+#include "check.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#define MESSAGES 2000
+#define BLOCK    4096
+
+static char path[] = "test-stage-XXXXXX";
+
+/* Message i is a uint8 vector of i % 50 elements, all i, so blocks
+   compress well and messages straddle them */
+static void emit(cpk_output_t *out, uint32_t i) {
+    uint32_t n = i % 50, k = 0;
+
+    cpk_write8(out, 0x24);
+    cpk_write8(out, n);
+    cpk_write8(out, 0x14);
+    for(k = 0; k < n; k++)
+        cpk_write8(out, i);
+}
+
+static int read_all(int fd, uint8_t **buf, size_t *len) {
+    off_t size = lseek(fd, 0, SEEK_END);
+
+    *buf = NULL;
+    *len = 0;
+    if(size < 0 || lseek(fd, 0, SEEK_SET) < 0 ||
+       !(*buf = malloc(size ? size : 1)))
+        return -1;
+
+    if(read(fd, *buf, size) != size) {
+        free(*buf);
+        *buf = NULL;
+        return -1;
+    }
+
+    *len = size;
+    return lseek(fd, 0, SEEK_SET) < 0 ? -1 : 0;
+}
+
+static int fresh(void) {
+    int fd = open(path, O_RDWR | O_TRUNC);
+
+    CHECK(fd >= 0);
+    return fd;
+}
+
+static void test_codec(const cpk_codec_t *codec, cpk_pool_t *pool) {
+    cpk_output_t out, plain;
+    cpk_input_t in;
+    cpk_object_t *obj = NULL;
+    uint8_t *staged = NULL, *expanded = NULL;
+    size_t staged_len = 0, expanded_len = 0;
+    uint32_t i = 0;
+    int fd = fresh(), bad = 0;
+
+    if(fd < 0) return;
+
+    cpk_output_init(&plain);
+    CHECK(cpk_output_init_stage(&out, fd, codec, BLOCK, 0) == 0);
+
+    for(i = 0; i < MESSAGES; i++) {
+        emit(&out, i);
+        emit(&plain, i);
+
+        /* A reader waiting on a message gets a short block */
+        if(i % 97 == 0)
+            CHECK(cpk_output_flush(&out) == 0);
+    }
+
+    CHECK(cpk_output_flush(&out) == 0);
+    cpk_output_fini(&out);
+
+    CHECK(read_all(fd, &staged, &staged_len) == 0);
+    if(codec->compress)
+        CHECK(staged_len < plain.buffer_used);
+
+    /* As a stream */
+    CHECK(cpk_input_init_stage(&in, fd) == 0);
+    for(i = 0; i < MESSAGES; i++) {
+        obj = cpk_decode_r(&in);
+        if(!obj || obj->header != 0x24 || obj->container.size != i % 50)
+            bad++;
+        cpk_free_r(obj);
+    }
+    CHECK(bad == 0);
+
+    obj = cpk_decode_r(&in);
+    CHECK(obj && CPK_IS_ERROR(obj->header));
+    cpk_free_r(obj);
+    cpk_input_fini(&in);
+
+    /* Whole */
+    CHECK(cpk_stage_expand(pool, staged, staged_len, &expanded,
+                           &expanded_len) == 0);
+    CHECK(expanded_len == plain.buffer_used &&
+          !memcmp(expanded, plain.buffer, expanded_len));
+
+    free(expanded);
+    free(staged);
+    cpk_output_fini(&plain);
+    close(fd);
+}
+
+static size_t put32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+    return 4;
+}
+
+/* A stream header and one block header, followed by len bytes of
+   body; the codec's id and the block's lengths are the test's */
+static size_t make_stream(uint8_t *buf, uint8_t codec, uint32_t block_size,
+                          uint32_t stored, uint32_t len, uint32_t body) {
+    size_t n = 0;
+
+    memcpy(buf, "CPKZ\1", 5);
+    buf[5] = codec;
+    buf[6] = buf[7] = 0;
+    n = 8 + put32(buf + 8, block_size);
+    n += put32(buf + n, stored);
+    n += put32(buf + n, len);
+
+    memset(buf + n, 0x14, body);
+    return n + body;
+}
+
+/* Each must fail, read as a stream or expanded whole */
+static void check_refused(const uint8_t *buf, size_t len, cpk_pool_t *pool) {
+    cpk_input_t in;
+    cpk_object_t *obj = NULL;
+    uint8_t *dst = NULL;
+    size_t dst_len = 0;
+    int fd = fresh(), ok = 0;
+
+    CHECK(cpk_stage_expand(pool, buf, len, &dst, &dst_len) == CPK_ERROR);
+    CHECK(dst == NULL);
+
+    if(fd < 0) return;
+
+    CHECK(write(fd, buf, len) == (ssize_t)len && lseek(fd, 0, SEEK_SET) == 0);
+
+    if(cpk_input_init_stage(&in, fd) == 0) {
+        obj = cpk_decode_r(&in);
+        ok = obj && !CPK_IS_ERROR(obj->header);
+        cpk_free_r(obj);
+    }
+
+    CHECK(!ok);
+    cpk_input_fini(&in);
+    close(fd);
+}
+
+static void test_hostile(cpk_pool_t *pool) {
+    uint8_t buf[256];
+    size_t n = 0;
+
+    /* The none codec cannot expand, so only stored blocks are valid,
+       even one with nothing to expand */
+    n = make_stream(buf, CPK_CODEC_NONE, 64, 0, 8, 0);
+    check_refused(buf, n, pool);
+    n = make_stream(buf, CPK_CODEC_NONE, 64, 4, 8, 4);
+    check_refused(buf, n, pool);
+
+    /* Longer than a block */
+    n = make_stream(buf, CPK_CODEC_NONE, 16, 0x80000000u | 32, 32, 32);
+    check_refused(buf, n, pool);
+
+    /* Stored lengths that disagree */
+    n = make_stream(buf, CPK_CODEC_NONE, 64, 0x80000000u | 8, 9, 9);
+    check_refused(buf, n, pool);
+
+    /* Cut short */
+    n = make_stream(buf, CPK_CODEC_NONE, 64, 0x80000000u | 32, 32, 31);
+    check_refused(buf, n, pool);
+
+    /* More than the codec could ever have produced */
+    if(cpk_codec(CPK_CODEC_LZ)) {
+        n = make_stream(buf, CPK_CODEC_LZ, 16, 200, 16, 200);
+        check_refused(buf, n, pool);
+    }
+
+    /* An unknown codec, an empty block size, a huge one */
+    n = make_stream(buf, 0xEE, 64, 0x80000000u | 4, 4, 4);
+    check_refused(buf, n, pool);
+    n = make_stream(buf, CPK_CODEC_NONE, 0, 0x80000000u | 4, 4, 4);
+    check_refused(buf, n, pool);
+    n = make_stream(buf, CPK_CODEC_NONE, CPK_STAGE_MAX_BLOCK + 1,
+                    0x80000000u | 4, 4, 4);
+    check_refused(buf, n, pool);
+
+    /* A stored block of one uint8 is fine, to show the others fail for
+       their own reasons */
+    {
+        uint8_t *dst = NULL;
+        size_t dst_len = 0;
+
+        n = make_stream(buf, CPK_CODEC_NONE, 64, 0x80000000u | 2, 2, 2);
+        CHECK(cpk_stage_expand(pool, buf, n, &dst, &dst_len) == 0);
+        CHECK(dst_len == 2 && dst[0] == 0x14);
+        free(dst);
+    }
+}
+
+int main(void) {
+    cpk_pool_t *pool = cpk_pool_new(4);
+    uint8_t ids[] = { CPK_CODEC_NONE, CPK_CODEC_LZ, CPK_CODEC_ZLIB };
+    size_t i = 0;
+    int fd = mkstemp(path);
+
+    if(fd < 0) return 1;
+    close(fd);
+
+    for(i = 0; i < sizeof(ids); i++) {
+        if(!cpk_codec(ids[i])) continue;
+
+        test_codec(cpk_codec(ids[i]), pool);
+        test_codec(cpk_codec(ids[i]), NULL);
+    }
+
+    test_hostile(pool);
+
+    unlink(path);
+    cpk_pool_free(pool);
+    return CHECK_STATUS;
+}
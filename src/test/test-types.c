@@ -0,0 +1,318 @@
+/*
+ * libconspack
+ * Copyright (C) 2012  Ryan Pavlik
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the GNU Lesser General Public
+ * License (LGPL) version 2.1 which accompanies this distribution, and
+ * is available at http://www.gnu.org/licenses/lgpl-2.1.html
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ */
+
+/*
+ * test-types: tmaps decoded into registered structs, keys given as
+ * strings, symbols, tags and refs, registries that refuse bad
+ * descriptors and stay usable after, and tmaps built to exhaust
+ * memory, the stack or the input.
+ */
+
+#include "config.h"
+#include "conspack/conspack.h"
+#include "check.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct _point {
+    int32_t x;
+    int32_t y;
+} point_t;
+
+typedef struct _line {
+    point_t a, b;
+    char name[8];
+    double weight;
+    uint8_t closed;
+    cpk_object_t *extra;
+} line_t;
+
+static const cpk_field_t point_fields[] = {
+    CPK_FIELD(point_t, x, CPK_FIELD_INT),
+    CPK_FIELD(point_t, y, CPK_FIELD_INT),
+};
+
+static const cpk_type_t point_type = {
+    "point", point_fields, 2, sizeof(point_t)
+};
+
+static const cpk_field_t line_fields[] = {
+    CPK_FIELD_NESTED(line_t, a, "a", point_type),
+    CPK_FIELD_NESTED(line_t, b, "b", point_type),
+    CPK_FIELD(line_t, name, CPK_FIELD_CHARS),
+    CPK_FIELD(line_t, weight, CPK_FIELD_FLOAT),
+    CPK_FIELD(line_t, closed, CPK_FIELD_BOOL),
+    CPK_FIELD(line_t, extra, CPK_FIELD_OBJECT),
+};
+
+static const cpk_type_t line_type = {
+    "line", line_fields, 6, sizeof(line_t)
+};
+
+/* Nodes nest through themselves, as deep as a message likes */
+typedef struct _node {
+    int32_t value;
+    struct _node *unused;
+} node_t;
+
+static const cpk_type_t node_type;
+
+static const cpk_field_t node_fields[] = {
+    CPK_FIELD(node_t, value, CPK_FIELD_INT),
+    { "next", 0, sizeof(node_t), CPK_FIELD_STRUCT, &node_type },
+};
+
+static const cpk_type_t node_type = {
+    "node", node_fields, 2, sizeof(node_t)
+};
+
+static void tmap(cpk_output_t *out, uint8_t n, const char *type) {
+    cpk_write8(out, 0x38);
+    cpk_write8(out, n);
+    cpk_encode_string(out, type);
+}
+
+static void int32(cpk_output_t *out, int32_t v) {
+    cpk_write8(out, 0x12);
+    cpk_write32(out, v);
+}
+
+static void point(cpk_output_t *out, int32_t x, int32_t y) {
+    tmap(out, 2, "point");
+    cpk_encode_string(out, "x");
+    int32(out, x);
+    cpk_encode_string(out, "y");
+    int32(out, y);
+}
+
+static const cpk_type_t* decode(cpk_output_t *out, const cpk_registry_t *reg,
+                                void *dest, size_t size, cpk_object_t *err) {
+    cpk_input_t in;
+
+    cpk_input_init(&in, out->buffer, out->buffer_used);
+    return cpk_decode_struct(&in, reg, dest, size, err);
+}
+
+static void test_decode(cpk_registry_t *reg) {
+    cpk_output_t out;
+    cpk_object_t err;
+    line_t line;
+
+    cpk_output_init(&out);
+
+    /* The type as a keyword, keys as strings, a tagged key and a ref
+       to it, and a key the type does not have */
+    cpk_write8(&out, 0x38);
+    cpk_write8(&out, 7);
+    cpk_write8(&out, 0x83);
+    cpk_encode_string(&out, "line");
+
+    cpk_encode_string(&out, "a");
+    tmap(&out, 2, "point");
+    cpk_write8(&out, 0xF1);
+    cpk_encode_string(&out, "x");
+    int32(&out, -5);
+    cpk_encode_string(&out, "y");
+    int32(&out, 7);
+
+    cpk_encode_string(&out, "b");
+    tmap(&out, 1, "point");
+    cpk_write8(&out, 0x71);
+    int32(&out, 9);
+
+    cpk_encode_string(&out, "name");
+    cpk_encode_string(&out, "edge");
+    cpk_encode_string(&out, "weight");
+    cpk_write8(&out, 0x19);
+    cpk_write_double(&out, 2.5);
+    cpk_encode_string(&out, "closed");
+    cpk_write8(&out, 0x01);
+    cpk_encode_string(&out, "colour");
+    cpk_encode_string(&out, "red");
+    cpk_encode_string(&out, "extra");
+    cpk_write8(&out, 0x24);
+    cpk_write8(&out, 2);
+    cpk_write8(&out, 0x14);
+    cpk_write8(&out, 1);
+    cpk_write8(&out, 2);
+
+    memset(&line, 0, sizeof(line));
+    line.b.y = 42;
+
+    CHECK(decode(&out, reg, &line, sizeof(line), &err) == &line_type);
+    CHECK(line.a.x == -5 && line.a.y == 7);
+    CHECK(line.b.x == 9 && line.b.y == 42);
+    CHECK(!strcmp(line.name, "edge"));
+    CHECK(line.weight == 2.5 && line.closed == 1);
+    CHECK(line.extra && line.extra->header == 0x24 &&
+          line.extra->container.size == 2);
+    cpk_free_r(line.extra);
+
+    /* Smaller than the type */
+    CHECK(decode(&out, reg, &line, sizeof(line) - 1, &err) == NULL);
+    CHECK(err.error.code == CPK_ERR_LIMIT);
+
+    /* A name that does not fit its field */
+    cpk_output_clear(&out);
+    tmap(&out, 1, "line");
+    cpk_encode_string(&out, "name");
+    cpk_encode_string(&out, "too long");
+    CHECK(decode(&out, reg, &line, sizeof(line), &err) == NULL);
+    CHECK(err.error.code == CPK_ERR_LIMIT);
+
+    /* A nested tmap of the wrong type */
+    cpk_output_clear(&out);
+    tmap(&out, 1, "line");
+    cpk_encode_string(&out, "a");
+    tmap(&out, 0, "line");
+    CHECK(decode(&out, reg, &line, sizeof(line), &err) == NULL);
+    CHECK(err.error.code == CPK_ERR_BAD_TYPE);
+
+    /* A type nobody registered */
+    cpk_output_clear(&out);
+    tmap(&out, 0, "circle");
+    CHECK(decode(&out, reg, &line, sizeof(line), &err) == NULL);
+    CHECK(err.error.code == CPK_ERR_BAD_TYPE);
+
+    cpk_output_fini(&out);
+}
+
+static void test_registry(void) {
+    static const cpk_field_t twice[] = {
+        CPK_FIELD_KEY(point_t, x, "x", CPK_FIELD_INT),
+        CPK_FIELD_KEY(point_t, y, "x", CPK_FIELD_INT),
+    };
+    static const cpk_field_t odd[] = {
+        { "x", 0, 3, CPK_FIELD_INT, NULL },
+    };
+    static const cpk_field_t outside[] = {
+        { "x", 6, 4, CPK_FIELD_INT, NULL },
+    };
+    static const cpk_type_t bad_point = {
+        "point", odd, 1, sizeof(point_t)
+    };
+    static const cpk_field_t holds_bad[] = {
+        { "p", 0, sizeof(point_t), CPK_FIELD_STRUCT, &bad_point },
+    };
+    static const cpk_type_t types[] = {
+        { "twice", twice, 2, sizeof(point_t) },
+        { "odd", odd, 1, sizeof(point_t) },
+        { "outside", outside, 1, sizeof(point_t) },
+        { NULL, point_fields, 2, sizeof(point_t) },
+        { "", point_fields, 2, sizeof(point_t) },
+        { "point", point_fields, 2, sizeof(point_t) },
+        { "holder", holds_bad, 1, sizeof(point_t) },
+    };
+    cpk_registry_t *reg = cpk_registry_new();
+    cpk_output_t out;
+    cpk_object_t err;
+    point_t p;
+    size_t i = 0;
+
+    CHECK(reg != NULL);
+    if(!reg) return;
+
+    CHECK(cpk_registry_add(reg, &point_type) == 0);
+    CHECK(cpk_registry_add(reg, &point_type) == 0);
+
+    /* Each is refused; the last only after appending itself, which
+       must be undone without leaving the registry pointing at it */
+    for(i = 0; i < sizeof(types) / sizeof(types[0]); i++)
+        CHECK(cpk_registry_add(reg, &types[i]) == CPK_ERROR);
+
+    cpk_output_init(&out);
+    point(&out, 1, 2);
+    memset(&p, 0, sizeof(p));
+    CHECK(decode(&out, reg, &p, sizeof(p), &err) == &point_type);
+    CHECK(p.x == 1 && p.y == 2);
+
+    cpk_output_clear(&out);
+    tmap(&out, 0, "holder");
+    CHECK(decode(&out, reg, &p, sizeof(p), &err) == NULL);
+    CHECK(err.error.code == CPK_ERR_BAD_TYPE);
+
+    cpk_output_fini(&out);
+    cpk_registry_free(reg);
+}
+
+static void test_hostile(cpk_registry_t *reg) {
+    uint8_t nils[] = { 0x3E, 0x40, 0x00, 0x00, 0x00, 0x00,
+                       0x40, 4, 'l', 'i', 'n', 'e' };
+    uint8_t numbers[] = { 0x3E, 0x40, 0x00, 0x00, 0x00, 0x14,
+                          0x40, 4, 'l', 'i', 'n', 'e' };
+    cpk_output_t out;
+    cpk_input_t in;
+    cpk_object_t err;
+    line_t line;
+    uint32_t i = 0, n = 0;
+
+    /* A billion nil pairs take no input; the budget stops them */
+    cpk_input_init(&in, nils, sizeof(nils));
+    CHECK(cpk_decode_struct(&in, reg, &line, sizeof(line), &err) == NULL);
+    CHECK(err.error.code == CPK_ERR_LIMIT);
+
+    /* Pairs that would need input that is not there */
+    cpk_input_init(&in, numbers, sizeof(numbers));
+    CHECK(cpk_decode_struct(&in, reg, &line, sizeof(line), &err) == NULL);
+    CHECK(err.error.code == CPK_ERR_EOF);
+
+    /* A type object behind two million tags */
+    cpk_output_init(&out);
+    cpk_write8(&out, 0x38);
+    cpk_write8(&out, 0);
+    for(i = 0; i < 2 * 1024 * 1024; i++)
+        cpk_write8(&out, 0xF0 | (i & 0xF));
+    cpk_encode_string(&out, "line");
+
+    CHECK(decode(&out, reg, &line, sizeof(line), &err) == NULL);
+    CHECK(err.error.code == CPK_ERR_BAD_TYPE);
+
+    /* Nodes nested far past the depth limit */
+    {
+        node_t node;
+
+        cpk_output_clear(&out);
+        for(n = 0; n < 5000; n++) {
+            tmap(&out, 1, "node");
+            cpk_encode_string(&out, "next");
+        }
+        tmap(&out, 0, "node");
+
+        CHECK(decode(&out, reg, &node, sizeof(node), &err) == NULL);
+        CHECK(err.error.code == CPK_ERR_LIMIT);
+    }
+
+    cpk_output_fini(&out);
+}
+
+int main(void) {
+    cpk_registry_t *reg = cpk_registry_new();
+
+    if(!reg || cpk_registry_add(reg, &line_type) ||
+       cpk_registry_add(reg, &node_type)) {
+        fprintf(stderr, "could not register the test types\n");
+        return 1;
+    }
+
+    test_decode(reg);
+    test_registry();
+    test_hostile(reg);
+
+    cpk_registry_free(reg);
+    return CHECK_STATUS;
+}
@@ -0,0 +1,228 @@
+/*
+ * libconspack
+ * Copyright (C) 2012  Ryan Pavlik
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the GNU Lesser General Public
+ * License (LGPL) version 2.1 which accompanies this distribution, and
+ * is available at http://www.gnu.org/licenses/lgpl-2.1.html
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ */
+
+/*
+ * test-validate: well-formed messages of every kind, malformed ones
+ * that must be refused, and hostile ones held to max_depth,
+ * max_elements, max_size and the count of elements that take no
+ * input.
+ */
+
+#include "config.h"
+#include "conspack/conspack.h"
+#include "check.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* The validator's answer: -1 for a whole message, or the error code */
+static int validate(const uint8_t *buf, size_t len,
+                    const cpk_limits_t *limits) {
+    cpk_object_t err;
+    size_t span = 0;
+
+    err.header = 0;
+    span = cpk_validate_span(buf, len, limits, &err);
+
+    if(!span) {
+        CHECK(CPK_IS_ERROR(err.header));
+        return err.error.code;
+    }
+
+    CHECK(cpk_validate(buf, len, limits) == (span == len ? 0 : CPK_ERROR));
+    return span == len ? -1 : CPK_ERR_TRAILING;
+}
+
+static int validate_out(cpk_output_t *out, const cpk_limits_t *limits) {
+    return validate(out->buffer, out->buffer_used, limits);
+}
+
+static void test_kinds(void) {
+    static const uint8_t good[][12] = {
+        { 0x00 },                               /* nil */
+        { 0x01 },                               /* t */
+        { 0x12, 0x00, 0x00, 0x01, 0x00 },       /* int32 */
+        { 0x19, 0x3F, 0xF0, 0, 0, 0, 0, 0, 0 }, /* double */
+        { 0x1F, 0x10, 0x01, 0x10, 0x03 },       /* rational */
+        { 0x40, 0x02, 'h', 'i' },               /* string */
+        { 0x24, 0x03, 0x14, 1, 2, 3 },          /* fixed uint8 vector */
+        { 0x30, 0x01, 0x01, 0x00 },             /* map */
+        { 0x28, 0x02, 0x01, 0x01 },             /* list */
+        { 0x80, 0x01, 0x00 },                   /* cons */
+        { 0x83, 0x40, 0x01, 'k' },              /* keyword */
+        { 0xF1, 0x71 },                         /* tag and ref */
+    };
+    static const size_t good_len[] = { 1, 1, 5, 9, 5, 4, 6, 4, 4, 3, 4, 2 };
+    static const struct {
+        uint8_t data[8];
+        size_t len;
+        int code;
+    } bad[] = {
+        { { 0x05 }, 1, CPK_ERR_BAD_HEADER },
+        { { 0x23, 0x00 }, 2, CPK_ERR_BAD_SIZE },
+        { { 0x12, 0x00, 0x00 }, 3, CPK_ERR_EOF },
+        { { 0x40, 0x05, 'a' }, 3, CPK_ERR_EOF },
+        { { 0x20, 0x03, 0x00, 0x00 }, 4, CPK_ERR_EOF },
+        { { 0x1F, 0x10, 0x01, 0x40, 0x00 }, 5, CPK_ERR_BAD_TYPE },
+        { { 0x24, 0x02, 0x05, 0x00, 0x00 }, 5, CPK_ERR_BAD_HEADER },
+        { { 0x00, 0x00 }, 2, CPK_ERR_TRAILING },
+    };
+    size_t i = 0;
+
+    for(i = 0; i < sizeof(good_len) / sizeof(good_len[0]); i++)
+        CHECK(validate(good[i], good_len[i], NULL) == -1);
+
+    for(i = 0; i < sizeof(bad) / sizeof(bad[0]); i++)
+        CHECK(validate(bad[i].data, bad[i].len, NULL) == bad[i].code);
+
+    /* Nothing at all is not a message */
+    CHECK(validate(good[0], 0, NULL) == CPK_ERR_EOF);
+}
+
+/* depth vectors, each holding the next, around nil */
+static void nested(cpk_output_t *out, uint32_t depth) {
+    uint32_t i = 0;
+
+    cpk_output_clear(out);
+    for(i = 0; i < depth; i++)
+        cpk_encode_container(out, CPK_CONTAINER_VECTOR, 1, 0);
+    cpk_write8(out, 0x00);
+}
+
+static void test_depth(void) {
+    cpk_output_t out;
+    cpk_limits_t limits;
+    uint32_t i = 0;
+
+    memset(&limits, 0, sizeof(limits));
+    cpk_output_init(&out);
+
+    /* Containers may nest max_depth deep, and no further */
+    limits.max_depth = 8;
+    nested(&out, 8);
+    CHECK(validate_out(&out, &limits) == -1);
+    nested(&out, 9);
+    CHECK(validate_out(&out, &limits) == CPK_ERR_LIMIT);
+
+    /* The default stops nesting that would exhaust the stack */
+    nested(&out, CPK_DEFAULT_MAX_DEPTH);
+    CHECK(validate_out(&out, NULL) == -1);
+    nested(&out, 1000000);
+    CHECK(validate_out(&out, NULL) == CPK_ERR_LIMIT);
+
+    /* Conses down a long cdr are not depth */
+    cpk_output_clear(&out);
+    for(i = 0; i < 100000; i++) {
+        cpk_write8(&out, 0x80);
+        cpk_write8(&out, 0x01);
+    }
+    cpk_write8(&out, 0x00);
+    CHECK(validate_out(&out, &limits) == -1);
+
+    /* Tags nest, and are bounded like containers */
+    cpk_output_clear(&out);
+    for(i = 0; i < 1000000; i++)
+        cpk_write8(&out, 0xF0);
+    cpk_write8(&out, 0x00);
+    CHECK(validate_out(&out, NULL) == CPK_ERR_LIMIT);
+
+    cpk_output_fini(&out);
+}
+
+static void test_elements(void) {
+    cpk_output_t out;
+    cpk_limits_t limits;
+    uint32_t i = 0;
+
+    memset(&limits, 0, sizeof(limits));
+    cpk_output_init(&out);
+
+    cpk_encode_container(&out, CPK_CONTAINER_VECTOR, 100, 0);
+    for(i = 0; i < 100; i++)
+        cpk_write8(&out, 0x01);
+
+    limits.max_elements = 200;
+    CHECK(validate_out(&out, &limits) == -1);
+    limits.max_elements = 50;
+    CHECK(validate_out(&out, &limits) == CPK_ERR_LIMIT);
+
+    /* max_size applies to the declared size, before any element */
+    cpk_output_clear(&out);
+    cpk_encode_container(&out, CPK_CONTAINER_VECTOR, 100, 0x14);
+    for(i = 0; i < 100; i++)
+        cpk_write8(&out, i);
+
+    memset(&limits, 0, sizeof(limits));
+    limits.max_size = 100;
+    CHECK(validate_out(&out, &limits) == -1);
+    limits.max_size = 99;
+    CHECK(validate_out(&out, &limits) == CPK_ERR_LIMIT);
+
+    cpk_output_fini(&out);
+}
+
+static void test_unbacked(void) {
+    /* Four billion nils, or trues, in six bytes */
+    static const uint8_t nils[] = { 0x26, 0xFF, 0xFF, 0xFF, 0xFF, 0x00 };
+    static const uint8_t trues[] = { 0x26, 0x00, 0x10, 0x00, 0x01, 0x01 };
+    /* Four billion uint8s that are not there */
+    static const uint8_t bytes[] = { 0x26, 0xFF, 0xFF, 0xFF, 0xFF, 0x14 };
+    /* A map claiming more pairs than a uint32 can count twice */
+    static const uint8_t pairs[] = { 0x32, 0x80, 0x00, 0x00, 0x00 };
+    cpk_output_t out;
+    cpk_limits_t limits;
+    uint32_t i = 0;
+
+    CHECK(validate(nils, sizeof(nils), NULL) == CPK_ERR_LIMIT);
+    CHECK(validate(trues, sizeof(trues), NULL) == CPK_ERR_LIMIT);
+    CHECK(validate(bytes, sizeof(bytes), NULL) == CPK_ERR_EOF);
+    CHECK(validate(pairs, sizeof(pairs), NULL) == CPK_ERR_BAD_SIZE);
+
+    /* The count is for the whole message, not each container; a
+       fixed header of 0 means none, so these hold trues */
+    cpk_output_init(&out);
+    cpk_encode_container(&out, CPK_CONTAINER_VECTOR, 8, 0);
+    for(i = 0; i < 8; i++)
+        cpk_encode_container(&out, CPK_CONTAINER_VECTOR,
+                             CPK_DEFAULT_MAX_UNBACKED / 8, 0x01);
+    CHECK(validate_out(&out, NULL) == -1);
+
+    cpk_encode_container(&out, CPK_CONTAINER_VECTOR, 1, 0x01);
+    out.buffer[1]++;
+    CHECK(validate_out(&out, NULL) == CPK_ERR_LIMIT);
+
+    /* max_elements sets it when given */
+    memset(&limits, 0, sizeof(limits));
+    limits.max_elements = 1000;
+    cpk_output_clear(&out);
+    cpk_encode_container(&out, CPK_CONTAINER_VECTOR, 500, 0x01);
+    CHECK(validate_out(&out, &limits) == -1);
+
+    cpk_output_clear(&out);
+    cpk_encode_container(&out, CPK_CONTAINER_VECTOR, 1001, 0x01);
+    CHECK(validate_out(&out, &limits) == CPK_ERR_LIMIT);
+
+    cpk_output_fini(&out);
+}
+
+int main(void) {
+    test_kinds();
+    test_depth();
+    test_elements();
+    test_unbacked();
+
+    return CHECK_STATUS;
+}
@@ -0,0 +1,737 @@
+/*
+ * libconspack
+ * Copyright (C) 2012  Ryan Pavlik
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the GNU Lesser General Public
+ * License (LGPL) version 2.1 which accompanies this distribution, and
+ * is available at http://www.gnu.org/licenses/lgpl-2.1.html
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ */
+
+#include "config.h"
+#include "conspack/conspack.h"
+#include "internal.h"
+
+#include <string.h>
+
+/*
+ * Typed maps decoded straight into caller structs, with no tree in
+ * between.  Each registered type's field names are hashed once and
+ * laid out by a perfect hash: a seed is searched for that sends every
+ * name to its own slot of a table at most half full, so finding a
+ * key's field costs one hash of the key, a multiply and a compare.
+ * Type names are laid out the same way across the registry.
+ *
+ * Keys and type objects that arrive tagged are remembered by id for
+ * the rest of the message, so the refs that stand for them later
+ * resolve without their bytes.
+ */
+
+#define SLOT_MULT  0x9E3779B97F4A7C15ULL
+#define SEED_STEP  0xC2B2AE3D27D4EB4FULL
+#define SEED_TRIES 256
+#define SLOT_BITS_MAX 20
+
+/* Tag ids past this are not remembered; refs to them match nothing */
+#define TAGS 256
+
+typedef struct _name {
+    uint64_t hash;
+    uint32_t len;
+} name_t;
+
+typedef struct _reg_field {
+    const cpk_field_t *field;   /* NULL in an empty slot */
+    const struct _reg_type *nested;
+    name_t name;
+    uint32_t index;             /* bit in a tmap's seen mask */
+} reg_field_t;
+
+typedef struct _reg_type {
+    const cpk_type_t *type;
+    name_t name;
+
+    uint64_t seed;
+    int shift;
+    reg_field_t *slots;
+} reg_type_t;
+
+struct _cpk_registry {
+    reg_type_t **types;
+    uint32_t ntypes, cap;
+
+    uint64_t seed;
+    int shift;
+    reg_type_t **slots;
+};
+
+typedef struct _reader {
+    cpk_input_t *in;
+    const cpk_registry_t *reg;
+    cpk_object_t *err;
+    uint32_t max_depth;
+
+    uint64_t tagged[TAGS / 64];
+    name_t tags[TAGS];
+} reader_t;
+
+static inline uint64_t name_hash(const void *name, size_t len) {
+    return cpk_hash64(0, name, len);
+}
+
+static inline uint32_t slot_of(uint64_t hash, uint64_t seed, int shift) {
+    return (uint32_t)(((hash ^ seed) * SLOT_MULT) >> shift);
+}
+
+/* Finds a seed and a table of 1 << bits slots, at least twice the
+   names, that give each hash a slot of its own.  Equal hashes never
+   separate, so the caller rules them out first. */
+static int place(const uint64_t *hashes, uint32_t n,
+                 uint64_t *seed, int *bits) {
+    uint8_t *used = NULL;
+    uint32_t i = 0, k = 0, s = 0;
+    int b = 1;
+
+    while((1U << b) < n * 2) b++;
+
+    for(; b <= SLOT_BITS_MAX; b++) {
+        if(!(used = malloc(1U << b))) return -1;
+
+        for(k = 0; k < SEED_TRIES; k++) {
+            memset(used, 0, 1U << b);
+
+            for(i = 0; i < n; i++) {
+                s = slot_of(hashes[i], k * SEED_STEP, 64 - b);
+                if(used[s]) break;
+                used[s] = 1;
+            }
+
+            if(i == n) {
+                free(used);
+                *seed = k * SEED_STEP;
+                *bits = b;
+                return 0;
+            }
+        }
+
+        free(used);
+    }
+
+    return -1;
+}
+
+static int valid_field(const cpk_type_t *type, const cpk_field_t *f) {
+    size_t len = f->name ? strlen(f->name) : 0;
+
+    if(!len || len > CPK_TYPE_NAME_MAX) return 0;
+    if(f->offset > type->size || f->size > type->size - f->offset)
+        return 0;
+
+    switch(f->kind) {
+        case CPK_FIELD_INT:
+        case CPK_FIELD_UINT:
+        case CPK_FIELD_BOOL:
+            return f->size == 1 || f->size == 2 || f->size == 4 ||
+                   f->size == 8;
+
+        case CPK_FIELD_FLOAT:
+            return f->size == sizeof(float) || f->size == sizeof(double);
+
+        case CPK_FIELD_CHARS:
+            return f->size > 0;
+
+        case CPK_FIELD_STRUCT:
+            return f->type && f->size >= f->type->size;
+
+        case CPK_FIELD_OBJECT:
+            return f->size == sizeof(cpk_object_t*);
+    }
+
+    return 0;
+}
+
+/* Lays the registry's type names out again after one is added */
+static int place_types(cpk_registry_t *reg) {
+    reg_type_t **slots = NULL;
+    uint64_t *hashes = NULL, seed = 0;
+    uint32_t i = 0;
+    int bits = 0;
+
+    if(!(hashes = malloc(reg->ntypes * sizeof(uint64_t))))
+        return -1;
+
+    for(i = 0; i < reg->ntypes; i++)
+        hashes[i] = reg->types[i]->name.hash;
+
+    if(place(hashes, reg->ntypes, &seed, &bits) ||
+       !(slots = calloc(1U << bits, sizeof(reg_type_t*)))) {
+        free(hashes);
+        return -1;
+    }
+
+    for(i = 0; i < reg->ntypes; i++)
+        slots[slot_of(hashes[i], seed, 64 - bits)] = reg->types[i];
+
+    free(hashes);
+    free(reg->slots);
+    reg->slots = slots;
+    reg->seed = seed;
+    reg->shift = 64 - bits;
+    return 0;
+}
+
+/* Appends type and the types nested in it that are new to reg.  The
+   name table is left alone, and on failure so is whatever was
+   appended; cpk_registry_add settles both. */
+static const reg_type_t* add_type(cpk_registry_t *reg,
+                                  const cpk_type_t *type) {
+    reg_type_t *t = NULL, **types = NULL;
+    uint64_t hashes[CPK_TYPE_FIELDS];
+    size_t len = type->name ? strlen(type->name) : 0;
+    uint32_t i = 0, j = 0;
+    int bits = 0;
+
+    if(!len || len > CPK_TYPE_NAME_MAX || type->nfields > CPK_TYPE_FIELDS)
+        return NULL;
+
+    for(i = 0; i < reg->ntypes; i++) {
+        if(reg->types[i]->type == type)
+            return reg->types[i];
+
+        if(!strcmp(reg->types[i]->type->name, type->name))
+            return NULL;
+    }
+
+    for(i = 0; i < type->nfields; i++) {
+        if(!valid_field(type, &type->fields[i]))
+            return NULL;
+
+        hashes[i] = name_hash(type->fields[i].name,
+                              strlen(type->fields[i].name));
+        for(j = 0; j < i; j++)
+            if(hashes[j] == hashes[i]) return NULL;
+    }
+
+    if(reg->ntypes == reg->cap) {
+        types = realloc(reg->types, (reg->cap ? reg->cap * 2 : 8) *
+                                    sizeof(reg_type_t*));
+        if(!types) return NULL;
+
+        reg->types = types;
+        reg->cap = reg->cap ? reg->cap * 2 : 8;
+    }
+
+    if(!(t = calloc(1, sizeof(reg_type_t))))
+        return NULL;
+
+    t->type = type;
+    t->name.hash = name_hash(type->name, len);
+    t->name.len = len;
+
+    if(place(hashes, type->nfields, &t->seed, &bits) ||
+       !(t->slots = calloc(1U << bits, sizeof(reg_field_t)))) {
+        free(t);
+        return NULL;
+    }
+
+    t->shift = 64 - bits;
+    for(i = 0; i < type->nfields; i++) {
+        reg_field_t *f = &t->slots[slot_of(hashes[i], t->seed, t->shift)];
+
+        f->field = &type->fields[i];
+        f->name.hash = hashes[i];
+        f->name.len = strlen(type->fields[i].name);
+        f->index = i;
+    }
+
+    /* Registered before its nested types, so a cycle ends here */
+    reg->types[reg->ntypes++] = t;
+
+    for(i = 0; i < type->nfields; i++) {
+        const cpk_field_t *field = &type->fields[i];
+        reg_field_t *f = NULL;
+
+        if(field->kind != CPK_FIELD_STRUCT) continue;
+
+        f = &t->slots[slot_of(hashes[i], t->seed, t->shift)];
+        if(!(f->nested = add_type(reg, field->type)))
+            return NULL;
+    }
+
+    return t;
+}
+
+cpk_registry_t* cpk_registry_new(void) {
+    return calloc(1, sizeof(cpk_registry_t));
+}
+
+void cpk_registry_free(cpk_registry_t *reg) {
+    uint32_t i = 0;
+
+    if(!reg) return;
+
+    for(i = 0; i < reg->ntypes; i++) {
+        free(reg->types[i]->slots);
+        free(reg->types[i]);
+    }
+
+    free(reg->types);
+    free(reg->slots);
+    free(reg);
+}
+
+/* Adds type and any types nested in it.  Fails on a malformed
+   descriptor, more than CPK_TYPE_FIELDS fields, two fields of one
+   name, or a different type already registered under its name. */
+int cpk_registry_add(cpk_registry_t *reg, const cpk_type_t *type) {
+    uint32_t n = reg->ntypes;
+
+    if(add_type(reg, type) && (reg->ntypes == n || !place_types(reg)))
+        return 0;
+
+    /* Everything added on the way goes.  Types registered before only
+       point at each other, and the name table is the old one. */
+    while(reg->ntypes > n) {
+        reg_type_t *t = reg->types[--reg->ntypes];
+
+        free(t->slots);
+        free(t);
+    }
+
+    return CPK_ERROR;
+}
+
+static const reg_type_t* find_type(const cpk_registry_t *reg,
+                                   const name_t *name, const uint8_t *buf,
+                                   int bytes) {
+    const reg_type_t *t = NULL;
+
+    if(!reg->slots) return NULL;
+
+    t = reg->slots[slot_of(name->hash, reg->seed, reg->shift)];
+    if(!t || t->name.hash != name->hash || t->name.len != name->len)
+        return NULL;
+    if(bytes && memcmp(t->type->name, buf, name->len))
+        return NULL;
+
+    return t;
+}
+
+static const reg_field_t* find_field(const reg_type_t *t,
+                                     const name_t *name, const uint8_t *buf,
+                                     int bytes) {
+    const reg_field_t *f = &t->slots[slot_of(name->hash, t->seed, t->shift)];
+
+    if(!f->field || f->name.hash != name->hash || f->name.len != name->len)
+        return NULL;
+    if(bytes && memcmp(f->field->name, buf, name->len))
+        return NULL;
+
+    return f;
+}
+
+ /* Reading */
+
+static int fail(reader_t *r, uint32_t code, const char *reason,
+                uint8_t value) {
+    cpk_err(r->err, code, reason, value, r->in->buffer_read);
+    return -1;
+}
+
+static int next_header(reader_t *r, uint8_t *h) {
+    if(cpk_read8(r->in, h) < 0)
+        return fail(r, CPK_ERR_EOF, CPK_ERR_EOF_MSG, 0);
+
+    return 0;
+}
+
+static int read_id(reader_t *r, uint8_t h, uint32_t *id) {
+    const cpk_header_info_t *info = CPK_HEADER_INFO(h);
+
+    if(info->flags & CPK_HD_INLINE) {
+        *id = info->value;
+        return 0;
+    }
+
+    *id = cpk_decode_size(r->in, h, r->err);
+    return CPK_IS_ERROR(r->err->header) ? -1 : 0;
+}
+
+/* Reads a key or type object whose header is h.  A string or a
+   symbol's name gives a name, its bytes left in buf when there are
+   any; a tag is remembered and a ref looked up.  Returns 1 for a
+   name, 0 for anything else (which is skipped), or -1 on error. */
+static int read_name(reader_t *r, uint8_t h, name_t *name, uint8_t *buf,
+                     int *bytes) {
+    cpk_input_t *in = r->in;
+    uint32_t size = 0, id = 0, n = 0;
+    uint8_t next = 0;
+    int ret = 0;
+
+    if(CPK_IS_STRING(h)) {
+        size = cpk_decode_size(in, h, r->err);
+        if(CPK_IS_ERROR(r->err->header)) return -1;
+
+        /* Too long to be a registered name, so only length is kept */
+        if(size > CPK_TYPE_NAME_MAX) {
+            name->hash = 0;
+            name->len = size;
+            *bytes = 0;
+
+            for(; size; size -= n) {
+                n = size < CPK_TYPE_NAME_MAX ? size : CPK_TYPE_NAME_MAX;
+                if(cpk_read_bytes(in, buf, n) < 0)
+                    return fail(r, CPK_ERR_EOF, CPK_ERR_EOF_MSG, 0);
+            }
+
+            return 1;
+        }
+
+        if(cpk_read_bytes(in, buf, size) < 0)
+            return fail(r, CPK_ERR_EOF, CPK_ERR_EOF_MSG, 0);
+
+        name->hash = name_hash(buf, size);
+        name->len = size;
+        *bytes = 1;
+        return 1;
+    }
+
+    if(CPK_IS_SYMBOL(h)) {
+        if(next_header(r, &next)) return -1;
+        if(!CPK_IS_STRING(next))
+            return fail(r, CPK_ERR_BAD_TYPE, CPK_ERR_BAD_TYPE_MSG, next);
+        if(read_name(r, next, name, buf, bytes) < 0) return -1;
+
+        if(!CPK_IS_KEYWORD(h)) {
+            if(next_header(r, &next)) return -1;
+            if(cpk_skip_after(in, next, r->err)) return -1;
+        }
+
+        return 1;
+    }
+
+    /* A tag only wraps a name, never another tag */
+    if(CPK_IS_TAG(h)) {
+        if(read_id(r, h, &id) || next_header(r, &next)) return -1;
+        if(CPK_IS_TAG(next))
+            return fail(r, CPK_ERR_BAD_TYPE, CPK_ERR_BAD_TYPE_MSG, next);
+        if((ret = read_name(r, next, name, buf, bytes)) == 1 && id < TAGS) {
+            r->tagged[id / 64] |= 1ULL << (id % 64);
+            r->tags[id] = *name;
+        }
+
+        return ret;
+    }
+
+    if(CPK_IS_REF(h)) {
+        if(read_id(r, h, &id)) return -1;
+        if(id >= TAGS || !(r->tagged[id / 64] & (1ULL << (id % 64))))
+            return 0;
+
+        *name = r->tags[id];
+        *bytes = 0;
+        return 1;
+    }
+
+    return cpk_skip_after(in, h, r->err) ? -1 : 0;
+}
+
+/* A plain number of 64 bits or fewer, read into num */
+static int read_number(reader_t *r, uint8_t h, cpk_object_t *num) {
+    const cpk_header_info_t *info = CPK_HEADER_INFO(h);
+
+    if(!(info->flags & CPK_HD_VALID) || info->kind != CPK_NUMBER ||
+       info->children || info->payload > 8)
+        return fail(r, CPK_ERR_BAD_TYPE, CPK_ERR_BAD_TYPE_MSG, h);
+
+    num->header = h;
+    num->number.val.uint64 = 0;
+    cpk_decode_number(r->in, num, h);
+    if(CPK_IS_ERROR(num->header)) {
+        *r->err = *num;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* An integer's value as its low 64 bits and a sign; 0 for a float */
+static int integer(const cpk_object_t *num, uint64_t *v, int *neg) {
+    const cpk_number_t *n = &num->number;
+
+    switch(CPK_NUMBER_TYPE(num->header)) {
+        case CPK_INT8:   *v = (uint64_t)(int64_t)n->val.int8; break;
+        case CPK_INT16:  *v = (uint64_t)(int64_t)n->val.int16; break;
+        case CPK_INT32:  *v = (uint64_t)(int64_t)n->val.int32; break;
+        case CPK_INT64:  *v = (uint64_t)n->val.int64; break;
+        case CPK_UINT8:  *v = n->val.uint8; break;
+        case CPK_UINT16: *v = n->val.uint16; break;
+        case CPK_UINT32: *v = n->val.uint32; break;
+        case CPK_UINT64: *v = n->val.uint64; break;
+
+        default:
+            return 0;
+    }
+
+    *neg = CPK_NUMBER_TYPE(num->header) < CPK_UINT8 && (int64_t)*v < 0;
+    return 1;
+}
+
+static void store_uint(uint8_t *p, size_t size, uint64_t v) {
+    uint8_t u8 = (uint8_t)v;
+    uint16_t u16 = (uint16_t)v;
+    uint32_t u32 = (uint32_t)v;
+
+    switch(size) {
+        case 1: memcpy(p, &u8, 1); break;
+        case 2: memcpy(p, &u16, 2); break;
+        case 4: memcpy(p, &u32, 4); break;
+        case 8: memcpy(p, &v, 8); break;
+    }
+}
+
+/* Any integer whose value fits the field, whatever width it came in */
+static int read_int(reader_t *r, const cpk_field_t *f, uint8_t h,
+                    uint8_t *p) {
+    cpk_object_t num;
+    uint64_t v = 0, max = 0;
+    int neg = 0, bits = f->size * 8;
+
+    if(read_number(r, h, &num)) return -1;
+    if(!integer(&num, &v, &neg))
+        return fail(r, CPK_ERR_BAD_TYPE, CPK_ERR_BAD_TYPE_MSG, h);
+
+    if(f->kind == CPK_FIELD_INT) {
+        max = bits == 64 ? INT64_MAX : (1ULL << (bits - 1)) - 1;
+        if(neg ? (int64_t)v < -(int64_t)max - 1 : v > max)
+            return fail(r, CPK_ERR_LIMIT, CPK_ERR_LIMIT_MSG, h);
+    } else {
+        max = bits == 64 ? UINT64_MAX : (1ULL << bits) - 1;
+        if(neg || v > max)
+            return fail(r, CPK_ERR_LIMIT, CPK_ERR_LIMIT_MSG, h);
+    }
+
+    store_uint(p, f->size, v);
+    return 0;
+}
+
+/* Floats and doubles, and integers widened; a double only goes into
+   a float field when it loses nothing there */
+static int read_float(reader_t *r, const cpk_field_t *f, uint8_t h,
+                      uint8_t *p) {
+    cpk_object_t num;
+    uint64_t v = 0;
+    double d = 0;
+    float s = 0;
+    int neg = 0;
+
+    if(read_number(r, h, &num)) return -1;
+
+    if(integer(&num, &v, &neg))
+        d = neg ? (double)(int64_t)v : (double)v;
+    else if(CPK_NUMBER_TYPE(h) == CPK_SINGLE_FLOAT)
+        d = num.number.val.single_float;
+    else if(CPK_NUMBER_TYPE(h) == CPK_DOUBLE_FLOAT)
+        d = num.number.val.double_float;
+    else
+        return fail(r, CPK_ERR_BAD_TYPE, CPK_ERR_BAD_TYPE_MSG, h);
+
+    if(f->size == sizeof(double)) {
+        memcpy(p, &d, sizeof(d));
+        return 0;
+    }
+
+    s = (float)d;
+    if(CPK_NUMBER_TYPE(h) == CPK_DOUBLE_FLOAT && s != d && d == d)
+        return fail(r, CPK_ERR_LIMIT, CPK_ERR_LIMIT_MSG, h);
+
+    memcpy(p, &s, sizeof(s));
+    return 0;
+}
+
+static int read_chars(reader_t *r, const cpk_field_t *f, uint8_t h,
+                      uint8_t *p) {
+    uint32_t size = 0;
+
+    if(!CPK_IS_STRING(h))
+        return fail(r, CPK_ERR_BAD_TYPE, CPK_ERR_BAD_TYPE_MSG, h);
+
+    size = cpk_decode_size(r->in, h, r->err);
+    if(CPK_IS_ERROR(r->err->header)) return -1;
+
+    if(size >= f->size)
+        return fail(r, CPK_ERR_LIMIT, CPK_ERR_LIMIT_MSG, h);
+    if(cpk_read_bytes(r->in, p, size) < 0)
+        return fail(r, CPK_ERR_EOF, CPK_ERR_EOF_MSG, 0);
+
+    p[size] = 0;
+    return 0;
+}
+
+static const reg_type_t* read_tmap(reader_t *r, uint8_t h,
+                                   const reg_type_t *expect, uint8_t *dest,
+                                   size_t size, uint32_t depth);
+
+/* again is set when the key came earlier in the same tmap, so a tree
+   stored for it then is this call's to free */
+static int read_field(reader_t *r, const reg_field_t *rf, uint8_t h,
+                      uint8_t *dest, uint32_t depth, int again) {
+    const cpk_field_t *f = rf->field;
+    uint8_t *p = dest + f->offset;
+    cpk_object_t *obj = NULL, *old = NULL;
+
+    switch(f->kind) {
+        case CPK_FIELD_INT:
+        case CPK_FIELD_UINT:
+            return read_int(r, f, h, p);
+
+        case CPK_FIELD_FLOAT:
+            return read_float(r, f, h, p);
+
+        case CPK_FIELD_BOOL:
+            if(h != CPK_NIL && h != CPK_TRUE)
+                return fail(r, CPK_ERR_BAD_TYPE, CPK_ERR_BAD_TYPE_MSG, h);
+
+            store_uint(p, f->size, h == CPK_TRUE);
+            return 0;
+
+        case CPK_FIELD_CHARS:
+            return read_chars(r, f, h, p);
+
+        case CPK_FIELD_STRUCT:
+            return read_tmap(r, h, rf->nested, p, f->size, depth + 1) ? 0 : -1;
+
+        case CPK_FIELD_OBJECT:
+            if(!(obj = cpk_decode_after(r->in, h)))
+                return fail(r, CPK_ERR_ALLOC, CPK_ERR_ALLOC_MSG, 0);
+
+            if(CPK_IS_ERROR(obj->header)) {
+                *r->err = *obj;
+                if(!r->in->arena) free(obj);
+                return -1;
+            }
+
+            if(again && !r->in->arena) {
+                memcpy(&old, p, sizeof(old));
+                cpk_free_r(old);
+            }
+
+            memcpy(p, &obj, sizeof(obj));
+            return 0;
+    }
+
+    return fail(r, CPK_ERR_BAD_TYPE, CPK_ERR_BAD_TYPE_MSG, h);
+}
+
+static const reg_type_t* read_tmap(reader_t *r, uint8_t h,
+                                   const reg_type_t *expect, uint8_t *dest,
+                                   size_t size, uint32_t depth) {
+    const cpk_header_info_t *info = CPK_HEADER_INFO(h);
+    const reg_type_t *t = NULL;
+    const reg_field_t *f = NULL;
+    uint8_t buf[CPK_TYPE_NAME_MAX], fixed = 0, th = 0, kh = 0, vh = 0;
+    uint64_t seen = 0;
+    uint32_t n = 0, i = 0;
+    name_t name;
+    int bytes = 0, ret = 0;
+
+    if(!(info->flags & CPK_HD_VALID) || !CPK_IS_TMAP(h)) {
+        fail(r, CPK_ERR_BAD_TYPE, CPK_ERR_BAD_TYPE_MSG, h);
+        return NULL;
+    }
+
+    if(depth > r->max_depth) {
+        fail(r, CPK_ERR_LIMIT, CPK_ERR_LIMIT_MSG, h);
+        return NULL;
+    }
+
+    n = cpk_decode_size(r->in, h, r->err);
+    if(CPK_IS_ERROR(r->err->header)) return NULL;
+
+    if((info->flags & CPK_HD_FIXED) && next_header(r, &fixed))
+        return NULL;
+
+    /* Held to the same bounds as a container the decoder reads */
+    if(cpk_check_container(h, n, fixed, cpk_input_remaining(r->in),
+                           r->in->limits, &r->in->unbacked, r->err,
+                           r->in->buffer_read))
+        return NULL;
+
+    /* The type object never uses the fixed header */
+    if(next_header(r, &th)) return NULL;
+    if((ret = read_name(r, th, &name, buf, &bytes)) < 0) return NULL;
+
+    if(!ret || !(t = find_type(r->reg, &name, buf, bytes)) ||
+       (expect && t != expect)) {
+        fail(r, CPK_ERR_BAD_TYPE, CPK_ERR_BAD_TYPE_MSG, th);
+        return NULL;
+    }
+
+    if(t->type->size > size) {
+        fail(r, CPK_ERR_LIMIT, CPK_ERR_LIMIT_MSG, th);
+        return NULL;
+    }
+
+    for(i = 0; i < n; i++) {
+        if(info->flags & CPK_HD_FIXED) kh = fixed;
+        else if(next_header(r, &kh)) return NULL;
+
+        if((ret = read_name(r, kh, &name, buf, &bytes)) < 0) return NULL;
+        f = ret ? find_field(t, &name, buf, bytes) : NULL;
+
+        if(info->flags & CPK_HD_FIXED) vh = fixed;
+        else if(next_header(r, &vh)) return NULL;
+
+        /* Keys the type does not have are passed over */
+        if(!f) {
+            if(cpk_skip_after(r->in, vh, r->err)) return NULL;
+            continue;
+        }
+
+        if(read_field(r, f, vh, dest, depth, (seen >> f->index) & 1))
+            return NULL;
+
+        seen |= 1ULL << f->index;
+    }
+
+    return t;
+}
+
+/* Decodes the next object, which must be a tmap of a registered type,
+   into dest, and returns its type.  Keys the type lacks are skipped
+   and fields the tmap lacks are left as they were.  On failure NULL
+   is returned with err set, and dest may be partly written; trees
+   stored in CPK_FIELD_OBJECT fields by then are the caller's. */
+const cpk_type_t* cpk_decode_struct(cpk_input_t *in,
+                                    const cpk_registry_t *reg,
+                                    void *dest, size_t size,
+                                    cpk_object_t *err) {
+    const reg_type_t *t = NULL;
+    cpk_object_t tmp;
+    reader_t r;
+    uint8_t h = 0;
+
+    if(!err) err = &tmp;
+    err->header = 0;
+
+    r.in = in;
+    r.reg = reg;
+    r.err = err;
+    r.max_depth = in->limits && in->limits->max_depth ?
+                  in->limits->max_depth : CPK_DEFAULT_MAX_DEPTH;
+    memset(r.tagged, 0, sizeof(r.tagged));
+
+    in->allocated = 0;
+    in->unbacked = 0;
+
+    if(next_header(&r, &h)) return NULL;
+
+    t = read_tmap(&r, h, NULL, dest, size, 1);
+    return t ? t->type : NULL;
+}
@@ -0,0 +1,349 @@
+/*
+ * libconspack
+ * Copyright (C) 2012  Ryan Pavlik
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the GNU Lesser General Public
+ * License (LGPL) version 2.1 which accompanies this distribution, and
+ * is available at http://www.gnu.org/licenses/lgpl-2.1.html
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ */
+
+#include "config.h"
+#include "conspack/conspack.h"
+#include "internal.h"
+
+typedef struct _cpk_validator {
+    const uint8_t *buf;
+    size_t len;
+    size_t pos;
+
+    uint64_t elements;
+    uint64_t unbacked;
+    uint64_t max_elements;
+    uint32_t max_depth;
+    uint32_t max_size;
+
+    const cpk_limits_t *limits;
+    cpk_object_t *err;
+} cpk_validator_t;
+
+static int validate_r(cpk_validator_t *v, uint32_t depth,
+                      int skip_header, uint8_t header);
+
+static int fail(cpk_validator_t *v, uint32_t code, const char *reason,
+                uint8_t value) {
+    if(v->err)
+        cpk_err(v->err, code, reason, value, v->pos);
+
+    return -1;
+}
+
+static inline int has(cpk_validator_t *v, uint64_t bytes) {
+    return (uint64_t)(v->len - v->pos) >= bytes;
+}
+
+static inline int count(cpk_validator_t *v, uint64_t n) {
+    v->elements += n;
+
+    if(v->max_elements && v->elements > v->max_elements)
+        return fail(v, CPK_ERR_LIMIT, CPK_ERR_LIMIT_MSG, 0);
+
+    return 0;
+}
+
+static inline int nest(cpk_validator_t *v, uint32_t depth) {
+    if(depth >= v->max_depth)
+        return fail(v, CPK_ERR_LIMIT, CPK_ERR_LIMIT_MSG, 0);
+
+    return 0;
+}
+
+static int bad_header(cpk_validator_t *v, uint8_t header) {
+    if(CPK_HEADER_INFO(header)->flags & CPK_HD_BAD_SIZE)
+        return fail(v, CPK_ERR_BAD_SIZE, CPK_ERR_BAD_SIZE_MSG, header);
+
+    return fail(v, CPK_ERR_BAD_HEADER, CPK_ERR_BAD_HEADER_MSG, header);
+}
+
+static int read_size(cpk_validator_t *v, const cpk_header_info_t *info,
+                     uint32_t *size) {
+    const uint8_t *p = v->buf + v->pos;
+
+    if(!has(v, info->size))
+        return fail(v, CPK_ERR_EOF, CPK_ERR_EOF_MSG, 0);
+
+    switch(info->size) {
+        case 1: *size = p[0]; break;
+        case 2: *size = ((uint32_t)p[0] << 8) | p[1]; break;
+        default:
+            *size = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+                    ((uint32_t)p[2] << 8)  | p[3];
+    }
+
+    v->pos += info->size;
+
+    if(v->max_size && *size > v->max_size)
+        return fail(v, CPK_ERR_LIMIT, CPK_ERR_LIMIT_MSG, 0);
+
+    return 0;
+}
+
+/* Bytes each element of a fixed container occupies when the fixed
+   header alone determines it, or -1 if the elements carry structure
+   that has to be walked. */
+int cpk_fixed_payload(uint8_t header) {
+    const cpk_header_info_t *info = CPK_HEADER_INFO(header);
+
+    if(!(info->flags & CPK_HD_VALID) || info->kind == CPK_TAG)
+        return -1;
+    if(info->flags & CPK_HD_INLINE)
+        return 0;
+    if(info->kind == CPK_NUMBER && !info->children)
+        return info->payload;
+
+    return -1;
+}
+
+/* A container's declared size and fixed header, checked the same way
+   by the validator and the decoder so that what one accepts the other
+   does too.  Every element costs at least one byte unless the fixed
+   header carries the whole value, so the size is checked against the
+   left bytes after the fixed header before anything is walked.  The
+   elements that cost nothing are added to unbacked, a count for the
+   whole message, and bounded there instead.  Returns -1 with err (if
+   not NULL) set. */
+int cpk_check_container(uint8_t header, uint32_t size, uint8_t fixed,
+                        uint64_t left, const cpk_limits_t *limits,
+                        uint64_t *unbacked, cpk_object_t *err, size_t pos) {
+    const cpk_header_info_t *info = CPK_HEADER_INFO(header);
+    uint64_t n = size, need = 0, max = CPK_DEFAULT_MAX_UNBACKED;
+    int payload = -1;
+
+    if(info->flags & CPK_HD_FIXED) {
+        if(!(CPK_HEADER_INFO(fixed)->flags & CPK_HD_VALID)) {
+            if(!err) return -1;
+
+            if(CPK_HEADER_INFO(fixed)->flags & CPK_HD_BAD_SIZE)
+                cpk_err(err, CPK_ERR_BAD_SIZE, CPK_ERR_BAD_SIZE_MSG,
+                        fixed, pos);
+            else
+                cpk_err(err, CPK_ERR_BAD_HEADER, CPK_ERR_BAD_HEADER_MSG,
+                        fixed, pos);
+            return -1;
+        }
+
+        payload = cpk_fixed_payload(fixed);
+    }
+
+    /* The decoder counts a map's keys and values, and a tmap's type,
+       in a uint32_t */
+    if(info->flags & CPK_HD_MAP) {
+        if(size > (UINT32_MAX - 1) / 2) {
+            if(err)
+                cpk_err(err, CPK_ERR_BAD_SIZE, CPK_ERR_BAD_SIZE_MSG,
+                        header, pos);
+            return -1;
+        }
+
+        n *= 2;
+    }
+
+    /* The tmap type object never uses the fixed header */
+    need = n * (payload < 0 ? 1 : payload);
+    if(info->flags & CPK_HD_TMAP)
+        need++;
+
+    if(need > left) {
+        if(err) cpk_err(err, CPK_ERR_EOF, CPK_ERR_EOF_MSG, 0, pos);
+        return -1;
+    }
+
+    if(!payload) {
+        if(limits && limits->max_elements)
+            max = limits->max_elements;
+
+        *unbacked += n;
+        if(*unbacked > max) {
+            if(err) cpk_err(err, CPK_ERR_LIMIT, CPK_ERR_LIMIT_MSG, 0, pos);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int validate_container(cpk_validator_t *v, uint32_t depth,
+                              uint8_t header) {
+    const cpk_header_info_t *info = CPK_HEADER_INFO(header);
+    uint32_t size = 0;
+    uint64_t n = 0, i = 0;
+    uint8_t fixed = 0;
+    int is_fixed = info->flags & CPK_HD_FIXED;
+    int payload = -1;
+
+    if(read_size(v, info, &size)) return -1;
+
+    if(is_fixed) {
+        if(!has(v, 1))
+            return fail(v, CPK_ERR_EOF, CPK_ERR_EOF_MSG, 0);
+
+        fixed = v->buf[v->pos++];
+        payload = cpk_fixed_payload(fixed);
+    }
+
+    if(cpk_check_container(header, size, fixed, v->len - v->pos,
+                           v->limits, &v->unbacked, v->err, v->pos))
+        return -1;
+
+    n = size;
+    if(info->flags & CPK_HD_MAP)
+        n *= 2;
+
+    if(nest(v, depth)) return -1;
+
+    if((info->flags & CPK_HD_TMAP) && validate_r(v, depth + 1, 0, 0))
+        return -1;
+
+    if(payload >= 0) {
+        if(count(v, n)) return -1;
+
+        v->pos += n * payload;
+        return 0;
+    }
+
+    for(i = 0; i < n; i++)
+        if(validate_r(v, depth + 1, is_fixed, fixed))
+            return -1;
+
+    return 0;
+}
+
+static int validate_r(cpk_validator_t *v, uint32_t depth,
+                      int skip_header, uint8_t header) {
+    const cpk_header_info_t *info = NULL;
+    uint32_t size = 0, i = 0;
+
+    /* Loop rather than recurse on a cons cdr, so lists are walked flat */
+    for(;;) {
+        if(!skip_header) {
+            if(!has(v, 1))
+                return fail(v, CPK_ERR_EOF, CPK_ERR_EOF_MSG, 0);
+
+            header = v->buf[v->pos++];
+        }
+
+        info = CPK_HEADER_INFO(header);
+
+        if(count(v, 1)) return -1;
+
+        if(!(info->flags & CPK_HD_VALID))
+            return bad_header(v, header);
+
+        if((info->flags & CPK_HD_INLINE) && !info->children)
+            return 0;
+
+        switch(info->kind) {
+            case CPK_NUMBER:
+                if(info->children)
+                    break;
+
+                if(!has(v, info->payload))
+                    return fail(v, CPK_ERR_EOF, CPK_ERR_EOF_MSG, 0);
+
+                v->pos += info->payload;
+                return 0;
+
+            case CPK_CONTAINER:
+                return validate_container(v, depth, header);
+
+            case CPK_STRING:
+                if(read_size(v, info, &size)) return -1;
+                if(!has(v, size))
+                    return fail(v, CPK_ERR_EOF, CPK_ERR_EOF_MSG, 0);
+
+                v->pos += size;
+                return 0;
+
+            case CPK_REF:
+            case CPK_INDEX:
+            case CPK_POINTER:
+                return read_size(v, info, &size);
+
+            /* Tags nest the object they wrap, as the decoder does */
+            case CPK_TAG:
+                if(info->size && read_size(v, info, &size)) return -1;
+                if(nest(v, depth)) return -1;
+
+                depth++;
+                skip_header = 0;
+                continue;
+
+            case CPK_CONS:
+                if(nest(v, depth)) return -1;
+                if(validate_r(v, depth + 1, 0, 0)) return -1;
+
+                skip_header = 0;
+                continue;
+        }
+
+        /* Complex, rational, rref, package and symbol: a fixed number
+           of child objects; the parts of a number must be numbers */
+        if(nest(v, depth)) return -1;
+
+        for(i = 0; i < info->children; i++) {
+            if(info->kind == CPK_NUMBER) {
+                if(!has(v, 1))
+                    return fail(v, CPK_ERR_EOF, CPK_ERR_EOF_MSG, 0);
+                if(!CPK_IS_NUMBER(v->buf[v->pos]))
+                    return fail(v, CPK_ERR_BAD_TYPE, CPK_ERR_BAD_TYPE_MSG,
+                                v->buf[v->pos]);
+            }
+
+            if(validate_r(v, depth + 1, 0, 0)) return -1;
+        }
+
+        return 0;
+    }
+}
+
+size_t cpk_validate_span(const uint8_t *buf, size_t len,
+                         const cpk_limits_t *limits, cpk_object_t *err) {
+    cpk_validator_t v;
+
+    v.buf = buf;
+    v.len = len;
+    v.pos = 0;
+    v.elements = 0;
+    v.unbacked = 0;
+    v.max_elements = 0;
+    v.max_depth = CPK_DEFAULT_MAX_DEPTH;
+    v.max_size = 0;
+    v.limits = limits;
+    v.err = err;
+
+    if(limits) {
+        if(limits->max_depth) v.max_depth = limits->max_depth;
+        v.max_elements = limits->max_elements;
+        v.max_size = limits->max_size;
+    }
+
+    if(validate_r(&v, 0, 0, 0))
+        return 0;
+
+    return v.pos;
+}
+
+int cpk_validate(const uint8_t *buf, size_t len, const cpk_limits_t *limits) {
+    size_t span = cpk_validate_span(buf, len, limits, NULL);
+
+    if(!span || span != len)
+        return CPK_ERROR;
+
+    return 0;
+}